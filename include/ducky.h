@@ -10,6 +10,10 @@ void ducky_load_profile();
 /* Executes a DuckyScript file */
 int ducky_execute_script(const char *filename);
 
+/* Forgets variables, functions, labels and default delays (used between
+ * scripts run by a long-lived process) */
+void ducky_reset();
+
 /* Sets a script variable manually */
 void ducky_set_var(const char *name, const char *val);
 
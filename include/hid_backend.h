@@ -0,0 +1,80 @@
+#ifndef HID_BACKEND_H
+#define HID_BACKEND_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Output backends: where a context's reports end up.
+ *
+ * "device" writes to the hidg fds, with poll pacing and writev/io_uring
+ * batching. The others need no gadget and take reports one at a time, so
+ * tests, benchmarks and dry runs can use the production binary:
+ *   mock          one "[HID-MOCK] Writing N bytes: .." line per report on
+ *                 stdout (HID_MOCK_LATENCY_US delays each report)
+ *   capture:FILE  timestamped binary records appended to FILE
+ *   record:FILE   writes to the devices like "device" and appends every
+ *                 report that went out to FILE (no batching)
+ *   memory        role/length/report records in a growable buffer
+ *   null          discards reports
+ * Writer threads of several devices may share one backend; the built-in
+ * backends serialise internally.
+ *
+ * Capture format (capture:, record:): an 8-byte header ("HIDC", version,
+ * 3 zero bytes), then per report: CLOCK_MONOTONIC nanoseconds at submission
+ * (uint64, little endian), role (uint8), length (uint8), the report bytes.
+ * Files are append-only: a new run adds its records after the existing
+ * ones. hid_replay.h reads them back.
+ */
+
+#define HID_CAPTURE_MAGIC "HIDC"
+#define HID_CAPTURE_VERSION 2
+#define HID_CAPTURE_HEADER_SIZE 8
+#define HID_CAPTURE_RECORD_HEADER 10 /* timestamp, role, length */
+
+struct hid_backend_ops {
+  const char *name;
+  /* Non-zero if write() needs the device's open fd; otherwise no device
+   * node is opened and fd is -1 */
+  int needs_fd;
+  /* Emits one report of device role (enum hid_role). Returns len, or -1
+   * with errno set. */
+  long (*write)(void *state, int role, int fd, const void *buf, size_t len);
+  int (*flush)(void *state);    /* optional */
+  void (*destroy)(void *state); /* optional */
+};
+
+struct hid_backend;
+
+/* A backend around caller-supplied ops (which must outlive it) */
+struct hid_backend *hid_backend_new(const struct hid_backend_ops *ops,
+                                    void *state);
+
+/* A built-in backend from its spec: "device", "mock", "capture:FILE",
+ * "record:FILE", "memory" or "null". NULL with errno set on failure
+ * (EINVAL for an unknown spec or a FILE that is not a capture). */
+struct hid_backend *hid_backend_open(const char *spec);
+
+/* Flushes and frees b */
+void hid_backend_free(struct hid_backend *b);
+
+const char *hid_backend_name(const struct hid_backend *b);
+int hid_backend_needs_fd(const struct hid_backend *b);
+
+/* The built-in device backend: writes may be batched around write() */
+int hid_backend_is_device(const struct hid_backend *b);
+
+long hid_backend_write(struct hid_backend *b, int role, int fd,
+                       const void *buf, size_t len);
+int hid_backend_flush(struct hid_backend *b);
+
+/* Reports and bytes accepted so far */
+void hid_backend_counts(const struct hid_backend *b, uint64_t *reports,
+                        uint64_t *bytes);
+
+/* Memory backend: the records so far (NULL for other backends). The pointer
+ * is valid until the next write or clear. */
+const uint8_t *hid_backend_data(struct hid_backend *b, size_t *len);
+void hid_backend_clear(struct hid_backend *b);
+
+#endif // HID_BACKEND_H
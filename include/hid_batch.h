@@ -0,0 +1,73 @@
+#ifndef HID_BATCH_H
+#define HID_BATCH_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Batched report submission.
+ *
+ * Takes a run of pre-encoded, equally sized reports and hands them to the
+ * kernel with as few syscalls as possible:
+ *   - no inter-report delays: writev(), one iovec per report (hidg has no
+ *     write_iter, so the VFS issues one f_hidg write per segment and report
+ *     boundaries are kept);
+ *   - with delays: one io_uring chain of linked WRITE and TIMEOUT requests
+ *     per ring-full, reaped with a single io_uring_enter();
+ *   - otherwise: a tight write()/nanosleep() loop through the caller's sink.
+ */
+
+struct hid_timeline;
+
+enum hid_batch_mode {
+  HID_BATCH_LOOP = 0,
+  HID_BATCH_WRITEV = 1,
+  HID_BATCH_URING = 2,
+};
+
+/* Writes one report; same contract as write(2). arg is the value given to
+ * hid_batch_submit(). */
+typedef int (*hid_batch_sink)(void *arg, int fd, const void *buf, size_t len);
+
+/* Told about every write the batch layer issues itself (writev calls and
+ * io_uring write completions; writes made through the sink are not
+ * reported). arg is the submitter's; res/err follow write(2); ns is the time
+ * spent in the syscall, or UINT64_MAX when unknown. */
+typedef void (*hid_batch_observer)(void *arg, int fd, long res, size_t len,
+                                   size_t reports, uint64_t ns, int err);
+
+struct hid_batch_stats {
+  uint64_t batches;
+  uint64_t reports;
+  uint64_t syscalls; /* write/writev/io_uring_enter/nanosleep issued */
+  uint64_t uring_chains;
+  uint64_t fallbacks; /* uring chains cut short and finished by the loop */
+};
+
+/* Caps the most capable mechanism that may be used (default HID_BATCH_URING).
+ * io_uring is only used when the kernel supports it. */
+void hid_batch_set_max_mode(enum hid_batch_mode mode);
+
+/* Submits count reports of report_len bytes stored back to back. delays_us
+ * may be NULL; otherwise delays_us[i] is waited after report i, measured
+ * from the previous deadline on tl (hid_timeline.h) or, with tl NULL, from
+ * the moment the report was written. Reports are written strictly in order.
+ * Returns the number of reports fully written; count on success. Safe to
+ * call from several threads; the mode, observer and stats are
+ * process-wide. */
+size_t hid_batch_submit(int fd, const uint8_t *reports, size_t report_len,
+                        size_t count, const uint32_t *delays_us,
+                        struct hid_timeline *tl, hid_batch_sink sink,
+                        void *arg);
+
+void hid_batch_set_observer(hid_batch_observer obs);
+
+void hid_batch_get_stats(struct hid_batch_stats *out);
+
+/* Human readable name of the mode the next delayed batch would use */
+const char *hid_batch_mode_name(void);
+
+/* Releases the io_uring instance, if one was created */
+void hid_batch_shutdown(void);
+
+#endif // HID_BATCH_H
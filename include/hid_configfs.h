@@ -0,0 +1,89 @@
+#ifndef HID_CONFIGFS_H
+#define HID_CONFIGFS_H
+
+#include "hid_ctx.h"
+#include "hid_discover.h"
+#include <stddef.h>
+
+/*
+ * Native configfs gadget setup.
+ *
+ * The C counterpart of system/bin/hid-setup. Instead of tearing the three
+ * hid functions down and rebuilding them behind a fixed sleep, it reads the
+ * gadget and changes only what differs from the spec: attributes are
+ * rewritten one by one, missing functions created, missing links added. The
+ * UDC is unbound only around structural changes (configfs refuses them on a
+ * bound gadget) and bound again right after; a gadget that merely lost its
+ * UDC is just bound. hid.gs* functions the spec no longer has (switching
+ * to or from the composite layout) are unlinked. Afterwards it waits, with
+ * inotify, until every function's hidg node exists, creating those nobody
+ * else creates.
+ *
+ * Paths are root (HID_SYSROOT) + gadget, so the whole thing runs against a
+ * temporary directory standing in for /config, /sys and /dev.
+ */
+
+#define HID_GADGET_MODULE_DIR "/data/adb/modules/hid-gadget"
+#define HID_GADGET_DEFAULT_WAIT_MS 2000
+#define HID_GADGET_DESC_MAX 512
+#define HID_GADGET_FUNCTION_MAX 4
+
+struct hid_function_spec {
+  char name[32]; /* configfs function, e.g. "hid.gs1" */
+  int protocol;
+  int subclass;
+  int report_length;
+  unsigned char desc[HID_GADGET_DESC_MAX];
+  size_t desc_len;
+};
+
+struct hid_gadget_spec {
+  const char *root;   /* prefix for /config, /sys and /dev ("" real) */
+  const char *gadget; /* gadget directory below root */
+  const char *config; /* configuration name (b.1), NULL to pick one */
+  int wait_ms;        /* how long to wait for the hidg nodes */
+  int dry_run;        /* only count what would change */
+  int nfunctions;
+  struct hid_function_spec functions[HID_GADGET_FUNCTION_MAX];
+};
+
+/* What hid_gadget_reconcile() did (or, dry, would do) */
+struct hid_gadget_changes {
+  int created;    /* function directories made */
+  int attributes; /* attributes rewritten */
+  int linked;     /* functions linked into the configuration */
+  int unlinked;   /* links removed to rewrite a bound function */
+  int unbound;    /* UDC released for structural changes */
+  int bound;      /* UDC written */
+  int nodes;      /* hidg nodes created with mknod() */
+  double elapsed_ms;
+  char why[160]; /* on failure, what went wrong */
+};
+
+/* The layout hid-setup creates: keyboard (hid.gs1, boot or NKRO), mouse
+ * (hid.gs2, 4 or 5 bytes, 6 or 7 with 16-bit X/Y), consumer control
+ * (hid.gs3) and, with HID_ABSOLUTE=1 (mouse.absolute=true), the absolute
+ * pointer (hid.gs4), following HID_KEYBOARD_NKRO, HID_MOUSE_HSCROLL /
+ * HID_MOUSE_16BIT / HID_MOUSE_HIRES / HID_MOUSE_REPORT_SIZE and the
+ * module.prop switches. With HID_COMPOSITE=1 (hid.composite=true) the
+ * descriptors are joined into one hid.gs1 with report IDs
+ * HID_REPORT_ID_KEYBOARD/MOUSE/CONSUMER/ABSOLUTE.
+ * Descriptors come from HID_DESC_DIR, else the module's system/etc/hid, else
+ * /system/etc/hid. HID_GADGET_DIR, HID_CONFIG_DIR and HID_SETUP_WAIT_MS
+ * override the rest. Returns -1 with errno set if a descriptor cannot be
+ * read. */
+int hid_gadget_spec_default(struct hid_gadget_spec *spec, const char *root);
+
+/* Brings the gadget in line with spec. 0 on success, -1 with errno set and
+ * changes->why filled in otherwise. */
+int hid_gadget_reconcile(const struct hid_gadget_spec *spec,
+                         struct hid_gadget_changes *changes);
+
+/* Total number of changes made */
+int hid_gadget_change_count(const struct hid_gadget_changes *changes);
+
+/* One line summarising the changes, e.g. for stderr */
+void hid_gadget_describe(char *buf, size_t size,
+                         const struct hid_gadget_changes *changes);
+
+#endif // HID_CONFIGFS_H
@@ -0,0 +1,404 @@
+#ifndef HID_CTX_H
+#define HID_CTX_H
+
+#include "hid_backend.h"
+#include "hid_stats.h"
+#include "hid_timeline.h"
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+/*
+ * libhidgadget: reentrant HID output.
+ *
+ * A struct hid_ctx owns one keyboard, mouse, consumer and (optional)
+ * absolute pointer device: their paths and fds, report formats, keyboard
+ * layout, held-key state, writer queues and write statistics. Further hidg
+ * nodes join its device registry and can be selected for a role at any
+ * time; each keeps its own fd, queue and statistics. Contexts are
+ * independent, so one process can drive several gadgets; a single context
+ * must only be used by one thread at a time. hid_interface.h is the older
+ * global API, a thin wrapper over the default context.
+ *
+ *   struct hid_ctx *ctx = hid_ctx_new();
+ *   hid_ctx_set_device(ctx, HID_ROLE_KEYBOARD, "/dev/hidg0");
+ *   hid_ctx_send_text(ctx, "hello", 5);
+ *   hid_ctx_free(ctx);
+ *
+ * Functions returning int return 0 on success and -1 on failure, with errno
+ * set where the failure came from the system.
+ */
+
+enum hid_role {
+  HID_ROLE_KEYBOARD,
+  HID_ROLE_MOUSE,
+  HID_ROLE_CONSUMER,
+  HID_ROLE_ABSOLUTE, /* optional absolute pointer (hid-setup HID_ABSOLUTE) */
+  HID_ROLE_COUNT
+};
+
+/* Roles every gadget has; the ones after them exist only when enabled */
+#define HID_ROLE_BASE_COUNT HID_ROLE_ABSOLUTE
+
+/* Report sizes of the default descriptors */
+#define HID_KEYBOARD_REPORT_SIZE 8
+#define HID_KEYBOARD_NKRO_REPORT_SIZE 16
+#define HID_MOUSE_REPORT_SIZE 4 /* 5 with horizontal scroll */
+#define HID_MOUSE_WIDE_REPORT_SIZE 6 /* 16-bit X/Y, 7 with horizontal scroll */
+#define HID_CONSUMER_REPORT_SIZE 2
+#define HID_ABSOLUTE_REPORT_SIZE 5 /* buttons, X and Y as 16-bit LE */
+
+/* Logical range of the absolute pointer's X and Y: the host stretches it
+ * over the whole screen */
+#define HID_ABSOLUTE_MAX 32767
+
+/* Report IDs of the composite descriptor (HID_OPT_COMPOSITE): every role
+ * on one interface, each report prefixed with its role's ID */
+#define HID_REPORT_ID_KEYBOARD 1
+#define HID_REPORT_ID_MOUSE 2
+#define HID_REPORT_ID_CONSUMER 3
+#define HID_REPORT_ID_ABSOLUTE 4
+
+/* Keyboard modifier masks */
+#define HID_MOD_CTRL_LEFT (1 << 0)
+#define HID_MOD_SHIFT_LEFT (1 << 1)
+#define HID_MOD_ALT_LEFT (1 << 2)
+#define HID_MOD_GUI_LEFT (1 << 3)
+#define HID_MOD_CTRL_RIGHT (1 << 4)
+#define HID_MOD_SHIFT_RIGHT (1 << 5)
+#define HID_MOD_ALT_RIGHT (1 << 6)
+#define HID_MOD_GUI_RIGHT (1 << 7)
+
+/* Largest relative step of one mouse report, 8-bit and 16-bit X/Y */
+#define HID_MOUSE_DELTA_MAX 127
+#define HID_MOUSE_WIDE_DELTA_MAX 32767
+
+/* Resolution Multiplier of hid-setup's hi-res scrolling descriptor */
+#define HID_MOUSE_HIRES_MULTIPLIER 8
+
+/* Mouse button masks */
+#define HID_MOUSE_BTN_LEFT (1 << 0)
+#define HID_MOUSE_BTN_RIGHT (1 << 1)
+#define HID_MOUSE_BTN_MIDDLE (1 << 2)
+
+/* Integer options; the environment variable hid_ctx_load_env() reads each
+ * from is given in brackets. */
+enum hid_option {
+  HID_OPT_ASYNC,             /* per-device writer threads [HID_ASYNC] */
+  HID_OPT_ASYNC_DEPTH,       /* writer ring size [HID_ASYNC_DEPTH] */
+  HID_OPT_QUEUE_STATS,       /* producer-side timing [HID_QUEUE_STATS] */
+  HID_OPT_STATS,             /* write histograms, default on [HID_STATS] */
+  HID_OPT_PACING_POLL,       /* pace on POLLOUT [HID_PACING=poll] */
+  HID_OPT_MIN_DWELL_US,      /* poll pacing gap [HID_MIN_DWELL_US] */
+  HID_OPT_PACING_TIMEOUT_MS, /* poll pacing timeout [HID_PACING_TIMEOUT_MS] */
+  HID_OPT_KEYBOARD_NKRO,     /* bitmap keyboard [HID_KEYBOARD_NKRO] */
+  HID_OPT_MOUSE_REPORT_SIZE, /* 4 or 5, 6 or 7 with 16-bit X/Y
+                                [HID_MOUSE_REPORT_SIZE, HID_MOUSE_16BIT] */
+  HID_OPT_MOUSE_HSCROLL,     /* horizontal wheel [HID_MOUSE_HSCROLL] */
+  HID_OPT_TYPING_ROLLOVER,   /* overlapping keystrokes [HID_TYPING] */
+  HID_OPT_TIMING_RELATIVE,   /* delays from "now" [HID_TIMING=relative] */
+  HID_OPT_TIMER_SPIN_US,     /* busy-wait delay tails [HID_TIMER_SPIN_US] */
+  HID_OPT_RT_PRIORITY,       /* SCHED_FIFO, 0 off [HID_RT=1, HID_RT_PRIORITY] */
+  HID_OPT_RT_CPU,            /* writer CPU, -1 any [HID_RT_CPU] */
+  HID_OPT_RECONNECT_MS,      /* ride out host disconnects, 0 off
+                                [HID_RECONNECT_MS] */
+  HID_OPT_COMPOSITE,         /* one interface with report IDs for every
+                                role [HID_COMPOSITE] */
+  HID_OPT_SCREEN_WIDTH,      /* absolute pointer pixels, 0 logical units */
+  HID_OPT_SCREEN_HEIGHT,     /* [HID_SCREEN=WIDTHxHEIGHT] */
+  HID_OPT_MOUSE_STEP_MAX,    /* largest motion per report, 0 what the report
+                                holds [HID_MOUSE_STEP_MAX] */
+  HID_OPT_MOUSE_INTERVAL_US, /* host polling interval for mouse paths, 0
+                                from the UDC speed [HID_MOUSE_INTERVAL_US] */
+  HID_OPT_WHEEL_MULTIPLIER,  /* wheel counts per detent (1..255); 1 unless
+                                HID_MOUSE_HIRES opts in, then the hi-res
+                                descriptor's [HID_MOUSE_HIRES] */
+  HID_OPT_MOUSE_COALESCE,    /* merge relative mouse reports while the
+                                endpoint is busy; turns on HID_OPT_ASYNC
+                                [HID_MOUSE_COALESCE] */
+  HID_OPT_COUNT
+};
+
+#define HID_TIMER_SPIN_MAX_US 10000
+#define HID_RECONNECT_DEFAULT_MS 10000
+
+struct hid_ctx;
+struct hid_path;
+
+/* --- Lifetime and configuration --- */
+
+/* A context with no devices and default options. NULL if out of memory. */
+struct hid_ctx *hid_ctx_new(void);
+
+/* Flushes and stops the writer queues, closes the fds and frees ctx */
+void hid_ctx_free(struct hid_ctx *ctx);
+
+/* Sets (path) or clears (NULL) the node for role, closing any open fd.
+ * The node is opened on first use. */
+int hid_ctx_set_device(struct hid_ctx *ctx, enum hid_role role,
+                       const char *path);
+
+/* Path of the node for role, or NULL */
+const char *hid_ctx_device(const struct hid_ctx *ctx, enum hid_role role);
+
+/* The open fd for role (opening it if needed), or -1. Always -1 when the
+ * backend writes no device nodes. */
+int hid_ctx_fd(struct hid_ctx *ctx, enum hid_role role);
+
+/* Opens role's node if the backend needs it: 0 when role can be written */
+int hid_ctx_open(struct hid_ctx *ctx, enum hid_role role);
+
+/* Sends all further reports to backend (NULL: the hidg devices), flushing
+ * first. The context takes ownership and frees the previous backend. */
+int hid_ctx_set_backend(struct hid_ctx *ctx, struct hid_backend *backend);
+struct hid_backend *hid_ctx_backend(const struct hid_ctx *ctx);
+
+/* Assigns hidg nodes (hid_discover.h) to the roles that have no device yet:
+ * by the role of their configfs function, otherwise the lowest-numbered
+ * nodes in role order. A composite function takes every role and turns on
+ * HID_OPT_COMPOSITE. HID_DEVICE_CACHE names the cache file (empty: none)
+ * and HID_SYSROOT is prepended to /dev, /sys and /config. Returns the number
+ * of nodes found, or -1. All nodes found also join the device registry.
+ * With a backend that needs no nodes and none found, every role gets a
+ * placeholder path so callers checking for devices proceed. */
+int hid_ctx_discover(struct hid_ctx *ctx);
+
+/* Applies the HID_* environment variables listed with enum hid_option, the
+ * HID_KEYBOARD_DEV / HID_MOUSE_DEV / HID_CONSUMER_DEV overrides, the
+ * HID_OUTPUT backend spec (hid_backend_open()) and HID_TIMER_SLACK_NS (for
+ * the calling thread). Without HID_KEYBOARD_NKRO the configfs report length
+ * decides, read from the gadget hid_gadget_path() names (HID_SYSROOT,
+ * HID_GADGET_DIR). */
+void hid_ctx_load_env(struct hid_ctx *ctx);
+
+/* Non-zero for a switch that is on: "1", "true" or "yes" in any case. Every
+ * HID_* switch is read this way, by hid-setup and setup too. */
+int hid_env_true(const char *value);
+
+int hid_ctx_set_option(struct hid_ctx *ctx, enum hid_option opt, int value);
+int hid_ctx_get_option(const struct hid_ctx *ctx, enum hid_option opt);
+
+/* Real-time mode (hid_rt.h) for the calling thread, which should be the one
+ * driving ctx: SCHED_FIFO at HID_OPT_RT_PRIORITY, pinning to HID_OPT_RT_CPU
+ * and, with a priority, mlockall. Writer threads started later
+ * (HID_OPT_ASYNC) apply the same settings themselves. Returns the HID_RT_*
+ * steps that took effect; refused steps are skipped. */
+int hid_ctx_rt_enter(struct hid_ctx *ctx);
+
+/* Selects the keyboard layout ("US"). Returns -1 and keeps US otherwise. */
+int hid_ctx_set_locale(struct hid_ctx *ctx, const char *name);
+
+/* Size of the reports the device for role expects, not counting the
+ * report ID of a composite device */
+size_t hid_ctx_report_size(const struct hid_ctx *ctx, enum hid_role role);
+
+/* --- Output --- */
+
+/* Writes one report as is. 8-byte keyboard reports are expanded when the
+ * keyboard uses the NKRO descriptor, and reports for a composite device get
+ * their role's report ID in front (unless they already start with it).
+ *
+ * When a write fails because the host went away (ESHUTDOWN, ENODEV, EIO, a
+ * poll pacing timeout, ...), the report is held for up to
+ * HID_OPT_RECONNECT_MS: the device's node is reopened once it and the UDC
+ * are back, and output resumes with that same report. Later reports wait
+ * behind it, in the writer ring with HID_OPT_ASYNC. */
+int hid_ctx_send_report(struct hid_ctx *ctx, enum hid_role role,
+                        const void *report, size_t len);
+
+/* Writes count reports stored back to back with as few syscalls as the
+ * batch layer allows; delays_us (optional) are waited after each report */
+int hid_ctx_send_reports(struct hid_ctx *ctx, enum hid_role role,
+                         const uint8_t *reports, size_t report_len,
+                         size_t count, const uint32_t *delays_us);
+
+/* Waits until everything queued has reached the device (no-op unless
+ * HID_OPT_ASYNC) */
+int hid_ctx_flush(struct hid_ctx *ctx);
+
+/* errno of the first output failure (send or flush) since the last call,
+ * or 0, and clears it. Lets long-running callers such as script engines
+ * stop instead of typing into a host that is gone. */
+int hid_ctx_take_error(struct hid_ctx *ctx);
+
+/* Flushes, then waits ms on the context's timeline (hid_timeline.h): the
+ * delays of sleeps, keystroke delays and taps add up without drift */
+void hid_ctx_sleep(struct hid_ctx *ctx, int ms);
+
+/* Press-to-release hold for taps: waits us, except in poll pacing mode,
+ * where the release already waits for the host to read the press */
+void hid_ctx_tap_hold(struct hid_ctx *ctx, unsigned us);
+
+/* --- Keyboard --- */
+
+int hid_ctx_send_keyboard_report(struct hid_ctx *ctx, uint8_t modifiers,
+                                 const uint8_t keys[6]);
+
+/* A key name (F1, ENTER, ...), consumer key or literal text, each stroke
+ * combined with modifiers_str ("CTRL-ALT") */
+int hid_ctx_send_key_sequence(struct hid_ctx *ctx, const char *modifiers_str,
+                              const char *sequence);
+
+/* Types len bytes of literal text; unmapped bytes are skipped */
+int hid_ctx_send_text(struct hid_ctx *ctx, const char *buf, size_t len);
+
+/* Same, waiting delay_ms + rand(0..fuzz_ms) after each keystroke */
+int hid_ctx_send_text_delayed(struct hid_ctx *ctx, const char *buf,
+                              size_t len, int delay_ms, int fuzz_ms);
+
+/* Types text with modifiers held throughout and delay_ms after each
+ * keystroke, warning about unmapped characters, then releases everything */
+int hid_ctx_send_keys(struct hid_ctx *ctx, uint8_t modifiers, const char *buf,
+                      size_t len, int delay_ms);
+
+/* Presses each character in turn without releasing; the last key stays down
+ * with its modifiers */
+int hid_ctx_press_keys(struct hid_ctx *ctx, uint8_t modifiers,
+                       const char *buf, size_t len);
+
+/* DuckyScript HOLD/RELEASE: keys stay down across calls (six at most, any
+ * number with NKRO). Releases are barriers. */
+int hid_ctx_hold_key(struct hid_ctx *ctx, const char *key_name);
+int hid_ctx_release_key(struct hid_ctx *ctx, const char *key_name);
+int hid_ctx_release_all_keys(struct hid_ctx *ctx);
+
+/* --- Mouse --- */
+
+/* With HID_OPT_MOUSE_COALESCE, a mouse report sent while the ones before it
+ * still wait for the host adds its motion, wheel and pan to the newest of
+ * them, provided that one holds the same buttons, did not change them
+ * itself and the sums fit in a report. The writer only takes a report once
+ * the host has polled the previous one, so a burst of events costs one
+ * report per poll instead of a backlog the cursor lags behind, and presses
+ * and releases keep their place between the motion around them. */
+int hid_ctx_send_mouse_report(struct hid_ctx *ctx, uint8_t buttons, int8_t x,
+                              int8_t y, int8_t wheel, int8_t hwheel);
+int hid_ctx_send_mouse_move(struct hid_ctx *ctx, int8_t x, int8_t y);
+int hid_ctx_send_mouse_press(struct hid_ctx *ctx, uint8_t buttons);
+int hid_ctx_send_mouse_release(struct hid_ctx *ctx);
+int hid_ctx_send_mouse_click(struct hid_ctx *ctx, uint8_t buttons);
+
+/* Relative motion of any size with buttons held. Split into the fewest
+ * reports that carry it (steps of HID_MOUSE_DELTA_MAX, or
+ * HID_MOUSE_WIDE_DELTA_MAX with the 16-bit descriptor), spread evenly so
+ * the cursor follows a straight line. HID_OPT_MOUSE_STEP_MAX caps the steps
+ * instead, e.g. below the speed where the host's pointer acceleration sets
+ * in, so that long moves land where a slow hand would have put them. */
+int hid_ctx_send_mouse_motion(struct hid_ctx *ctx, uint8_t buttons,
+                              int32_t dx, int32_t dy);
+
+/* Moves along path (hid_path.h) in its duration with buttons held: one
+ * report per host polling interval (HID_OPT_MOUSE_INTERVAL_US, or what the
+ * gadget's USB speed implies), each due on the context's timeline so the
+ * schedule does not drift. Sub-count positions carry over between reports,
+ * and whatever the report size or HID_OPT_MOUSE_STEP_MAX held back is
+ * caught up on the following ones, so the gesture always ends exactly on
+ * the path's end point. */
+int hid_ctx_send_mouse_path(struct hid_ctx *ctx, uint8_t buttons,
+                            const struct hid_path *path);
+
+/* One wheel report of wheel (and, with HID_OPT_MOUSE_HSCROLL, hwheel)
+ * counts. Relative fields are consumed once per report, so nothing needs
+ * to reset them afterwards. */
+int hid_ctx_send_mouse_scroll(struct hid_ctx *ctx, int8_t wheel,
+                              int8_t hwheel);
+
+/* Scrolls v detents up (negative: down) and h right (needs
+ * HID_OPT_MOUSE_HSCROLL) over duration_ms, scheduled like
+ * hid_ctx_send_mouse_path(). With a hi-res descriptor
+ * (HID_OPT_WHEEL_MULTIPLIER > 1) a detent is that many counts, so
+ * fractions of a detent scroll and long scrolls glide; without one, whole
+ * detents. 0 ms sends the counts in as few reports as they fit. */
+int hid_ctx_send_mouse_wheel(struct hid_ctx *ctx, double v, double h,
+                             int duration_ms);
+
+/* --- Absolute pointer --- */
+
+/* Puts the cursor at (x, y) with one HID_ROLE_ABSOLUTE report, whatever
+ * the host's pointer acceleration. x and y are pixels of the
+ * HID_OPT_SCREEN_WIDTH x HEIGHT screen, or logical units up to
+ * HID_ABSOLUTE_MAX without a screen size, and are clamped to it. */
+int hid_ctx_send_absolute(struct hid_ctx *ctx, uint8_t buttons, int x, int y);
+
+/* Parses a coordinate for hid_ctx_send_absolute(): an integer, or a
+ * percentage of the axis (0 x, 1 y) from 0 to 100 such as "50%". -1 with
+ * EINVAL if s is neither. */
+int hid_ctx_parse_coordinate(const struct hid_ctx *ctx, int axis,
+                             const char *s, int *out);
+
+/* --- Consumer control --- */
+
+/* Taps a consumer key by name (PLAY, VOL+, ...) */
+int hid_ctx_send_consumer_key(struct hid_ctx *ctx, const char *action);
+
+/* --- Device registry --- */
+
+/* Registry entries 0..HID_ROLE_COUNT-1 are the devices hid_ctx_set_device()
+ * configures; more nodes (other gadgets, extra functions) are added after
+ * them. Selecting a device for a role routes that role's reports to it. With
+ * HID_OPT_ASYNC every device has its own queue and writer thread, so a slow
+ * or disconnected device never holds up the others, and reports still queued
+ * for a device drain there after another one is selected. */
+
+#define HID_DEVICE_MAX 32
+
+struct hid_device_info {
+  int index;
+  const char *path; /* NULL for an unset role slot */
+  const char *name; /* basename of path, e.g. "hidg3" */
+  int kind;         /* role of its configfs function, -1 unknown */
+  int composite;    /* every role behind report IDs on one interface */
+  int selected;     /* role it is selected for, -1 none */
+};
+
+int hid_ctx_device_count(const struct hid_ctx *ctx);
+int hid_ctx_device_info(const struct hid_ctx *ctx, int index,
+                        struct hid_device_info *out);
+
+/* Adds a node of the given kind (-1 unknown) and returns its index, or the
+ * index it already has. -1 with ENOSPC when the registry is full. */
+int hid_ctx_add_device(struct hid_ctx *ctx, const char *path, int kind);
+
+/* Index of the device named by an index, a path or a node name, or -1
+ * (ENOENT) */
+int hid_ctx_find_device(const struct hid_ctx *ctx, const char *name);
+
+/* Routes role (-1: the device's kind) to device index. Keys held on the
+ * previous keyboard are released first. */
+int hid_ctx_select_device(struct hid_ctx *ctx, int role, int index);
+int hid_ctx_selected_device(const struct hid_ctx *ctx, enum hid_role role);
+
+/* Applies a comma-separated selection: "hidg3" (for its kind),
+ * "mouse=hidg4", "keyboard=2" or "default" (every role back to its own
+ * device). Stops at the first entry that fails, with ENOENT or EINVAL. */
+int hid_ctx_select_devices(struct hid_ctx *ctx, const char *spec);
+
+/* --- Statistics --- */
+
+/* Write statistics of role's device since creation or the last reset */
+void hid_ctx_get_stats(const struct hid_ctx *ctx, enum hid_role role,
+                       struct hid_stats *out);
+void hid_ctx_reset_stats(struct hid_ctx *ctx);
+
+/* Timeline counters: delays waited, wake-up lateness and resyncs */
+void hid_ctx_get_timing(const struct hid_ctx *ctx,
+                        struct hid_timing_stats *out);
+
+/* Queue and batch counters (HID_OPT_QUEUE_STATS), one line per device */
+void hid_ctx_print_queue_stats(const struct hid_ctx *ctx, FILE *out);
+
+/* --- Names (no context needed) --- */
+
+extern const char *const hid_role_names[HID_ROLE_COUNT];
+
+/* "CTRL-SHIFT" -> modifier mask. If remainder is not NULL it is pointed at
+ * the first part of mod_str that is not a modifier. */
+uint8_t hid_parse_modifiers(const char *mod_str, const char **remainder);
+
+/* Usage of a named key (F1, ENTER, ...), or 0 */
+uint8_t hid_fn_key_usage(const char *key_name);
+
+/* Usage of a named consumer control (PLAY, VOL+, ...), or 0 */
+uint16_t hid_consumer_key_usage(const char *key_name);
+
+#endif // HID_CTX_H
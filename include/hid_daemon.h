@@ -0,0 +1,44 @@
+#ifndef HID_DAEMON_H
+#define HID_DAEMON_H
+
+/*
+ * Resident command server.
+ *
+ * `hid-gadget daemon` discovers the devices once, keeps the hidg fds open
+ * and executes commands received on a local SOCK_SEQPACKET socket, one at a
+ * time. A request carries the command's argv, the client's HID_* environment
+ * and its stdin/stdout/stderr (SCM_RIGHTS), so output lands on the caller's
+ * terminal exactly as if the command had run in-process. The reply is the
+ * command's exit status.
+ *
+ * The socket also hands out the shared-memory report ring (hid_shm.h) to
+ * producers when the daemon runs with --shm.
+ */
+
+/* Socket used when neither --socket nor HID_SOCKET is given */
+#define HID_DAEMON_DEFAULT_SOCKET "/data/local/tmp/hid-gadget.sock"
+
+/* Runs one command: argv[0] is the program name, argv[1] the command.
+ * Returns an exit status. */
+typedef int (*hid_daemon_handler)(int argc, char *argv[]);
+
+/* Resolves the socket path: explicit argument, then HID_SOCKET, then the
+ * default. */
+const char *hid_daemon_socket_path(const char *explicit_path);
+
+/* Binds path and serves requests until SIGINT/SIGTERM. Only root and the
+ * daemon's own uid may connect. Returns 0 on a clean shutdown, -1 if the
+ * socket could not be set up. */
+int hid_daemon_serve(const char *path, hid_daemon_handler handler);
+
+/* Publishes fd (-1: none) to local clients: the request argv
+ * {"hid-gadget", "shm-fd"} is answered by the daemon itself with status 0
+ * and the fd attached, instead of going to the handler. */
+void hid_daemon_share_fd(int fd);
+
+/* Sends argv (argv[0] is the program name) to the daemon at path and waits
+ * for the result. Returns 0 with *status set, or -1 when no daemon is
+ * reachable (nothing was executed). */
+int hid_daemon_forward(const char *path, int argc, char *argv[], int *status);
+
+#endif // HID_DAEMON_H
@@ -0,0 +1,74 @@
+#ifndef HID_DISCOVER_H
+#define HID_DISCOVER_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * hidg node discovery.
+ *
+ * /sys/class/hidg lists the f_hid nodes with their device numbers, and each
+ * configfs hid function (/config/usb_gadget/<gadget>/functions/hid.*)
+ * exposes the same number next to its boot protocol and report length,
+ * which tell the roles apart: protocol 1 is a keyboard, 2 a mouse, 0 with
+ * 16-byte reports the NKRO keyboard, 0 with 6 or 7 the 16-bit mouse, 0
+ * with 2-byte reports consumer control and 0 with 5-byte reports the
+ * absolute pointer. A function whose report descriptor declares report IDs is a
+ * composite interface carrying every role (hid-setup's HID_COMPOSITE).
+ * Kernels without the class directory fall back to scanning /dev.
+ *
+ * The result can be cached in a small text file. A later process reuses it
+ * as long as every node still has the device number and mtime it was cached
+ * with and no gadget's function directory changed, so startup costs a few
+ * stat() calls instead of a walk over /dev.
+ */
+
+#define HID_DISCOVER_MAX 32
+#define HID_DISCOVER_DEFAULT_CACHE "/data/local/tmp/.hid-gadget-devices"
+#define HID_GADGET_DEFAULT_DIR "/config/usb_gadget/g1"
+
+/* hid_node.role of a composite function: every role behind report IDs */
+#define HID_NODE_COMPOSITE 16
+
+struct hid_node {
+  char path[256];
+  int number; /* N of hidgN */
+  unsigned major, minor;
+  int role;          /* enum hid_role named by configfs, HID_NODE_COMPOSITE
+                        or -1 */
+  int report_length; /* from configfs, 0 if unknown */
+  int64_t mtime_ns;  /* of the node, for cache validation */
+};
+
+/* Finds up to max hidg nodes, sorted by number. root is prepended to /dev,
+ * /sys and /config ("" for the real ones). cache (NULL for none) is used if
+ * still valid and rewritten after a scan. Returns the number of nodes, or -1
+ * with errno set if neither sysfs nor /dev could be read. */
+int hid_discover_nodes(const char *root, const char *cache,
+                       struct hid_node *out, int max);
+
+/* HID_SYSROOT: prefix of /dev, /sys and /config ("" for the real ones).
+ * This and HID_GADGET_DIR are read from the environment on first use and
+ * kept for the life of the process. */
+const char *hid_sysroot(void);
+
+/* HID_GADGET_DIR: the gadget hid-setup manages, without the sysroot
+ * (HID_GADGET_DEFAULT_DIR when unset) */
+const char *hid_gadget_dir(void);
+
+/* snprintf() for paths: -1 instead of a truncated path */
+int hid_path_fmt(char *out, size_t size, const char *fmt, ...)
+    __attribute__((format(printf, 3, 4)));
+
+/* sysroot + gadget directory + "/" + rel, e.g. "functions/hid.gs1/
+ * report_length" or "UDC". -1 if it does not fit in size. */
+int hid_gadget_path(char *out, size_t size, const char *rel);
+
+/* Non-zero if a report descriptor contains a Report ID item */
+int hid_desc_has_report_ids(const unsigned char *desc, size_t len);
+
+/* Largest Resolution Multiplier a report descriptor offers (the physical
+ * maximum of its feature), 1 if it has none */
+int hid_desc_resolution_multiplier(const unsigned char *desc, size_t len);
+
+#endif // HID_DISCOVER_H
@@ -4,6 +4,20 @@
 #include <stddef.h>
 #include <stdint.h>
 
+/*
+ * Global HID API, kept for the TUI, the Ducky engine and existing callers.
+ * Every function acts on the default libhidgadget context (hid_ctx.h); new
+ * code that needs several gadgets or threads should use contexts directly.
+ */
+
+struct hid_ctx;
+
+/* The context used below. Created on first use from the environment and
+ * /dev/hidg* discovery unless one was installed. */
+struct hid_ctx *hid_default_ctx(void);
+/* Installs ctx as the default (NULL forgets it); the caller keeps ownership */
+void hid_set_default_ctx(struct hid_ctx *ctx);
+
 /* HID Core Primitives */
 int send_keyboard_report(uint8_t modifiers, uint8_t key1, uint8_t key2,
                          uint8_t key3, uint8_t key4, uint8_t key5,
@@ -12,19 +26,38 @@ int send_mouse_report(uint8_t buttons, int8_t x, int8_t y, int8_t wheel,
                       int8_t hwheel);
 int send_mouse_click(uint8_t buttons);
 int send_mouse_move(int8_t x, int8_t y);
+int send_mouse_press(uint8_t buttons);
+int send_mouse_release(void);
 int send_mouse_scroll(int8_t wheel);
+/* Absolute pointer to (x, y): pixels, logical units or "N%" each, see
+ * hid_ctx_send_absolute() */
+int send_mouse_moveto(const char *x, const char *y);
+/* Smooth relative motion along a path spec such as "line 300 400 0" (see
+ * hid_path.h). With buttons, a drag: pressed before, released after. */
+int send_mouse_path(uint8_t buttons, const char *spec);
 int send_consumer_key(const char *action);
 
 int set_hid_locale(const char *name);
+int select_hid_device(const char *spec);
 int send_raw_hid_report(const uint8_t *report, size_t size);
+uint8_t parse_modifiers(const char *mod_str, const char **remainder);
 
 /* High Level Helpers */
 int send_key_sequence(const char *modifiers_str, const char *sequence);
+/* Types len bytes of literal text; no key-name parsing, unmapped bytes skipped */
+int send_text(const char *buf, size_t len);
+/* Same, waiting delay_ms + rand(0..fuzz_ms) after each keystroke */
+int send_text_delayed(const char *buf, size_t len, int delay_ms, int fuzz_ms);
 int hold_key(const char *key_name);
 int release_key(const char *key_name);
 int release_all_keys(void);
 
 /* Utilities */
+/* Waits for queued reports to reach the device (no-op unless HID_ASYNC=1) */
+int hid_flush(void);
+/* Flushes, then sleeps: delays always start after preceding reports */
 void hid_sleep(int ms);
+/* errno of the first failed send or flush since the last call, or 0 */
+int hid_take_error(void);
 
 #endif // HID_INTERFACE_H
@@ -0,0 +1,48 @@
+#ifndef HID_PATH_H
+#define HID_PATH_H
+
+/*
+ * Mouse paths.
+ *
+ * A gesture for the relative mouse: a curve that starts where the cursor
+ * is, at (0, 0), and the time it should take. hid_ctx_send_mouse_path()
+ * (hid_ctx.h) samples it once per host polling interval and sends the
+ * difference between consecutive samples, rounded against the running
+ * total so that fractions of a count carry over to the next report instead
+ * of getting lost: the cursor ends exactly on the end point however many
+ * steps the curve took.
+ *
+ *   line   MS X1 Y1 [X2 Y2 ...]    straight segments through the waypoints,
+ *                                  at constant speed
+ *   bezier MS C1X C1Y [C2X C2Y] X Y  quadratic or cubic Bezier curve to X Y
+ *   arc    MS CX CY DEGREES        circle around CX CY, clockwise on screen
+ *                                  for positive DEGREES
+ *
+ * MS is the duration in milliseconds; coordinates are mouse counts
+ * relative to the start.
+ */
+
+#define HID_PATH_POINTS_MAX 16
+#define HID_PATH_COORD_MAX (1 << 24) /* counts from the start, either way */
+
+enum hid_path_kind { HID_PATH_LINE, HID_PATH_BEZIER, HID_PATH_ARC };
+
+struct hid_path {
+  enum hid_path_kind kind;
+  int duration_ms;
+  int npoints; /* waypoints, control points and end, or the arc's centre */
+  double x[HID_PATH_POINTS_MAX];
+  double y[HID_PATH_POINTS_MAX];
+  double length[HID_PATH_POINTS_MAX]; /* line: distance up to point i */
+  double degrees;                     /* arc */
+};
+
+/* Parses argv ("line 300 400 0", ...) as above: 0, or -1 with EINVAL if
+ * it is not a path */
+int hid_path_parse(struct hid_path *path, int argc, char *const argv[]);
+
+/* Where the path is at t (0 start, 1 end) */
+void hid_path_point(const struct hid_path *path, double t, double *x,
+                    double *y);
+
+#endif // HID_PATH_H
@@ -0,0 +1,94 @@
+#ifndef HID_QUEUE_H
+#define HID_QUEUE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Asynchronous report pipeline.
+ *
+ * One queue feeds one hidg file descriptor. The caller's thread is the single
+ * producer and pushes fixed-size slots into a lock-free ring; a dedicated
+ * writer thread drains the ring with blocking write() calls. The producer only
+ * blocks when the ring is full (counted as a stall) or on an explicit flush.
+ */
+
+/* Largest report a slot can carry: room for a 16-byte NKRO report with a
+ * composite report ID in front, and then some */
+#define HID_QUEUE_SLOT_SIZE 64
+
+/* Default ring capacity in reports (rounded up to a power of two) */
+#define HID_QUEUE_DEFAULT_DEPTH 1024
+
+/* Writes one report; same contract as write(2). arg is the value given to
+ * hid_queue_create(). */
+typedef int (*hid_queue_sink)(void *arg, int fd, const void *buf, size_t len);
+
+/* Folds report into queued, the newest report still waiting in the ring,
+ * and returns 1; returns 0 to have it queued behind instead. Runs on the
+ * producer's thread while the writer keeps off that slot. */
+typedef int (*hid_queue_merge)(void *arg, uint8_t *queued, size_t queued_len,
+                               const void *report, size_t len);
+
+/* Waits until the sink can take a report without blocking (POLLOUT on a
+ * hidg node). Called on the writer thread before it takes each report off
+ * the ring, so the reports behind it stay open to merging until then.
+ * Returns 0, or -1 with errno set if it gave up (e.g. ETIMEDOUT): the
+ * report still goes to the sink, whose own error handling decides its
+ * fate, and the failure is counted. */
+typedef int (*hid_queue_gate)(void *arg, int fd);
+
+struct hid_queue;
+
+struct hid_queue_stats {
+  uint64_t pushed;        /* reports accepted from the producer */
+  uint64_t merged;        /* of those, folded into one already queued */
+  uint64_t written;       /* reports fully written by the writer thread */
+  uint64_t errors;        /* failed or short writes */
+  uint64_t gate_failures; /* gate waits that timed out or failed */
+  uint64_t stalls;        /* pushes that found the ring full */
+  uint64_t stall_ns;      /* producer time spent waiting for space */
+  uint64_t flush_ns;      /* producer time spent in hid_queue_flush */
+  uint64_t write_ns;      /* writer time spent inside the sink */
+  uint32_t depth;         /* reports currently queued */
+  uint32_t max_depth;     /* high-water mark */
+  uint32_t capacity;
+};
+
+/* Called on every new writer thread before it writes anything, with the
+ * queue's sink arg (e.g. to raise its scheduling class). Process-wide. */
+typedef void (*hid_queue_thread_hook)(void *arg);
+void hid_queue_set_thread_hook(hid_queue_thread_hook hook);
+
+/* Creates a queue and starts its writer thread. fd is only handed to the
+ * sink (-1 for outputs without one). Returns NULL on failure. */
+struct hid_queue *hid_queue_create(int fd, size_t depth, hid_queue_sink sink,
+                                   void *arg);
+
+/* Queues one report (len <= HID_QUEUE_SLOT_SIZE). Blocks while the ring is
+ * full. Returns 0, or -1 with EMSGSIZE if the report is too large. */
+int hid_queue_push(struct hid_queue *q, const void *report, size_t len);
+
+/* Like hid_queue_push(), but first offers the report to merge() along
+ * with the newest queued report the writer has not started on. */
+int hid_queue_push_merge(struct hid_queue *q, const void *report, size_t len,
+                         hid_queue_merge merge, void *arg);
+
+/* Installs (NULL removes) the writer's gate; takes effect from the next
+ * report on. */
+void hid_queue_set_gate(struct hid_queue *q, hid_queue_gate gate);
+
+/* Barrier: waits until every queued report has been written. Returns -1 if
+ * any write failed since the previous flush, 0 otherwise. */
+int hid_queue_flush(struct hid_queue *q);
+
+/* Number of reports waiting to be written */
+size_t hid_queue_depth(const struct hid_queue *q);
+
+void hid_queue_get_stats(const struct hid_queue *q,
+                         struct hid_queue_stats *out);
+
+/* Flushes, stops the writer thread and frees the queue. Does not close fd. */
+void hid_queue_destroy(struct hid_queue *q);
+
+#endif // HID_QUEUE_H
@@ -0,0 +1,64 @@
+#ifndef HID_REPLAY_H
+#define HID_REPLAY_H
+
+#include "hid_ctx.h"
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Replay of capture files (capture:FILE / record:FILE, format in
+ * hid_backend.h).
+ *
+ * The file is mmapped and its reports are re-emitted through a context at
+ * absolute deadlines: report i is due at start + (t_i - t_0) / speed, slept
+ * for with hid_sleep_until_ns() (the context's HID_OPT_TIMER_SPIN_US
+ * applies), so time spent writing never accumulates into drift. Speed 0
+ * sends as fast as the endpoint takes them.
+ */
+
+/* A capture file mapped read-only */
+struct hid_capture {
+  const uint8_t *data;
+  size_t size;
+};
+
+struct hid_capture_record {
+  uint64_t timestamp_ns;
+  enum hid_role role;
+  const uint8_t *report; /* points into the mapping */
+  size_t len;
+};
+
+/* Maps path and checks its header. -1 with errno set (EINVAL: not a
+ * capture of HID_CAPTURE_VERSION). */
+int hid_capture_map(struct hid_capture *cap, const char *path);
+void hid_capture_unmap(struct hid_capture *cap);
+
+/* Decodes the record at *pos (start with 0) and advances past it. Returns 1
+ * for a record, 0 at the end, -1 (EINVAL) for a truncated or corrupt one. */
+int hid_capture_next(const struct hid_capture *cap, size_t *pos,
+                     struct hid_capture_record *rec);
+
+struct hid_replay_opts {
+  double speed;        /* 1.0 real time, 2.0 twice as fast, 0 no waiting */
+  uint64_t max_gap_ns; /* longer pauses (e.g. between appended runs) are
+                          shortened to this; 0 keeps them */
+};
+
+/* Reports sent later than this after their deadline count as late */
+#define HID_REPLAY_LATE_NS 1000000ull
+
+struct hid_replay_result {
+  size_t reports;       /* reports sent */
+  uint64_t elapsed_ns;  /* first deadline to the final flush */
+  size_t late_reports;  /* sent more than HID_REPLAY_LATE_NS late */
+  uint64_t max_late_ns; /* worst lateness */
+};
+
+/* Sends every report of cap through ctx and flushes. Stops at the first
+ * failed report (-1, errno set); result (optional) covers what was sent. */
+int hid_ctx_replay(struct hid_ctx *ctx, const struct hid_capture *cap,
+                   const struct hid_replay_opts *opts,
+                   struct hid_replay_result *result);
+
+#endif // HID_REPLAY_H
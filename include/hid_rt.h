@@ -0,0 +1,41 @@
+#ifndef HID_RT_H
+#define HID_RT_H
+
+/*
+ * Real-time mode for the threads that write reports.
+ *
+ * Opt-in, meant for root on busy devices where the scheduler preempts the
+ * writer mid-burst. Every step is tried on its own and a refused one only
+ * degrades the mode: without CAP_SYS_NICE the thread stays SCHED_OTHER,
+ * without CAP_IPC_LOCK (or RLIMIT_MEMLOCK) memory stays pageable, and
+ * pinning works unprivileged as long as the CPU is online.
+ */
+
+#define HID_RT_DEFAULT_PRIORITY 50
+#define HID_RT_STACK_PREFAULT (256 * 1024)
+/* Stack size for the library's own writer threads: the prefault plus room
+ * for the frames above it, independent of the libc default (128 KiB on
+ * musl) */
+#define HID_RT_THREAD_STACK (HID_RT_STACK_PREFAULT + 256 * 1024)
+
+/* What hid_rt_enter_thread() / hid_ctx_rt_enter() achieved */
+enum hid_rt_result {
+  HID_RT_FIFO = 1 << 0,   /* SCHED_FIFO at the requested priority */
+  HID_RT_PINNED = 1 << 1, /* affinity set to the requested CPU */
+  HID_RT_LOCKED = 1 << 2, /* mlockall(MCL_CURRENT | MCL_FUTURE) */
+};
+
+/* Applies SCHED_FIFO at priority (1-99, 0 leaves the policy alone) and pins
+ * to cpu (-1: no pinning) for the calling thread, then pre-faults
+ * HID_RT_STACK_PREFAULT bytes of its stack. Returns the HID_RT_* steps that
+ * took effect; errno is from the last one that failed. */
+int hid_rt_enter_thread(int priority, int cpu);
+
+/* Locks current and future mappings. 0, or -1 with errno set. */
+int hid_rt_lock_memory(void);
+
+/* One line describing what the mode achieved, e.g. for stderr */
+void hid_rt_describe(char *buf, unsigned long size, int priority, int cpu,
+                     int result);
+
+#endif // HID_RT_H
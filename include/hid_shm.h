@@ -0,0 +1,293 @@
+#ifndef HID_SHM_H
+#define HID_SHM_H
+
+/*
+ * Shared-memory report ring.
+ *
+ * A resident `hid-gadget daemon --shm` maps a ring of fixed-size report
+ * slots that any number of other processes can fill without syscalls; a
+ * drain thread in the daemon writes them to the hidg fds in ring order.
+ *
+ * This header is all a producer needs (no library to link):
+ *
+ *   struct hid_shm_ring *ring = hid_shm_attach_path("/data/local/tmp/hid.ring");
+ *   // or: hid_shm_attach_fd(hid_shm_request_fd(NULL));
+ *   uint8_t press[8] = {0, 0, 0x04}, release[8] = {0};
+ *   hid_shm_push(ring, HID_SHM_KEYBOARD, press, 8, 0);
+ *   hid_shm_push(ring, HID_SHM_KEYBOARD, release, 8, 0);
+ *
+ * The ring is a bounded multi-producer queue with a sequence number per slot
+ * (Vyukov): producers claim a slot with one CAS on head and publish it by
+ * storing its sequence. The consumer only sleeps on a futex when the ring is
+ * empty; the first producer to find it asleep issues the one FUTEX_WAKE, so
+ * a busy stream costs producers no syscalls at all.
+ *
+ * Keyboard reports are 8-byte boot reports (expanded automatically when the
+ * gadget uses NKRO) or raw 16-byte NKRO reports; mouse and consumer reports
+ * use the gadget's report sizes.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/futex.h>
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/un.h>
+#include <time.h>
+#include <unistd.h>
+
+#define HID_SHM_MAGIC 0x314d485344494821ull /* "!HIDSHM1" */
+#define HID_SHM_VERSION 1
+#define HID_SHM_REPORT_MAX 32
+#define HID_SHM_DEFAULT_SLOTS 4096
+
+enum hid_shm_role {
+  HID_SHM_KEYBOARD = 0,
+  HID_SHM_MOUSE = 1,
+  HID_SHM_CONSUMER = 2,
+};
+
+struct hid_shm_slot {
+  _Atomic uint64_t seq; /* == index + 1 once published */
+  uint64_t due_ns;      /* CLOCK_MONOTONIC deadline, 0 = as soon as possible */
+  uint8_t role;
+  uint8_t len;
+  uint8_t reserved[2];
+  uint8_t data[HID_SHM_REPORT_MAX];
+  uint8_t pad[12];
+};
+
+struct hid_shm_header {
+  uint64_t magic;
+  uint32_t version;
+  uint32_t capacity; /* slots, power of two */
+  uint32_t slot_size;
+  uint32_t header_size;
+  uint8_t pad0[40];
+
+  _Atomic uint64_t head; /* next slot to claim (producers) */
+  uint8_t pad1[56];
+
+  _Atomic uint64_t tail;          /* next slot to drain (consumer) */
+  _Atomic uint32_t wake;          /* futex word */
+  _Atomic uint32_t consumer_idle; /* consumer is (about to be) asleep */
+  _Atomic uint32_t stop;
+  uint8_t pad2[44];
+
+  /* Counters */
+  _Atomic uint64_t pushed;
+  _Atomic uint64_t full;   /* pushes rejected because the ring was full */
+  _Atomic uint64_t wakeups; /* FUTEX_WAKE calls issued by producers */
+  _Atomic uint64_t drained;
+  _Atomic uint64_t dropped; /* drained slots that could not be written */
+  uint8_t pad3[24];
+};
+
+struct hid_shm_ring {
+  struct hid_shm_header *hdr;
+  struct hid_shm_slot *slots;
+  size_t map_len;
+};
+
+static inline size_t hid_shm_map_size(uint32_t capacity) {
+  return sizeof(struct hid_shm_header) +
+         (size_t)capacity * sizeof(struct hid_shm_slot);
+}
+
+static inline uint64_t hid_shm_now_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+/* Maps an existing ring from an fd (memfd or file). The fd may be closed
+ * afterwards. Returns NULL if it is not a compatible ring. */
+static inline struct hid_shm_ring *hid_shm_attach_fd(int fd) {
+  struct stat st;
+  if (fd < 0 || fstat(fd, &st) != 0 ||
+      (size_t)st.st_size < sizeof(struct hid_shm_header))
+    return NULL;
+  void *p = mmap(NULL, (size_t)st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED,
+                 fd, 0);
+  if (p == MAP_FAILED)
+    return NULL;
+  struct hid_shm_header *h = (struct hid_shm_header *)p;
+  if (h->magic != HID_SHM_MAGIC || h->version != HID_SHM_VERSION ||
+      h->slot_size != sizeof(struct hid_shm_slot) ||
+      h->header_size != sizeof(struct hid_shm_header) ||
+      hid_shm_map_size(h->capacity) > (size_t)st.st_size) {
+    munmap(p, (size_t)st.st_size);
+    return NULL;
+  }
+  struct hid_shm_ring *r = (struct hid_shm_ring *)malloc(sizeof(*r));
+  if (!r) {
+    munmap(p, (size_t)st.st_size);
+    return NULL;
+  }
+  r->hdr = h;
+  r->slots = (struct hid_shm_slot *)((char *)p + sizeof(*h));
+  r->map_len = (size_t)st.st_size;
+  return r;
+}
+
+static inline void hid_shm_detach(struct hid_shm_ring *r) {
+  if (!r)
+    return;
+  munmap(r->hdr, r->map_len);
+  free(r);
+}
+
+static inline struct hid_shm_ring *hid_shm_attach_path(const char *path) {
+  int fd = open(path, O_RDWR | O_CLOEXEC);
+  if (fd < 0)
+    return NULL;
+  struct hid_shm_ring *r = hid_shm_attach_fd(fd);
+  close(fd);
+  return r;
+}
+
+/* Asks the daemon listening on socket_path (NULL: $HID_SOCKET or the
+ * default) for its ring's memfd. Returns the fd, or -1. */
+static inline int hid_shm_request_fd(const char *socket_path) {
+  if (!socket_path)
+    socket_path = getenv("HID_SOCKET");
+  if (!socket_path)
+    socket_path = "/data/local/tmp/hid-gadget.sock";
+
+  struct sockaddr_un addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  if (strlen(socket_path) >= sizeof(addr.sun_path))
+    return -1;
+  strcpy(addr.sun_path, socket_path);
+  int s = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+  if (s < 0)
+    return -1;
+  if (connect(s, (struct sockaddr *)&addr, sizeof(addr)) != 0) {
+    close(s);
+    return -1;
+  }
+
+  /* Daemon request for argv {"hid-gadget", "shm-fd"} (see hid-daemon.c):
+   * "HGD1", u32 argc, u32 envc, NUL-terminated args */
+  static const char args[] = "hid-gadget\0shm-fd";
+  char req[12 + sizeof(args)];
+  uint32_t counts[2] = {2, 0};
+  memcpy(req, "HGD1", 4);
+  memcpy(req + 4, counts, sizeof(counts));
+  memcpy(req + 12, args, sizeof(args));
+  int fd = -1;
+  if (send(s, req, sizeof(req), MSG_NOSIGNAL) == (ssize_t)sizeof(req)) {
+    int32_t status = -1;
+    union {
+      char buf[CMSG_SPACE(sizeof(int))];
+      struct cmsghdr align;
+    } ctrl;
+    struct iovec iov = {.iov_base = &status, .iov_len = sizeof(status)};
+    struct msghdr msg = {.msg_iov = &iov,
+                         .msg_iovlen = 1,
+                         .msg_control = ctrl.buf,
+                         .msg_controllen = sizeof(ctrl.buf)};
+    if (recvmsg(s, &msg, MSG_CMSG_CLOEXEC) == (ssize_t)sizeof(status) &&
+        status == 0) {
+      struct cmsghdr *c = CMSG_FIRSTHDR(&msg);
+      if (c && c->cmsg_level == SOL_SOCKET && c->cmsg_type == SCM_RIGHTS)
+        memcpy(&fd, CMSG_DATA(c), sizeof(fd));
+    }
+  }
+  close(s);
+  return fd;
+}
+
+/* Queues one report. due_ns is an absolute CLOCK_MONOTONIC time before which
+ * the report must not be sent (0: immediately). Returns 0, -1 with EAGAIN if
+ * the ring is full, or -1 with EINVAL for a bad report. Lock-free and safe
+ * from any number of threads and processes. */
+static inline int hid_shm_push(struct hid_shm_ring *r, enum hid_shm_role role,
+                               const void *report, size_t len,
+                               uint64_t due_ns) {
+  if (!r || len == 0 || len > HID_SHM_REPORT_MAX) {
+    errno = EINVAL;
+    return -1;
+  }
+  struct hid_shm_header *h = r->hdr;
+  uint64_t mask = h->capacity - 1;
+  uint64_t pos = atomic_load_explicit(&h->head, memory_order_relaxed);
+  struct hid_shm_slot *slot;
+
+  for (;;) {
+    slot = &r->slots[pos & mask];
+    uint64_t seq = atomic_load_explicit(&slot->seq, memory_order_acquire);
+    int64_t diff = (int64_t)(seq - pos);
+    if (diff == 0) {
+      if (atomic_compare_exchange_weak_explicit(&h->head, &pos, pos + 1,
+                                                memory_order_relaxed,
+                                                memory_order_relaxed))
+        break;
+    } else if (diff < 0) {
+      atomic_fetch_add_explicit(&h->full, 1, memory_order_relaxed);
+      errno = EAGAIN;
+      return -1;
+    } else {
+      pos = atomic_load_explicit(&h->head, memory_order_relaxed);
+    }
+  }
+
+  slot->due_ns = due_ns;
+  slot->role = (uint8_t)role;
+  slot->len = (uint8_t)len;
+  memcpy(slot->data, report, len);
+  atomic_store_explicit(&slot->seq, pos + 1, memory_order_release);
+  atomic_fetch_add_explicit(&h->pushed, 1, memory_order_relaxed);
+
+  /* Pairs with the consumer's fence between announcing sleep and its last
+   * look at the ring: either it sees this slot or we see it idle. */
+  atomic_thread_fence(memory_order_seq_cst);
+  if (atomic_load_explicit(&h->consumer_idle, memory_order_relaxed) &&
+      atomic_exchange(&h->consumer_idle, 0)) {
+    /* Only the producer that cleared the flag pays for the wake */
+    atomic_fetch_add(&h->wake, 1);
+    atomic_fetch_add_explicit(&h->wakeups, 1, memory_order_relaxed);
+    syscall(SYS_futex, &h->wake, FUTEX_WAKE, 1, NULL, NULL, 0);
+  }
+  return 0;
+}
+
+/* Reports queued but not yet written */
+static inline uint64_t hid_shm_pending(const struct hid_shm_ring *r) {
+  return atomic_load(&r->hdr->head) - atomic_load(&r->hdr->tail);
+}
+
+/* --- Consumer side (implemented in hid-shm.c, used by hid-gadget) --- */
+
+/* Writes one drained report; returns 0 on success */
+typedef int (*hid_shm_sink)(enum hid_shm_role role, const uint8_t *report,
+                            size_t len);
+
+struct hid_shm_server;
+
+/* Creates a ring of `slots` reports (rounded up to a power of two) backed by
+ * the file at path, or by an anonymous memfd when path is NULL, and starts
+ * the drain thread. */
+struct hid_shm_server *hid_shm_server_start(const char *path, size_t slots,
+                                            hid_shm_sink sink);
+
+/* The ring's fd, for handing to clients (SCM_RIGHTS) */
+int hid_shm_server_fd(const struct hid_shm_server *srv);
+
+/* The mapped header, for reading the counters */
+const struct hid_shm_header *
+hid_shm_server_header(const struct hid_shm_server *srv);
+
+/* Stops the drain thread (reports still queued are discarded), unmaps the
+ * ring and removes its file */
+void hid_shm_server_stop(struct hid_shm_server *srv);
+
+#endif // HID_SHM_H
@@ -0,0 +1,71 @@
+#ifndef HID_STATS_H
+#define HID_STATS_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+/*
+ * Per-device write statistics.
+ *
+ * Every report write is timed with CLOCK_MONOTONIC and counted into a
+ * log2-bucketed latency histogram: bucket 0 holds writes under 1.024 us,
+ * bucket i writes in [2^(9+i), 2^(10+i)) ns, the last bucket everything
+ * above. A struct hid_stats is only ever updated by one thread (the caller
+ * in synchronous mode, the device's writer thread with HID_ASYNC=1).
+ */
+
+#define HID_STATS_BUCKETS 24
+
+/* Marks a write whose blocking time is unknown (io_uring completions) */
+#define HID_STATS_NO_LATENCY UINT64_MAX
+
+enum hid_err_class {
+  HID_ERR_AGAIN = 0, /* EAGAIN/EWOULDBLOCK: endpoint busy */
+  HID_ERR_GONE,      /* ESHUTDOWN/ENODEV/EPIPE/ENXIO/EIO: host or UDC gone */
+  HID_ERR_TIMEOUT,   /* ETIMEDOUT: host stopped polling (poll pacing) */
+  HID_ERR_INTR,      /* EINTR */
+  HID_ERR_OTHER,
+  HID_ERR_CLASSES
+};
+
+/* Class of a write errno */
+enum hid_err_class hid_err_classify(int err);
+
+struct hid_stats {
+  uint64_t writes;       /* write-type syscalls (one writev counts once) */
+  uint64_t reports;      /* reports fully written */
+  uint64_t bytes;
+  uint64_t short_writes; /* returned fewer bytes than requested */
+  uint64_t errors[HID_ERR_CLASSES];
+  uint64_t lat_samples;
+  uint64_t lat_total_ns;
+  uint64_t lat_max_ns;
+  uint64_t hist[HID_STATS_BUCKETS];
+};
+
+/* Accounts one write syscall of len bytes carrying `reports` reports that
+ * returned res (errno err when res < 0) after ns nanoseconds. */
+void hid_stats_record(struct hid_stats *s, long res, size_t len,
+                      size_t reports, uint64_t ns, int err);
+
+void hid_stats_merge(struct hid_stats *dst, const struct hid_stats *src);
+
+/* Upper bound of the bucket holding the p-th percentile (0 < p <= 1) */
+uint64_t hid_stats_percentile_ns(const struct hid_stats *s, double p);
+
+/* Human readable dump: one summary line plus the non-empty buckets */
+void hid_stats_print(FILE *out, const char *name, const struct hid_stats *s);
+
+/* Adds st[0..n) into the stats file at path (created if missing), under an
+ * exclusive flock so concurrent invocations accumulate correctly.
+ * Returns 0 or -1 with errno set. */
+int hid_stats_save(const char *path, const char *const names[],
+                   const struct hid_stats *st, size_t n);
+
+/* Reads the stats file into st[0..n) (zeroed first). Devices missing from
+ * the file stay zero. Returns 0 or -1 with errno set. */
+int hid_stats_load(const char *path, const char *const names[],
+                   struct hid_stats *st, size_t n);
+
+#endif // HID_STATS_H
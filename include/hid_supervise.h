@@ -0,0 +1,50 @@
+#ifndef HID_SUPERVISE_H
+#define HID_SUPERVISE_H
+
+#include <stddef.h>
+
+/*
+ * Gadget supervisor.
+ *
+ * `hid-gadget supervise` replaces the polling loop of service.sh. It sleeps
+ * in poll() on the events that can break the gadget and checks it only
+ * after one of them:
+ *   - inotify on the configfs gadget (UDC file, function links in every
+ *     configuration) and on /dev (hidg nodes coming and going);
+ *   - kernel uevents (NETLINK_KOBJECT_UEVENT) for the udc, hidg and
+ *     android_usb subsystems;
+ *   - on Android, changes of the sys.usb.config property.
+ * Events are debounced (settle_ms), and the repair (the native setup of
+ * hid_configfs.h, or setup_cmd) only runs when the check finds something
+ * missing and the USB mode asks for HID (the first check, at boot, sets HID
+ * up regardless), so the events the repair itself causes end in a passing
+ * check. Failed repairs back off exponentially, up to a minute. A periodic
+ * check (recheck_s) covers events that cannot be watched.
+ */
+
+#define HID_SETUP_DEFAULT_COMMAND                                              \
+  "setprop sys.usb.config hid && /system/bin/hid-setup"
+
+struct hid_supervise_opts {
+  const char *root;      /* prefix for /dev, /sys and /config ("" real) */
+  const char *gadget;    /* configfs gadget below root */
+  const char *setup_cmd; /* run with sh -c instead of the native setup */
+  int settle_ms;         /* quiet time after an event before checking */
+  int recheck_s;         /* check this often without events, 0 never */
+  int once;              /* check, repair if needed and return */
+};
+
+#define HID_SUPERVISE_DEFAULT_SETTLE_MS 300
+#define HID_SUPERVISE_DEFAULT_RECHECK_S 60
+
+/* Checks the gadget at root + gadget: 0 if it is complete, otherwise 1 with
+ * what is missing written to why */
+int hid_gadget_check(const char *root, const char *gadget, char *why,
+                     size_t size);
+
+/* Supervises until SIGINT/SIGTERM and returns 0, or -1 if no event source
+ * could be set up. With opts->once: 0 if the gadget is (now) healthy, 1 if
+ * not. */
+int hid_supervise_run(const struct hid_supervise_opts *opts);
+
+#endif // HID_SUPERVISE_H
@@ -0,0 +1,67 @@
+#ifndef HID_TIMELINE_H
+#define HID_TIMELINE_H
+
+#include <stdint.h>
+#include <stdio.h>
+
+/*
+ * Drift-free delays.
+ *
+ * A timeline remembers the deadline of the last delay and places the next
+ * one relative to it instead of relative to "now": deadline = previous
+ * deadline + delay, slept for with clock_nanosleep(TIMER_ABSTIME). Wake-up
+ * latency and the time spent writing between two delays are absorbed by the
+ * next one, so a script's duration stays at the sum of its delays however
+ * many there are. When the previous deadline is more than
+ * HID_TIMELINE_RESYNC_NS in the past (untimed work such as a long STRING, or
+ * idle time between commands) the timeline restarts at "now" rather than
+ * rushing to catch up.
+ *
+ * An optional spin tail sleeps until spin_ns before the deadline and busy
+ * waits the rest, for sub-millisecond accuracy at the cost of CPU.
+ */
+
+#define HID_TIMELINE_RESYNC_NS 20000000ull /* 20 ms */
+
+/* Default timer slack the CLI requests (the kernel default is 50 us) */
+#define HID_TIMER_DEFAULT_SLACK_NS 1000ul
+
+struct hid_timing_stats {
+  uint64_t waits;         /* delays waited on the timeline */
+  uint64_t resyncs;       /* restarts at "now" after untimed work */
+  uint64_t late_total_ns; /* wake-up lateness against the deadlines */
+  uint64_t late_max_ns;
+};
+
+struct hid_timeline {
+  uint64_t deadline_ns; /* last deadline (CLOCK_MONOTONIC), 0 before any */
+  uint32_t spin_ns;
+  int relative; /* measure every delay from "now" (the old behaviour) */
+  struct hid_timing_stats stats;
+};
+
+uint64_t hid_monotonic_ns(void);
+
+/* Sleeps until the CLOCK_MONOTONIC time deadline_ns, spinning for the last
+ * spin_ns. Returns at once if it has passed. */
+void hid_sleep_until_ns(uint64_t deadline_ns, uint32_t spin_ns);
+
+/* Sets the calling thread's timer slack (inherited by threads it creates
+ * later); 0 restores the default. */
+int hid_timer_set_slack(unsigned long ns);
+
+void hid_timeline_init(struct hid_timeline *tl);
+
+/* Where the next delay starts: the last deadline, or now after a resync */
+uint64_t hid_timeline_start(struct hid_timeline *tl);
+
+/* Waits delay_ns past hid_timeline_start() and makes that the new deadline */
+void hid_timeline_wait(struct hid_timeline *tl, uint64_t delay_ns);
+
+/* Records a deadline reached elsewhere (a batch scheduled its own) */
+void hid_timeline_set(struct hid_timeline *tl, uint64_t deadline_ns);
+
+/* One "[HID-STATS] timing: ..." line; nothing if no delay was waited */
+void hid_timing_print(FILE *out, const struct hid_timing_stats *s);
+
+#endif // HID_TIMELINE_H
@@ -1,8 +1,13 @@
 #!/system/bin/sh
 # Magisk Module service script for HID Gadget
-# Ensures HID gadget is initialized on boot and monitors for changes.
+# Ensures HID gadget is initialized on boot and keeps it set up.
 
-# Wait for the system to settle down after boot
+# The supervisor waits for sys.boot_completed, sets the gadget up if it is
+# incomplete and then repairs it only when configfs, the UDC or the
+# hidg nodes change and leave it broken.
+/system/bin/hid-gadget supervise && exit 0
+
+# Fallback (binary missing or no event source): the old polling loop
 sleep 30
 
 # Force initial setup to prevent "no device" errors on first run
@@ -23,10 +28,6 @@ while true; do
                 # Configuration confirmed as HID, ensure setup is applied
                 /system/bin/hid-setup
                 ;;
-            *)
-                # HID dropped? You might want to auto-restore it here
-                # setprop sys.usb.config hid
-                ;;
         esac
         prev_config="$current_config"
     fi
@@ -1,6 +1,7 @@
 #include "../include/ducky.h"
 #include "../include/hid_interface.h"
 #include <ctype.h>
+#include <errno.h>
 #include <fcntl.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -426,12 +427,8 @@ static int exec_line(Script *s, int pc) {
     char *sub = substitute_vars(line);
     int ln = (sub[6] == 'L');
     const char *t = sub + (ln ? 9 : 7);
-    for (const char *c = t; *c; c++) {
-      char b[2] = {*c, 0};
-      send_key_sequence(NULL, b);
-      if (g_default_char_delay > 0)
-        hid_sleep(g_default_char_delay + (rand() % (g_default_char_fuzz + 1)));
-    }
+    send_text_delayed(t, strlen(t), g_default_char_delay,
+                      g_default_char_fuzz);
     if (ln)
       send_key_sequence(NULL, "ENTER");
     free(sub);
@@ -544,6 +541,43 @@ static int exec_line(Script *s, int pc) {
     char *sub = substitute_vars(line);
     set_hid_locale(sub + 7);
     free(sub);
+  } else if (strncmp(line, "DEVICE ", 7) == 0) {
+    char *sub = substitute_vars(line);
+    if (select_hid_device(sub + 7) != 0)
+      fprintf(stderr, "[Ducky] DEVICE %s: %s\n", sub + 7, strerror(errno));
+    free(sub);
+  } else if (strncmp(line, "MOUSE_MOVETO ", 13) == 0) {
+    char *sub = substitute_vars(line);
+    char x[32], y[32];
+    if (sscanf(sub + 13, "%31s %31s", x, y) != 2)
+      fprintf(stderr, "[Ducky] MOUSE_MOVETO needs X Y\n");
+    else if (send_mouse_moveto(x, y) != 0)
+      fprintf(stderr, "[Ducky] MOUSE_MOVETO %s %s: %s\n", x, y,
+              strerror(errno));
+    free(sub);
+  } else if (strncmp(line, "MOUSE_PATH ", 11) == 0) {
+    char *sub = substitute_vars(line);
+    if (send_mouse_path(0, sub + 11) != 0)
+      fprintf(stderr, "[Ducky] MOUSE_PATH %s: %s\n", sub + 11,
+              strerror(errno));
+    free(sub);
+  } else if (strncmp(line, "MOUSE_DRAG ", 11) == 0) {
+    char *sub = substitute_vars(line);
+    char *spec = sub + 11;
+    uint8_t button = 0x01; /* left, unless a button comes first */
+    if (strncmp(spec, "LEFT ", 5) == 0) {
+      spec += 5;
+    } else if (strncmp(spec, "RIGHT ", 6) == 0) {
+      button = 0x02;
+      spec += 6;
+    } else if (strncmp(spec, "MIDDLE ", 7) == 0) {
+      button = 0x04;
+      spec += 7;
+    }
+    if (send_mouse_path(button, spec) != 0)
+      fprintf(stderr, "[Ducky] MOUSE_DRAG %s: %s\n", sub + 11,
+              strerror(errno));
+    free(sub);
   } else if (strncmp(line, "KEYCODE ", 8) == 0) {
     char *sub = substitute_vars(line);
     uint8_t report[8] = {0};
@@ -594,6 +628,11 @@ static int exec_line(Script *s, int pc) {
     char *sub = substitute_vars(line);
     g_default_delay = atoi(sub + 13);
     free(sub);
+  } else if (strncmp(line, "DEFAULTCHARDELAY ", 17) == 0 ||
+             strncmp(line, "DEFAULT_CHAR_DELAY ", 19) == 0) {
+    char *sub = substitute_vars(line);
+    g_default_char_delay = atoi(lskip(strchr(sub, ' ')));
+    free(sub);
   } else if (strncmp(line, "FUNCTION ", 9) == 0 ||
              strncmp(line, "END_FUNCTION", 12) == 0 ||
              strncmp(line, "RETURN", 6) == 0 ||
@@ -684,18 +723,31 @@ static int exec_line(Script *s, int pc) {
   return pc + 1;
 }
 
+static int g_initialized = 0;
+
 void ducky_init() {
-  static int initialized = 0;
-  if (!initialized) {
+  if (!g_initialized) {
     srand(time(NULL));
     // Setup system constants
     ducky_set_var("WINDOWS", "WINDOWS");
     ducky_set_var("LINUX", "LINUX");
     ducky_set_var("MACOS", "MACOS");
-    initialized = 1;
+    g_initialized = 1;
   }
 }
 
+void ducky_reset() {
+  g_var_count = 0;
+  g_func_count = 0;
+  g_label_count = 0;
+  g_default_delay = 0;
+  g_default_delay_fuzz = 0;
+  g_default_char_delay = 0;
+  g_default_char_fuzz = 0;
+  g_in_function = 0;
+  g_initialized = 0;
+}
+
 void ducky_load_profile() {
   ducky_init();
   Script vars_s;
@@ -714,13 +766,24 @@ int ducky_execute_script(const char *filename) {
   Script s;
   if (load_script(filename, &s) != 0)
     return -1;
-  int pc = 0;
-  while (pc < s.count)
+  int pc = 0, ret = 0;
+  hid_take_error(); // failures of earlier commands are not ours
+  while (pc < s.count) {
+    int line = pc;
     pc = exec_line(&s, pc);
+    // Output that failed even after waiting for the host: stop typing
+    int err = hid_take_error();
+    if (err) {
+      fprintf(stderr, "[Ducky] Output failed at line %d (%s); stopping\n",
+              line + 1, strerror(err));
+      ret = -1;
+      break;
+    }
+  }
   if (g_hid_led_fd >= 0) {
     close(g_hid_led_fd);
     g_hid_led_fd = -1;
   }
   free_script(&s);
-  return 0;
+  return ret;
 }
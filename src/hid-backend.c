@@ -0,0 +1,383 @@
+/*
+ * hid-backend.c - report output backends (see hid_backend.h).
+ */
+
+#include "../include/hid_backend.h"
+#include "../include/hid_timeline.h"
+#include <errno.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+struct hid_backend {
+  const struct hid_backend_ops *ops;
+  void *state;
+  _Atomic uint64_t reports;
+  _Atomic uint64_t bytes;
+};
+
+/* Memory record: role, length, payload */
+#define RECORD_HEADER 2
+#define RECORD_MAX (RECORD_HEADER + 255)
+
+static size_t encode_record(uint8_t *out, int role, const void *buf,
+                            size_t len) {
+  out[0] = (uint8_t)role;
+  out[1] = (uint8_t)len;
+  memcpy(out + RECORD_HEADER, buf, len);
+  return RECORD_HEADER + len;
+}
+
+// --- Device ---
+static long device_write(void *state, int role, int fd, const void *buf,
+                         size_t len) {
+  (void)state;
+  (void)role;
+  return write(fd, buf, len);
+}
+
+static const struct hid_backend_ops device_ops = {
+    .name = "device", .needs_fd = 1, .write = device_write};
+// --- End Device ---
+
+// --- Mock ---
+struct mock_state {
+  pthread_mutex_t lock;
+  int latency_us; // simulates a host that is slow to poll the endpoint
+};
+
+static long mock_write(void *state, int role, int fd, const void *buf,
+                       size_t len) {
+  static const char hex[] = "0123456789ABCDEF";
+  struct mock_state *m = state;
+  const uint8_t *report = buf;
+  char line[64 + 3 * 255];
+  (void)role;
+  (void)fd;
+  if (len > 255) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  if (m->latency_us > 0)
+    usleep(m->latency_us);
+  int n = snprintf(line, sizeof(line), "[HID-MOCK] Writing %zu bytes: ", len);
+  for (size_t i = 0; i < len; i++) {
+    line[n++] = hex[report[i] >> 4];
+    line[n++] = hex[report[i] & 15];
+    line[n++] = ' ';
+  }
+  line[n++] = '\n';
+
+  pthread_mutex_lock(&m->lock);
+  fwrite(line, 1, (size_t)n, stdout);
+  pthread_mutex_unlock(&m->lock);
+  return (long)len;
+}
+
+static int mock_flush(void *state) {
+  (void)state;
+  return fflush(stdout) == 0 ? 0 : -1;
+}
+
+static void mock_destroy(void *state) {
+  struct mock_state *m = state;
+  pthread_mutex_destroy(&m->lock);
+  free(m);
+}
+
+static const struct hid_backend_ops mock_ops = {.name = "mock",
+                                                .write = mock_write,
+                                                .flush = mock_flush,
+                                                .destroy = mock_destroy};
+// --- End Mock ---
+
+// --- Capture File ---
+struct capture_state {
+  pthread_mutex_t lock;
+  FILE *file;
+  int failed; // a record:FILE report went out but could not be logged
+};
+
+static int capture_append(struct capture_state *c, int role, uint64_t ts,
+                          const void *buf, size_t len) {
+  uint8_t rec[HID_CAPTURE_RECORD_HEADER + 255];
+  for (int i = 0; i < 8; i++)
+    rec[i] = (uint8_t)(ts >> (8 * i));
+  rec[8] = (uint8_t)role;
+  rec[9] = (uint8_t)len;
+  memcpy(rec + HID_CAPTURE_RECORD_HEADER, buf, len);
+  size_t n = HID_CAPTURE_RECORD_HEADER + len;
+
+  pthread_mutex_lock(&c->lock);
+  size_t w = fwrite(rec, 1, n, c->file);
+  pthread_mutex_unlock(&c->lock);
+  if (w != n) {
+    errno = EIO;
+    return -1;
+  }
+  return 0;
+}
+
+static long capture_write(void *state, int role, int fd, const void *buf,
+                          size_t len) {
+  (void)fd;
+  if (len > 255) {
+    errno = EINVAL;
+    return -1;
+  }
+  if (capture_append(state, role, hid_monotonic_ns(), buf, len) != 0)
+    return -1;
+  return (long)len;
+}
+
+/* record:FILE: the device write decides the result; the log follows it */
+static long record_write(void *state, int role, int fd, const void *buf,
+                         size_t len) {
+  struct capture_state *c = state;
+  uint64_t ts = hid_monotonic_ns();
+  long n = write(fd, buf, len);
+  if (n > 0 && capture_append(c, role, ts, buf, (size_t)n) != 0)
+    c->failed = 1;
+  return n;
+}
+
+static int capture_flush(void *state) {
+  struct capture_state *c = state;
+  pthread_mutex_lock(&c->lock);
+  int ret = (fflush(c->file) == 0 && !c->failed) ? 0 : -1;
+  pthread_mutex_unlock(&c->lock);
+  return ret;
+}
+
+static void capture_destroy(void *state) {
+  struct capture_state *c = state;
+  fclose(c->file);
+  pthread_mutex_destroy(&c->lock);
+  free(c);
+}
+
+static const struct hid_backend_ops capture_ops = {.name = "capture",
+                                                   .write = capture_write,
+                                                   .flush = capture_flush,
+                                                   .destroy = capture_destroy};
+
+static const struct hid_backend_ops record_ops = {.name = "record",
+                                                  .needs_fd = 1,
+                                                  .write = record_write,
+                                                  .flush = capture_flush,
+                                                  .destroy = capture_destroy};
+
+/* Opens path for appending: a new or empty file gets the header, an existing
+ * one must already be a capture of this version */
+static struct capture_state *capture_open(const char *path) {
+  static const uint8_t header[HID_CAPTURE_HEADER_SIZE] = {
+      'H', 'I', 'D', 'C', HID_CAPTURE_VERSION, 0, 0, 0};
+  uint8_t existing[HID_CAPTURE_HEADER_SIZE];
+  struct capture_state *c = calloc(1, sizeof(*c));
+  if (!c)
+    return NULL;
+  c->file = fopen(path, "a+b");
+  if (!c->file) {
+    free(c);
+    return NULL;
+  }
+  /* Records are tiny; let stdio turn them into large writes */
+  setvbuf(c->file, NULL, _IOFBF, 1 << 16);
+  size_t got = fread(existing, 1, sizeof(existing), c->file);
+  fseek(c->file, 0, SEEK_END); // switching from reading to appending
+  if (got == 0) {
+    fwrite(header, 1, sizeof(header), c->file);
+  } else if (got != sizeof(existing) ||
+             memcmp(existing, header, sizeof(header)) != 0) {
+    fclose(c->file);
+    free(c);
+    errno = EINVAL;
+    return NULL;
+  }
+  pthread_mutex_init(&c->lock, NULL);
+  return c;
+}
+// --- End Capture File ---
+
+// --- Memory Buffer ---
+struct memory_state {
+  pthread_mutex_t lock;
+  uint8_t *data;
+  size_t len;
+  size_t cap;
+};
+
+static long memory_write(void *state, int role, int fd, const void *buf,
+                         size_t len) {
+  struct memory_state *m = state;
+  (void)fd;
+  if (len > 255) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  pthread_mutex_lock(&m->lock);
+  if (m->len + RECORD_MAX > m->cap) {
+    size_t cap = m->cap ? m->cap * 2 : 4096;
+    uint8_t *data = realloc(m->data, cap);
+    if (!data) {
+      pthread_mutex_unlock(&m->lock);
+      errno = ENOMEM;
+      return -1;
+    }
+    m->data = data;
+    m->cap = cap;
+  }
+  m->len += encode_record(m->data + m->len, role, buf, len);
+  pthread_mutex_unlock(&m->lock);
+  return (long)len;
+}
+
+static void memory_destroy(void *state) {
+  struct memory_state *m = state;
+  free(m->data);
+  pthread_mutex_destroy(&m->lock);
+  free(m);
+}
+
+static const struct hid_backend_ops memory_ops = {
+    .name = "memory", .write = memory_write, .destroy = memory_destroy};
+// --- End Memory Buffer ---
+
+// --- Null Sink ---
+static long null_write(void *state, int role, int fd, const void *buf,
+                       size_t len) {
+  (void)state;
+  (void)role;
+  (void)fd;
+  (void)buf;
+  return (long)len;
+}
+
+static const struct hid_backend_ops null_ops = {.name = "null",
+                                                .write = null_write};
+// --- End Null Sink ---
+
+struct hid_backend *hid_backend_new(const struct hid_backend_ops *ops,
+                                    void *state) {
+  struct hid_backend *b = calloc(1, sizeof(*b));
+  if (!b)
+    return NULL;
+  b->ops = ops;
+  b->state = state;
+  return b;
+}
+
+struct hid_backend *hid_backend_open(const char *spec) {
+  const struct hid_backend_ops *ops = NULL;
+  void *state = NULL;
+
+  if (strcmp(spec, "device") == 0) {
+    ops = &device_ops;
+  } else if (strcmp(spec, "null") == 0) {
+    ops = &null_ops;
+  } else if (strcmp(spec, "mock") == 0) {
+    struct mock_state *m = calloc(1, sizeof(*m));
+    if (!m)
+      return NULL;
+    const char *lat = getenv("HID_MOCK_LATENCY_US");
+    m->latency_us = lat ? atoi(lat) : 0;
+    pthread_mutex_init(&m->lock, NULL);
+    ops = &mock_ops;
+    state = m;
+  } else if (strcmp(spec, "memory") == 0) {
+    struct memory_state *m = calloc(1, sizeof(*m));
+    if (!m)
+      return NULL;
+    pthread_mutex_init(&m->lock, NULL);
+    ops = &memory_ops;
+    state = m;
+  } else if (strncmp(spec, "capture:", 8) == 0 && spec[8] != '\0') {
+    if (!(state = capture_open(spec + 8)))
+      return NULL;
+    ops = &capture_ops;
+  } else if (strncmp(spec, "record:", 7) == 0 && spec[7] != '\0') {
+    if (!(state = capture_open(spec + 7)))
+      return NULL;
+    ops = &record_ops;
+  } else {
+    errno = EINVAL;
+    return NULL;
+  }
+
+  struct hid_backend *b = hid_backend_new(ops, state);
+  if (!b && ops->destroy)
+    ops->destroy(state);
+  return b;
+}
+
+void hid_backend_free(struct hid_backend *b) {
+  if (!b)
+    return;
+  hid_backend_flush(b);
+  if (b->ops->destroy)
+    b->ops->destroy(b->state);
+  free(b);
+}
+
+const char *hid_backend_name(const struct hid_backend *b) {
+  return b->ops->name;
+}
+
+int hid_backend_needs_fd(const struct hid_backend *b) {
+  return b->ops->needs_fd;
+}
+
+int hid_backend_is_device(const struct hid_backend *b) {
+  return b->ops == &device_ops;
+}
+
+long hid_backend_write(struct hid_backend *b, int role, int fd,
+                       const void *buf, size_t len) {
+  long n = b->ops->write(b->state, role, fd, buf, len);
+  if (n > 0) {
+    atomic_fetch_add_explicit(&b->reports, 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&b->bytes, (uint64_t)n, memory_order_relaxed);
+  }
+  return n;
+}
+
+int hid_backend_flush(struct hid_backend *b) {
+  return b->ops->flush ? b->ops->flush(b->state) : 0;
+}
+
+void hid_backend_counts(const struct hid_backend *b, uint64_t *reports,
+                        uint64_t *bytes) {
+  if (reports)
+    *reports = atomic_load(&b->reports);
+  if (bytes)
+    *bytes = atomic_load(&b->bytes);
+}
+
+const uint8_t *hid_backend_data(struct hid_backend *b, size_t *len) {
+  if (b->ops != &memory_ops) {
+    if (len)
+      *len = 0;
+    return NULL;
+  }
+  struct memory_state *m = b->state;
+  pthread_mutex_lock(&m->lock);
+  const uint8_t *data = m->data;
+  if (len)
+    *len = m->len;
+  pthread_mutex_unlock(&m->lock);
+  return data;
+}
+
+void hid_backend_clear(struct hid_backend *b) {
+  if (b->ops != &memory_ops)
+    return;
+  struct memory_state *m = b->state;
+  pthread_mutex_lock(&m->lock);
+  m->len = 0;
+  pthread_mutex_unlock(&m->lock);
+}
@@ -0,0 +1,478 @@
+/*
+ * hid-batch.c - Batched report submission (writev / io_uring / loop).
+ *
+ * io_uring is driven through the raw syscalls so the static musl builds need
+ * no liburing. Inter-report delays become IORING_OP_TIMEOUT requests linked
+ * between the writes; IORING_TIMEOUT_ETIME_SUCCESS keeps an expired timeout
+ * from breaking the chain. Kernels that reject any of this simply fall back
+ * to the loop, resuming at the first report that was not written.
+ *
+ * On a timeline the timeouts are IORING_TIMEOUT_ABS deadlines computed when
+ * the chain is built, so the chain keeps the caller's absolute schedule. A
+ * chain cannot resync; lag behind a stalled host is caught up at the host's
+ * polling rate.
+ */
+
+#include "../include/hid_batch.h"
+#include "../include/hid_timeline.h"
+#include <errno.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <time.h>
+#include <unistd.h>
+
+#if defined(__has_include)
+#if __has_include(<linux/io_uring.h>) && defined(__NR_io_uring_setup)
+#define HID_HAVE_URING 1
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#endif
+#endif
+
+#define BATCH_IOV_MAX 1024
+#define URING_ENTRIES 256
+
+static enum hid_batch_mode g_max_mode = HID_BATCH_URING;
+static struct hid_batch_stats g_stats; /* updated with stat_add() only */
+static hid_batch_observer g_observer;
+
+/* Batches may come from several threads (one per context); the io_uring
+ * instance is shared and is only ever driven by one of them at a time. */
+static pthread_mutex_t g_ring_lock = PTHREAD_MUTEX_INITIALIZER;
+
+void hid_batch_set_max_mode(enum hid_batch_mode mode) { g_max_mode = mode; }
+
+void hid_batch_set_observer(hid_batch_observer obs) { g_observer = obs; }
+
+static inline void stat_add(uint64_t *counter, uint64_t n) {
+  __atomic_fetch_add(counter, n, __ATOMIC_RELAXED);
+}
+
+void hid_batch_get_stats(struct hid_batch_stats *out) {
+  out->batches = __atomic_load_n(&g_stats.batches, __ATOMIC_RELAXED);
+  out->reports = __atomic_load_n(&g_stats.reports, __ATOMIC_RELAXED);
+  out->syscalls = __atomic_load_n(&g_stats.syscalls, __ATOMIC_RELAXED);
+  out->uring_chains =
+      __atomic_load_n(&g_stats.uring_chains, __ATOMIC_RELAXED);
+  out->fallbacks = __atomic_load_n(&g_stats.fallbacks, __ATOMIC_RELAXED);
+}
+
+/* Waits us after a report: from now, or on the caller's timeline */
+static void delay_us(uint32_t us, struct hid_timeline *tl) {
+  stat_add(&g_stats.syscalls, 1);
+  if (tl) {
+    hid_timeline_wait(tl, (uint64_t)us * 1000u);
+    return;
+  }
+  struct timespec ts = {us / 1000000, (long)(us % 1000000) * 1000};
+  while (nanosleep(&ts, &ts) != 0 && errno == EINTR)
+    ;
+}
+
+/* Writes reports [0, count) with no delays between them. Returns the number
+ * of reports fully written. */
+static size_t write_run(int fd, const uint8_t *reports, size_t report_len,
+                        size_t count, hid_batch_sink sink, void *arg) {
+  size_t done = 0;
+
+  if (g_max_mode >= HID_BATCH_WRITEV && count > 1) {
+    struct iovec iov[BATCH_IOV_MAX];
+    while (done < count) {
+      size_t n = count - done;
+      if (n > BATCH_IOV_MAX)
+        n = BATCH_IOV_MAX;
+      for (size_t i = 0; i < n; i++) {
+        iov[i].iov_base = (void *)(reports + (done + i) * report_len);
+        iov[i].iov_len = report_len;
+      }
+      stat_add(&g_stats.syscalls, 1);
+      uint64_t t0 = g_observer ? hid_monotonic_ns() : 0;
+      ssize_t w = writev(fd, iov, (int)n);
+      if (g_observer)
+        g_observer(arg, fd, (long)w, n * report_len, n, hid_monotonic_ns() - t0, errno);
+      if (w < 0) {
+        if (errno == EINTR)
+          continue;
+        break; /* let the loop below report the error on this report */
+      }
+      done += (size_t)w / report_len;
+      if ((size_t)w != n * report_len)
+        return done; /* short write: never split a report */
+    }
+  }
+
+  for (; done < count; done++) {
+    stat_add(&g_stats.syscalls, 1);
+    if (sink(arg, fd, reports + done * report_len, report_len) !=
+        (int)report_len)
+      break;
+  }
+  return done;
+}
+
+/* Loop mode with delays: writev the runs between non-zero delays. */
+static size_t submit_loop(int fd, const uint8_t *reports, size_t report_len,
+                          size_t count, const uint32_t *delays_us,
+                          struct hid_timeline *tl, hid_batch_sink sink,
+                          void *arg) {
+  size_t done = 0;
+  while (done < count) {
+    size_t end = done;
+    while (end < count && (!delays_us || delays_us[end] == 0))
+      end++;
+    if (end < count)
+      end++; /* include the report the delay follows */
+
+    size_t n = write_run(fd, reports + done * report_len, report_len,
+                         end - done, sink, arg);
+    done += n;
+    if (done < end)
+      break;
+    if (delays_us && delays_us[end - 1] > 0)
+      delay_us(delays_us[end - 1], tl);
+  }
+  return done;
+}
+
+#ifdef HID_HAVE_URING
+struct uring {
+  int fd;
+  unsigned sq_entries;
+  unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+  unsigned *cq_head, *cq_tail, *cq_mask;
+  struct io_uring_sqe *sqes;
+  struct io_uring_cqe *cqes;
+  void *sq_ptr, *cq_ptr;
+  size_t sq_size, cq_size, sqes_size;
+};
+
+static struct uring g_ring = {.fd = -1};
+static int g_ring_state = 0; /* 0 untried, 1 ready, -1 unavailable */
+
+static int uring_probe_ops(int fd) {
+  size_t sz = sizeof(struct io_uring_probe) +
+              IORING_OP_LAST * sizeof(struct io_uring_probe_op);
+  struct io_uring_probe *probe = calloc(1, sz);
+  if (!probe)
+    return -1;
+  int ok = 0;
+  if (syscall(__NR_io_uring_register, fd, IORING_REGISTER_PROBE, probe,
+              IORING_OP_LAST) == 0 &&
+      probe->last_op >= IORING_OP_WRITE &&
+      (probe->ops[IORING_OP_WRITE].flags & IO_URING_OP_SUPPORTED) &&
+      (probe->ops[IORING_OP_TIMEOUT].flags & IO_URING_OP_SUPPORTED))
+    ok = 1;
+  free(probe);
+  return ok ? 0 : -1;
+}
+
+static void uring_teardown(void) {
+  if (g_ring.sqes)
+    munmap(g_ring.sqes, g_ring.sqes_size);
+  if (g_ring.cq_ptr && g_ring.cq_ptr != g_ring.sq_ptr)
+    munmap(g_ring.cq_ptr, g_ring.cq_size);
+  if (g_ring.sq_ptr)
+    munmap(g_ring.sq_ptr, g_ring.sq_size);
+  if (g_ring.fd >= 0)
+    close(g_ring.fd);
+  memset(&g_ring, 0, sizeof(g_ring));
+  g_ring.fd = -1;
+}
+
+static int uring_init(void) {
+  if (g_ring_state != 0)
+    return g_ring_state > 0 ? 0 : -1;
+  g_ring_state = -1;
+
+  struct io_uring_params p;
+  memset(&p, 0, sizeof(p));
+  int fd = (int)syscall(__NR_io_uring_setup, URING_ENTRIES, &p);
+  if (fd < 0)
+    return -1;
+  g_ring.fd = fd;
+  if (uring_probe_ops(fd) != 0) {
+    uring_teardown();
+    return -1;
+  }
+
+  g_ring.sq_entries = p.sq_entries;
+  g_ring.sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+  g_ring.cq_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+  if (p.features & IORING_FEAT_SINGLE_MMAP) {
+    if (g_ring.cq_size > g_ring.sq_size)
+      g_ring.sq_size = g_ring.cq_size;
+    g_ring.cq_size = g_ring.sq_size;
+  }
+
+  g_ring.sq_ptr = mmap(NULL, g_ring.sq_size, PROT_READ | PROT_WRITE,
+                       MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+  if (g_ring.sq_ptr == MAP_FAILED) {
+    g_ring.sq_ptr = NULL;
+    uring_teardown();
+    return -1;
+  }
+  if (p.features & IORING_FEAT_SINGLE_MMAP) {
+    g_ring.cq_ptr = g_ring.sq_ptr;
+  } else {
+    g_ring.cq_ptr = mmap(NULL, g_ring.cq_size, PROT_READ | PROT_WRITE,
+                         MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+    if (g_ring.cq_ptr == MAP_FAILED) {
+      g_ring.cq_ptr = NULL;
+      uring_teardown();
+      return -1;
+    }
+  }
+  g_ring.sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+  g_ring.sqes = mmap(NULL, g_ring.sqes_size, PROT_READ | PROT_WRITE,
+                     MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+  if (g_ring.sqes == MAP_FAILED) {
+    g_ring.sqes = NULL;
+    uring_teardown();
+    return -1;
+  }
+
+  char *sq = g_ring.sq_ptr, *cq = g_ring.cq_ptr;
+  g_ring.sq_head = (unsigned *)(sq + p.sq_off.head);
+  g_ring.sq_tail = (unsigned *)(sq + p.sq_off.tail);
+  g_ring.sq_mask = (unsigned *)(sq + p.sq_off.ring_mask);
+  g_ring.sq_array = (unsigned *)(sq + p.sq_off.array);
+  g_ring.cq_head = (unsigned *)(cq + p.cq_off.head);
+  g_ring.cq_tail = (unsigned *)(cq + p.cq_off.tail);
+  g_ring.cq_mask = (unsigned *)(cq + p.cq_off.ring_mask);
+  g_ring.cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+
+  g_ring_state = 1;
+  return 0;
+}
+
+static struct io_uring_sqe *uring_next_sqe(unsigned *tail) {
+  unsigned idx = *tail & *g_ring.sq_mask;
+  struct io_uring_sqe *sqe = &g_ring.sqes[idx];
+  memset(sqe, 0, sizeof(*sqe));
+  g_ring.sq_array[idx] = idx;
+  (*tail)++;
+  return sqe;
+}
+
+/*
+ * Submits one linked chain covering reports [0, count) and waits for it.
+ * Returns the number of reports written; *delay_done reports whether the
+ * delay after the last written report already elapsed. With clock, delays
+ * are absolute deadlines following *clock.
+ */
+static size_t uring_chain(int fd, const uint8_t *reports, size_t report_len,
+                          size_t count, const uint32_t *delays_us,
+                          const uint64_t *clock, int *delay_done, void *arg) {
+  struct __kernel_timespec ts[URING_ENTRIES];
+  unsigned tail = *g_ring.sq_tail;
+  unsigned queued = 0;
+  uint64_t deadline = clock ? *clock : 0;
+
+  for (size_t i = 0; i < count; i++) {
+    struct io_uring_sqe *sqe = uring_next_sqe(&tail);
+    sqe->opcode = IORING_OP_WRITE;
+    sqe->fd = fd;
+    sqe->addr = (uint64_t)(uintptr_t)(reports + i * report_len);
+    sqe->len = (uint32_t)report_len;
+    sqe->off = (uint64_t)-1; /* current position; ignored for streams */
+    sqe->user_data = i << 1;
+    sqe->flags = IOSQE_IO_LINK;
+    queued++;
+
+    if (delays_us[i] > 0) {
+      uint64_t ns = (uint64_t)delays_us[i] * 1000u;
+      if (clock)
+        ns = deadline += ns;
+      ts[i].tv_sec = (long long)(ns / 1000000000u);
+      ts[i].tv_nsec = (long long)(ns % 1000000000u);
+      sqe = uring_next_sqe(&tail);
+      sqe->opcode = IORING_OP_TIMEOUT;
+      sqe->fd = -1;
+      sqe->addr = (uint64_t)(uintptr_t)&ts[i];
+      sqe->len = 1;
+      sqe->timeout_flags = IORING_TIMEOUT_ETIME_SUCCESS |
+                           (clock ? IORING_TIMEOUT_ABS : 0);
+      sqe->user_data = (i << 1) | 1;
+      sqe->flags = IOSQE_IO_LINK;
+      queued++;
+    }
+  }
+  /* Terminate the chain */
+  g_ring.sqes[(tail - 1) & *g_ring.sq_mask].flags &= ~IOSQE_IO_LINK;
+  __atomic_store_n(g_ring.sq_tail, tail, __ATOMIC_RELEASE);
+
+  unsigned to_submit = queued, reaped = 0;
+  size_t written = 0;
+  int chain_ok = 1;
+  *delay_done = 0;
+
+  while (reaped < queued) {
+    stat_add(&g_stats.syscalls, 1);
+    int r = (int)syscall(__NR_io_uring_enter, g_ring.fd, to_submit,
+                         queued - reaped, IORING_ENTER_GETEVENTS, NULL, 0);
+    if (r < 0) {
+      if (errno == EINTR)
+        continue;
+      if (to_submit == queued) {
+        /* Nothing was consumed: withdraw the chain */
+        __atomic_store_n(g_ring.sq_tail, tail - queued, __ATOMIC_RELEASE);
+        return 0;
+      }
+      break;
+    }
+    to_submit = to_submit > (unsigned)r ? to_submit - (unsigned)r : 0;
+
+    unsigned head = *g_ring.cq_head;
+    unsigned ctail = __atomic_load_n(g_ring.cq_tail, __ATOMIC_ACQUIRE);
+    for (; head != ctail; head++) {
+      const struct io_uring_cqe *cqe = &g_ring.cqes[head & *g_ring.cq_mask];
+      size_t idx = cqe->user_data >> 1;
+      int is_timeout = cqe->user_data & 1;
+      if (!is_timeout && g_observer && cqe->res != -ECANCELED)
+        g_observer(arg, fd, cqe->res < 0 ? -1 : (long)cqe->res, report_len, 1,
+                   UINT64_MAX, cqe->res < 0 ? -cqe->res : 0);
+      if (chain_ok) {
+        if (!is_timeout && cqe->res == (int)report_len && idx == written) {
+          written++;
+          *delay_done = 0;
+        } else if (is_timeout && cqe->res == -ETIME && idx + 1 == written) {
+          *delay_done = 1;
+        } else {
+          chain_ok = 0;
+        }
+      }
+      reaped++;
+    }
+    __atomic_store_n(g_ring.cq_head, head, __ATOMIC_RELEASE);
+  }
+  if (written > 0 && delays_us[written - 1] == 0)
+    *delay_done = 1;
+  return written;
+}
+
+/* Takes g_ring_lock and makes sure the ring exists. Returns 0 with the lock
+ * held, or -1 (lock released) when io_uring is unavailable. */
+static int uring_acquire(void) {
+  pthread_mutex_lock(&g_ring_lock);
+  if (uring_init() == 0)
+    return 0;
+  pthread_mutex_unlock(&g_ring_lock);
+  return -1;
+}
+
+static uint64_t sum_delays_ns(const uint32_t *delays_us, size_t n) {
+  uint64_t ns = 0;
+  for (size_t i = 0; i < n; i++)
+    ns += (uint64_t)delays_us[i] * 1000u;
+  return ns;
+}
+
+/* Called with g_ring_lock held (uring_acquire); releases it */
+static size_t submit_uring(int fd, const uint8_t *reports, size_t report_len,
+                           size_t count, const uint32_t *delays_us,
+                           struct hid_timeline *tl, hid_batch_sink sink,
+                           void *arg) {
+  size_t done = 0;
+  uint64_t clock = tl ? hid_timeline_start(tl) : 0;
+  while (done < count) {
+    /* Each report needs at most two SQEs */
+    size_t n = count - done;
+    if (n > g_ring.sq_entries / 2)
+      n = g_ring.sq_entries / 2;
+    if (n > URING_ENTRIES / 2)
+      n = URING_ENTRIES / 2;
+
+    int delay_done = 0;
+    stat_add(&g_stats.uring_chains, 1);
+    size_t w = uring_chain(fd, reports + done * report_len, report_len, n,
+                           delays_us + done, tl ? &clock : NULL, &delay_done,
+                           arg);
+    if (tl) {
+      /* Deadline after the last report written, not yet waited for if the
+       * chain stopped before its timeout */
+      clock += sum_delays_ns(delays_us + done, w);
+      hid_timeline_set(tl, clock);
+    }
+    done += w;
+    if (w < n) {
+      /* Chain cut short: finish with the loop from the exact report */
+      stat_add(&g_stats.fallbacks, 1);
+      pthread_mutex_unlock(&g_ring_lock);
+      if (w > 0 && !delay_done && delays_us[done - 1] > 0) {
+        if (tl)
+          hid_sleep_until_ns(clock, tl->spin_ns);
+        else
+          delay_us(delays_us[done - 1], NULL);
+      }
+      return done + submit_loop(fd, reports + done * report_len, report_len,
+                                count - done, delays_us + done, tl, sink, arg);
+    }
+  }
+  pthread_mutex_unlock(&g_ring_lock);
+  return done;
+}
+#endif
+
+static int has_delays(const uint32_t *delays_us, size_t count) {
+  if (!delays_us)
+    return 0;
+  for (size_t i = 0; i < count; i++) {
+    if (delays_us[i] > 0)
+      return 1;
+  }
+  return 0;
+}
+
+size_t hid_batch_submit(int fd, const uint8_t *reports, size_t report_len,
+                        size_t count, const uint32_t *delays_us,
+                        struct hid_timeline *tl, hid_batch_sink sink,
+                        void *arg) {
+  if (fd < 0 || !reports || report_len == 0 || count == 0)
+    return 0;
+
+  stat_add(&g_stats.batches, 1);
+  size_t done;
+
+  if (!has_delays(delays_us, count)) {
+    done = write_run(fd, reports, report_len, count, sink, arg);
+  }
+#ifdef HID_HAVE_URING
+  /* A spin tail needs a thread to spin on: timelines with one use the loop */
+  else if (g_max_mode >= HID_BATCH_URING && !(tl && tl->spin_ns) &&
+           uring_acquire() == 0) {
+    done = submit_uring(fd, reports, report_len, count, delays_us, tl, sink,
+                        arg);
+  }
+#endif
+  else {
+    done = submit_loop(fd, reports, report_len, count, delays_us, tl, sink,
+                       arg);
+  }
+
+  stat_add(&g_stats.reports, done);
+  return done;
+}
+
+const char *hid_batch_mode_name(void) {
+#ifdef HID_HAVE_URING
+  if (g_max_mode >= HID_BATCH_URING && uring_acquire() == 0) {
+    pthread_mutex_unlock(&g_ring_lock);
+    return "io_uring";
+  }
+#endif
+  return g_max_mode >= HID_BATCH_WRITEV ? "writev" : "loop";
+}
+
+void hid_batch_shutdown(void) {
+#ifdef HID_HAVE_URING
+  pthread_mutex_lock(&g_ring_lock);
+  if (g_ring_state > 0)
+    uring_teardown();
+  g_ring_state = 0;
+  pthread_mutex_unlock(&g_ring_lock);
+#endif
+}
@@ -0,0 +1,704 @@
+/*
+ * hid-configfs.c - native gadget setup with a diff-based reconcile (see
+ * hid_configfs.h).
+ */
+
+#define _GNU_SOURCE
+#include "../include/hid_configfs.h"
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/inotify.h>
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
+#include <time.h>
+#include <unistd.h>
+#ifdef __ANDROID__
+#include <sys/system_properties.h>
+#endif
+
+/* How long ueventd gets to create a registered node before we mknod it */
+#define NODE_GRACE_MS 100
+
+/* hid.gs* links of another layout removed in one reconcile, at most */
+#define RETIRED_MAX 8
+
+/* hid-setup's 5-byte mouse: buttons, X, Y, wheel and AC Pan */
+static const unsigned char g_mouse_hscroll_desc[] = {
+    0x05, 0x01, 0x09, 0x02, 0xA1, 0x01, 0x09, 0x01, 0xA1, 0x00, 0x05, 0x09,
+    0x19, 0x01, 0x29, 0x03, 0x15, 0x00, 0x25, 0x01, 0x95, 0x03, 0x75, 0x01,
+    0x81, 0x02, 0x95, 0x01, 0x75, 0x05, 0x81, 0x03, 0x05, 0x01, 0x09, 0x30,
+    0x09, 0x31, 0x09, 0x38, 0x15, 0x81, 0x25, 0x7f, 0x75, 0x08, 0x95, 0x03,
+    0x81, 0x06, 0x05, 0x0C, 0x0A, 0x38, 0x02, 0x95, 0x01, 0x81, 0x06, 0xC0,
+    0xC0};
+
+/* hid-setup's 16-bit mouse (HID_MOUSE_16BIT): buttons, X and Y in
+ * -32767..32767, wheel and, in the 7-byte variant, AC Pan */
+static const unsigned char g_mouse_wide_desc[] = {
+    0x05, 0x01, 0x09, 0x02, 0xA1, 0x01, 0x09, 0x01, 0xA1, 0x00, 0x05, 0x09,
+    0x19, 0x01, 0x29, 0x03, 0x15, 0x00, 0x25, 0x01, 0x95, 0x03, 0x75, 0x01,
+    0x81, 0x02, 0x95, 0x01, 0x75, 0x05, 0x81, 0x03, 0x05, 0x01, 0x09, 0x30,
+    0x09, 0x31, 0x16, 0x01, 0x80, 0x26, 0xFF, 0x7F, 0x75, 0x10, 0x95, 0x02,
+    0x81, 0x06, 0x09, 0x38, 0x15, 0x81, 0x25, 0x7F, 0x75, 0x08, 0x95, 0x01,
+    0x81, 0x06, 0xC0, 0xC0};
+
+static const unsigned char g_mouse_wide_hscroll_desc[] = {
+    0x05, 0x01, 0x09, 0x02, 0xA1, 0x01, 0x09, 0x01, 0xA1, 0x00, 0x05, 0x09,
+    0x19, 0x01, 0x29, 0x03, 0x15, 0x00, 0x25, 0x01, 0x95, 0x03, 0x75, 0x01,
+    0x81, 0x02, 0x95, 0x01, 0x75, 0x05, 0x81, 0x03, 0x05, 0x01, 0x09, 0x30,
+    0x09, 0x31, 0x16, 0x01, 0x80, 0x26, 0xFF, 0x7F, 0x75, 0x10, 0x95, 0x02,
+    0x81, 0x06, 0x09, 0x38, 0x15, 0x81, 0x25, 0x7F, 0x75, 0x08, 0x95, 0x01,
+    0x81, 0x06, 0x05, 0x0C, 0x0A, 0x38, 0x02, 0x81, 0x06, 0xC0, 0xC0};
+
+/* hid-setup's hi-res scrolling mouse (HID_MOUSE_HIRES) in pieces: the
+ * usual buttons and X/Y, then the wheel and AC Pan each in a logical
+ * collection with a Resolution Multiplier feature (physical 1..8, so a
+ * host that sets it counts HID_MOUSE_HIRES_MULTIPLIER steps per detent).
+ * The input report is the same as without it. */
+static const unsigned char g_mouse_buttons_desc[] = {
+    0x05, 0x01, 0x09, 0x02, 0xA1, 0x01, 0x09, 0x01, 0xA1, 0x00, 0x05, 0x09,
+    0x19, 0x01, 0x29, 0x03, 0x15, 0x00, 0x25, 0x01, 0x95, 0x03, 0x75, 0x01,
+    0x81, 0x02, 0x95, 0x01, 0x75, 0x05, 0x81, 0x03};
+static const unsigned char g_mouse_xy_desc[] = {
+    0x05, 0x01, 0x09, 0x30, 0x09, 0x31, 0x15, 0x81,
+    0x25, 0x7F, 0x75, 0x08, 0x95, 0x02, 0x81, 0x06};
+static const unsigned char g_mouse_wide_xy_desc[] = {
+    0x05, 0x01, 0x09, 0x30, 0x09, 0x31, 0x16, 0x01, 0x80,
+    0x26, 0xFF, 0x7F, 0x75, 0x10, 0x95, 0x02, 0x81, 0x06};
+static const unsigned char g_mouse_hires_wheel_desc[] = {
+    0xA1, 0x02, 0x09, 0x48, 0x15, 0x00, 0x25, 0x01, 0x35, 0x01, 0x45,
+    0x08, 0x75, 0x02, 0x95, 0x01, 0xB1, 0x02, 0x35, 0x00, 0x45, 0x00,
+    0x09, 0x38, 0x15, 0x81, 0x25, 0x7F, 0x75, 0x08, 0x81, 0x06, 0xC0};
+static const unsigned char g_mouse_hires_pan_desc[] = {
+    0xA1, 0x02, 0x09, 0x48, 0x15, 0x00, 0x25, 0x01, 0x35, 0x01, 0x45, 0x08,
+    0x75, 0x02, 0x95, 0x01, 0xB1, 0x02, 0x35, 0x00, 0x45, 0x00, 0x05, 0x0C,
+    0x0A, 0x38, 0x02, 0x15, 0x81, 0x25, 0x7F, 0x75, 0x08, 0x81, 0x06, 0xC0};
+/* Feature padding to a whole byte, then the two collections' ends */
+static const unsigned char g_mouse_hires_end_desc[] = {
+    0x75, 0x06, 0xB1, 0x03, 0xC0, 0xC0};
+static const unsigned char g_mouse_hires_pan_end_desc[] = {
+    0x75, 0x04, 0xB1, 0x03, 0xC0, 0xC0};
+
+static double now_ms(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (double)ts.tv_sec * 1e3 + (double)ts.tv_nsec / 1e6;
+}
+
+/* Records why the reconcile failed and returns -1, keeping errno */
+static int __attribute__((format(printf, 2, 3)))
+fail(struct hid_gadget_changes *ch, const char *fmt, ...) {
+  int err = errno;
+  va_list ap;
+  va_start(ap, fmt);
+  vsnprintf(ch->why, sizeof(ch->why), fmt, ap);
+  va_end(ap);
+  errno = err ? err : EINVAL;
+  return -1;
+}
+
+static ssize_t read_file(const char *path, void *buf, size_t size) {
+  int fd = open(path, O_RDONLY | O_CLOEXEC);
+  if (fd < 0)
+    return -1;
+  ssize_t total = 0, n;
+  while ((size_t)total < size &&
+         (n = read(fd, (char *)buf + total, size - (size_t)total)) > 0)
+    total += n;
+  close(fd);
+  return total;
+}
+
+/* One write(), as configfs wants every attribute in a single store */
+static int write_file(const char *path, const void *buf, size_t len) {
+  int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+  if (fd < 0)
+    return -1;
+  ssize_t n = write(fd, buf, len);
+  int err = errno;
+  close(fd);
+  if (n != (ssize_t)len) {
+    errno = n < 0 ? err : EIO;
+    return -1;
+  }
+  return 0;
+}
+
+/* First line of a small attribute, newline stripped ("" if unreadable) */
+static void read_line(const char *path, char *buf, size_t size) {
+  ssize_t n = read_file(path, buf, size - 1);
+  buf[n > 0 ? n : 0] = '\0';
+  buf[strcspn(buf, "\n")] = '\0';
+}
+
+// --- Spec ---
+static int prop_enabled(const char *module_prop, const char *key) {
+  char buf[4096];
+  ssize_t n = read_file(module_prop, buf, sizeof(buf) - 1);
+  if (n <= 0)
+    return 0;
+  buf[n] = '\0';
+  size_t len = strlen(key);
+  for (char *line = buf; line && *line; line = strchr(line, '\n')) {
+    while (*line == '\n')
+      line++;
+    if (strncasecmp(line, key, len) == 0 && line[len] == '=') {
+      const char *v = line + len + 1;
+      while (*v == ' ' || *v == '\t')
+        v++;
+      return strncasecmp(v, "true", 4) == 0;
+    }
+  }
+  return 0;
+}
+
+static int env_is(const char *name, const char *value) {
+  const char *v = getenv(name);
+  return v && strcmp(v, value) == 0;
+}
+
+static int load_desc(struct hid_function_spec *fn, const char *dir,
+                     const char *file) {
+  char path[PATH_MAX];
+  if (hid_path_fmt(path, sizeof(path), "%s/%s", dir, file) != 0) {
+    errno = ENAMETOOLONG;
+    return -1;
+  }
+  ssize_t n = read_file(path, fn->desc, sizeof(fn->desc));
+  if (n <= 0) {
+    if (n == 0)
+      errno = ENODATA;
+    return -1;
+  }
+  fn->desc_len = (size_t)n;
+  return 0;
+}
+
+static void append_desc(struct hid_function_spec *fn,
+                        const unsigned char *part, size_t len) {
+  memcpy(fn->desc + fn->desc_len, part, len);
+  fn->desc_len += len;
+}
+
+static void mouse_hires_desc(struct hid_function_spec *fn, int wide,
+                             int hscroll) {
+  fn->desc_len = 0;
+  append_desc(fn, g_mouse_buttons_desc, sizeof(g_mouse_buttons_desc));
+  if (wide)
+    append_desc(fn, g_mouse_wide_xy_desc, sizeof(g_mouse_wide_xy_desc));
+  else
+    append_desc(fn, g_mouse_xy_desc, sizeof(g_mouse_xy_desc));
+  append_desc(fn, g_mouse_hires_wheel_desc, sizeof(g_mouse_hires_wheel_desc));
+  if (hscroll) {
+    append_desc(fn, g_mouse_hires_pan_desc, sizeof(g_mouse_hires_pan_desc));
+    append_desc(fn, g_mouse_hires_pan_end_desc,
+                sizeof(g_mouse_hires_pan_end_desc));
+  } else {
+    append_desc(fn, g_mouse_hires_end_desc, sizeof(g_mouse_hires_end_desc));
+  }
+}
+
+static void set_function(struct hid_function_spec *fn, const char *name,
+                         int protocol, int subclass, int report_length) {
+  snprintf(fn->name, sizeof(fn->name), "%s", name);
+  fn->protocol = protocol;
+  fn->subclass = subclass;
+  fn->report_length = report_length;
+}
+
+/* Appends part to fn's descriptor with a Report ID item right after its
+ * outermost Collection (Application), which every one of ours opens with */
+static int append_with_report_id(struct hid_function_spec *fn,
+                                 const struct hid_function_spec *part,
+                                 int id) {
+  static const unsigned char sizes[4] = {0, 1, 2, 4};
+  size_t at = 0;
+  while (at < part->desc_len && part->desc[at] != 0xA1)
+    at += 1u + sizes[part->desc[at] & 3];
+  at += 2; /* Collection and its one-byte type */
+  if (at > part->desc_len ||
+      fn->desc_len + part->desc_len + 2 > sizeof(fn->desc)) {
+    errno = EINVAL;
+    return -1;
+  }
+  unsigned char *out = fn->desc + fn->desc_len;
+  memcpy(out, part->desc, at);
+  out[at] = 0x85;
+  out[at + 1] = (unsigned char)id;
+  memcpy(out + at + 2, part->desc + at, part->desc_len - at);
+  fn->desc_len += part->desc_len + 2;
+  return 0;
+}
+
+int hid_gadget_spec_default(struct hid_gadget_spec *spec, const char *root) {
+  const char *module_prop = HID_GADGET_MODULE_DIR "/module.prop";
+  memset(spec, 0, sizeof(*spec));
+  spec->root = root ? root : "";
+  spec->gadget = hid_gadget_dir();
+  /* hid-setup takes the whole path; only the configuration name matters */
+  const char *config = getenv("HID_CONFIG_DIR");
+  if (config && *config)
+    spec->config = strrchr(config, '/') ? strrchr(config, '/') + 1 : config;
+  const char *wait = getenv("HID_SETUP_WAIT_MS");
+  spec->wait_ms = wait && *wait ? atoi(wait) : HID_GADGET_DEFAULT_WAIT_MS;
+
+  const char *dir = getenv("HID_DESC_DIR");
+  if (!dir || !*dir)
+    dir = access(HID_GADGET_MODULE_DIR "/system/etc/hid", F_OK) == 0
+              ? HID_GADGET_MODULE_DIR "/system/etc/hid"
+              : "/system/etc/hid";
+
+  int nkro = hid_env_true(getenv("HID_KEYBOARD_NKRO")) ||
+             prop_enabled(module_prop, "keyboard.nkro");
+  int hscroll = hid_env_true(getenv("HID_MOUSE_HSCROLL")) ||
+                env_is("HID_MOUSE_REPORT_SIZE", "5") ||
+                env_is("HID_MOUSE_REPORT_SIZE", "7") ||
+                prop_enabled(module_prop, "mouse.hscroll");
+  int wide = hid_env_true(getenv("HID_MOUSE_16BIT")) ||
+             env_is("HID_MOUSE_REPORT_SIZE", "6") ||
+             env_is("HID_MOUSE_REPORT_SIZE", "7") ||
+             prop_enabled(module_prop, "mouse.16bit");
+  int hires = hid_env_true(getenv("HID_MOUSE_HIRES")) ||
+              prop_enabled(module_prop, "mouse.hires");
+  int composite = hid_env_true(getenv("HID_COMPOSITE")) ||
+                  prop_enabled(module_prop, "hid.composite");
+  int absolute = hid_env_true(getenv("HID_ABSOLUTE")) ||
+                 prop_enabled(module_prop, "mouse.absolute");
+
+  struct hid_function_spec *kb = &spec->functions[HID_ROLE_KEYBOARD];
+  struct hid_function_spec *mouse = &spec->functions[HID_ROLE_MOUSE];
+  struct hid_function_spec *cc = &spec->functions[HID_ROLE_CONSUMER];
+  struct hid_function_spec *abs = &spec->functions[HID_ROLE_ABSOLUTE];
+  /* The NKRO bitmap is a report-protocol-only keyboard */
+  if (nkro)
+    set_function(kb, "hid.gs1", 0, 0, HID_KEYBOARD_NKRO_REPORT_SIZE);
+  else
+    set_function(kb, "hid.gs1", 1, 1, HID_KEYBOARD_REPORT_SIZE);
+  /* Like NKRO, 16-bit deltas need the report protocol */
+  if (wide)
+    set_function(mouse, "hid.gs2", 0, 0,
+                 HID_MOUSE_WIDE_REPORT_SIZE + hscroll);
+  else
+    set_function(mouse, "hid.gs2", 2, 1, HID_MOUSE_REPORT_SIZE + hscroll);
+  set_function(cc, "hid.gs3", 0, 0, HID_CONSUMER_REPORT_SIZE);
+  spec->nfunctions = HID_ROLE_BASE_COUNT;
+  if (absolute) {
+    set_function(abs, "hid.gs4", 0, 0, HID_ABSOLUTE_REPORT_SIZE);
+    if (load_desc(abs, dir, "absolute-desc.bin") != 0)
+      return -1;
+    spec->nfunctions = HID_ROLE_ABSOLUTE + 1;
+  }
+
+  if (load_desc(kb, dir,
+                nkro ? "keyboard-nkro-desc.bin" : "keyboard-desc.bin") != 0 ||
+      load_desc(cc, dir, "consumer-desc.bin") != 0)
+    return -1;
+  if (hires) {
+    mouse_hires_desc(mouse, wide, hscroll);
+  } else if (wide && hscroll) {
+    memcpy(mouse->desc, g_mouse_wide_hscroll_desc,
+           sizeof(g_mouse_wide_hscroll_desc));
+    mouse->desc_len = sizeof(g_mouse_wide_hscroll_desc);
+  } else if (wide) {
+    memcpy(mouse->desc, g_mouse_wide_desc, sizeof(g_mouse_wide_desc));
+    mouse->desc_len = sizeof(g_mouse_wide_desc);
+  } else if (hscroll) {
+    memcpy(mouse->desc, g_mouse_hscroll_desc, sizeof(g_mouse_hscroll_desc));
+    mouse->desc_len = sizeof(g_mouse_hscroll_desc);
+  } else if (load_desc(mouse, dir, "mouse-desc.bin") != 0) {
+    return -1;
+  }
+  if (!composite)
+    return 0;
+
+  /* One report-protocol interface sized for its longest report plus the
+   * ID; boot protocol cannot carry report IDs */
+  struct hid_function_spec parts[HID_ROLE_COUNT];
+  int nparts = spec->nfunctions;
+  memcpy(parts, spec->functions, sizeof(parts));
+  int longest = 0;
+  for (int r = 0; r < nparts; r++)
+    if (parts[r].report_length > longest)
+      longest = parts[r].report_length;
+  memset(spec->functions, 0, sizeof(spec->functions));
+  set_function(&spec->functions[0], "hid.gs1", 0, 0, longest + 1);
+  for (int r = 0; r < nparts; r++)
+    if (append_with_report_id(&spec->functions[0], &parts[r],
+                              HID_REPORT_ID_KEYBOARD + r) != 0)
+      return -1;
+  spec->nfunctions = 1;
+  return 0;
+}
+// --- End Spec ---
+
+// --- Diff ---
+/* Compares one integer attribute and rewrites it if it differs (unless
+ * dry). Returns 1 if it differed, 0 if not, -1 on a failed write. */
+static int sync_int_attr(const char *func, const char *name, int want,
+                         int dry) {
+  char path[PATH_MAX], buf[32];
+  if (hid_path_fmt(path, sizeof(path), "%s/%s", func, name) != 0)
+    return -1;
+  read_line(path, buf, sizeof(buf));
+  if (buf[0] && atoi(buf) == want)
+    return 0;
+  if (dry)
+    return 1;
+  int len = snprintf(buf, sizeof(buf), "%d\n", want);
+  return write_file(path, buf, (size_t)len) == 0 ? 1 : -1;
+}
+
+static int sync_desc_attr(const char *func,
+                          const struct hid_function_spec *fn, int dry) {
+  char path[PATH_MAX];
+  unsigned char cur[HID_GADGET_DESC_MAX + 1];
+  if (hid_path_fmt(path, sizeof(path), "%s/report_desc", func) != 0)
+    return -1;
+  ssize_t n = read_file(path, cur, sizeof(cur));
+  if (n == (ssize_t)fn->desc_len && memcmp(cur, fn->desc, fn->desc_len) == 0)
+    return 0;
+  if (dry)
+    return 1;
+  return write_file(path, fn->desc, fn->desc_len) == 0 ? 1 : -1;
+}
+
+/* Number of attributes of the function that differ from fn (rewritten
+ * unless dry), or -1 if a write failed */
+static int sync_function(const char *func, const struct hid_function_spec *fn,
+                         int dry) {
+  int r[4] = {sync_int_attr(func, "protocol", fn->protocol, dry),
+              sync_int_attr(func, "subclass", fn->subclass, dry),
+              sync_int_attr(func, "report_length", fn->report_length, dry),
+              sync_desc_attr(func, fn, dry)};
+  int changed = 0;
+  for (int i = 0; i < 4; i++) {
+    if (r[i] < 0)
+      return -1;
+    changed += r[i];
+  }
+  return changed;
+}
+
+/* The configuration to link into: the named one, else b.1, c.1 or the
+ * first that exists (OEMs differ) */
+static int find_config(const char *gadget, const char *name, char *out,
+                       size_t size) {
+  static const char *const preferred[] = {"b.1", "c.1"};
+  struct stat st;
+  if (name)
+    return hid_path_fmt(out, size, "%s/configs/%s", gadget, name) == 0 &&
+                   stat(out, &st) == 0 && S_ISDIR(st.st_mode)
+               ? 0
+               : -1;
+  for (size_t i = 0; i < sizeof(preferred) / sizeof(*preferred); i++)
+    if (hid_path_fmt(out, size, "%s/configs/%s", gadget, preferred[i]) == 0 &&
+        stat(out, &st) == 0 && S_ISDIR(st.st_mode))
+      return 0;
+  char configs[PATH_MAX];
+  DIR *dir = NULL;
+  if (hid_path_fmt(configs, sizeof(configs), "%s/configs", gadget) == 0)
+    dir = opendir(configs);
+  if (!dir)
+    return -1;
+  int found = -1;
+  struct dirent *entry;
+  while (found != 0 && (entry = readdir(dir)) != NULL)
+    if (entry->d_name[0] != '.' &&
+        hid_path_fmt(out, size, "%s/%s", configs, entry->d_name) == 0 &&
+        stat(out, &st) == 0 && S_ISDIR(st.st_mode))
+      found = 0;
+  closedir(dir);
+  return found;
+}
+
+/* Links in the configuration to hid.gs* functions spec does not have (the
+ * other layout's), at most max; returns how many */
+static int retired_links(const struct hid_gadget_spec *spec,
+                         const char *config, char (*out)[PATH_MAX], int max) {
+  DIR *dir = opendir(config);
+  if (!dir)
+    return 0;
+  int count = 0;
+  struct dirent *entry;
+  while (count < max && (entry = readdir(dir)) != NULL) {
+    if (strncmp(entry->d_name, "hid.gs", 6) != 0)
+      continue;
+    int wanted = 0;
+    for (int i = 0; i < spec->nfunctions; i++)
+      wanted |= strcmp(entry->d_name, spec->functions[i].name) == 0;
+    if (!wanted &&
+        hid_path_fmt(out[count], PATH_MAX, "%s/%s", config, entry->d_name) == 0)
+      count++;
+  }
+  closedir(dir);
+  return count;
+}
+
+/* The UDC to bind: the previous one if it still exists, else the first */
+static int pick_udc(const char *root, const char *previous, char *out,
+                    size_t size) {
+  char path[PATH_MAX];
+  struct stat st;
+  if (previous[0] &&
+      hid_path_fmt(path, sizeof(path), "%s/sys/class/udc/%s", root, previous) ==
+          0 &&
+      stat(path, &st) == 0)
+    return hid_path_fmt(out, size, "%s", previous);
+  DIR *dir = NULL;
+  if (hid_path_fmt(path, sizeof(path), "%s/sys/class/udc", root) == 0)
+    dir = opendir(path);
+  if (!dir)
+    return -1;
+  int found = -1;
+  struct dirent *entry;
+  while (found != 0 && (entry = readdir(dir)) != NULL)
+    if (entry->d_name[0] != '.')
+      found = hid_path_fmt(out, size, "%s", entry->d_name);
+  closedir(dir);
+  return found;
+}
+// --- End Diff ---
+
+// --- Nodes ---
+/* Makes sure hidg<minor> exists as the function's device. Returns 1 while
+ * it is still up to ueventd, 0 once it is there, -1 on error. */
+static int ensure_node(const char *root, unsigned major, unsigned minor,
+                       int grace_over, struct hid_gadget_changes *ch) {
+  char node[PATH_MAX], sys[PATH_MAX], classdir[PATH_MAX];
+  struct stat st;
+  if (hid_path_fmt(node, sizeof(node), "%s/dev/hidg%u", root, minor) != 0 ||
+      hid_path_fmt(classdir, sizeof(classdir), "%s/sys/class/hidg",
+                   root) != 0 ||
+      hid_path_fmt(sys, sizeof(sys), "%s/hidg%u", classdir, minor) != 0)
+    return -1;
+  if (stat(node, &st) == 0) {
+    if (S_ISCHR(st.st_mode) && st.st_rdev == makedev(major, minor)) {
+      if ((st.st_mode & 0666) != 0666)
+        chmod(node, 0666);
+      return 0;
+    }
+    unlink(node); /* left over from a gadget with another major */
+  }
+  /* A registered device gets its node from ueventd, give it a moment;
+   * without the class directory nobody else will make one */
+  if (!grace_over && stat(sys, &st) == 0)
+    return 1;
+  if (stat(classdir, &st) == 0 && stat(sys, &st) != 0)
+    return 1; /* not registered yet */
+  if (mknod(node, S_IFCHR | 0666, makedev(major, minor)) != 0 &&
+      errno != EEXIST)
+    return -1;
+  chmod(node, 0666);
+  ch->nodes++;
+  return 0;
+}
+
+static int wait_for_nodes(const struct hid_gadget_spec *spec,
+                          const char *gadget, struct hid_gadget_changes *ch) {
+  unsigned major[HID_GADGET_FUNCTION_MAX], minor[HID_GADGET_FUNCTION_MAX];
+  int known[HID_GADGET_FUNCTION_MAX] = {0};
+  for (int i = 0; i < spec->nfunctions; i++) {
+    char path[PATH_MAX], buf[32];
+    if (hid_path_fmt(path, sizeof(path), "%s/functions/%s/dev", gadget,
+                 spec->functions[i].name) != 0)
+      continue;
+    read_line(path, buf, sizeof(buf));
+    known[i] = sscanf(buf, "%u:%u", &major[i], &minor[i]) == 2;
+  }
+
+  int ino = -1, watching = 0;
+  double start = now_ms();
+  int result = 0;
+  for (;;) {
+    double waited = now_ms() - start;
+    int pending = 0;
+    for (int i = 0; i < spec->nfunctions && result == 0; i++) {
+      if (!known[i])
+        continue;
+      int r = ensure_node(spec->root, major[i], minor[i],
+                          waited >= NODE_GRACE_MS, ch);
+      if (r < 0)
+        result = fail(ch, "cannot create hidg%u: %s", minor[i],
+                      strerror(errno));
+      pending += r > 0;
+    }
+    if (result != 0 || !pending)
+      break;
+    /* Watch only once something is missing; a rescan follows, so an entry
+     * created in between is not missed */
+    if (!watching) {
+      watching = 1;
+      ino = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+      if (ino >= 0) {
+        char path[PATH_MAX];
+        const uint32_t mask = IN_CREATE | IN_ATTRIB | IN_MOVED_TO;
+        if (hid_path_fmt(path, sizeof(path), "%s/dev", spec->root) == 0)
+          inotify_add_watch(ino, path, mask);
+        if (hid_path_fmt(path, sizeof(path), "%s/sys/class/hidg", spec->root) ==
+            0)
+          inotify_add_watch(ino, path, mask);
+      }
+      continue;
+    }
+    if (waited >= spec->wait_ms) {
+      errno = ETIMEDOUT;
+      result = fail(ch, "hidg nodes missing after %d ms", spec->wait_ms);
+      break;
+    }
+    /* Woken by the node or its class entry; the grace period bounds it */
+    double next = waited < NODE_GRACE_MS ? NODE_GRACE_MS : spec->wait_ms;
+    struct pollfd pfd = {.fd = ino, .events = POLLIN};
+    if (ino < 0 || poll(&pfd, 1, (int)(next - waited) + 1) > 0) {
+      char buf[1024];
+      while (ino >= 0 && read(ino, buf, sizeof(buf)) > 0)
+        ;
+      if (ino < 0)
+        usleep(5000);
+    }
+  }
+  if (ino >= 0)
+    close(ino);
+  return result;
+}
+// --- End Nodes ---
+
+int hid_gadget_reconcile(const struct hid_gadget_spec *spec,
+                         struct hid_gadget_changes *ch) {
+  char gadget[PATH_MAX], config[PATH_MAX], udc_path[PATH_MAX];
+  char udc[64], bind_to[64];
+  struct stat st;
+  int dry = spec->dry_run;
+  memset(ch, 0, sizeof(*ch));
+  double start = now_ms();
+
+  errno = 0;
+  if (hid_path_fmt(gadget, sizeof(gadget), "%s%s", spec->root, spec->gadget) ||
+      stat(gadget, &st) != 0 || !S_ISDIR(st.st_mode))
+    return fail(ch, "no gadget at %s", spec->gadget);
+  if (find_config(gadget, spec->config, config, sizeof(config)) != 0)
+    return fail(ch, "no configuration under %s/configs", spec->gadget);
+  if (hid_path_fmt(udc_path, sizeof(udc_path), "%s/UDC", gadget) != 0)
+    return fail(ch, "path too long");
+  read_line(udc_path, udc, sizeof(udc));
+
+#ifdef __ANDROID__
+  /* Keep the USB HAL from reconfiguring the gadget behind our back */
+  char mode[PROP_VALUE_MAX] = "";
+  __system_property_get("sys.usb.config", mode);
+  if (!dry && !spec->root[0] && !strstr(mode, "hid"))
+    __system_property_set("sys.usb.config", "hid");
+#endif
+
+  /* Plan: per function, missing or how many attributes differ, and whether
+   * the configuration links it */
+  char func[HID_GADGET_FUNCTION_MAX][PATH_MAX];
+  char link[HID_GADGET_FUNCTION_MAX][PATH_MAX];
+  char retired[RETIRED_MAX][PATH_MAX];
+  int missing[HID_GADGET_FUNCTION_MAX], stale[HID_GADGET_FUNCTION_MAX];
+  int linked[HID_GADGET_FUNCTION_MAX];
+  int nretired = retired_links(spec, config, retired, RETIRED_MAX);
+  int structural = nretired > 0;
+  for (int i = 0; i < spec->nfunctions; i++) {
+    const struct hid_function_spec *fn = &spec->functions[i];
+    if (hid_path_fmt(func[i], sizeof(func[i]), "%s/functions/%s", gadget,
+                 fn->name) ||
+        hid_path_fmt(link[i], sizeof(link[i]), "%s/%s", config, fn->name))
+      return fail(ch, "path too long");
+    missing[i] = stat(func[i], &st) != 0;
+    stale[i] = missing[i] ? 0 : sync_function(func[i], fn, 1);
+    linked[i] = lstat(link[i], &st) == 0;
+    structural |= missing[i] || stale[i] || !linked[i];
+  }
+
+  /* A bound gadget refuses new links and function attribute writes */
+  if (structural && udc[0]) {
+    ch->unbound = 1;
+    if (!dry && write_file(udc_path, "\n", 1) != 0)
+      return fail(ch, "cannot unbind %s: %s", udc, strerror(errno));
+  }
+  /* The other layout's functions go; their directories too where configfs
+   * lets us, so they stop holding hidg minors */
+  for (int i = 0; i < nretired; i++) {
+    ch->unlinked++;
+    if (dry)
+      continue;
+    const char *name = strrchr(retired[i], '/') + 1;
+    char path[PATH_MAX];
+    if (unlink(retired[i]) != 0)
+      return fail(ch, "cannot unlink %s: %s", name, strerror(errno));
+    if (hid_path_fmt(path, sizeof(path), "%s/functions/%s", gadget, name) == 0)
+      rmdir(path);
+  }
+  for (int i = 0; i < spec->nfunctions; i++) {
+    const struct hid_function_spec *fn = &spec->functions[i];
+    if (missing[i]) {
+      ch->created++;
+      if (!dry && mkdir(func[i], 0755) != 0)
+        return fail(ch, "cannot create %s: %s", fn->name, strerror(errno));
+    }
+    if (missing[i] || stale[i]) {
+      /* A linked function keeps its attributes locked */
+      if (linked[i]) {
+        ch->unlinked++;
+        if (!dry && unlink(link[i]) != 0)
+          return fail(ch, "cannot unlink %s: %s", fn->name, strerror(errno));
+        linked[i] = 0;
+      }
+      int n = dry ? (missing[i] ? 4 : stale[i]) : sync_function(func[i], fn, 0);
+      if (n < 0)
+        return fail(ch, "cannot write %s attributes: %s", fn->name,
+                    strerror(errno));
+      ch->attributes += n;
+    }
+    if (!linked[i]) {
+      ch->linked++;
+      if (!dry && symlink(func[i], link[i]) != 0)
+        return fail(ch, "cannot link %s: %s", fn->name, strerror(errno));
+    }
+  }
+
+  if (!udc[0] || ch->unbound) {
+    if (pick_udc(spec->root, udc, bind_to, sizeof(bind_to)) != 0) {
+      errno = ENODEV;
+      return fail(ch, "no UDC in /sys/class/udc");
+    }
+    ch->bound = 1;
+    if (!dry) {
+      char line[sizeof(bind_to) + 1];
+      int len = snprintf(line, sizeof(line), "%s\n", bind_to);
+      if (write_file(udc_path, line, (size_t)len) != 0)
+        return fail(ch, "cannot bind %s: %s", bind_to, strerror(errno));
+    }
+  }
+
+  int result = dry ? 0 : wait_for_nodes(spec, gadget, ch);
+  ch->elapsed_ms = now_ms() - start;
+  return result;
+}
+
+int hid_gadget_change_count(const struct hid_gadget_changes *ch) {
+  return ch->created + ch->attributes + ch->linked + ch->unlinked +
+         ch->unbound + ch->bound + ch->nodes;
+}
+
+void hid_gadget_describe(char *buf, size_t size,
+                         const struct hid_gadget_changes *ch) {
+  if (hid_gadget_change_count(ch) == 0) {
+    snprintf(buf, size, "gadget up to date (%.1f ms)", ch->elapsed_ms);
+    return;
+  }
+  snprintf(buf, size,
+           "%d function%s created, %d attribute%s written, %d link%s added, "
+           "%d removed, UDC %s, %d node%s made (%.1f ms)",
+           ch->created, ch->created == 1 ? "" : "s", ch->attributes,
+           ch->attributes == 1 ? "" : "s", ch->linked,
+           ch->linked == 1 ? "" : "s", ch->unlinked,
+           ch->unbound ? "rebound" : ch->bound ? "bound" : "kept", ch->nodes,
+           ch->nodes == 1 ? "" : "s", ch->elapsed_ms);
+}
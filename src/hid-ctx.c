@@ -0,0 +1,2387 @@
+/*
+ * hid-ctx.c - libhidgadget core: devices, report output and the keyboard,
+ * mouse and consumer encoders, all state held in a struct hid_ctx.
+ *
+ * Every report leaves through hid_ctx_send_report(). In the default
+ * synchronous mode it is written on the caller's thread; with HID_OPT_ASYNC
+ * it is pushed onto a per-device ring and written by that device's writer
+ * thread instead. Runs of pre-encoded reports go to the batch layer.
+ */
+
+#include "../include/hid_ctx.h"
+#include "../include/hid_backend.h"
+#include "../include/hid_batch.h"
+#include "../include/hid_discover.h"
+#include "../include/hid_path.h"
+#include "../include/hid_queue.h"
+#include "../include/hid_rt.h"
+#include "../include/hid_timeline.h"
+#include <ctype.h>
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <math.h>
+#include <poll.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/inotify.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/* Backend of new contexts: the mock build prints reports by default */
+#ifdef MOCK_HID
+#define HID_DEFAULT_BACKEND "mock"
+#else
+#define HID_DEFAULT_BACKEND "device"
+#endif
+
+#define NKRO_BITMAP_BYTES (HID_KEYBOARD_NKRO_REPORT_SIZE - 1)
+#define NKRO_MAX_USAGE (NKRO_BITMAP_BYTES * 8 - 1)
+/* Below the gadget directory (hid_gadget_path()) */
+#define NKRO_FUNC_REPORT_LENGTH "functions/hid.gs1/report_length"
+#define MOUSE_FUNC_REPORT_LENGTH "functions/hid.gs2/report_length"
+#define KEYBOARD_FUNC_REPORT_DESC "functions/hid.gs1/report_desc"
+#define MOUSE_FUNC_REPORT_DESC "functions/hid.gs2/report_desc"
+
+/* Typing engine (HID_OPT_TYPING_ROLLOVER). The classic engine sends a press
+ * and a release report per character. The rollover engine presses the next
+ * key while the previous one is still down, so a run of distinct characters
+ * costs one report each:
+ *   - a repeated key, or a modifier that has to be let go, first gets an
+ *     all-keys-up report carrying the new modifiers;
+ *   - modifiers that are only added ride along with the next press, so Shift
+ *     stays down across a run of shifted characters;
+ *   - at most two keys are down at once and the newest one is always the
+ *     key being typed, so the host sees presses in text order.
+ * Strokes with a delay above ROLLOVER_MAX_DELAY_MS use the classic engine:
+ * holding a key that long would trigger the host's typematic repeat. */
+#define ROLLOVER_MAX_DELAY_MS 200
+
+/* Reports needed for len characters by either engine, final release
+ * included */
+#define TEXT_REPORTS_MAX(len) (2 * (size_t)(len) + 1)
+
+/* Precomputed ASCII -> (usage, modifier) table for the text fast path.
+ * Rebuilt lazily whenever the locale changes. */
+struct text_stroke {
+  uint8_t usage;
+  uint8_t mods;
+};
+
+struct hid_dev {
+  struct hid_ctx *ctx;
+  enum hid_role role; /* the role it is (or was last) selected for */
+  int kind;           /* role named by configfs, -1 if unknown */
+  int composite;      /* one interface for every role, reports carry IDs */
+  char *path;
+  int fd;
+  struct hid_queue *queue;
+  struct hid_stats stats;
+  uint64_t last_report_ns; /* poll pacing dwell */
+  uint64_t reconnects;     /* host disconnects ridden out */
+  /* HID_OPT_MOUSE_COALESCE: buttons of the last mouse report queued, and
+   * whether the newest queued report may take more motion */
+  uint8_t mouse_buttons;
+  int mouse_open;
+  /* Producer-side accounting, only collected with HID_OPT_QUEUE_STATS */
+  uint64_t out_reports;
+  uint64_t out_blocked_ns;
+};
+
+/* Device registry: dev[0..HID_ROLE_COUNT) are the default keyboard, mouse,
+ * consumer and absolute pointer devices, further hidg nodes follow. Each role sends to the
+ * device sel[role]; every device has its own fd, writer queue and stats.
+ * home[] is the selection "default" restores (all dev[0] when composite). */
+struct hid_ctx {
+  struct hid_dev dev[HID_DEVICE_MAX];
+  int ndev;
+  int sel[HID_ROLE_COUNT];
+  int home[HID_ROLE_COUNT];
+  int opt[HID_OPT_COUNT];
+  struct hid_backend *backend;
+  struct hid_timeline timeline; // delays of every device
+  int error;                    // first output errno, hid_ctx_take_error()
+  int coalesce_async;           // HID_OPT_ASYNC before coalescing forced it
+
+  const uint8_t *usage_table;
+  const char *shift_chars;
+  struct text_stroke text_table[128];
+  int text_table_ready;
+
+  /* DuckyScript HOLD/RELEASE state */
+  uint8_t held_keys[6];
+  uint8_t held_mods;
+  uint8_t held_bitmap[NKRO_BITMAP_BYTES]; // NKRO mode
+};
+
+const char *const hid_role_names[HID_ROLE_COUNT] = {"keyboard", "mouse",
+                                                    "consumer", "absolute"};
+
+/* "/dev/hidg3" -> "hidg3" */
+static const char *node_name(const char *path) {
+  const char *slash = strrchr(path, '/');
+  return slash ? slash + 1 : path;
+}
+
+static inline struct hid_dev *role_dev(struct hid_ctx *ctx,
+                                       enum hid_role role) {
+  return &ctx->dev[ctx->sel[role]];
+}
+
+static inline const struct hid_dev *role_dev_const(const struct hid_ctx *ctx,
+                                                   enum hid_role role) {
+  return &ctx->dev[ctx->sel[role]];
+}
+
+// --- Endpoint Pacing ---
+/* HID_OPT_PACING_POLL: the hidg nodes are opened non-blocking and each
+ * report waits for POLLOUT, which f_hid raises once the host has taken the
+ * previous report off the interrupt endpoint. The sender therefore runs at
+ * the host's polling rate instead of fixed sleeps. HID_OPT_MIN_DWELL_US keeps
+ * a minimum gap between reports on one device for hosts that debounce. */
+
+/* Role a report on dev belongs to: a composite device says so in the
+ * report ID */
+static int report_role(const struct hid_dev *dev, const void *buf,
+                       size_t len) {
+  uint8_t id = len > 0 ? *(const uint8_t *)buf : 0;
+  if (dev->composite && id >= HID_REPORT_ID_KEYBOARD &&
+      id <= HID_REPORT_ID_ABSOLUTE)
+    return id - HID_REPORT_ID_KEYBOARD;
+  return dev->role;
+}
+
+/* Waits for the endpoint (poll mode) and hands one report to the backend */
+static int endpoint_write(const struct hid_dev *dev, int fd, const void *buf,
+                          size_t len) {
+  const struct hid_ctx *ctx = dev->ctx;
+  struct hid_backend *b = ctx->backend;
+  int role = report_role(dev, buf, len);
+  if (!ctx->opt[HID_OPT_PACING_POLL] || !hid_backend_needs_fd(b))
+    return (int)hid_backend_write(b, role, fd, buf, len);
+
+  for (;;) {
+    struct pollfd pfd = {.fd = fd, .events = POLLOUT};
+    int r = poll(&pfd, 1, ctx->opt[HID_OPT_PACING_TIMEOUT_MS]);
+    if (r < 0) {
+      if (errno == EINTR)
+        continue;
+      return -1;
+    }
+    if (r == 0) {
+      errno = ETIMEDOUT; // host stopped polling the endpoint
+      return -1;
+    }
+    int n = (int)hid_backend_write(b, role, fd, buf, len);
+    if (n < 0 && errno == EAGAIN)
+      continue; // lost the race with another writer; wait again
+    return n;
+  }
+}
+
+static int paced_write(struct hid_dev *dev, int fd, const void *buf,
+                       size_t len) {
+  const struct hid_ctx *ctx = dev->ctx;
+  int poll_mode = ctx->opt[HID_OPT_PACING_POLL];
+  int stats = ctx->opt[HID_OPT_STATS];
+  int dwell_us = ctx->opt[HID_OPT_MIN_DWELL_US];
+
+  if (poll_mode && dwell_us > 0 && dev->last_report_ns != 0) {
+    hid_sleep_until_ns(dev->last_report_ns + (uint64_t)dwell_us * 1000u, 0);
+  }
+
+  /* Timed from here: the dwell above is our own delay, not the host's */
+  uint64_t t0 = (stats || poll_mode) ? hid_monotonic_ns() : 0;
+  int n = endpoint_write(dev, fd, buf, len);
+  if (!stats && !poll_mode)
+    return n;
+
+  int err = n < 0 ? errno : 0;
+  uint64_t t1 = hid_monotonic_ns();
+  if (n >= 0)
+    dev->last_report_ns = t1;
+  if (stats)
+    hid_stats_record(&dev->stats, n, len, 1, t1 - t0, err);
+  errno = err;
+  return n;
+}
+
+void hid_ctx_tap_hold(struct hid_ctx *ctx, unsigned us) {
+  if (!ctx->opt[HID_OPT_PACING_POLL])
+    hid_timeline_wait(&ctx->timeline, (uint64_t)us * 1000u);
+}
+
+static int open_flags(const struct hid_ctx *ctx) {
+  return ctx->opt[HID_OPT_PACING_POLL] ? (O_RDWR | O_NONBLOCK) : O_RDWR;
+}
+// --- End Endpoint Pacing ---
+
+// --- Host Reconnect ---
+/* HID_OPT_RECONNECT_MS: pulling the cable, a sleeping host or an unbound UDC
+ * make hidg writes fail (ESHUTDOWN, ENODEV, EIO, ..., or a poll pacing
+ * timeout). Instead of failing the report, the writer waits for the node to
+ * exist again (inotify on its directory) and for the UDC to be "configured"
+ * again (sysfs notifies pollers of its state file), reopens the node onto
+ * the same fd number and writes that report again. Nothing is lost or sent
+ * twice: the reports behind it wait on the caller's stack, in the bounded
+ * writer ring (HID_OPT_ASYNC, whose producer blocks once it is full) or in
+ * the batch, which resumes at the report that failed. */
+#define RECONNECT_MIN_WAIT_MS 5
+#define RECONNECT_MAX_WAIT_MS 250
+#define GADGET_UDC_FILE "UDC" /* below the gadget directory */
+#define UDC_CLASS_DIR "/sys/class/udc" /* below the sysroot */
+
+static int host_gone(int err) {
+  switch (hid_err_classify(err)) {
+  case HID_ERR_AGAIN:
+  case HID_ERR_GONE:
+  case HID_ERR_TIMEOUT:
+    return 1;
+  default:
+    return 0;
+  }
+}
+
+/* Opens the state file of the UDC the gadget is bound to (or the only one
+ * there is) and reads it, which also arms the change notification.
+ * *configured is 0 only for a UDC known not to be configured. */
+static int open_udc_state(int *configured) {
+  char name[NAME_MAX + 1] = "", path[PATH_MAX];
+  FILE *f = hid_gadget_path(path, sizeof(path), GADGET_UDC_FILE) == 0
+                ? fopen(path, "r")
+                : NULL;
+  *configured = 1;
+  if (f) {
+    if (!fgets(name, sizeof(name), f))
+      name[0] = '\0';
+    name[strcspn(name, "\n")] = '\0';
+    fclose(f);
+  }
+  if (!name[0]) {
+    snprintf(path, sizeof(path), "%s" UDC_CLASS_DIR, hid_sysroot());
+    DIR *dir = opendir(path);
+    struct dirent *entry;
+    while (dir && (entry = readdir(dir)) != NULL) {
+      if (entry->d_name[0] != '.') {
+        snprintf(name, sizeof(name), "%s", entry->d_name);
+        break;
+      }
+    }
+    if (dir)
+      closedir(dir);
+  }
+  if (!name[0])
+    return -1;
+
+  snprintf(path, sizeof(path), "%s" UDC_CLASS_DIR "/%s/state", hid_sysroot(),
+           name);
+  int fd = open(path, O_RDONLY | O_CLOEXEC);
+  char state[32];
+  ssize_t len = fd >= 0 ? read(fd, state, sizeof(state) - 1) : -1;
+  if (len > 0) {
+    state[len] = '\0';
+    *configured = strncmp(state, "configured", 10) == 0;
+  }
+  return fd;
+}
+
+/* Waits up to timeout_ms for the node to reappear or the UDC state to
+ * change, whichever is missing; otherwise just waits. Returns non-zero if
+ * the endpoint looks usable afterwards. */
+static int wait_for_endpoint(const struct hid_dev *dev, int timeout_ms) {
+  struct pollfd pfd[2];
+  int n = 0, configured;
+
+  if (access(dev->path, F_OK) != 0) {
+    char dir[PATH_MAX];
+    snprintf(dir, sizeof(dir), "%s", dev->path);
+    char *slash = strrchr(dir, '/');
+    if (!slash)
+      snprintf(dir, sizeof(dir), ".");
+    else
+      slash[slash == dir] = '\0'; // keep "/" itself
+    int ino = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (ino >= 0 && inotify_add_watch(ino, dir, IN_CREATE | IN_ATTRIB) >= 0)
+      pfd[n++] = (struct pollfd){.fd = ino, .events = POLLIN};
+    else if (ino >= 0)
+      close(ino);
+  }
+  int udc = open_udc_state(&configured);
+  if (udc >= 0 && !configured)
+    pfd[n++] = (struct pollfd){.fd = udc, .events = POLLPRI | POLLERR};
+  else if (udc >= 0)
+    close(udc);
+
+  poll(n ? pfd : NULL, (nfds_t)n, timeout_ms);
+  for (int i = 0; i < n; i++)
+    close(pfd[i].fd);
+
+  if (access(dev->path, F_OK) != 0)
+    return 0;
+  if ((udc = open_udc_state(&configured)) >= 0)
+    close(udc);
+  return configured;
+}
+
+/* Opens the node again onto the fd number the queue or batch already holds,
+ * so no writer is left with a stale descriptor */
+static int reopen_dev(struct hid_dev *dev) {
+  int fd = open(dev->path, open_flags(dev->ctx));
+  if (fd < 0)
+    return -1;
+  int ret = dup2(fd, dev->fd) < 0 ? -1 : 0;
+  close(fd);
+  return ret;
+}
+
+/* Writing buf failed with err because the host went away: waits for it to
+ * come back and writes buf again. Returns like paced_write(). */
+static int reconnect_write(struct hid_dev *dev, const void *buf, size_t len,
+                           int err) {
+  int limit_ms = dev->ctx->opt[HID_OPT_RECONNECT_MS];
+  uint64_t start = hid_monotonic_ns();
+  uint64_t deadline = start + (uint64_t)limit_ms * 1000000u;
+  int wait_ms = RECONNECT_MIN_WAIT_MS;
+  const char *name = hid_role_names[dev->role];
+
+  fprintf(stderr,
+          "[HID-RECONNECT] %s: %s; holding reports for up to %d ms\n", name,
+          strerror(err), limit_ms);
+  for (;;) {
+    uint64_t now = hid_monotonic_ns();
+    if (now >= deadline)
+      break;
+    int left_ms = (int)((deadline - now + 999999) / 1000000);
+    if (wait_for_endpoint(dev, wait_ms < left_ms ? wait_ms : left_ms) &&
+        reopen_dev(dev) == 0) {
+      int n = paced_write(dev, dev->fd, buf, len);
+      if (n >= 0 || !host_gone(errno)) {
+        if (n >= 0) {
+          dev->reconnects++;
+          fprintf(stderr, "[HID-RECONNECT] %s: resumed after %.1f ms\n",
+                  name, (hid_monotonic_ns() - start) / 1e6);
+        }
+        return n;
+      }
+      err = errno;
+    }
+    if (wait_ms < RECONNECT_MAX_WAIT_MS)
+      wait_ms *= 2;
+  }
+  fprintf(stderr, "[HID-RECONNECT] %s: host still gone after %d ms (%s)\n",
+          name, limit_ms, strerror(err));
+  errno = err;
+  return -1;
+}
+
+/* paced_write() for the output paths: rides out host disconnects */
+static int device_write(struct hid_dev *dev, int fd, const void *buf,
+                        size_t len) {
+  int n = paced_write(dev, fd, buf, len);
+  if (n < 0 && fd >= 0 && dev->path && host_gone(errno) &&
+      dev->ctx->opt[HID_OPT_RECONNECT_MS] > 0)
+    n = reconnect_write(dev, buf, len, errno);
+  return n;
+}
+// --- End Host Reconnect ---
+
+// --- NKRO Keyboard ---
+/* HID_OPT_KEYBOARD_NKRO (or a 16-byte hid.gs1 report_length written by
+ * hid-setup): the keyboard function uses keyboard-nkro-desc.bin, a modifier
+ * byte followed by a bitmap of usages 0x00-0x77. The encoders keep building
+ * 8-byte boot reports; hid_ctx_send_report() expands them into the bitmap,
+ * so every typing path switches format without changes. Held keys get their
+ * own bitmap and are not limited to six. */
+static inline void nkro_set(uint8_t *bitmap, uint8_t usage, int down) {
+  if (usage > NKRO_MAX_USAGE)
+    return; // not representable by the descriptor
+  if (down)
+    bitmap[usage >> 3] |= (uint8_t)(1u << (usage & 7));
+  else
+    bitmap[usage >> 3] &= (uint8_t)~(1u << (usage & 7));
+}
+
+/* Boot report (mods, reserved, 6 keys) -> NKRO report (mods, bitmap).
+ * Modifier usages in the key array become modifier bits. */
+static void boot_to_nkro(const uint8_t *boot, uint8_t *nkro) {
+  memset(nkro, 0, HID_KEYBOARD_NKRO_REPORT_SIZE);
+  nkro[0] = boot[0];
+  for (int i = 2; i < HID_KEYBOARD_REPORT_SIZE; i++) {
+    uint8_t usage = boot[i];
+    if (usage >= 0xE0 && usage <= 0xE7)
+      nkro[0] |= (uint8_t)(1u << (usage - 0xE0));
+    else if (usage > 3) // 0 is "no key", 1-3 are error codes
+      nkro_set(nkro + 1, usage, 1);
+  }
+}
+
+/* report_length of a configfs function hid-setup made, 0 if unknown */
+static int configfs_report_length(const char *attr) {
+  char path[PATH_MAX];
+  FILE *f = hid_gadget_path(path, sizeof(path), attr) == 0 ? fopen(path, "r")
+                                                           : NULL;
+  if (!f)
+    return 0;
+  int len = 0;
+  if (fscanf(f, "%d", &len) != 1)
+    len = 0;
+  fclose(f);
+  return len;
+}
+
+/* hid-setup records the report length in configfs; a 16-byte keyboard
+ * function (17 with the composite report ID) means the NKRO descriptor is
+ * active. */
+static int probe_keyboard_nkro(void) {
+  int len = configfs_report_length(NKRO_FUNC_REPORT_LENGTH);
+  return len == HID_KEYBOARD_NKRO_REPORT_SIZE ||
+         len == HID_KEYBOARD_NKRO_REPORT_SIZE + 1;
+}
+
+/* The Resolution Multiplier of the mouse descriptor hid-setup wrote
+ * (hid.gs2, or hid.gs1 in the composite layout), HID_MOUSE_HIRES_MULTIPLIER
+ * if neither can be read or offers one */
+static int probe_wheel_multiplier(void) {
+  static const char *const descs[] = {MOUSE_FUNC_REPORT_DESC,
+                                      KEYBOARD_FUNC_REPORT_DESC};
+  for (size_t i = 0; i < sizeof(descs) / sizeof(descs[0]); i++) {
+    unsigned char desc[1024];
+    char path[PATH_MAX];
+    FILE *f = hid_gadget_path(path, sizeof(path), descs[i]) == 0
+                  ? fopen(path, "rb")
+                  : NULL;
+    if (!f)
+      continue;
+    size_t len = fread(desc, 1, sizeof(desc), f);
+    fclose(f);
+    int m = hid_desc_resolution_multiplier(desc, len);
+    if (m > 1)
+      return m > 255 ? 255 : m;
+  }
+  return HID_MOUSE_HIRES_MULTIPLIER;
+}
+// --- End NKRO Keyboard ---
+
+// --- Composite Device ---
+/* HID_OPT_COMPOSITE (or a hid-setup function whose descriptor has report
+ * IDs): keyboard, mouse and consumer share one interface, one endpoint and
+ * one fd. Every role is routed to the keyboard's device and each report
+ * leaves with its role's report ID in front, so a Ctrl-click or a key
+ * followed by a volume change reaches the host in exactly the order it was
+ * sent, through a single writer queue. */
+#define ENCODED_REPORT_MAX HID_QUEUE_SLOT_SIZE /* writer rings take them all */
+
+/* The bytes that leave for a report of role on dev: boot keyboard reports
+ * expanded for NKRO, and the report ID in front on a composite device.
+ * Returns report itself if nothing changes, otherwise out with *len
+ * updated. Reports that already start with their ID pass as they are
+ * (captures replayed onto a composite device). */
+static const uint8_t *encode_report(const struct hid_ctx *ctx,
+                                    const struct hid_dev *dev,
+                                    enum hid_role role, const uint8_t *report,
+                                    size_t *len, uint8_t *out) {
+  uint8_t id = (uint8_t)(HID_REPORT_ID_KEYBOARD + role);
+  size_t n = *len;
+  if (ctx->opt[HID_OPT_KEYBOARD_NKRO] && role == HID_ROLE_KEYBOARD &&
+      n == HID_KEYBOARD_REPORT_SIZE) {
+    boot_to_nkro(report, out + dev->composite);
+    n = HID_KEYBOARD_NKRO_REPORT_SIZE;
+  } else if (!dev->composite || n + 1 > ENCODED_REPORT_MAX ||
+             (n == hid_ctx_report_size(ctx, role) + 1 && report[0] == id)) {
+    return report;
+  } else {
+    memcpy(out + 1, report, n);
+  }
+  if (dev->composite) {
+    out[0] = id;
+    n++;
+  }
+  *len = n;
+  return out;
+}
+
+/* Routes every role to the keyboard's device, or back to its own */
+static void route_composite(struct hid_ctx *ctx, int on) {
+  int k = on ? ctx->home[HID_ROLE_KEYBOARD] : HID_ROLE_KEYBOARD;
+  if (!on)
+    ctx->dev[ctx->home[HID_ROLE_KEYBOARD]].composite = 0;
+  for (int r = 0; r < HID_ROLE_COUNT; r++)
+    ctx->sel[r] = ctx->home[r] = on ? k : r;
+  ctx->dev[k].composite = on;
+  ctx->dev[k].role = HID_ROLE_KEYBOARD;
+}
+// --- End Composite Device ---
+
+// --- Context Lifetime ---
+static void batch_observer(void *arg, int fd, long res, size_t len,
+                           size_t reports, uint64_t ns, int err);
+static void writer_thread_start(void *arg);
+static int endpoint_gate(void *arg, int fd);
+static int queue_mouse(struct hid_dev *dev, const uint8_t *report,
+                       size_t len);
+
+struct hid_ctx *hid_ctx_new(void) {
+  struct hid_ctx *ctx = calloc(1, sizeof(*ctx));
+  if (!ctx)
+    return NULL;
+  for (int i = 0; i < HID_DEVICE_MAX; i++) {
+    ctx->dev[i].ctx = ctx;
+    ctx->dev[i].fd = -1;
+  }
+  for (int r = 0; r < HID_ROLE_COUNT; r++) {
+    ctx->dev[r].role = (enum hid_role)r;
+    ctx->dev[r].kind = r;
+    ctx->sel[r] = ctx->home[r] = r;
+  }
+  ctx->ndev = HID_ROLE_COUNT;
+  ctx->opt[HID_OPT_ASYNC_DEPTH] = HID_QUEUE_DEFAULT_DEPTH;
+  ctx->opt[HID_OPT_STATS] = 1;
+  ctx->opt[HID_OPT_PACING_TIMEOUT_MS] = 2000;
+  ctx->opt[HID_OPT_MOUSE_REPORT_SIZE] = HID_MOUSE_REPORT_SIZE;
+  ctx->opt[HID_OPT_RT_CPU] = -1;
+  ctx->opt[HID_OPT_RECONNECT_MS] = HID_RECONNECT_DEFAULT_MS;
+  ctx->opt[HID_OPT_WHEEL_MULTIPLIER] = 1;
+  hid_timeline_init(&ctx->timeline);
+  ctx->backend = hid_backend_open(HID_DEFAULT_BACKEND);
+  if (!ctx->backend) {
+    free(ctx);
+    return NULL;
+  }
+  /* Process-wide, but every context routes batch writes through it */
+  hid_batch_set_observer(batch_observer);
+  hid_queue_set_thread_hook(writer_thread_start);
+  return ctx;
+}
+
+static void close_dev(struct hid_dev *dev) {
+  if (dev->queue) {
+    hid_queue_destroy(dev->queue); // flushes first
+    dev->queue = NULL;
+  }
+  if (dev->fd >= 0) {
+    close(dev->fd);
+    dev->fd = -1;
+  }
+}
+
+void hid_ctx_free(struct hid_ctx *ctx) {
+  if (!ctx)
+    return;
+  for (int i = 0; i < ctx->ndev; i++) {
+    close_dev(&ctx->dev[i]);
+    free(ctx->dev[i].path);
+  }
+  hid_backend_free(ctx->backend);
+  free(ctx);
+}
+
+int hid_ctx_set_device(struct hid_ctx *ctx, enum hid_role role,
+                       const char *path) {
+  if ((unsigned)role >= HID_ROLE_COUNT) {
+    errno = EINVAL;
+    return -1;
+  }
+  /* The role's own entry, not whichever device it is routed to now */
+  struct hid_dev *dev = &ctx->dev[ctx->home[role]];
+  char *copy = NULL;
+  if (path && !(copy = strdup(path)))
+    return -1;
+  close_dev(dev);
+  free(dev->path);
+  dev->path = copy;
+  return 0;
+}
+
+const char *hid_ctx_device(const struct hid_ctx *ctx, enum hid_role role) {
+  return (unsigned)role < HID_ROLE_COUNT ? role_dev_const(ctx, role)->path
+                                         : NULL;
+}
+
+int hid_ctx_fd(struct hid_ctx *ctx, enum hid_role role) {
+  if ((unsigned)role >= HID_ROLE_COUNT || !hid_backend_needs_fd(ctx->backend))
+    return -1;
+  struct hid_dev *dev = role_dev(ctx, role);
+  if (!dev->path) {
+    errno = ENODEV;
+    return -1;
+  }
+  if (dev->fd < 0)
+    dev->fd = open(dev->path, open_flags(ctx));
+  return dev->fd;
+}
+
+int hid_ctx_open(struct hid_ctx *ctx, enum hid_role role) {
+  if ((unsigned)role >= HID_ROLE_COUNT) {
+    errno = EINVAL;
+    return -1;
+  }
+  if (!hid_backend_needs_fd(ctx->backend))
+    return 0;
+  return hid_ctx_fd(ctx, role) < 0 ? -1 : 0;
+}
+
+int hid_ctx_set_backend(struct hid_ctx *ctx, struct hid_backend *backend) {
+  if (!backend && !(backend = hid_backend_open("device")))
+    return -1;
+  /* Nothing may still be on its way to the old backend */
+  hid_ctx_flush(ctx);
+  hid_backend_free(ctx->backend);
+  ctx->backend = backend;
+  return 0;
+}
+
+struct hid_backend *hid_ctx_backend(const struct hid_ctx *ctx) {
+  return ctx->backend;
+}
+
+int hid_ctx_discover(struct hid_ctx *ctx) {
+  struct hid_node nodes[HID_DISCOVER_MAX];
+  const char *cache = getenv("HID_DEVICE_CACHE");
+  if (!cache)
+    cache = HID_DISCOVER_DEFAULT_CACHE;
+
+  int count = hid_discover_nodes(hid_sysroot(), *cache ? cache : NULL, nodes,
+                                 HID_DISCOVER_MAX);
+  if (count < 0) {
+    perror("Error discovering hidg devices");
+    return -1;
+  }
+
+  /* Nodes whose configfs function names a role take that role; the others
+   * fill the roles still free in hidg order. Roles that already have a node
+   * (e.g. from the env) are left alone. */
+  int claimed[HID_ROLE_COUNT] = {0}, used[HID_DISCOVER_MAX] = {0};
+  int labelled = 0;
+  /* A composite function is every role at once */
+  for (int i = 0; i < count; i++) {
+    if (nodes[i].role != HID_NODE_COMPOSITE)
+      continue;
+    labelled = used[i] = 1;
+    if (role_dev(ctx, HID_ROLE_KEYBOARD)->path)
+      continue;
+    if (hid_ctx_set_device(ctx, HID_ROLE_KEYBOARD, nodes[i].path) != 0) {
+      perror("Error allocating memory for device paths");
+      return -1;
+    }
+    if (!ctx->opt[HID_OPT_COMPOSITE])
+      hid_ctx_set_option(ctx, HID_OPT_COMPOSITE, 1);
+  }
+  for (int i = 0; i < count; i++) {
+    int r = nodes[i].role;
+    if (r < 0 || r >= HID_ROLE_COUNT)
+      continue;
+    labelled = 1;
+    used[i] = 1;
+    /* Composite: the other roles ride on the keyboard's device */
+    if (claimed[r] || (ctx->opt[HID_OPT_COMPOSITE] && r != HID_ROLE_KEYBOARD))
+      continue;
+    claimed[r] = 1;
+    if (!role_dev(ctx, r)->path &&
+        hid_ctx_set_device(ctx, (enum hid_role)r, nodes[i].path) != 0) {
+      perror("Error allocating memory for device paths");
+      return -1;
+    }
+  }
+  for (int r = 0, next = 0; r < HID_ROLE_BASE_COUNT; r++) {
+    if (claimed[r] || (labelled && role_dev(ctx, r)->path) ||
+        (ctx->opt[HID_OPT_COMPOSITE] && r != HID_ROLE_KEYBOARD))
+      continue;
+    /* Without configfs roles, node N is role N as it always was; optional
+     * roles are only ever taken from configfs */
+    int i = labelled ? next : r;
+    while (i < count && used[i])
+      i++;
+    if (i >= count)
+      break;
+    next = i + 1;
+    if (role_dev(ctx, r)->path)
+      continue;
+    used[i] = 1;
+    if (hid_ctx_set_device(ctx, (enum hid_role)r, nodes[i].path) != 0) {
+      perror("Error allocating memory for device paths");
+      return -1;
+    }
+  }
+
+  if (count == 0) {
+    if (hid_backend_needs_fd(ctx->backend))
+      return 0;
+    /* Dry run without a gadget: placeholder nodes that are never opened */
+    if (strcmp(hid_backend_name(ctx->backend), "mock") == 0)
+      printf("[HID-MOCK] Mocking device paths for testing.\n");
+    for (int r = 0; r < HID_ROLE_COUNT; r++) {
+      if (!role_dev(ctx, r)->path)
+        hid_ctx_set_device(ctx, (enum hid_role)r, "/dev/null");
+    }
+    return HID_ROLE_COUNT;
+  }
+
+  /* Every other node joins the registry for hid_ctx_select_device() */
+  for (int i = 0; i < count; i++) {
+    int composite = nodes[i].role == HID_NODE_COMPOSITE;
+    int index =
+        hid_ctx_add_device(ctx, nodes[i].path, composite ? -1 : nodes[i].role);
+    if (index >= 0 && composite)
+      ctx->dev[index].composite = 1;
+  }
+  return count;
+}
+
+// --- Device Registry ---
+int hid_ctx_device_count(const struct hid_ctx *ctx) { return ctx->ndev; }
+
+int hid_ctx_device_info(const struct hid_ctx *ctx, int index,
+                        struct hid_device_info *out) {
+  if (index < 0 || index >= ctx->ndev) {
+    errno = EINVAL;
+    return -1;
+  }
+  const struct hid_dev *dev = &ctx->dev[index];
+  out->index = index;
+  out->path = dev->path;
+  out->name = dev->path ? node_name(dev->path) : NULL;
+  out->kind = dev->kind;
+  out->composite = dev->composite;
+  out->selected = -1;
+  for (int r = 0; r < HID_ROLE_COUNT; r++)
+    if (ctx->sel[r] == index)
+      out->selected = r;
+  return 0;
+}
+
+int hid_ctx_add_device(struct hid_ctx *ctx, const char *path, int kind) {
+  if (!path || kind < -1 || kind >= HID_ROLE_COUNT) {
+    errno = EINVAL;
+    return -1;
+  }
+  for (int i = 0; i < ctx->ndev; i++)
+    if (ctx->dev[i].path && strcmp(ctx->dev[i].path, path) == 0)
+      return i;
+  if (ctx->ndev >= HID_DEVICE_MAX) {
+    errno = ENOSPC;
+    return -1;
+  }
+  struct hid_dev *dev = &ctx->dev[ctx->ndev];
+  if (!(dev->path = strdup(path)))
+    return -1;
+  dev->kind = kind;
+  dev->role = kind >= 0 ? (enum hid_role)kind : HID_ROLE_KEYBOARD;
+  return ctx->ndev++;
+}
+
+int hid_ctx_find_device(const struct hid_ctx *ctx, const char *name) {
+  char *end;
+  long index = strtol(name, &end, 10);
+  if (*name && !*end)
+    return index >= 0 && index < ctx->ndev ? (int)index : (errno = ENOENT, -1);
+  for (int i = 0; i < ctx->ndev; i++) {
+    const char *path = ctx->dev[i].path;
+    if (path && (strcmp(path, name) == 0 ||
+                 (!strchr(name, '/') && strcmp(node_name(path), name) == 0)))
+      return i;
+  }
+  errno = ENOENT;
+  return -1;
+}
+
+int hid_ctx_select_device(struct hid_ctx *ctx, int role, int index) {
+  if (index < 0 || index >= ctx->ndev || !ctx->dev[index].path) {
+    errno = ENOENT;
+    return -1;
+  }
+  /* A composite device by itself takes every role */
+  if (role < 0 && ctx->dev[index].composite) {
+    for (int r = 0; r < HID_ROLE_COUNT; r++)
+      if (hid_ctx_select_device(ctx, r, index) != 0)
+        return -1;
+    return 0;
+  }
+  if (role < 0)
+    role = ctx->dev[index].kind;
+  if (role < 0 || role >= HID_ROLE_COUNT) {
+    errno = EINVAL;
+    return -1;
+  }
+  if (ctx->sel[role] == index)
+    return 0;
+  /* Keys held on the old keyboard would stay down there for good */
+  if (role == HID_ROLE_KEYBOARD) {
+    int held = ctx->held_mods != 0;
+    for (size_t i = 0; i < sizeof(ctx->held_keys); i++)
+      held |= ctx->held_keys[i] != 0;
+    for (size_t i = 0; i < sizeof(ctx->held_bitmap); i++)
+      held |= ctx->held_bitmap[i] != 0;
+    if (held)
+      hid_ctx_release_all_keys(ctx);
+  }
+  /* No flush: whatever the old device still has queued drains on its own */
+  ctx->sel[role] = index;
+  if (!ctx->dev[index].composite)
+    ctx->dev[index].role = (enum hid_role)role;
+  return 0;
+}
+
+int hid_ctx_selected_device(const struct hid_ctx *ctx, enum hid_role role) {
+  return (unsigned)role < HID_ROLE_COUNT ? ctx->sel[role] : -1;
+}
+
+int hid_ctx_select_devices(struct hid_ctx *ctx, const char *spec) {
+  char buf[256];
+  if (!spec || strlen(spec) >= sizeof(buf)) {
+    errno = EINVAL;
+    return -1;
+  }
+  strcpy(buf, spec);
+  char *save = NULL;
+  for (char *item = strtok_r(buf, ", \t", &save); item;
+       item = strtok_r(NULL, ", \t", &save)) {
+    if (strcasecmp(item, "default") == 0) {
+      for (int r = 0; r < HID_ROLE_COUNT; r++) {
+        if (ctx->dev[ctx->home[r]].path)
+          hid_ctx_select_device(ctx, r, ctx->home[r]);
+        ctx->sel[r] = ctx->home[r];
+      }
+      continue;
+    }
+    int role = -1;
+    char *eq = strchr(item, '=');
+    if (eq) {
+      *eq = '\0';
+      for (int r = 0; r < HID_ROLE_COUNT; r++)
+        if (strcasecmp(item, hid_role_names[r]) == 0)
+          role = r;
+      if (role < 0) {
+        errno = EINVAL;
+        return -1;
+      }
+      item = eq + 1;
+    }
+    int index = hid_ctx_find_device(ctx, item);
+    if (index < 0 || hid_ctx_select_device(ctx, role, index) != 0)
+      return -1;
+  }
+  return 0;
+}
+// --- End Device Registry ---
+
+int hid_env_true(const char *v) {
+  return v && (strcmp(v, "1") == 0 || strcasecmp(v, "true") == 0 ||
+               strcasecmp(v, "yes") == 0);
+}
+
+void hid_ctx_load_env(struct hid_ctx *ctx) {
+  // Output backend (HID_OUTPUT=device|mock|capture:FILE|record:FILE|memory|null)
+  {
+    const char *out = getenv("HID_OUTPUT");
+    if (out && *out) {
+      struct hid_backend *b = hid_backend_open(out);
+      if (b)
+        hid_ctx_set_backend(ctx, b);
+      else
+        fprintf(stderr, "[HID-OUTPUT] Cannot use output '%s': %s\n", out,
+                strerror(errno));
+    }
+  }
+  // Device overrides (HID_KEYBOARD_DEV / HID_MOUSE_DEV / HID_CONSUMER_DEV /
+  // HID_ABSOLUTE_DEV)
+  {
+    static const char *const vars[HID_ROLE_COUNT] = {
+        "HID_KEYBOARD_DEV", "HID_MOUSE_DEV", "HID_CONSUMER_DEV",
+        "HID_ABSOLUTE_DEV"};
+    for (int r = 0; r < HID_ROLE_COUNT; r++) {
+      const char *path = getenv(vars[r]);
+      struct stat st;
+      if (path && stat(path, &st) == 0 && S_ISCHR(st.st_mode))
+        hid_ctx_set_device(ctx, (enum hid_role)r, path);
+    }
+  }
+  // Optional mouse capabilities (HID_MOUSE_HSCROLL / HID_MOUSE_REPORT_SIZE /
+  // HID_MOUSE_16BIT, else whatever hid-setup configured)
+  {
+    const char *sz = getenv("HID_MOUSE_REPORT_SIZE");
+    const char *hs = getenv("HID_MOUSE_HSCROLL");
+    const char *wide = getenv("HID_MOUSE_16BIT");
+    int v = sz ? atoi(sz)
+               : !hs && !wide ? configfs_report_length(MOUSE_FUNC_REPORT_LENGTH)
+                              : 0;
+    if (v >= HID_MOUSE_REPORT_SIZE && v <= HID_MOUSE_WIDE_REPORT_SIZE + 1)
+      hid_ctx_set_option(ctx, HID_OPT_MOUSE_REPORT_SIZE, v);
+    if (hid_env_true(hs) || (!hs && (v == 5 || v == 7)))
+      hid_ctx_set_option(ctx, HID_OPT_MOUSE_HSCROLL, 1);
+    if (hid_env_true(wide) &&
+        ctx->opt[HID_OPT_MOUSE_REPORT_SIZE] < HID_MOUSE_WIDE_REPORT_SIZE)
+      hid_ctx_set_option(ctx, HID_OPT_MOUSE_REPORT_SIZE,
+                         ctx->opt[HID_OPT_MOUSE_REPORT_SIZE] + 2);
+    const char *step = getenv("HID_MOUSE_STEP_MAX");
+    if (step && *step)
+      hid_ctx_set_option(ctx, HID_OPT_MOUSE_STEP_MAX, atoi(step));
+    const char *interval = getenv("HID_MOUSE_INTERVAL_US");
+    if (interval && *interval)
+      hid_ctx_set_option(ctx, HID_OPT_MOUSE_INTERVAL_US, atoi(interval));
+    /* Opt-in only: a host that never sets the feature (macOS, firmware)
+     * would scroll that many times too far */
+    if (hid_env_true(getenv("HID_MOUSE_HIRES")))
+      hid_ctx_set_option(ctx, HID_OPT_WHEEL_MULTIPLIER,
+                         probe_wheel_multiplier());
+  }
+  // NKRO keyboard (HID_KEYBOARD_NKRO, else whatever hid-setup configured)
+  {
+    const char *nk = getenv("HID_KEYBOARD_NKRO");
+    hid_ctx_set_option(ctx, HID_OPT_KEYBOARD_NKRO,
+                       nk ? hid_env_true(nk) : probe_keyboard_nkro());
+  }
+  // Composite gadget (HID_COMPOSITE, else whatever discovery finds)
+  if (hid_env_true(getenv("HID_COMPOSITE")))
+    hid_ctx_set_option(ctx, HID_OPT_COMPOSITE, 1);
+  // Screen the absolute pointer spans (HID_SCREEN=1920x1080)
+  {
+    const char *screen = getenv("HID_SCREEN");
+    int w, h;
+    if (screen && sscanf(screen, "%dx%d", &w, &h) == 2 && w > 0 && h > 0) {
+      hid_ctx_set_option(ctx, HID_OPT_SCREEN_WIDTH, w);
+      hid_ctx_set_option(ctx, HID_OPT_SCREEN_HEIGHT, h);
+    }
+  }
+  // Asynchronous report pipeline (HID_ASYNC / HID_ASYNC_DEPTH)
+  {
+    const char *depth = getenv("HID_ASYNC_DEPTH");
+    const char *qs = getenv("HID_QUEUE_STATS");
+    if (hid_env_true(getenv("HID_ASYNC")))
+      hid_ctx_set_option(ctx, HID_OPT_ASYNC, 1);
+    if (depth) {
+      int v = atoi(depth);
+      if (v > 0)
+        hid_ctx_set_option(ctx, HID_OPT_ASYNC_DEPTH, v);
+    }
+    if (hid_env_true(qs))
+      hid_ctx_set_option(ctx, HID_OPT_QUEUE_STATS, 1);
+  }
+  // Mouse report coalescing (HID_MOUSE_COALESCE)
+  if (hid_env_true(getenv("HID_MOUSE_COALESCE")))
+    hid_ctx_set_option(ctx, HID_OPT_MOUSE_COALESCE, 1);
+  // Write statistics (HID_STATS=0 turns collection off)
+  {
+    const char *st = getenv("HID_STATS");
+    if (st && strcmp(st, "0") == 0)
+      hid_ctx_set_option(ctx, HID_OPT_STATS, 0);
+  }
+  // Endpoint pacing (HID_PACING=poll, HID_MIN_DWELL_US, HID_PACING_TIMEOUT_MS)
+  {
+    const char *pm = getenv("HID_PACING");
+    const char *dwell = getenv("HID_MIN_DWELL_US");
+    const char *pto = getenv("HID_PACING_TIMEOUT_MS");
+    if (pm && strcasecmp(pm, "poll") == 0)
+      hid_ctx_set_option(ctx, HID_OPT_PACING_POLL, 1);
+    if (dwell) {
+      int v = atoi(dwell);
+      if (v >= 0 && v <= 1000000)
+        hid_ctx_set_option(ctx, HID_OPT_MIN_DWELL_US, v);
+    }
+    if (pto) {
+      int v = atoi(pto);
+      if (v > 0)
+        hid_ctx_set_option(ctx, HID_OPT_PACING_TIMEOUT_MS, v);
+    }
+  }
+  // Typing engine (HID_TYPING=classic|rollover)
+  {
+    const char *tm = getenv("HID_TYPING");
+    if (tm && strcasecmp(tm, "rollover") == 0)
+      hid_ctx_set_option(ctx, HID_OPT_TYPING_ROLLOVER, 1);
+  }
+  // Delay timing (HID_TIMING=relative, HID_TIMER_SPIN_US, HID_TIMER_SLACK_NS)
+  {
+    const char *tm = getenv("HID_TIMING");
+    const char *spin = getenv("HID_TIMER_SPIN_US");
+    const char *slack = getenv("HID_TIMER_SLACK_NS");
+    if (tm && strcasecmp(tm, "relative") == 0)
+      hid_ctx_set_option(ctx, HID_OPT_TIMING_RELATIVE, 1);
+    if (spin) {
+      int v = atoi(spin);
+      if (v >= 0 && v <= HID_TIMER_SPIN_MAX_US)
+        hid_ctx_set_option(ctx, HID_OPT_TIMER_SPIN_US, v);
+    }
+    if (slack && *slack)
+      hid_timer_set_slack(strtoul(slack, NULL, 10));
+  }
+  // Host disconnects (HID_RECONNECT_MS, 0 fails writes at once)
+  {
+    const char *rc = getenv("HID_RECONNECT_MS");
+    if (rc && *rc)
+      hid_ctx_set_option(ctx, HID_OPT_RECONNECT_MS, atoi(rc));
+  }
+  // Real-time mode (HID_RT=1, HID_RT_PRIORITY, HID_RT_CPU)
+  {
+    const char *prio = getenv("HID_RT_PRIORITY");
+    const char *cpu = getenv("HID_RT_CPU");
+    if (hid_env_true(getenv("HID_RT")))
+      hid_ctx_set_option(ctx, HID_OPT_RT_PRIORITY, HID_RT_DEFAULT_PRIORITY);
+    if (prio && *prio)
+      hid_ctx_set_option(ctx, HID_OPT_RT_PRIORITY, atoi(prio));
+    if (cpu && *cpu)
+      hid_ctx_set_option(ctx, HID_OPT_RT_CPU, atoi(cpu));
+  }
+}
+
+int hid_ctx_set_option(struct hid_ctx *ctx, enum hid_option opt, int value) {
+  if ((unsigned)opt >= HID_OPT_COUNT) {
+    errno = EINVAL;
+    return -1;
+  }
+  switch (opt) {
+  case HID_OPT_ASYNC_DEPTH:
+  case HID_OPT_PACING_TIMEOUT_MS:
+    if (value <= 0) {
+      errno = EINVAL;
+      return -1;
+    }
+    break;
+  case HID_OPT_MIN_DWELL_US:
+    if (value < 0 || value > 1000000) {
+      errno = EINVAL;
+      return -1;
+    }
+    break;
+  case HID_OPT_TIMER_SPIN_US:
+    if (value < 0 || value > HID_TIMER_SPIN_MAX_US) {
+      errno = EINVAL;
+      return -1;
+    }
+    break;
+  case HID_OPT_WHEEL_MULTIPLIER:
+    if (value < 1 || value > 255) {
+      errno = EINVAL;
+      return -1;
+    }
+    break;
+  case HID_OPT_RT_PRIORITY:
+    if (value < 0 || value > 99) {
+      errno = EINVAL;
+      return -1;
+    }
+    break;
+  case HID_OPT_RECONNECT_MS:
+  case HID_OPT_SCREEN_WIDTH:
+  case HID_OPT_SCREEN_HEIGHT:
+  case HID_OPT_MOUSE_STEP_MAX:
+  case HID_OPT_MOUSE_INTERVAL_US:
+    if (value < 0) {
+      errno = EINVAL;
+      return -1;
+    }
+    break;
+  case HID_OPT_RT_CPU:
+    if (value < -1) {
+      errno = EINVAL;
+      return -1;
+    }
+    break;
+  case HID_OPT_MOUSE_REPORT_SIZE:
+    if (value < HID_MOUSE_REPORT_SIZE ||
+        value > HID_MOUSE_WIDE_REPORT_SIZE + 1) {
+      errno = EINVAL;
+      return -1;
+    }
+    break;
+  default:
+    value = value != 0;
+    break;
+  }
+  int was = ctx->opt[opt];
+  ctx->opt[opt] = value;
+
+  switch (opt) {
+  case HID_OPT_ASYNC:
+    /* Back to synchronous writes: drain and stop the writer threads */
+    if (!value) {
+      for (int i = 0; i < ctx->ndev; i++) {
+        hid_queue_destroy(ctx->dev[i].queue);
+        ctx->dev[i].queue = NULL;
+      }
+    }
+    break;
+  case HID_OPT_PACING_POLL:
+    /* Poll pacing needs non-blocking fds; switch the ones already open */
+    for (int i = 0; i < ctx->ndev; i++) {
+      int fd = ctx->dev[i].fd;
+      int fl = fd >= 0 ? fcntl(fd, F_GETFL) : -1;
+      if (fl >= 0)
+        fcntl(fd, F_SETFL, value ? (fl | O_NONBLOCK) : (fl & ~O_NONBLOCK));
+    }
+    break;
+  case HID_OPT_MOUSE_HSCROLL:
+    /* The pan byte follows the wheel in either format */
+    if (value && (ctx->opt[HID_OPT_MOUSE_REPORT_SIZE] == HID_MOUSE_REPORT_SIZE ||
+                  ctx->opt[HID_OPT_MOUSE_REPORT_SIZE] ==
+                      HID_MOUSE_WIDE_REPORT_SIZE))
+      ctx->opt[HID_OPT_MOUSE_REPORT_SIZE]++;
+    break;
+  case HID_OPT_TIMING_RELATIVE:
+    ctx->timeline.relative = value;
+    break;
+  case HID_OPT_COMPOSITE:
+    hid_ctx_flush(ctx);
+    route_composite(ctx, value);
+    break;
+  case HID_OPT_TIMER_SPIN_US:
+    ctx->timeline.spin_ns = (uint32_t)value * 1000u;
+    break;
+  case HID_OPT_MOUSE_COALESCE:
+    /* Merging happens in the writer rings: they run while coalescing
+     * does, then HID_OPT_ASYNC goes back to what it was */
+    if (value && !was) {
+      ctx->coalesce_async = ctx->opt[HID_OPT_ASYNC];
+      hid_ctx_set_option(ctx, HID_OPT_ASYNC, 1);
+    } else if (!value && was) {
+      hid_ctx_set_option(ctx, HID_OPT_ASYNC, ctx->coalesce_async);
+    }
+    for (int i = 0; i < ctx->ndev; i++)
+      hid_queue_set_gate(ctx->dev[i].queue, value ? endpoint_gate : NULL);
+    break;
+  default:
+    break;
+  }
+  return 0;
+}
+
+int hid_ctx_get_option(const struct hid_ctx *ctx, enum hid_option opt) {
+  return (unsigned)opt < HID_OPT_COUNT ? ctx->opt[opt] : -1;
+}
+
+int hid_ctx_rt_enter(struct hid_ctx *ctx) {
+  int prio = ctx->opt[HID_OPT_RT_PRIORITY];
+  int cpu = ctx->opt[HID_OPT_RT_CPU];
+  int result = hid_rt_enter_thread(prio, cpu);
+  int err = errno;
+  if (prio > 0) {
+    if (hid_rt_lock_memory() == 0)
+      result |= HID_RT_LOCKED;
+    else
+      err = errno;
+  }
+  errno = err;
+  return result;
+}
+
+size_t hid_ctx_report_size(const struct hid_ctx *ctx, enum hid_role role) {
+  switch (role) {
+  case HID_ROLE_KEYBOARD:
+    return ctx->opt[HID_OPT_KEYBOARD_NKRO] ? HID_KEYBOARD_NKRO_REPORT_SIZE
+                                           : HID_KEYBOARD_REPORT_SIZE;
+  case HID_ROLE_MOUSE:
+    return (size_t)ctx->opt[HID_OPT_MOUSE_REPORT_SIZE];
+  case HID_ROLE_CONSUMER:
+    return HID_CONSUMER_REPORT_SIZE;
+  case HID_ROLE_ABSOLUTE:
+    return HID_ABSOLUTE_REPORT_SIZE;
+  default:
+    return 0;
+  }
+}
+// --- End Context Lifetime ---
+
+// --- Report Output Path ---
+/* Queue and batch sink: runs on the writer thread in async mode */
+static int sink_write(void *arg, int fd, const void *buf, size_t len) {
+  return device_write(arg, fd, buf, len);
+}
+
+/* Writer threads of HID_OPT_ASYNC take the real-time settings */
+static void writer_thread_start(void *arg) {
+  const struct hid_dev *dev = arg;
+  const struct hid_ctx *ctx = dev->ctx;
+  if (ctx->opt[HID_OPT_RT_PRIORITY] > 0 || ctx->opt[HID_OPT_RT_CPU] >= 0)
+    hid_rt_enter_thread(ctx->opt[HID_OPT_RT_PRIORITY],
+                        ctx->opt[HID_OPT_RT_CPU]);
+}
+
+/* Accounts writes the batch layer issues without going through the sink */
+static void batch_observer(void *arg, int fd, long res, size_t len,
+                           size_t reports, uint64_t ns, int err) {
+  struct hid_dev *dev = arg;
+  (void)fd;
+  if (!dev || !dev->ctx->opt[HID_OPT_STATS])
+    return;
+  hid_stats_record(&dev->stats, res, len, reports,
+                   ns == UINT64_MAX ? HID_STATS_NO_LATENCY : ns, err);
+}
+
+/* Remembers the first failure for hid_ctx_take_error(); returns -1 */
+static int output_failed(struct hid_ctx *ctx) {
+  int err = errno ? errno : EIO;
+  if (!ctx->error)
+    ctx->error = err;
+  errno = err;
+  return -1;
+}
+
+static int output_report(struct hid_ctx *ctx, enum hid_role role,
+                         const void *report, size_t len) {
+  struct hid_dev *dev = role_dev(ctx, role);
+  int fd = -1;
+  if (hid_backend_needs_fd(ctx->backend) && (fd = hid_ctx_fd(ctx, role)) < 0)
+    return -1;
+
+  if (ctx->opt[HID_OPT_ASYNC]) {
+    if (!dev->queue) {
+      dev->queue = hid_queue_create(fd, (size_t)ctx->opt[HID_OPT_ASYNC_DEPTH],
+                                    sink_write, dev);
+      if (dev->queue && ctx->opt[HID_OPT_MOUSE_COALESCE])
+        hid_queue_set_gate(dev->queue, endpoint_gate);
+    }
+    if (dev->queue && role == HID_ROLE_MOUSE &&
+        ctx->opt[HID_OPT_MOUSE_COALESCE])
+      return queue_mouse(dev, report, len);
+    dev->mouse_open = 0;
+    if (dev->queue)
+      return hid_queue_push(dev->queue, report, len);
+    /* Could not start a writer thread: fall back to synchronous writes */
+  }
+  return (device_write(dev, fd, report, len) == (int)len) ? 0 : -1;
+}
+
+int hid_ctx_send_report(struct hid_ctx *ctx, enum hid_role role,
+                        const void *report, size_t len) {
+  if ((unsigned)role >= HID_ROLE_COUNT) {
+    errno = EINVAL;
+    return -1;
+  }
+  struct hid_dev *dev = role_dev(ctx, role);
+  uint8_t encoded[ENCODED_REPORT_MAX];
+  report = encode_report(ctx, dev, role, report, &len, encoded);
+
+  if (!ctx->opt[HID_OPT_QUEUE_STATS])
+    return output_report(ctx, role, report, len) == 0 ? 0 : output_failed(ctx);
+
+  uint64_t t0 = hid_monotonic_ns();
+  int ret = output_report(ctx, role, report, len);
+  dev->out_blocked_ns += hid_monotonic_ns() - t0;
+  dev->out_reports++;
+  return ret == 0 ? 0 : output_failed(ctx);
+}
+
+/* Reports [from, count) one at a time, each followed by its delay */
+static int send_each(struct hid_ctx *ctx, enum hid_role role,
+                     const uint8_t *reports, size_t report_len, size_t from,
+                     size_t count, const uint32_t *delays_us) {
+  for (size_t i = from; i < count; i++) {
+    if (hid_ctx_send_report(ctx, role, reports + i * report_len,
+                            report_len) != 0)
+      return -1;
+    if (delays_us && delays_us[i] > 0) {
+      hid_ctx_flush(ctx);
+      hid_timeline_wait(&ctx->timeline, (uint64_t)delays_us[i] * 1000u);
+    }
+  }
+  return 0;
+}
+
+int hid_ctx_send_reports(struct hid_ctx *ctx, enum hid_role role,
+                         const uint8_t *reports, size_t report_len,
+                         size_t count, const uint32_t *delays_us) {
+  if (count == 0)
+    return 0;
+  if ((unsigned)role >= HID_ROLE_COUNT) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  /* Queued, paced or non-device output goes report by report */
+  if (ctx->opt[HID_OPT_ASYNC] || ctx->opt[HID_OPT_PACING_POLL] ||
+      !hid_backend_is_device(ctx->backend))
+    return send_each(ctx, role, reports, report_len, 0, count, delays_us);
+
+  struct hid_dev *dev = role_dev(ctx, role);
+  int fd = hid_ctx_fd(ctx, role);
+  if (fd < 0)
+    return output_failed(ctx);
+
+  /* NKRO expansion and report IDs, as hid_ctx_send_report() would */
+  const uint8_t *boot = reports;
+  size_t boot_len = report_len;
+  uint8_t *expanded = NULL;
+  uint8_t first[ENCODED_REPORT_MAX];
+  size_t out_len = report_len;
+  if (encode_report(ctx, dev, role, reports, &out_len, first) != reports) {
+    expanded = malloc(count * out_len);
+    if (!expanded)
+      return output_failed(ctx);
+    for (size_t i = 0; i < count; i++) {
+      uint8_t *dst = expanded + i * out_len;
+      size_t len = report_len;
+      const uint8_t *src =
+          encode_report(ctx, dev, role, boot + i * boot_len, &len, dst);
+      if (len != out_len) { /* mixed formats: one at a time */
+        free(expanded);
+        return send_each(ctx, role, boot, boot_len, 0, count, delays_us);
+      }
+      if (src != dst)
+        memcpy(dst, src, len);
+    }
+    reports = expanded;
+    report_len = out_len;
+  }
+
+  int queue_stats = ctx->opt[HID_OPT_QUEUE_STATS];
+  uint64_t t0 = queue_stats ? hid_monotonic_ns() : 0;
+  size_t done = hid_batch_submit(fd, reports, report_len, count, delays_us,
+                                 &ctx->timeline, sink_write, dev);
+  if (queue_stats) {
+    dev->out_blocked_ns += hid_monotonic_ns() - t0;
+    dev->out_reports += done;
+  }
+  free(expanded);
+  if (done == count)
+    return 0;
+  /* writev and io_uring give up on the first error; the report that failed
+   * goes again (waiting for the host) and the rest follow one by one */
+  if (host_gone(errno) && ctx->opt[HID_OPT_RECONNECT_MS] > 0)
+    return send_each(ctx, role, boot, boot_len, done, count, delays_us);
+  return output_failed(ctx);
+}
+
+int hid_ctx_flush(struct hid_ctx *ctx) {
+  int ret = 0;
+  for (int i = 0; i < ctx->ndev; i++) {
+    if (ctx->dev[i].queue && hid_queue_flush(ctx->dev[i].queue) != 0) {
+      errno = EIO; // the writer thread already gave up on a report
+      ret = -1;
+    }
+  }
+  if (hid_backend_flush(ctx->backend) != 0)
+    ret = -1;
+  return ret == 0 ? 0 : output_failed(ctx);
+}
+
+int hid_ctx_take_error(struct hid_ctx *ctx) {
+  int err = ctx->error;
+  ctx->error = 0;
+  return err;
+}
+
+/* Delays are barriers: everything queued so far reaches the host first */
+void hid_ctx_sleep(struct hid_ctx *ctx, int ms) {
+  hid_ctx_flush(ctx);
+  if (ms > 0)
+    hid_timeline_wait(&ctx->timeline, (uint64_t)ms * 1000000u);
+}
+
+void hid_ctx_get_stats(const struct hid_ctx *ctx, enum hid_role role,
+                       struct hid_stats *out) {
+  if ((unsigned)role < HID_ROLE_COUNT)
+    *out = role_dev_const(ctx, role)->stats;
+  else
+    memset(out, 0, sizeof(*out));
+}
+
+void hid_ctx_reset_stats(struct hid_ctx *ctx) {
+  for (int i = 0; i < ctx->ndev; i++)
+    memset(&ctx->dev[i].stats, 0, sizeof(ctx->dev[i].stats));
+  memset(&ctx->timeline.stats, 0, sizeof(ctx->timeline.stats));
+}
+
+void hid_ctx_get_timing(const struct hid_ctx *ctx,
+                        struct hid_timing_stats *out) {
+  *out = ctx->timeline.stats;
+}
+
+void hid_ctx_print_queue_stats(const struct hid_ctx *ctx, FILE *out) {
+  for (int i = 0; i < ctx->ndev; i++) {
+    const struct hid_dev *dev = &ctx->dev[i];
+    if (dev->out_reports == 0)
+      continue;
+    /* Extra registry devices go by their node name */
+    const char *name = i < HID_ROLE_COUNT || !dev->path
+                           ? (dev->composite ? "composite"
+                                             : hid_role_names[dev->role])
+                           : node_name(dev->path);
+    fprintf(out, "[HID-QUEUE] %s: %llu reports, producer blocked %.3f ms",
+            name, (unsigned long long)dev->out_reports,
+            dev->out_blocked_ns / 1e6);
+    if (dev->queue) {
+      struct hid_queue_stats st;
+      hid_queue_get_stats(dev->queue, &st);
+      fprintf(out,
+              " (stalls %llu / %.3f ms, flush %.3f ms), writer %.3f ms, "
+              "depth %u max %u/%u, errors %llu",
+              (unsigned long long)st.stalls, st.stall_ns / 1e6,
+              st.flush_ns / 1e6, st.write_ns / 1e6, st.depth, st.max_depth,
+              st.capacity, (unsigned long long)st.errors);
+      if (st.merged)
+        fprintf(out, ", merged %llu", (unsigned long long)st.merged);
+      if (st.gate_failures)
+        fprintf(out, ", gate failures %llu",
+                (unsigned long long)st.gate_failures);
+    }
+    fprintf(out, "\n");
+  }
+
+  struct hid_batch_stats bs;
+  hid_batch_get_stats(&bs);
+  if (bs.batches > 0) {
+    fprintf(out,
+            "[HID-BATCH] %s: %llu batches, %llu reports, %llu syscalls "
+            "(%.3f per report), %llu uring chains, %llu fallbacks\n",
+            hid_batch_mode_name(), (unsigned long long)bs.batches,
+            (unsigned long long)bs.reports, (unsigned long long)bs.syscalls,
+            bs.reports ? (double)bs.syscalls / bs.reports : 0.0,
+            (unsigned long long)bs.uring_chains,
+            (unsigned long long)bs.fallbacks);
+  }
+}
+// --- End Report Output Path ---
+
+// --- Key Tables ---
+/* Keyboard usage table - mapping ASCII characters to HID usage codes */
+static const uint8_t usage_table_us[128] = {
+    0,  0,  0,  0,
+    0,  0,  0,  0, /* 0-7 */
+    42, 43, 40, 0,
+    0,  0,  0,  0, /* 8-15 (Backspace, Tab, Enter) */
+    0,  0,  0,  0,
+    0,  0,  0,  0, /* 16-23 */
+    0,  0,  0,  41,
+    0,  0,  0,  0, /* 24-31 (Escape) */
+    44, 30, 52, 32,
+    33, 34, 35, 52, /* 32-39 (Space, !, ", #, $, %, &, ') */
+    38, 39, 37, 46,
+    54, 45, 55, 56, /* 40-47 ((, ), *, +, ,, -, ., /) */
+    39, 30, 31, 32,
+    33, 34, 35, 36, /* 48-55 (0-7) */
+    37, 38, 51, 51,
+    54, 46, 55, 56, /* 56-63 (8, 9, :, ;, <, =, >, ?) */
+    31, 4,  5,  6,
+    7,  8,  9,  10, /* 64-71 (@(Shift+2),A-G) */
+    11, 12, 13, 14,
+    15, 16, 17, 18, /* 72-79 (H-O) */
+    19, 20, 21, 22,
+    23, 24, 25, 26, /* 80-87 (P-W) */
+    27, 28, 29, 47,
+    49, 48, 33, 38, /* 88-95 (X-Z,[,\|],^ (Shift+6)) - Adjusted */
+    53, 4,  5,  6,
+    7,  8,  9,  10, /* 96-103 (`,a-g) */
+    11, 12, 13, 14,
+    15, 16, 17, 18, /* 104-111 (h-o) */
+    19, 20, 21, 22,
+    23, 24, 25, 26, /* 112-119 (p-w) */
+    27, 28, 29, 47,
+    49, 48, 53, 0 /* 120-127 (x-z,{,|,},~) - Adjusted */
+};
+
+/* Shift needed for these characters (US layout assumed) */
+static const char *shift_chars_us =
+    "!@#$%^&*()_+{}|:\"<>?~ABCDEFGHIJKLMNOPQRSTUVWXYZ";
+
+/* Function key mapping */
+struct fn_key {
+  const char *name;
+  uint8_t usage;
+};
+
+static const struct fn_key fn_keys[] = {
+    {"F1", 58},     {"F2", 59},        {"F3", 60},          {"F4", 61},
+    {"F5", 62},     {"F6", 63},        {"F7", 64},          {"F8", 65},
+    {"F9", 66},     {"F10", 67},       {"F11", 68},         {"F12", 69},
+    {"INSERT", 73}, {"HOME", 74},      {"PAGEUP", 75},      {"DELETE", 76},
+    {"END", 77},    {"PAGEDOWN", 78},  {"RIGHT", 79},       {"LEFT", 80},
+    {"DOWN", 81},   {"UP", 82},        {"NUMLOCK", 83},     {"ESC", 41},
+    {"TAB", 43},    {"CAPSLOCK", 57},  {"PRINTSCREEN", 70}, {"SCROLLLOCK", 71},
+    {"PAUSE", 72},  {"BACKSPACE", 42}, {"RETURN", 40},      {"ENTER", 40},
+    {"SPACE", 44},  {NULL, 0}};
+
+/* Consumer control key mapping */
+struct consumer_key {
+  const char *name;
+  uint16_t usage;
+};
+
+static const struct consumer_key consumer_keys[] = {
+    {"PLAY", 0x00B0},        {"PAUSE", 0x00B1},       {"RECORD", 0x00B2},
+    {"FORWARD", 0x00B3},     {"REWIND", 0x00B4},      {"NEXT", 0x00B5},
+    {"PREVIOUS", 0x00B6},    {"STOP", 0x00B7},        {"EJECT", 0x00B8},
+    {"MUTE", 0x00E2},        {"VOL+", 0x00E9},        {"VOL-", 0x00EA},
+    {"BRIGHTNESS+", 0x006F}, {"BRIGHTNESS-", 0x0070}, {NULL, 0}};
+
+int hid_ctx_set_locale(struct hid_ctx *ctx, const char *name) {
+  if (strcasecmp(name, "US") == 0) {
+    ctx->usage_table = usage_table_us;
+    ctx->shift_chars = shift_chars_us;
+    ctx->text_table_ready = 0;
+    return 0;
+  }
+  fprintf(stderr,
+          "[HID-HW] Locale '%s' not supported yet. Falling back to US.\n",
+          name);
+  return -1;
+}
+
+static const uint8_t *usage_table(const struct hid_ctx *ctx) {
+  return ctx->usage_table ? ctx->usage_table : usage_table_us;
+}
+
+static void build_text_table(struct hid_ctx *ctx) {
+  const uint8_t *usage = usage_table(ctx);
+  const char *shift = ctx->shift_chars ? ctx->shift_chars : shift_chars_us;
+
+  memset(ctx->text_table, 0, sizeof(ctx->text_table));
+  for (int c = 1; c < 128; c++) {
+    ctx->text_table[c].usage = usage[c];
+    if (usage[c] != 0 && strchr(shift, c))
+      ctx->text_table[c].mods = HID_MOD_SHIFT_LEFT;
+  }
+  ctx->text_table_ready = 1;
+}
+
+static inline const struct text_stroke *
+lookup_text_stroke(struct hid_ctx *ctx, unsigned char c) {
+  if (c >= 128)
+    return NULL;
+  if (!ctx->text_table_ready)
+    build_text_table(ctx);
+  return ctx->text_table[c].usage ? &ctx->text_table[c] : NULL;
+}
+
+/* Parses "CTRL-ALT-..." (see hid_ctx.h) */
+uint8_t hid_parse_modifiers(const char *mod_str, const char **remainder) {
+  uint8_t modifiers = 0;
+  if (remainder)
+    *remainder = mod_str;
+
+  char *mod_copy = strdup(mod_str);
+  if (!mod_copy)
+    return 0;
+
+  char *token = strtok(mod_copy, "-");
+
+  while (token != NULL) {
+    uint8_t m = 0;
+    if (strcasecmp(token, "CTRL") == 0 || strcasecmp(token, "CONTROL") == 0)
+      m = HID_MOD_CTRL_LEFT;
+    else if (strcasecmp(token, "SHIFT") == 0)
+      m = HID_MOD_SHIFT_LEFT;
+    else if (strcasecmp(token, "ALT") == 0)
+      m = HID_MOD_ALT_LEFT;
+    else if (strcasecmp(token, "GUI") == 0 || strcasecmp(token, "WIN") == 0 ||
+             strcasecmp(token, "META") == 0 || strcasecmp(token, "SUPER") == 0)
+      m = HID_MOD_GUI_LEFT;
+    else if (strcasecmp(token, "RCTRL") == 0 ||
+             strcasecmp(token, "RCONTROL") == 0)
+      m = HID_MOD_CTRL_RIGHT;
+    else if (strcasecmp(token, "RSHIFT") == 0)
+      m = HID_MOD_SHIFT_RIGHT;
+    else if (strcasecmp(token, "RALT") == 0)
+      m = HID_MOD_ALT_RIGHT;
+    else if (strcasecmp(token, "RGUI") == 0 || strcasecmp(token, "RWIN") == 0 ||
+             strcasecmp(token, "RMETA") == 0 ||
+             strcasecmp(token, "RSUPER") == 0)
+      m = HID_MOD_GUI_RIGHT;
+
+    if (m == 0) {
+      /* This token is not a modifier. */
+      if (remainder)
+        *remainder = mod_str + (token - mod_copy);
+      break;
+    }
+
+    modifiers |= m;
+
+    /* Move remainder to after this token and hyphen if present */
+    if (remainder) {
+      *remainder = mod_str + (token - mod_copy) + strlen(token);
+      if (**remainder == '-')
+        (*remainder)++;
+    }
+
+    token = strtok(NULL, "-");
+  }
+
+  free(mod_copy);
+  return modifiers;
+}
+
+uint8_t hid_fn_key_usage(const char *key_name) {
+  for (int i = 0; fn_keys[i].name != NULL; i++) {
+    if (strcasecmp(key_name, fn_keys[i].name) == 0)
+      return fn_keys[i].usage;
+  }
+  return 0;
+}
+
+uint16_t hid_consumer_key_usage(const char *key_name) {
+  for (int i = 0; consumer_keys[i].name != NULL; i++) {
+    if (strcasecmp(key_name, consumer_keys[i].name) == 0)
+      return consumer_keys[i].usage;
+  }
+  return 0;
+}
+
+/* Key name ("ENTER") or single ASCII character -> usage */
+static uint8_t get_key_code(const struct hid_ctx *ctx, const char *name) {
+  uint8_t usage = hid_fn_key_usage(name);
+  if (usage)
+    return usage;
+  if (strlen(name) == 1) {
+    unsigned char c = (unsigned char)name[0];
+    if (c < 128)
+      return usage_table(ctx)[c];
+  }
+  return 0;
+}
+// --- End Key Tables ---
+
+// --- Keyboard ---
+static int keyboard_ready(const struct hid_ctx *ctx) {
+  if (role_dev_const(ctx, HID_ROLE_KEYBOARD)->path ||
+      !hid_backend_needs_fd(ctx->backend))
+    return 1;
+  errno = ENODEV;
+  return 0;
+}
+
+int hid_ctx_send_keyboard_report(struct hid_ctx *ctx, uint8_t modifiers,
+                                 const uint8_t keys[6]) {
+  if (!keyboard_ready(ctx))
+    return -1;
+  uint8_t report[HID_KEYBOARD_REPORT_SIZE] = {modifiers, 0};
+  if (keys)
+    memcpy(report + 2, keys, 6);
+  return hid_ctx_send_report(ctx, HID_ROLE_KEYBOARD, report, sizeof(report));
+}
+
+int hid_ctx_send_consumer_key(struct hid_ctx *ctx, const char *action) {
+  uint16_t usage = hid_consumer_key_usage(action);
+  if (usage == 0) {
+    errno = EINVAL;
+    return -1;
+  }
+  if (hid_ctx_open(ctx, HID_ROLE_CONSUMER) != 0)
+    return -1;
+
+  uint8_t report[HID_CONSUMER_REPORT_SIZE] = {usage & 0xFF,
+                                              (usage >> 8) & 0xFF};
+  if (hid_ctx_send_report(ctx, HID_ROLE_CONSUMER, report, sizeof(report)) != 0)
+    return -1;
+  hid_ctx_tap_hold(ctx, 50000); // 50ms tap
+  memset(report, 0, sizeof(report));
+  return hid_ctx_send_report(ctx, HID_ROLE_CONSUMER, report, sizeof(report));
+}
+
+int hid_ctx_send_key_sequence(struct hid_ctx *ctx, const char *modifiers_str,
+                              const char *sequence) {
+  if (!keyboard_ready(ctx))
+    return -1;
+
+  // Check if the entire sequence is a consumer key first
+  if (sequence && hid_consumer_key_usage(sequence) != 0)
+    return hid_ctx_send_consumer_key(ctx, sequence);
+
+  if (hid_ctx_open(ctx, HID_ROLE_KEYBOARD) != 0)
+    return -1;
+
+  uint8_t modifiers = 0;
+  if (modifiers_str)
+    modifiers = hid_parse_modifiers(modifiers_str, NULL);
+
+  uint8_t report[HID_KEYBOARD_REPORT_SIZE] = {0};
+  report[0] = modifiers;
+
+  if (sequence == NULL || strlen(sequence) == 0) {
+    /* Just send modifiers */
+    hid_ctx_send_report(ctx, HID_ROLE_KEYBOARD, report, sizeof(report));
+    return 0;
+  }
+
+  /* Check for function key */
+  uint8_t fn_usage = hid_fn_key_usage(sequence);
+  if (fn_usage != 0) {
+    report[2] = fn_usage;
+    hid_ctx_send_report(ctx, HID_ROLE_KEYBOARD, report, sizeof(report));
+    /* Release if it's a one-shot */
+    report[2] = 0;
+    hid_ctx_send_report(ctx, HID_ROLE_KEYBOARD, report, sizeof(report));
+  } else {
+    /* Regular text */
+    for (const char *p = sequence; *p; p++) {
+      const struct text_stroke *ks = lookup_text_stroke(ctx, (unsigned char)*p);
+
+      if (ks) {
+        report[0] = modifiers | ks->mods;
+        report[2] = ks->usage;
+        hid_ctx_send_report(ctx, HID_ROLE_KEYBOARD, report, sizeof(report));
+
+        /* Release */
+        report[0] = modifiers;
+        report[2] = 0;
+        hid_ctx_send_report(ctx, HID_ROLE_KEYBOARD, report, sizeof(report));
+      }
+    }
+  }
+
+  /* Final release if modifiers were used and it's not a holding operation */
+  if (modifiers != 0) {
+    report[0] = 0;
+    report[2] = 0;
+    hid_ctx_send_report(ctx, HID_ROLE_KEYBOARD, report, sizeof(report));
+  }
+
+  return 0;
+}
+
+static const struct text_stroke *
+text_stroke_or_warn(struct hid_ctx *ctx, char c, int warn_unmapped) {
+  const struct text_stroke *ks = lookup_text_stroke(ctx, (unsigned char)c);
+  if (!ks && warn_unmapped)
+    fprintf(stderr,
+            "Warning: Character '%c' (ASCII %d) not mapped to HID usage "
+            "code.\n",
+            c, (unsigned char)c);
+  return ks;
+}
+
+/* Encodes text as press/release report pairs (release keeps base_mods).
+ * marks[i] is set on the report that completes a keystroke, i.e. where a
+ * per-key delay belongs. Returns the number of reports. */
+static size_t encode_text(struct hid_ctx *ctx, const char *buf, size_t len,
+                          uint8_t base_mods, uint8_t *out, uint8_t *marks,
+                          int warn_unmapped) {
+  size_t n = 0;
+  for (size_t i = 0; i < len; i++) {
+    const struct text_stroke *ks =
+        text_stroke_or_warn(ctx, buf[i], warn_unmapped);
+    if (!ks)
+      continue;
+    uint8_t *press = out + n++ * HID_KEYBOARD_REPORT_SIZE;
+    uint8_t *release = out + n++ * HID_KEYBOARD_REPORT_SIZE;
+    memset(press, 0, 2 * HID_KEYBOARD_REPORT_SIZE);
+    press[0] = base_mods | ks->mods;
+    press[2] = ks->usage;
+    release[0] = base_mods;
+    if (marks) {
+      marks[n - 2] = 0;
+      marks[n - 1] = 1;
+    }
+  }
+  return n;
+}
+
+/* Encodes text as overlapping strokes (see ROLLOVER_MAX_DELAY_MS). The last
+ * key is left pressed; the caller appends the final release. */
+static size_t encode_text_rollover(struct hid_ctx *ctx, const char *buf,
+                                   size_t len, uint8_t base_mods, uint8_t *out,
+                                   uint8_t *marks, int warn_unmapped) {
+  size_t n = 0;
+  uint8_t cur_mods = base_mods;
+  uint8_t held = 0;
+
+  for (size_t i = 0; i < len; i++) {
+    const struct text_stroke *ks =
+        text_stroke_or_warn(ctx, buf[i], warn_unmapped);
+    if (!ks)
+      continue;
+    uint8_t mods = base_mods | ks->mods;
+
+    if ((cur_mods & ~mods) || held == ks->usage) {
+      uint8_t *up = out + n * HID_KEYBOARD_REPORT_SIZE;
+      memset(up, 0, HID_KEYBOARD_REPORT_SIZE);
+      up[0] = mods;
+      if (marks)
+        marks[n] = 0;
+      n++;
+      held = 0;
+    }
+
+    uint8_t *press = out + n * HID_KEYBOARD_REPORT_SIZE;
+    memset(press, 0, HID_KEYBOARD_REPORT_SIZE);
+    press[0] = mods;
+    press[2] = held ? held : ks->usage;
+    press[3] = held ? ks->usage : 0;
+    if (marks)
+      marks[n] = 1;
+    n++;
+    cur_mods = mods;
+    held = ks->usage;
+  }
+  return n;
+}
+
+/* Encodes with the configured engine. Returns the number of reports; the
+ * output always ends with every key released and only base_mods down. out
+ * and marks must hold TEXT_REPORTS_MAX(len) entries. */
+static size_t encode_keystrokes(struct hid_ctx *ctx, const char *buf,
+                                size_t len, uint8_t base_mods,
+                                int max_delay_ms, uint8_t *out, uint8_t *marks,
+                                int warn_unmapped) {
+  if (!ctx->opt[HID_OPT_TYPING_ROLLOVER] ||
+      max_delay_ms > ROLLOVER_MAX_DELAY_MS)
+    return encode_text(ctx, buf, len, base_mods, out, marks, warn_unmapped);
+
+  size_t n = encode_text_rollover(ctx, buf, len, base_mods, out, marks,
+                                  warn_unmapped);
+  if (n > 0) {
+    uint8_t *release = out + n * HID_KEYBOARD_REPORT_SIZE;
+    memset(release, 0, HID_KEYBOARD_REPORT_SIZE);
+    release[0] = base_mods;
+    if (marks)
+      marks[n] = 0;
+    n++;
+  }
+  return n;
+}
+
+/* Encodes text and submits it as one batch: a single writev without delays,
+ * an io_uring chain with them. Each completed keystroke is followed by
+ * delay_ms + rand(0..fuzz_ms). */
+static int type_text(struct hid_ctx *ctx, const char *buf, size_t len,
+                     uint8_t base_mods, int delay_ms, int fuzz_ms,
+                     int warn_unmapped) {
+  size_t cap = TEXT_REPORTS_MAX(len);
+  uint8_t *reports = malloc(cap * HID_KEYBOARD_REPORT_SIZE);
+  uint8_t *marks = malloc(cap);
+  uint32_t *delays = delay_ms > 0 ? calloc(cap, sizeof(uint32_t)) : NULL;
+  if (!reports || !marks || (delay_ms > 0 && !delays)) {
+    free(reports);
+    free(marks);
+    free(delays);
+    return -1;
+  }
+
+  size_t count = encode_keystrokes(ctx, buf, len, base_mods, delay_ms + fuzz_ms,
+                                   reports, marks, warn_unmapped);
+  if (delays) {
+    for (size_t i = 0; i < count; i++) {
+      if (!marks[i])
+        continue;
+      /* In microseconds, clamped to what a delay slot holds (~71 min) */
+      uint64_t us = ((uint64_t)delay_ms +
+                     (fuzz_ms > 0 ? (uint64_t)rand() % ((uint64_t)fuzz_ms + 1)
+                                  : 0)) *
+                    1000u;
+      delays[i] = us > UINT32_MAX ? UINT32_MAX : (uint32_t)us;
+    }
+  }
+  int ret = hid_ctx_send_reports(ctx, HID_ROLE_KEYBOARD, reports,
+                                 HID_KEYBOARD_REPORT_SIZE, count, delays);
+  free(reports);
+  free(marks);
+  free(delays);
+  return ret;
+}
+
+/* Type raw text through the precomputed stroke table. Unlike
+ * hid_ctx_send_key_sequence, no key-name matching is attempted: every byte
+ * is a literal character and unmapped bytes are skipped. */
+int hid_ctx_send_text(struct hid_ctx *ctx, const char *buf, size_t len) {
+  return hid_ctx_send_text_delayed(ctx, buf, len, 0, 0);
+}
+
+int hid_ctx_send_text_delayed(struct hid_ctx *ctx, const char *buf,
+                              size_t len, int delay_ms, int fuzz_ms) {
+  if (!keyboard_ready(ctx))
+    return -1;
+  if (len == 0)
+    return 0;
+  return type_text(ctx, buf, len, 0, delay_ms, fuzz_ms, 0);
+}
+
+int hid_ctx_send_keys(struct hid_ctx *ctx, uint8_t modifiers, const char *buf,
+                      size_t len, int delay_ms) {
+  if (!keyboard_ready(ctx))
+    return -1;
+  if (type_text(ctx, buf, len, modifiers, delay_ms, 0, 1) != 0)
+    return -1;
+
+  uint8_t report[HID_KEYBOARD_REPORT_SIZE] = {modifiers};
+  // Ensure a final release with only explicit modifiers is sent.
+  if (len > 0 &&
+      hid_ctx_send_report(ctx, HID_ROLE_KEYBOARD, report, sizeof(report)) != 0)
+    return -1;
+  /* Ensure FULL release including modifiers */
+  if (modifiers != 0) {
+    report[0] = 0;
+    hid_ctx_send_report(ctx, HID_ROLE_KEYBOARD, report, sizeof(report));
+  }
+  return 0;
+}
+
+int hid_ctx_press_keys(struct hid_ctx *ctx, uint8_t modifiers,
+                       const char *buf, size_t len) {
+  if (!keyboard_ready(ctx))
+    return -1;
+  uint8_t report[HID_KEYBOARD_REPORT_SIZE] = {0};
+  for (size_t i = 0; i < len; i++) {
+    const struct text_stroke *ks = text_stroke_or_warn(ctx, buf[i], 1);
+    if (!ks)
+      continue;
+    /* Set modifiers (explicit + shift if needed) and key in report */
+    report[0] = modifiers | ks->mods;
+    report[2] = ks->usage;
+    if (hid_ctx_send_report(ctx, HID_ROLE_KEYBOARD, report, sizeof(report)) !=
+        0)
+      return -1;
+  }
+  return 0;
+}
+
+static int send_held_state(struct hid_ctx *ctx) {
+  if (ctx->opt[HID_OPT_KEYBOARD_NKRO]) {
+    uint8_t report[HID_KEYBOARD_NKRO_REPORT_SIZE];
+    report[0] = ctx->held_mods;
+    memcpy(report + 1, ctx->held_bitmap, NKRO_BITMAP_BYTES);
+    return hid_ctx_send_report(ctx, HID_ROLE_KEYBOARD, report, sizeof(report));
+  }
+  return hid_ctx_send_keyboard_report(ctx, ctx->held_mods, ctx->held_keys);
+}
+
+int hid_ctx_hold_key(struct hid_ctx *ctx, const char *key_name) {
+  if (strcasecmp(key_name, "CTRL") == 0)
+    ctx->held_mods |= (HID_MOD_CTRL_LEFT);
+  else if (strcasecmp(key_name, "SHIFT") == 0)
+    ctx->held_mods |= (HID_MOD_SHIFT_LEFT);
+  else if (strcasecmp(key_name, "ALT") == 0)
+    ctx->held_mods |= (HID_MOD_ALT_LEFT);
+  else if (strcasecmp(key_name, "GUI") == 0 ||
+           strcasecmp(key_name, "WINDOWS") == 0)
+    ctx->held_mods |= (HID_MOD_GUI_LEFT);
+  else {
+    uint8_t code = get_key_code(ctx, key_name);
+    if (code && ctx->opt[HID_OPT_KEYBOARD_NKRO]) {
+      nkro_set(ctx->held_bitmap, code, 1);
+    } else if (code) {
+      for (int i = 0; i < 6; i++) {
+        if (ctx->held_keys[i] == 0) {
+          ctx->held_keys[i] = code;
+          break;
+        }
+      }
+    }
+  }
+  send_held_state(ctx);
+  return 0;
+}
+
+int hid_ctx_release_key(struct hid_ctx *ctx, const char *key_name) {
+  if (strcasecmp(key_name, "CTRL") == 0)
+    ctx->held_mods &= ~(HID_MOD_CTRL_LEFT);
+  else if (strcasecmp(key_name, "SHIFT") == 0)
+    ctx->held_mods &= ~(HID_MOD_SHIFT_LEFT);
+  else if (strcasecmp(key_name, "ALT") == 0)
+    ctx->held_mods &= ~(HID_MOD_ALT_LEFT);
+  else if (strcasecmp(key_name, "GUI") == 0)
+    ctx->held_mods &= ~(HID_MOD_GUI_LEFT);
+  else {
+    uint8_t code = get_key_code(ctx, key_name);
+    if (code && ctx->opt[HID_OPT_KEYBOARD_NKRO]) {
+      nkro_set(ctx->held_bitmap, code, 0);
+    } else if (code) {
+      for (int i = 0; i < 6; i++) {
+        if (ctx->held_keys[i] == code)
+          ctx->held_keys[i] = 0;
+      }
+    }
+  }
+  send_held_state(ctx);
+  /* RELEASE is a barrier: the key is up on the host when we return */
+  return hid_ctx_flush(ctx);
+}
+
+int hid_ctx_release_all_keys(struct hid_ctx *ctx) {
+  ctx->held_mods = 0;
+  memset(ctx->held_keys, 0, sizeof(ctx->held_keys));
+  memset(ctx->held_bitmap, 0, sizeof(ctx->held_bitmap));
+  send_held_state(ctx);
+  return hid_ctx_flush(ctx);
+}
+// --- End Keyboard ---
+
+// --- Mouse ---
+#define MOUSE_REPORT_MAX 8
+
+static inline int mouse_wide(const struct hid_ctx *ctx) {
+  return ctx->opt[HID_OPT_MOUSE_REPORT_SIZE] >= HID_MOUSE_WIDE_REPORT_SIZE;
+}
+
+/* Mouse reports: buttons, X, Y, wheel and, when enabled, AC Pan. X and Y
+ * are one byte each, or 16-bit little endian with the wide descriptor
+ * (HID_MOUSE_WIDE_REPORT_SIZE). Returns the report size. */
+static size_t encode_mouse(const struct hid_ctx *ctx, uint8_t *report,
+                           uint8_t buttons, int x, int y, int8_t wheel,
+                           int8_t hwheel) {
+  size_t size = (size_t)ctx->opt[HID_OPT_MOUSE_REPORT_SIZE];
+  uint8_t *p = report;
+  memset(report, 0, MOUSE_REPORT_MAX);
+  *p++ = buttons;
+  if (mouse_wide(ctx)) {
+    *p++ = (uint8_t)x;
+    *p++ = (uint8_t)((uint16_t)x >> 8);
+    *p++ = (uint8_t)y;
+    *p++ = (uint8_t)((uint16_t)y >> 8);
+  } else {
+    *p++ = (uint8_t)x;
+    *p++ = (uint8_t)y;
+  }
+  *p++ = (uint8_t)wheel;
+  if ((size_t)(p - report) < size)
+    *p = (uint8_t)hwheel;
+  return size;
+}
+
+int hid_ctx_send_mouse_report(struct hid_ctx *ctx, uint8_t buttons, int8_t x,
+                              int8_t y, int8_t wheel, int8_t hwheel) {
+  uint8_t report[MOUSE_REPORT_MAX];
+  size_t size = encode_mouse(ctx, report, buttons, x, y, wheel, hwheel);
+  return hid_ctx_send_report(ctx, HID_ROLE_MOUSE, report, size);
+}
+
+int hid_ctx_send_mouse_move(struct hid_ctx *ctx, int8_t x, int8_t y) {
+  return hid_ctx_send_mouse_report(ctx, 0, x, y, 0, 0);
+}
+
+int hid_ctx_send_mouse_press(struct hid_ctx *ctx, uint8_t buttons) {
+  return hid_ctx_send_mouse_report(ctx, buttons, 0, 0, 0, 0);
+}
+
+int hid_ctx_send_mouse_release(struct hid_ctx *ctx) {
+  return hid_ctx_send_mouse_report(ctx, 0, 0, 0, 0, 0);
+}
+
+int hid_ctx_send_mouse_click(struct hid_ctx *ctx, uint8_t buttons) {
+  if (hid_ctx_send_mouse_press(ctx, buttons) != 0)
+    return -1;
+  hid_ctx_tap_hold(ctx, 30000); // 30ms
+  return hid_ctx_send_mouse_release(ctx);
+}
+
+/* Reports built per call; longer moves go out in several batches */
+#define MOTION_BATCH 64
+
+/* Largest motion one report may carry on either axis */
+static int64_t motion_limit(const struct hid_ctx *ctx) {
+  int64_t limit = mouse_wide(ctx) ? HID_MOUSE_WIDE_DELTA_MAX
+                                  : HID_MOUSE_DELTA_MAX;
+  int step_max = ctx->opt[HID_OPT_MOUSE_STEP_MAX];
+  return step_max > 0 && step_max < limit ? step_max : limit;
+}
+
+int hid_ctx_send_mouse_motion(struct hid_ctx *ctx, uint8_t buttons,
+                              int32_t dx, int32_t dy) {
+  int64_t limit = motion_limit(ctx);
+  int64_t ax = dx < 0 ? -(int64_t)dx : dx, ay = dy < 0 ? -(int64_t)dy : dy;
+  int64_t longest = ax > ay ? ax : ay;
+  int64_t steps = longest == 0 ? 1 : (longest + limit - 1) / limit;
+
+  /* After step i (1..steps) the cursor is at d * i / steps, truncated
+   * toward zero: consecutive positions differ by at most limit, and the
+   * last one is exactly (dx, dy) */
+  uint8_t batch[MOTION_BATCH * MOUSE_REPORT_MAX];
+  size_t size = (size_t)ctx->opt[HID_OPT_MOUSE_REPORT_SIZE], n = 0;
+  int64_t px = 0, py = 0;
+  for (int64_t i = 1; i <= steps; i++) {
+    int64_t x = (int64_t)dx * i / steps, y = (int64_t)dy * i / steps;
+    encode_mouse(ctx, batch + n * size, buttons, (int)(x - px),
+                 (int)(y - py), 0, 0);
+    px = x;
+    py = y;
+    if (++n == MOTION_BATCH || i == steps) {
+      if (hid_ctx_send_reports(ctx, HID_ROLE_MOUSE, batch, size, n, NULL) != 0)
+        return -1;
+      n = 0;
+    }
+  }
+  return 0;
+}
+
+/* HID_OPT_MOUSE_COALESCE (see hid_ctx.h): merging into the newest queued
+ * report. A report that changes the buttons opens no window of its own:
+ * motion after a press must not be sent along with it, nor moved before
+ * it. */
+static void decode_mouse(const struct hid_ctx *ctx, const uint8_t *p,
+                         int64_t d[4]) {
+  if (mouse_wide(ctx)) {
+    d[0] = (int16_t)(p[1] | p[2] << 8);
+    d[1] = (int16_t)(p[3] | p[4] << 8);
+    p += 5;
+  } else {
+    d[0] = (int8_t)p[1];
+    d[1] = (int8_t)p[2];
+    p += 3;
+  }
+  size_t size = (size_t)ctx->opt[HID_OPT_MOUSE_REPORT_SIZE];
+  d[2] = (int8_t)p[0];
+  d[3] = size == HID_MOUSE_REPORT_SIZE + 1 ||
+                 size == HID_MOUSE_WIDE_REPORT_SIZE + 1
+             ? (int8_t)p[1]
+             : 0;
+}
+
+static int merge_mouse(void *arg, uint8_t *queued, size_t queued_len,
+                       const void *report, size_t len) {
+  const struct hid_dev *dev = arg;
+  const struct hid_ctx *ctx = dev->ctx;
+  const uint8_t *r = report;
+  size_t id = dev->composite;
+  if (queued_len != len || (id && queued[0] != HID_REPORT_ID_MOUSE) ||
+      queued[id] != r[id])
+    return 0;
+
+  int64_t a[4], b[4];
+  int64_t limit[4] = {motion_limit(ctx), motion_limit(ctx),
+                      HID_MOUSE_DELTA_MAX, HID_MOUSE_DELTA_MAX};
+  decode_mouse(ctx, queued + id, a);
+  decode_mouse(ctx, r + id, b);
+  for (int i = 0; i < 4; i++) {
+    a[i] += b[i];
+    if (a[i] > limit[i] || a[i] < -limit[i])
+      return 0;
+  }
+  uint8_t merged[MOUSE_REPORT_MAX];
+  encode_mouse(ctx, merged, r[id], (int)a[0], (int)a[1], (int8_t)a[2],
+               (int8_t)a[3]);
+  memcpy(queued + id, merged, len - id);
+  return 1;
+}
+
+static int queue_mouse(struct hid_dev *dev, const uint8_t *report,
+                       size_t len) {
+  uint8_t buttons = report[dev->composite];
+  int ret = dev->mouse_open && buttons == dev->mouse_buttons
+                ? hid_queue_push_merge(dev->queue, report, len, merge_mouse,
+                                       dev)
+                : hid_queue_push(dev->queue, report, len);
+  dev->mouse_open = buttons == dev->mouse_buttons;
+  dev->mouse_buttons = buttons;
+  return ret;
+}
+
+/* The writer takes the next report once the host has polled the last one,
+ * not earlier, to sit blocked in write() with it */
+static int endpoint_gate(void *arg, int fd) {
+  const struct hid_dev *dev = arg;
+  if (fd < 0 || !hid_backend_is_device(dev->ctx->backend))
+    return 0;
+  struct pollfd pfd = {.fd = fd, .events = POLLOUT};
+  int r;
+  while ((r = poll(&pfd, 1, dev->ctx->opt[HID_OPT_PACING_TIMEOUT_MS])) < 0 &&
+         errno == EINTR)
+    ;
+  if (r == 0) {
+    errno = ETIMEDOUT; // host stopped polling the endpoint
+    return -1;
+  }
+  if (r < 0)
+    return -1;
+  if (pfd.revents & (POLLERR | POLLHUP | POLLNVAL)) {
+    errno = pfd.revents & POLLNVAL ? EBADF : EIO;
+    return -1;
+  }
+  return 0;
+}
+
+/* f_hid's interrupt endpoint asks for bInterval 10 (10 ms) at full speed
+ * and 4 (2^3 microframes, 1 ms) at high speed and above */
+#define MOUSE_INTERVAL_FS_US 10000
+#define MOUSE_INTERVAL_HS_US 1000
+
+/* HID_OPT_MOUSE_INTERVAL_US, else the interval the UDC's current speed
+ * implies (HID_SYSROOT/sys/class/udc/<udc>/current_speed) */
+static uint32_t mouse_interval_us(const struct hid_ctx *ctx) {
+  if (ctx->opt[HID_OPT_MOUSE_INTERVAL_US] > 0)
+    return (uint32_t)ctx->opt[HID_OPT_MOUSE_INTERVAL_US];
+  const char *root = hid_sysroot();
+  char path[PATH_MAX], speed[32] = "";
+  snprintf(path, sizeof(path), "%s" UDC_CLASS_DIR, root);
+  DIR *dir = opendir(path);
+  struct dirent *de;
+  while (dir && !*speed && (de = readdir(dir))) {
+    if (de->d_name[0] == '.')
+      continue;
+    snprintf(path, sizeof(path), "%s" UDC_CLASS_DIR "/%s/current_speed", root,
+             de->d_name);
+    FILE *f = fopen(path, "r");
+    if (f) {
+      if (!fgets(speed, sizeof(speed), f))
+        *speed = 0;
+      fclose(f);
+    }
+  }
+  if (dir)
+    closedir(dir);
+  return strncmp(speed, "full-speed", 10) == 0 ||
+                 strncmp(speed, "low-speed", 9) == 0
+             ? MOUSE_INTERVAL_FS_US
+             : MOUSE_INTERVAL_HS_US;
+}
+
+/* Motion sampled over time: mouse paths and smooth scrolling */
+enum { AXIS_X, AXIS_Y, AXIS_WHEEL, AXIS_PAN, AXIS_COUNT };
+typedef void (*motion_sampler)(const void *arg, double t,
+                               double at[AXIS_COUNT]);
+
+/* Report i of steps carries what sample(i / steps) adds to the counts sent
+ * so far, rounded, and is due one polling interval after report i - 1.
+ * Samples that round to no motion send nothing; their interval goes to the
+ * report before them (or, before the first one, is waited out right away).
+ * What the per-report limits held back follows at the end. */
+static int send_sampled(struct hid_ctx *ctx, uint8_t buttons,
+                        int duration_ms, motion_sampler sample,
+                        const void *arg) {
+  uint32_t interval = mouse_interval_us(ctx);
+  int64_t steps = (int64_t)duration_ms * 1000 / interval;
+  if (steps < 1)
+    steps = 1;
+  int64_t limit[AXIS_COUNT] = {motion_limit(ctx), motion_limit(ctx),
+                               HID_MOUSE_DELTA_MAX, HID_MOUSE_DELTA_MAX};
+  double end[AXIS_COUNT] = {0};
+  sample(arg, 1, end);
+
+  uint8_t batch[MOTION_BATCH * MOUSE_REPORT_MAX];
+  uint32_t delays[MOTION_BATCH];
+  size_t size = (size_t)ctx->opt[HID_OPT_MOUSE_REPORT_SIZE], n = 0;
+  int64_t sent[AXIS_COUNT] = {0};
+  uint64_t lead_us = 0;
+  for (int64_t i = 1;; i++) {
+    double at[AXIS_COUNT] = {0};
+    if (i <= steps)
+      sample(arg, (double)i / (double)steps, at);
+    else
+      memcpy(at, end, sizeof(at));
+    int64_t d[AXIS_COUNT];
+    int moved = 0;
+    for (int a = 0; a < AXIS_COUNT; a++) {
+      d[a] = llround(at[a]) - sent[a];
+      d[a] = d[a] > limit[a] ? limit[a] : d[a] < -limit[a] ? -limit[a] : d[a];
+      moved |= d[a] != 0;
+    }
+    uint32_t due = i < steps ? interval : 0;
+    if (!moved) {
+      if (i >= steps)
+        break;
+      if (n > 0)
+        delays[n - 1] += due;
+      else
+        lead_us += due;
+      continue;
+    }
+    if (n == MOTION_BATCH) {
+      if (hid_ctx_send_reports(ctx, HID_ROLE_MOUSE, batch, size, n,
+                               delays) != 0)
+        return -1;
+      n = 0;
+    }
+    if (n == 0 && lead_us > 0) {
+      hid_ctx_flush(ctx);
+      hid_timeline_wait(&ctx->timeline, lead_us * 1000u);
+      lead_us = 0;
+    }
+    encode_mouse(ctx, batch + n * size, buttons, (int)d[AXIS_X],
+                 (int)d[AXIS_Y], (int8_t)d[AXIS_WHEEL], (int8_t)d[AXIS_PAN]);
+    delays[n++] = due;
+    for (int a = 0; a < AXIS_COUNT; a++)
+      sent[a] += d[a];
+  }
+  if (n > 0 &&
+      hid_ctx_send_reports(ctx, HID_ROLE_MOUSE, batch, size, n, delays) != 0)
+    return -1;
+  if (lead_us > 0) {
+    hid_ctx_flush(ctx);
+    hid_timeline_wait(&ctx->timeline, lead_us * 1000u);
+  }
+  return 0;
+}
+
+static void path_sample(const void *arg, double t, double at[AXIS_COUNT]) {
+  hid_path_point(arg, t, &at[AXIS_X], &at[AXIS_Y]);
+}
+
+int hid_ctx_send_mouse_path(struct hid_ctx *ctx, uint8_t buttons,
+                            const struct hid_path *path) {
+  if (!path || path->npoints < 1) {
+    errno = EINVAL;
+    return -1;
+  }
+  return send_sampled(ctx, buttons, path->duration_ms, path_sample, path);
+}
+
+int hid_ctx_send_mouse_scroll(struct hid_ctx *ctx, int8_t wheel,
+                              int8_t hwheel) {
+  // Vertical scroll always at byte 3; horizontal at byte 4 when enabled
+  if (!ctx->opt[HID_OPT_MOUSE_HSCROLL])
+    hwheel = 0;
+  return hid_ctx_send_mouse_report(ctx, 0, 0, 0, wheel, hwheel);
+}
+
+/* A straight glide of the wheel and pan counts */
+static void wheel_sample(const void *arg, double t, double at[AXIS_COUNT]) {
+  const double *counts = arg;
+  at[AXIS_WHEEL] = counts[0] * t;
+  at[AXIS_PAN] = counts[1] * t;
+}
+
+int hid_ctx_send_mouse_wheel(struct hid_ctx *ctx, double v, double h,
+                             int duration_ms) {
+  int multiplier = ctx->opt[HID_OPT_WHEEL_MULTIPLIER];
+  double counts[2] = {v * multiplier,
+                      ctx->opt[HID_OPT_MOUSE_HSCROLL] ? h * multiplier : 0};
+  if (!isfinite(v) || !isfinite(h) || duration_ms < 0 ||
+      fabs(counts[0]) > INT32_MAX || fabs(counts[1]) > INT32_MAX) {
+    errno = EINVAL;
+    return -1;
+  }
+  return send_sampled(ctx, 0, duration_ms, wheel_sample, counts);
+}
+// --- End Mouse ---
+
+// --- Absolute Pointer ---
+/* HID_ROLE_ABSOLUTE: a pointer whose X and Y are positions, not deltas, in
+ * 0..HID_ABSOLUTE_MAX across the screen (tablet style, absolute-desc.bin).
+ * Hosts apply no acceleration to it, so one report lands exactly where it
+ * says. With a screen size set, pixels are scaled so that the last pixel of
+ * each axis maps to HID_ABSOLUTE_MAX. */
+static int screen_extent(const struct hid_ctx *ctx, int axis) {
+  int px = ctx->opt[axis ? HID_OPT_SCREEN_HEIGHT : HID_OPT_SCREEN_WIDTH];
+  return px > 0 ? px - 1 : HID_ABSOLUTE_MAX;
+}
+
+static uint16_t absolute_axis(const struct hid_ctx *ctx, int axis, int pos) {
+  int extent = screen_extent(ctx, axis);
+  if (pos <= 0 || extent == 0)
+    return 0;
+  if (pos >= extent)
+    return HID_ABSOLUTE_MAX;
+  if (extent == HID_ABSOLUTE_MAX)
+    return (uint16_t)pos;
+  return (uint16_t)(((int64_t)pos * HID_ABSOLUTE_MAX + extent / 2) / extent);
+}
+
+int hid_ctx_send_absolute(struct hid_ctx *ctx, uint8_t buttons, int x, int y) {
+  uint16_t ax = absolute_axis(ctx, 0, x), ay = absolute_axis(ctx, 1, y);
+  const uint8_t report[HID_ABSOLUTE_REPORT_SIZE] = {
+      buttons, (uint8_t)ax, (uint8_t)(ax >> 8), (uint8_t)ay,
+      (uint8_t)(ay >> 8)};
+  return hid_ctx_send_report(ctx, HID_ROLE_ABSOLUTE, report, sizeof(report));
+}
+
+int hid_ctx_parse_coordinate(const struct hid_ctx *ctx, int axis,
+                             const char *s, int *out) {
+  char *end;
+  errno = 0;
+  if (strchr(s, '%')) {
+    double pct = strtod(s, &end);
+    if (end == s || strcmp(end, "%") != 0 || errno || !isfinite(pct) ||
+        pct < 0 || pct > 100) {
+      errno = EINVAL;
+      return -1;
+    }
+    *out = (int)(pct / 100.0 * screen_extent(ctx, axis) + 0.5);
+    return 0;
+  }
+  long v = strtol(s, &end, 10);
+  if (end == s || *end || errno || v < INT_MIN || v > INT_MAX) {
+    errno = EINVAL;
+    return -1;
+  }
+  *out = (int)v;
+  return 0;
+}
+// --- End Absolute Pointer ---
@@ -0,0 +1,410 @@
+/*
+ * hid-daemon.c - UNIX-socket command server and its thin client.
+ *
+ * Wire format (one SOCK_SEQPACKET message per request):
+ *   "HGD1" | u32 argc | u32 envc | argc NUL-terminated args |
+ *   envc NUL-terminated "NAME=value" entries
+ * with the client's fds 0, 1, 2 and its working directory attached as
+ * SCM_RIGHTS, so relative script paths resolve as they would locally. The
+ * reply is a single i32 exit status. A connection may carry any number of
+ * requests.
+ */
+
+#define _GNU_SOURCE
+#include "../include/hid_daemon.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#define DAEMON_MAGIC "HGD1"
+#define DAEMON_MSG_MAX 65536
+#define DAEMON_MAX_ARGS 256
+#define DAEMON_MAX_ENV 64
+#define DAEMON_FDS 4 /* stdin, stdout, stderr, cwd */
+
+struct request_header {
+  char magic[4];
+  uint32_t argc;
+  uint32_t envc;
+};
+
+extern char **environ;
+
+static volatile sig_atomic_t g_stop = 0;
+static int g_shared_fd = -1;
+
+static void on_stop_signal(int sig) {
+  (void)sig;
+  g_stop = 1;
+}
+
+const char *hid_daemon_socket_path(const char *explicit_path) {
+  if (explicit_path && *explicit_path)
+    return explicit_path;
+  const char *env = getenv("HID_SOCKET");
+  if (env && *env)
+    return env;
+  return HID_DAEMON_DEFAULT_SOCKET;
+}
+
+static int make_addr(const char *path, struct sockaddr_un *addr) {
+  memset(addr, 0, sizeof(*addr));
+  addr->sun_family = AF_UNIX;
+  if (strlen(path) >= sizeof(addr->sun_path)) {
+    errno = ENAMETOOLONG;
+    return -1;
+  }
+  strcpy(addr->sun_path, path);
+  return 0;
+}
+
+static int connect_socket(const char *path) {
+  struct sockaddr_un addr;
+  if (make_addr(path, &addr) != 0)
+    return -1;
+  int fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+  if (fd < 0)
+    return -1;
+  if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0) {
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+/* --- Server --- */
+
+void hid_daemon_share_fd(int fd) { g_shared_fd = fd; }
+
+/* Answers an "shm-fd" request with the shared fd (SCM_RIGHTS) */
+static int send_shared_fd(int conn) {
+  int32_t status = g_shared_fd >= 0 ? 0 : 1;
+  union {
+    char buf[CMSG_SPACE(sizeof(int))];
+    struct cmsghdr align;
+  } ctrl;
+  memset(&ctrl, 0, sizeof(ctrl));
+  struct iovec iov = {.iov_base = &status, .iov_len = sizeof(status)};
+  struct msghdr msg = {.msg_iov = &iov, .msg_iovlen = 1};
+  if (g_shared_fd >= 0) {
+    msg.msg_control = ctrl.buf;
+    msg.msg_controllen = sizeof(ctrl.buf);
+    struct cmsghdr *c = CMSG_FIRSTHDR(&msg);
+    c->cmsg_level = SOL_SOCKET;
+    c->cmsg_type = SCM_RIGHTS;
+    c->cmsg_len = CMSG_LEN(sizeof(int));
+    memcpy(CMSG_DATA(c), &g_shared_fd, sizeof(int));
+  }
+  return sendmsg(conn, &msg, MSG_NOSIGNAL) == (ssize_t)sizeof(status);
+}
+
+struct env_backup {
+  char *name;
+  char *old_value; /* NULL: was unset */
+};
+
+static void apply_env(char *entries[], size_t n, struct env_backup *bak) {
+  for (size_t i = 0; i < n; i++) {
+    char *eq = strchr(entries[i], '=');
+    bak[i].name = NULL;
+    if (!eq || eq == entries[i])
+      continue;
+    bak[i].name = strndup(entries[i], (size_t)(eq - entries[i]));
+    if (!bak[i].name)
+      continue;
+    const char *old = getenv(bak[i].name);
+    bak[i].old_value = old ? strdup(old) : NULL;
+    setenv(bak[i].name, eq + 1, 1);
+  }
+}
+
+static void restore_env(struct env_backup *bak, size_t n) {
+  for (size_t i = n; i-- > 0;) {
+    if (!bak[i].name)
+      continue;
+    if (bak[i].old_value)
+      setenv(bak[i].name, bak[i].old_value, 1);
+    else
+      unsetenv(bak[i].name);
+    free(bak[i].name);
+    free(bak[i].old_value);
+  }
+}
+
+/* Splits the string area into count NUL-terminated entries */
+static int split_strings(char **p, const char *end, char *out[],
+                         uint32_t count) {
+  for (uint32_t i = 0; i < count; i++) {
+    char *nul = memchr(*p, '\0', (size_t)(end - *p));
+    if (!nul)
+      return -1;
+    out[i] = *p;
+    *p = nul + 1;
+  }
+  return 0;
+}
+
+static int peer_allowed(int conn) {
+  struct ucred cred;
+  socklen_t len = sizeof(cred);
+  if (getsockopt(conn, SOL_SOCKET, SO_PEERCRED, &cred, &len) != 0)
+    return 0;
+  return cred.uid == 0 || cred.uid == getuid();
+}
+
+/* Handles one request. Returns 1 to keep the connection, 0 on EOF or a
+ * malformed request. */
+static int serve_request(int conn, char *buf, hid_daemon_handler handler) {
+  int fds[DAEMON_FDS] = {-1, -1, -1, -1};
+  union {
+    char buf[CMSG_SPACE(sizeof(fds))];
+    struct cmsghdr align;
+  } ctrl;
+  struct iovec iov = {.iov_base = buf, .iov_len = DAEMON_MSG_MAX};
+  struct msghdr msg = {.msg_iov = &iov,
+                       .msg_iovlen = 1,
+                       .msg_control = ctrl.buf,
+                       .msg_controllen = sizeof(ctrl.buf)};
+
+  ssize_t n = recvmsg(conn, &msg, MSG_CMSG_CLOEXEC);
+  if (n <= 0)
+    return 0;
+
+  int nfds = 0;
+  for (struct cmsghdr *c = CMSG_FIRSTHDR(&msg); c; c = CMSG_NXTHDR(&msg, c)) {
+    if (c->cmsg_level == SOL_SOCKET && c->cmsg_type == SCM_RIGHTS) {
+      nfds = (int)((c->cmsg_len - CMSG_LEN(0)) / sizeof(int));
+      if (nfds > DAEMON_FDS)
+        nfds = DAEMON_FDS; /* extras are a protocol error; ignore them */
+      memcpy(fds, CMSG_DATA(c), (size_t)nfds * sizeof(int));
+    }
+  }
+
+  int ok = 0;
+  struct request_header hdr;
+  char *argv[DAEMON_MAX_ARGS + 1];
+  char *envv[DAEMON_MAX_ENV];
+  char *p = buf + sizeof(hdr), *end = buf + n;
+  if ((size_t)n > sizeof(hdr)) {
+    memcpy(&hdr, buf, sizeof(hdr));
+    ok = memcmp(hdr.magic, DAEMON_MAGIC, 4) == 0 && hdr.argc >= 2 &&
+         hdr.argc <= DAEMON_MAX_ARGS && hdr.envc <= DAEMON_MAX_ENV &&
+         split_strings(&p, end, argv, hdr.argc) == 0 &&
+         split_strings(&p, end, envv, hdr.envc) == 0;
+  }
+  if (!ok) {
+    for (int i = 0; i < nfds; i++)
+      close(fds[i]);
+    return 0;
+  }
+  argv[hdr.argc] = NULL;
+
+  if (hdr.argc == 2 && strcmp(argv[1], "shm-fd") == 0) {
+    for (int i = 0; i < nfds; i++)
+      close(fds[i]);
+    return send_shared_fd(conn);
+  }
+
+  /* Borrow the client's stdio and cwd for the duration of the command */
+  int saved[3] = {-1, -1, -1};
+  int stdio = nfds < 3 ? nfds : 3;
+  fflush(stdout);
+  fflush(stderr);
+  for (int i = 0; i < stdio; i++) {
+    saved[i] = dup(i);
+    dup2(fds[i], i);
+    close(fds[i]);
+  }
+  clearerr(stdin);
+  int saved_cwd = -1;
+  if (nfds == DAEMON_FDS) {
+    saved_cwd = open(".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (saved_cwd >= 0 && fchdir(fds[3]) != 0) {
+      close(saved_cwd);
+      saved_cwd = -1;
+    }
+    close(fds[3]);
+  }
+
+  struct env_backup bak[DAEMON_MAX_ENV];
+  apply_env(envv, hdr.envc, bak);
+  int32_t status = handler((int)hdr.argc, argv);
+  restore_env(bak, hdr.envc);
+
+  if (saved_cwd >= 0) {
+    if (fchdir(saved_cwd) != 0)
+      perror("[HID-DAEMON] fchdir");
+    close(saved_cwd);
+  }
+  fflush(stdout);
+  fflush(stderr);
+  for (int i = 0; i < stdio; i++) {
+    if (saved[i] >= 0) {
+      dup2(saved[i], i);
+      close(saved[i]);
+    }
+  }
+  clearerr(stdin);
+
+  return send(conn, &status, sizeof(status), MSG_NOSIGNAL) ==
+         (ssize_t)sizeof(status);
+}
+
+int hid_daemon_serve(const char *path, hid_daemon_handler handler) {
+  struct sockaddr_un addr;
+  if (make_addr(path, &addr) != 0)
+    return -1;
+
+  /* Refuse to steal the socket of a daemon that is still alive */
+  int probe = connect_socket(path);
+  if (probe >= 0) {
+    close(probe);
+    errno = EADDRINUSE;
+    return -1;
+  }
+  unlink(path);
+
+  int lfd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+  if (lfd < 0)
+    return -1;
+  if (bind(lfd, (struct sockaddr *)&addr, sizeof(addr)) != 0 ||
+      chmod(path, 0660) != 0 || listen(lfd, 16) != 0) {
+    int err = errno;
+    close(lfd);
+    errno = err;
+    return -1;
+  }
+
+  struct sigaction sa;
+  memset(&sa, 0, sizeof(sa));
+  sa.sa_handler = on_stop_signal; /* no SA_RESTART: unblock accept/recv */
+  sigaction(SIGINT, &sa, NULL);
+  sigaction(SIGTERM, &sa, NULL);
+  signal(SIGPIPE, SIG_IGN);
+
+  char *buf = malloc(DAEMON_MSG_MAX);
+  if (!buf) {
+    close(lfd);
+    unlink(path);
+    return -1;
+  }
+
+  while (!g_stop) {
+    int conn = accept4(lfd, NULL, NULL, SOCK_CLOEXEC);
+    if (conn < 0) {
+      if (errno == EINTR || errno == ECONNABORTED)
+        continue;
+      break;
+    }
+    if (peer_allowed(conn)) {
+      while (!g_stop && serve_request(conn, buf, handler))
+        ;
+    }
+    close(conn);
+  }
+
+  free(buf);
+  close(lfd);
+  unlink(path);
+  return 0;
+}
+
+/* --- Client --- */
+
+static int append(char *buf, size_t *len, const char *s) {
+  size_t n = strlen(s) + 1;
+  if (*len + n > DAEMON_MSG_MAX)
+    return -1;
+  memcpy(buf + *len, s, n);
+  *len += n;
+  return 0;
+}
+
+int hid_daemon_forward(const char *path, int argc, char *argv[], int *status) {
+  if (argc < 2 || argc > DAEMON_MAX_ARGS)
+    return -1;
+  int sock = connect_socket(path);
+  if (sock < 0)
+    return -1;
+
+  char *buf = malloc(DAEMON_MSG_MAX);
+  if (!buf) {
+    close(sock);
+    return -1;
+  }
+  struct request_header hdr = {.argc = (uint32_t)argc};
+  memcpy(hdr.magic, DAEMON_MAGIC, 4);
+  size_t len = sizeof(hdr);
+  int ok = 1;
+  for (int i = 0; i < argc && ok; i++)
+    ok = append(buf, &len, argv[i]) == 0;
+  for (char **e = environ; ok && e && *e && hdr.envc < DAEMON_MAX_ENV; e++) {
+    if (strncmp(*e, "HID_", 4) == 0 && strncmp(*e, "HID_SOCKET=", 11) != 0) {
+      ok = append(buf, &len, *e) == 0;
+      hdr.envc++;
+    }
+  }
+  memcpy(buf, &hdr, sizeof(hdr));
+  if (!ok) {
+    free(buf);
+    close(sock);
+    errno = E2BIG;
+    return -1;
+  }
+
+  /* Closed stdio slots are backed by /dev/null so positions line up */
+  int fds[DAEMON_FDS], opened[DAEMON_FDS] = {-1, -1, -1, -1};
+  for (int i = 0; i < 3; i++) {
+    fds[i] = i;
+    if (fcntl(i, F_GETFD) < 0)
+      fds[i] = opened[i] = open("/dev/null", O_RDWR | O_CLOEXEC);
+  }
+  fds[3] = opened[3] = open(".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  if (fds[3] < 0)
+    fds[3] = opened[3] = open("/", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+
+  union {
+    char buf[CMSG_SPACE(sizeof(fds))];
+    struct cmsghdr align;
+  } ctrl;
+  memset(&ctrl, 0, sizeof(ctrl));
+  struct iovec iov = {.iov_base = buf, .iov_len = len};
+  struct msghdr msg = {.msg_iov = &iov,
+                       .msg_iovlen = 1,
+                       .msg_control = ctrl.buf,
+                       .msg_controllen = sizeof(ctrl.buf)};
+  struct cmsghdr *c = CMSG_FIRSTHDR(&msg);
+  c->cmsg_level = SOL_SOCKET;
+  c->cmsg_type = SCM_RIGHTS;
+  c->cmsg_len = CMSG_LEN(sizeof(fds));
+  memcpy(CMSG_DATA(c), fds, sizeof(fds));
+
+  ssize_t sent = sendmsg(sock, &msg, MSG_NOSIGNAL);
+  free(buf);
+  for (int i = 0; i < DAEMON_FDS; i++) {
+    if (opened[i] >= 0)
+      close(opened[i]);
+  }
+  if (sent < 0) {
+    close(sock);
+    return -1;
+  }
+
+  /* From here the command may have run: never report "no daemon" */
+  int32_t st;
+  ssize_t r;
+  do {
+    r = recv(sock, &st, sizeof(st), 0);
+  } while (r < 0 && errno == EINTR);
+  close(sock);
+  *status = (r == (ssize_t)sizeof(st)) ? st : EXIT_FAILURE;
+  return 0;
+}
@@ -0,0 +1,429 @@
+/*
+ * hid-discover.c - hidg nodes from sysfs and configfs, with an on-disk cache
+ * (see hid_discover.h).
+ */
+
+#include "../include/hid_discover.h"
+#include "../include/hid_ctx.h"
+#include <ctype.h>
+#include <dirent.h>
+#include <errno.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
+#include <unistd.h>
+
+#define CACHE_MAGIC "hidg-cache"
+#define CACHE_VERSION 3
+
+static int64_t mtime_ns(const struct stat *st) {
+  return (int64_t)st->st_mtim.tv_sec * 1000000000 + st->st_mtim.tv_nsec;
+}
+
+int hid_path_fmt(char *out, size_t size, const char *fmt, ...) {
+  va_list ap;
+  va_start(ap, fmt);
+  int n = vsnprintf(out, size, fmt, ap);
+  va_end(ap);
+  return n < 0 || (size_t)n >= size ? -1 : 0;
+}
+
+/* Read once: writer threads build paths from them while the daemon swaps
+ * per-command variables in and out of the environment */
+static pthread_once_t g_paths_once = PTHREAD_ONCE_INIT;
+static const char *g_sysroot = "";
+static const char *g_gadget_dir = HID_GADGET_DEFAULT_DIR;
+
+static void load_paths(void) {
+  const char *root = getenv("HID_SYSROOT");
+  const char *gadget = getenv("HID_GADGET_DIR");
+  if (root && (root = strdup(root)))
+    g_sysroot = root;
+  if (gadget && *gadget && (gadget = strdup(gadget)))
+    g_gadget_dir = gadget;
+}
+
+const char *hid_sysroot(void) {
+  pthread_once(&g_paths_once, load_paths);
+  return g_sysroot;
+}
+
+const char *hid_gadget_dir(void) {
+  pthread_once(&g_paths_once, load_paths);
+  return g_gadget_dir;
+}
+
+int hid_gadget_path(char *out, size_t size, const char *rel) {
+  return hid_path_fmt(out, size, "%s%s/%s", hid_sysroot(), hid_gadget_dir(),
+                      rel);
+}
+
+/* First line of a small sysfs/configfs attribute, newline stripped */
+static int read_attr(const char *path, char *buf, size_t size) {
+  FILE *f = fopen(path, "r");
+  if (!f)
+    return -1;
+  int ok = fgets(buf, (int)size, f) != NULL;
+  fclose(f);
+  if (!ok)
+    return -1;
+  buf[strcspn(buf, "\n")] = '\0';
+  return 0;
+}
+
+static int read_int_attr(const char *dir, const char *name, int *out) {
+  char path[PATH_MAX], buf[32];
+  if (hid_path_fmt(path, sizeof(path), "%s/%s", dir, name) != 0 ||
+      read_attr(path, buf, sizeof(buf)) != 0)
+    return -1;
+  *out = atoi(buf);
+  return 0;
+}
+
+static int read_devnum(const char *path, unsigned *major, unsigned *minor) {
+  char buf[32];
+  if (read_attr(path, buf, sizeof(buf)) != 0 ||
+      sscanf(buf, "%u:%u", major, minor) != 2)
+    return -1;
+  return 0;
+}
+
+/* hidgN -> N, or -1 */
+static int hidg_number(const char *name) {
+  if (strncmp(name, "hidg", 4) != 0 || !isdigit((unsigned char)name[4]))
+    return -1;
+  return atoi(name + 4);
+}
+
+/* Records the node at path if it is the character device major:minor (or
+ * any character device when check is 0) */
+static int add_node(struct hid_node *out, int *count, int max,
+                    const char *path, int number, int check, unsigned major,
+                    unsigned minor) {
+  struct stat st;
+  if (*count >= max || stat(path, &st) != 0 || !S_ISCHR(st.st_mode))
+    return -1;
+  if (check && (major(st.st_rdev) != major || minor(st.st_rdev) != minor))
+    return -1;
+  struct hid_node *n = &out[(*count)++];
+  memset(n, 0, sizeof(*n));
+  snprintf(n->path, sizeof(n->path), "%s", path);
+  n->number = number;
+  n->major = major(st.st_rdev);
+  n->minor = minor(st.st_rdev);
+  n->role = -1;
+  n->mtime_ns = mtime_ns(&st);
+  return 0;
+}
+
+static int compare_nodes(const void *a, const void *b) {
+  return ((const struct hid_node *)a)->number -
+         ((const struct hid_node *)b)->number;
+}
+
+// --- Scanning ---
+/* The class directory names every f_hid node and its device number */
+static int scan_sysfs(const char *root, struct hid_node *out, int max) {
+  char dir_path[PATH_MAX];
+  DIR *dir = NULL;
+  if (hid_path_fmt(dir_path, sizeof(dir_path), "%s/sys/class/hidg", root) == 0)
+    dir = opendir(dir_path);
+  if (!dir)
+    return -1;
+
+  int count = 0;
+  struct dirent *entry;
+  while ((entry = readdir(dir)) != NULL) {
+    int number = hidg_number(entry->d_name);
+    char path[PATH_MAX];
+    unsigned major, minor;
+    if (number < 0)
+      continue;
+    if (hid_path_fmt(path, sizeof(path), "%s/%s/dev", dir_path,
+                     entry->d_name) ||
+        read_devnum(path, &major, &minor) != 0)
+      continue;
+    /* The node itself comes from ueventd or hid-setup's mknod */
+    if (hid_path_fmt(path, sizeof(path), "%s/dev/%s", root, entry->d_name) == 0)
+      add_node(out, &count, max, path, number, 1, major, minor);
+  }
+  closedir(dir);
+  return count;
+}
+
+/* Older kernels: every hidg* character device in /dev */
+static int scan_dev(const char *root, struct hid_node *out, int max) {
+  char dir_path[PATH_MAX];
+  DIR *dir = NULL;
+  if (hid_path_fmt(dir_path, sizeof(dir_path), "%s/dev", root) == 0)
+    dir = opendir(dir_path);
+  if (!dir)
+    return -1;
+
+  int count = 0;
+  struct dirent *entry;
+  while ((entry = readdir(dir)) != NULL) {
+    int number = hidg_number(entry->d_name);
+    char path[PATH_MAX];
+    if (number < 0)
+      continue;
+    if (hid_path_fmt(path, sizeof(path), "%s/%s", dir_path, entry->d_name) == 0)
+      add_node(out, &count, max, path, number, 0, 0, 0);
+  }
+  closedir(dir);
+  return count;
+}
+
+int hid_desc_has_report_ids(const unsigned char *desc, size_t len) {
+  size_t i = 0;
+  while (i < len) {
+    unsigned char prefix = desc[i];
+    if (prefix == 0xFE) { /* long item: data size in the next byte */
+      i += i + 1 < len ? 3u + desc[i + 1] : len;
+      continue;
+    }
+    if ((prefix & 0xFC) == 0x84) /* Global, Report ID */
+      return 1;
+    static const unsigned char sizes[4] = {0, 1, 2, 4};
+    i += 1u + sizes[prefix & 3];
+  }
+  return 0;
+}
+
+int hid_desc_resolution_multiplier(const unsigned char *desc, size_t len) {
+  static const unsigned char sizes[4] = {0, 1, 2, 4};
+  unsigned page = 0;
+  int32_t physical_max = 0;
+  int multiplier = 1, usage = 0;
+  size_t i = 0;
+  while (i < len) {
+    unsigned char prefix = desc[i];
+    if (prefix == 0xFE) {
+      i += i + 1 < len ? 3u + desc[i + 1] : len;
+      continue;
+    }
+    size_t n = sizes[prefix & 3];
+    if (i + 1 + n > len)
+      break;
+    uint32_t data = 0;
+    for (size_t b = 0; b < n; b++)
+      data |= (uint32_t)desc[i + 1 + b] << (8 * b);
+    switch (prefix & 0xFC) {
+    case 0x04: /* Global, Usage Page */
+      page = data;
+      break;
+    case 0x44: /* Global, Physical Maximum (signed) */
+      physical_max = n == 1   ? (int8_t)data
+                     : n == 2 ? (int16_t)data
+                              : (int32_t)data;
+      break;
+    case 0x08: /* Local, Usage: Generic Desktop / Resolution Multiplier */
+      if ((n == 4 ? data : (page << 16 | data)) == 0x00010048)
+        usage = 1;
+      break;
+    case 0xB0: /* Main, Feature */
+      if (usage && physical_max > multiplier)
+        multiplier = physical_max;
+      usage = 0;
+      break;
+    case 0x80: /* Main, Input */
+    case 0x90: /* Output */
+    case 0xA0: /* Collection */
+    case 0xC0: /* End Collection */
+      usage = 0;
+      break;
+    }
+    i += 1 + n;
+  }
+  return multiplier;
+}
+
+/* Composite functions carry report IDs in their descriptor */
+static int function_composite(const char *func) {
+  char path[PATH_MAX];
+  unsigned char desc[1024];
+  if (hid_path_fmt(path, sizeof(path), "%s/report_desc", func) != 0)
+    return 0;
+  FILE *f = fopen(path, "rb");
+  if (!f)
+    return 0;
+  size_t len = fread(desc, 1, sizeof(desc), f);
+  fclose(f);
+  return hid_desc_has_report_ids(desc, len);
+}
+
+/* Role of a configfs hid function */
+static int function_role(int protocol, int report_length) {
+  switch (protocol) {
+  case 1:
+    return HID_ROLE_KEYBOARD;
+  case 2:
+    return HID_ROLE_MOUSE;
+  default:
+    if (report_length == HID_KEYBOARD_NKRO_REPORT_SIZE)
+      return HID_ROLE_KEYBOARD;
+    if (report_length == HID_CONSUMER_REPORT_SIZE)
+      return HID_ROLE_CONSUMER;
+    if (report_length == HID_ABSOLUTE_REPORT_SIZE)
+      return HID_ROLE_ABSOLUTE;
+    if (report_length == HID_MOUSE_WIDE_REPORT_SIZE ||
+        report_length == HID_MOUSE_WIDE_REPORT_SIZE + 1)
+      return HID_ROLE_MOUSE;
+    return -1;
+  }
+}
+
+/* Labels the nodes with the role of the configfs function that owns their
+ * device number */
+static void label_roles(const char *root, struct hid_node *nodes, int count) {
+  char gadgets[PATH_MAX];
+  DIR *gdir = NULL;
+  if (hid_path_fmt(gadgets, sizeof(gadgets), "%s/config/usb_gadget", root) == 0)
+    gdir = opendir(gadgets);
+  if (!gdir)
+    return;
+
+  struct dirent *g;
+  while ((g = readdir(gdir)) != NULL) {
+    char funcs[PATH_MAX];
+    if (g->d_name[0] == '.' ||
+        hid_path_fmt(funcs, sizeof(funcs), "%s/%s/functions", gadgets,
+                     g->d_name))
+      continue;
+    DIR *fdir = opendir(funcs);
+    if (!fdir)
+      continue;
+    struct dirent *f;
+    while ((f = readdir(fdir)) != NULL) {
+      char func[PATH_MAX], dev[PATH_MAX];
+      unsigned major, minor;
+      int protocol = -1, report_length = 0;
+      if (strncmp(f->d_name, "hid.", 4) != 0 ||
+          hid_path_fmt(func, sizeof(func), "%s/%s", funcs, f->d_name) ||
+          hid_path_fmt(dev, sizeof(dev), "%s/dev", func) ||
+          read_devnum(dev, &major, &minor) != 0)
+        continue;
+      read_int_attr(func, "protocol", &protocol);
+      read_int_attr(func, "report_length", &report_length);
+      int role = protocol == 0 && function_composite(func)
+                     ? HID_NODE_COMPOSITE
+                     : function_role(protocol, report_length);
+      for (int i = 0; i < count; i++) {
+        if (nodes[i].major == major && nodes[i].minor == minor) {
+          nodes[i].role = role;
+          nodes[i].report_length = report_length;
+        }
+      }
+    }
+    closedir(fdir);
+  }
+  closedir(gdir);
+}
+
+/* Changes whenever a gadget gains or loses functions */
+static int64_t functions_stamp(const char *root) {
+  char gadgets[PATH_MAX];
+  DIR *gdir = NULL;
+  if (hid_path_fmt(gadgets, sizeof(gadgets), "%s/config/usb_gadget", root) == 0)
+    gdir = opendir(gadgets);
+  if (!gdir)
+    return 0;
+  int64_t stamp = 0;
+  struct dirent *g;
+  while ((g = readdir(gdir)) != NULL) {
+    char funcs[PATH_MAX];
+    struct stat st;
+    if (g->d_name[0] == '.' ||
+        hid_path_fmt(funcs, sizeof(funcs), "%s/%s/functions", gadgets,
+                     g->d_name))
+      continue;
+    if (stat(funcs, &st) == 0)
+      stamp = (int64_t)((uint64_t)stamp * 31 + (uint64_t)mtime_ns(&st));
+  }
+  closedir(gdir);
+  return stamp;
+}
+// --- End Scanning ---
+
+// --- Cache ---
+/* Format, one node per line after the header:
+ *   hidg-cache <CACHE_VERSION> <functions stamp>
+ *   <path> <major>:<minor> <mtime ns> <role> <report length>
+ * Valid while every node is still the same device with the same mtime. */
+static int cache_load(const char *cache, int64_t stamp, struct hid_node *out,
+                      int max) {
+  FILE *f = fopen(cache, "r");
+  if (!f)
+    return -1;
+  char magic[16];
+  int version, count = 0, valid = 1;
+  long long cached_stamp;
+  if (fscanf(f, "%15s %d %lld", magic, &version, &cached_stamp) != 3 ||
+      strcmp(magic, CACHE_MAGIC) != 0 || version != CACHE_VERSION ||
+      cached_stamp != stamp)
+    valid = 0;
+
+  struct hid_node n;
+  long long mtime;
+  while (valid && count < max &&
+         fscanf(f, "%255s %u:%u %lld %d %d", n.path, &n.major, &n.minor,
+                &mtime, &n.role, &n.report_length) == 6) {
+    struct stat st;
+    const char *base = strrchr(n.path, '/');
+    n.number = hidg_number(base ? base + 1 : n.path);
+    n.mtime_ns = mtime;
+    if (stat(n.path, &st) != 0 || !S_ISCHR(st.st_mode) ||
+        major(st.st_rdev) != n.major || minor(st.st_rdev) != n.minor ||
+        mtime_ns(&st) != n.mtime_ns || n.number < 0) {
+      valid = 0;
+      break;
+    }
+    out[count++] = n;
+  }
+  fclose(f);
+  /* An empty result is never cached: the nodes may appear any moment */
+  return valid && count > 0 ? count : -1;
+}
+
+/* Written aside and renamed, so concurrent starts never read half a file */
+static void cache_store(const char *cache, int64_t stamp,
+                        const struct hid_node *nodes, int count) {
+  char tmp[PATH_MAX];
+  if (hid_path_fmt(tmp, sizeof(tmp), "%s.%d", cache, (int)getpid()) != 0)
+    return;
+  FILE *f = fopen(tmp, "w");
+  if (!f)
+    return;
+  fprintf(f, "%s %d %lld\n", CACHE_MAGIC, CACHE_VERSION, (long long)stamp);
+  for (int i = 0; i < count; i++)
+    fprintf(f, "%s %u:%u %lld %d %d\n", nodes[i].path, nodes[i].major,
+            nodes[i].minor, (long long)nodes[i].mtime_ns, nodes[i].role,
+            nodes[i].report_length);
+  if (fclose(f) != 0 || rename(tmp, cache) != 0)
+    unlink(tmp);
+}
+// --- End Cache ---
+
+int hid_discover_nodes(const char *root, const char *cache,
+                       struct hid_node *out, int max) {
+  int64_t stamp = functions_stamp(root);
+  int count;
+  if (cache && (count = cache_load(cache, stamp, out, max)) > 0)
+    return count;
+
+  count = scan_sysfs(root, out, max);
+  if (count < 0)
+    count = scan_dev(root, out, max);
+  if (count < 0)
+    return -1;
+  qsort(out, (size_t)count, sizeof(*out), compare_nodes);
+  label_roles(root, out, count);
+  if (cache && count > 0)
+    cache_store(cache, stamp, out, count);
+  return count;
+}
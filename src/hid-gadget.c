@@ -4,356 +4,203 @@
  *
  * This program provides a user-space interface to USB HID gadget
  * functionality, allowing the device to act as a USB keyboard, mouse,
- * or consumer control device.
- * Dynamically finds the first three /dev/hidg* devices.
+ * consumer control device or absolute pointer.
+ * Every hidg node discovery finds joins a device registry; each role goes
+ * to the node configfs names for it, or to the one HID_DEVICE / --device
+ * selects.
+ *
+ * Report encoding and output live in libhidgadget (hid_ctx.h); this file is
+ * the command line, daemon and statistics front end.
  */
 
 #include "../include/ducky.h"
+#include "../include/hid_batch.h"
+#include "../include/hid_configfs.h"
+#include "../include/hid_ctx.h"
+#include "../include/hid_daemon.h"
 #include "../include/hid_interface.h"
+#include "../include/hid_path.h"
+#include "../include/hid_replay.h"
+#include "../include/hid_rt.h"
+#include "../include/hid_shm.h"
+#include "../include/hid_stats.h"
+#include "../include/hid_supervise.h"
 #include "../include/tui.h"
-#include <ctype.h>
-#include <dirent.h>
 #include <errno.h>
-#include <fcntl.h>
 #include <getopt.h>
 #include <limits.h>
-#include <linux/types.h>
+#include <pthread.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-#include <sys/ioctl.h>
-#include <sys/stat.h>
-#include <sys/types.h>
+#include <strings.h>
 #include <unistd.h>
 
-/* If the kernel headers are not available, we define our own structures */
-#ifndef HID_MAX_DESCRIPTOR_SIZE
-#define HID_MAX_DESCRIPTOR_SIZE 4096
-#endif
-
-// --- Dynamic Device Paths (Global Variables) ---
-char *g_keyboard_device = NULL;
-char *g_mouse_device = NULL;
-char *g_consumer_device = NULL;
-// --- End Dynamic Device Paths ---
-
-// --- Persistent File Descriptors ---
-static int g_fd_keyboard = -1;
-static int g_fd_mouse = -1;
-static int g_fd_consumer = -1;
+// --- Library Context ---
+/* The CLI drives one context, configured from the environment. It is also
+ * the default context behind hid_interface.h, which the TUI and the Ducky
+ * engine type through. */
+static struct hid_ctx *g_ctx = NULL;
+static int g_daemon_mode = 0; // commands arrive over the daemon socket
+static char *g_daemon_device; // the daemon's own HID_DEVICE, NULL if unset
 
-static int get_cached_fd(const char *path, int *cached_fd) {
-  if (!path)
-    return -1;
-  if (*cached_fd >= 0)
-    return *cached_fd;
-  *cached_fd = open(path, O_RDWR);
-  return *cached_fd;
+static inline const char *device_path(enum hid_role role) {
+  return hid_ctx_device(g_ctx, role);
 }
 
-void close_hid_fds() {
-  if (g_fd_keyboard >= 0) {
-    close(g_fd_keyboard);
-    g_fd_keyboard = -1;
-  }
-  if (g_fd_mouse >= 0) {
-    close(g_fd_mouse);
-    g_fd_mouse = -1;
+/* Write statistics (hid_stats.h): collected unless HID_STATS=0, printed at
+ * exit with HID_STATS=1, accumulated into HID_STATS_FILE when set. */
+static int g_stats_dump = 0;
+static const char *g_stats_file = NULL;
+
+static void report_write_stats(void) {
+  struct hid_stats st[HID_ROLE_COUNT];
+  int any = 0;
+  for (int r = 0; r < HID_ROLE_COUNT; r++) {
+    hid_ctx_get_stats(g_ctx, (enum hid_role)r, &st[r]);
+    if (st[r].writes == 0)
+      continue;
+    any = 1;
+    if (g_stats_dump)
+      hid_stats_print(stderr, hid_role_names[r], &st[r]);
   }
-  if (g_fd_consumer >= 0) {
-    close(g_fd_consumer);
-    g_fd_consumer = -1;
+  if (g_stats_dump) {
+    struct hid_timing_stats ts;
+    hid_ctx_get_timing(g_ctx, &ts);
+    hid_timing_print(stderr, &ts);
   }
-}
-// --- End Persistent File Descriptors ---
-
-/* Keyboard report descriptor */
-#define KEYBOARD_REPORT_SIZE 8
-
-/* Mouse report descriptor */
-#ifdef MOCK_HID
-static int mock_write(int fd, const void *buf, size_t count) {
-  const uint8_t *report = (const uint8_t *)buf;
-  printf("[HID-MOCK] Writing %zu bytes: ", count);
-  for (size_t i = 0; i < count; i++) {
-    printf("%02X ", report[i]);
-  }
-  printf("\n");
-  return (int)count;
-}
-#define write mock_write
-#endif
-
-#define MOUSE_REPORT_SIZE 4 /* Buttons(1), X(1), Y(1), Wheel(1) */
-static int g_mouse_report_size = MOUSE_REPORT_SIZE;
-static int g_mouse_support_hscroll = 0;
-
-/* Consumer control report descriptor */
-#define CONSUMER_REPORT_SIZE 2
-
-/* Keyboard modifier masks */
-#define MOD_CTRL_LEFT (1 << 0)
-#define MOD_SHIFT_LEFT (1 << 1)
-#define MOD_ALT_LEFT (1 << 2)
-#define MOD_GUI_LEFT (1 << 3)
-#define MOD_CTRL_RIGHT (1 << 4)
-#define MOD_SHIFT_RIGHT (1 << 5)
-#define MOD_ALT_RIGHT (1 << 6)
-#define MOD_GUI_RIGHT (1 << 7)
-
-/* Mouse button masks */
-#define MOUSE_BTN_LEFT (1 << 0)
-#define MOUSE_BTN_RIGHT (1 << 1)
-#define MOUSE_BTN_MIDDLE (1 << 2)
-
-/* Keyboard usage table - mapping ASCII characters to HID usage codes */
-static const uint8_t usage_table_us[128] = {
-    0,  0,  0,  0,
-    0,  0,  0,  0, /* 0-7 */
-    42, 43, 40, 0,
-    0,  0,  0,  0, /* 8-15 (Backspace, Tab, Enter) */
-    0,  0,  0,  0,
-    0,  0,  0,  0, /* 16-23 */
-    0,  0,  0,  41,
-    0,  0,  0,  0, /* 24-31 (Escape) */
-    44, 30, 52, 32,
-    33, 34, 35, 52, /* 32-39 (Space, !, ", #, $, %, &, ') */
-    38, 39, 37, 46,
-    54, 45, 55, 56, /* 40-47 ((, ), *, +, ,, -, ., /) */
-    39, 30, 31, 32,
-    33, 34, 35, 36, /* 48-55 (0-7) */
-    37, 38, 51, 51,
-    54, 46, 55, 56, /* 56-63 (8, 9, :, ;, <, =, >, ?) */
-    31, 4,  5,  6,
-    7,  8,  9,  10, /* 64-71 (@(Shift+2),A-G) */
-    11, 12, 13, 14,
-    15, 16, 17, 18, /* 72-79 (H-O) */
-    19, 20, 21, 22,
-    23, 24, 25, 26, /* 80-87 (P-W) */
-    27, 28, 29, 47,
-    49, 48, 33, 38, /* 88-95 (X-Z,[,\|],^ (Shift+6)) - Adjusted */
-    53, 4,  5,  6,
-    7,  8,  9,  10, /* 96-103 (`,a-g) */
-    11, 12, 13, 14,
-    15, 16, 17, 18, /* 104-111 (h-o) */
-    19, 20, 21, 22,
-    23, 24, 25, 26, /* 112-119 (p-w) */
-    27, 28, 29, 47,
-    49, 48, 53, 0 /* 120-127 (x-z,{,|,},~) - Adjusted */
-};
-
-/* Shift needed for these characters (US layout assumed) */
-static const char *shift_chars_us =
-    "!@#$%^&*()_+{}|:\"<>?~ABCDEFGHIJKLMNOPQRSTUVWXYZ";
-
-const uint8_t *current_usage_table = NULL;
-const char *current_shift_chars = NULL;
-
-/* Function key mapping */
-struct fn_key {
-  const char *name;
-  uint8_t usage;
-};
-
-static const struct fn_key fn_keys[] = {
-    {"F1", 58},     {"F2", 59},        {"F3", 60},          {"F4", 61},
-    {"F5", 62},     {"F6", 63},        {"F7", 64},          {"F8", 65},
-    {"F9", 66},     {"F10", 67},       {"F11", 68},         {"F12", 69},
-    {"INSERT", 73}, {"HOME", 74},      {"PAGEUP", 75},      {"DELETE", 76},
-    {"END", 77},    {"PAGEDOWN", 78},  {"RIGHT", 79},       {"LEFT", 80},
-    {"DOWN", 81},   {"UP", 82},        {"NUMLOCK", 83},     {"ESC", 41},
-    {"TAB", 43},    {"CAPSLOCK", 57},  {"PRINTSCREEN", 70}, {"SCROLLLOCK", 71},
-    {"PAUSE", 72},  {"BACKSPACE", 42}, {"RETURN", 40},      {"ENTER", 40},
-    {"SPACE", 44},  {NULL, 0}};
-
-/* Consumer control key mapping */
-struct consumer_key {
-  const char *name;
-  uint16_t usage;
-};
-
-static const struct consumer_key consumer_keys[] = {
-    {"PLAY", 0x00B0},        {"PAUSE", 0x00B1},       {"RECORD", 0x00B2},
-    {"FORWARD", 0x00B3},     {"REWIND", 0x00B4},      {"NEXT", 0x00B5},
-    {"PREVIOUS", 0x00B6},    {"STOP", 0x00B7},        {"EJECT", 0x00B8},
-    {"MUTE", 0x00E2},        {"VOL+", 0x00E9},        {"VOL-", 0x00EA},
-    {"BRIGHTNESS+", 0x006F}, {"BRIGHTNESS-", 0x0070}, {NULL, 0}};
-
-// Structure to hold device info for sorting
-int set_hid_locale(const char *name) {
-  if (strcasecmp(name, "US") == 0) {
-    current_usage_table = usage_table_us;
-    current_shift_chars = shift_chars_us;
-    return 0;
-  }
-  fprintf(stderr,
-          "[HID-HW] Locale '%s' not supported yet. Falling back to US.\n",
-          name);
-  return -1;
+  if (any && g_stats_file &&
+      hid_stats_save(g_stats_file, hid_role_names, st, HID_ROLE_COUNT) != 0)
+    fprintf(stderr, "[HID-STATS] Cannot update %s: %s\n", g_stats_file,
+            strerror(errno));
+  hid_ctx_reset_stats(g_ctx);
 }
 
-int send_raw_hid_report(const uint8_t *report, size_t size) {
-  if (!g_keyboard_device)
-    return -1;
-  int fd = get_cached_fd(g_keyboard_device, &g_fd_keyboard);
-  if (fd < 0)
-    return -1;
-  int n = write(fd, report, size);
-  return (n == (int)size) ? 0 : -1;
-}
-typedef struct {
-  char name[NAME_MAX]; // From <dirent.h>
-  int number;
-} hidg_device_info;
-
-// Comparison function for qsort
-int compare_hidg_devices(const void *a, const void *b) {
-  const hidg_device_info *dev_a = (const hidg_device_info *)a;
-  const hidg_device_info *dev_b = (const hidg_device_info *)b;
-  return dev_a->number - dev_b->number;
+/* Drains the writer threads, reports, then releases the context */
+static void shutdown_output(void) {
+  if (!g_ctx)
+    return;
+  hid_ctx_flush(g_ctx);
+  if (hid_ctx_get_option(g_ctx, HID_OPT_QUEUE_STATS))
+    hid_ctx_print_queue_stats(g_ctx, stderr);
+  if (hid_ctx_get_option(g_ctx, HID_OPT_STATS))
+    report_write_stats();
+  hid_set_default_ctx(NULL);
+  hid_ctx_free(g_ctx);
+  g_ctx = NULL;
+  hid_batch_shutdown();
 }
 
-// Function to find and assign the first three hidg devices
-int find_hidg_devices() {
-  DIR *dir;
-  struct dirent *entry;
-  hidg_device_info devices[32]; // Assume max 32 hidg devices
-  int count = 0;
-  const char *dev_dir = "/dev";
-  const char *prefix = "hidg";
-  size_t prefix_len = strlen(prefix);
-
-  dir = opendir(dev_dir);
-  if (!dir) {
-    perror("Error opening /dev directory");
-    return -1;
-  }
-
-  while ((entry = readdir(dir)) != NULL && count < 32) {
-    // Check if filename starts with "hidg" and is followed by digits
-    if (strncmp(entry->d_name, prefix, prefix_len) == 0 &&
-        isdigit(entry->d_name[prefix_len])) {
-      // Check if it's a character device (optional but good practice)
-      char full_path[PATH_MAX];
-      struct stat st;
-      snprintf(full_path, sizeof(full_path), "%s/%s", dev_dir, entry->d_name);
-      if (stat(full_path, &st) == 0 && S_ISCHR(st.st_mode)) {
-        // Extract the number
-        if (sscanf(entry->d_name + prefix_len, "%d", &devices[count].number) ==
-            1) {
-          snprintf(devices[count].name, NAME_MAX, "%s", entry->d_name);
-          // strncpy(devices[count].name, entry->d_name, NAME_MAX - 1);
-          // devices[count].name[NAME_MAX - 1] = '\0'; // Ensure null termination
-          count++;
-        }
-      }
-    }
-  }
-  closedir(dir);
-
-  if (count < 3) {
-    // Not fatal: caller may only need a subset (e.g., keyboard or mouse)
-    // Return the number found for the caller to decide.
-  }
+// --- End Library Context ---
 
-  // Sort the devices by number
-  qsort(devices, count, sizeof(hidg_device_info), compare_hidg_devices);
+// --- Shared-Memory Ring (daemon --shm) ---
+/* The drain thread and socket commands share the context: a command holds
+ * the lock for its whole run so its keystrokes are never interleaved with
+ * ring reports, and the ring resumes once it finishes. */
+static pthread_mutex_t g_output_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct hid_shm_server *g_shm = NULL;
 
-  // Construct full paths and assign to global variables
-  char path_buffer[PATH_MAX];
-
-  // Only fill device paths that haven't been set by environment overrides
-  if (count >= 1 && g_keyboard_device == NULL) {
-    snprintf(path_buffer, sizeof(path_buffer), "%s/%s", dev_dir,
-             devices[0].name);
-    g_keyboard_device = strdup(path_buffer);
-  }
-  if (count >= 2 && g_mouse_device == NULL) {
-    snprintf(path_buffer, sizeof(path_buffer), "%s/%s", dev_dir,
-             devices[1].name);
-    g_mouse_device = strdup(path_buffer);
-  }
-  if (count >= 3 && g_consumer_device == NULL) {
-    snprintf(path_buffer, sizeof(path_buffer), "%s/%s", dev_dir,
-             devices[2].name);
-    g_consumer_device = strdup(path_buffer);
-  }
+/* Keyboard reports arrive in boot format; NKRO expansion happens on output */
+static size_t role_report_size(enum hid_role role) {
+  if (role == HID_ROLE_KEYBOARD)
+    return HID_KEYBOARD_REPORT_SIZE;
+  return hid_ctx_report_size(g_ctx, role);
+}
 
-  // Check if strdup succeeded
-  if ((count >= 1 && !g_keyboard_device) || (count >= 2 && !g_mouse_device) ||
-      (count >= 3 && !g_consumer_device)) {
-    perror("Error allocating memory for device paths");
-    // Free any allocated memory before returning
-    free(g_keyboard_device);
-    g_keyboard_device = NULL;
-    free(g_mouse_device);
-    g_mouse_device = NULL;
-    free(g_consumer_device);
-    g_consumer_device = NULL;
+/* Ring sink: runs on the drain thread */
+static int shm_sink(enum hid_shm_role shm_role, const uint8_t *report,
+                    size_t len) {
+  enum hid_role role = (enum hid_role)shm_role;
+  /* Bitmap-form reports pass through hid_ctx_send_report() unchanged */
+  int raw_nkro = hid_ctx_get_option(g_ctx, HID_OPT_KEYBOARD_NKRO) &&
+                 role == HID_ROLE_KEYBOARD &&
+                 len == HID_KEYBOARD_NKRO_REPORT_SIZE;
+  if (len != role_report_size(role) && !raw_nkro)
     return -1;
-  }
 
-  if (count == 0) {
-#ifdef MOCK_HID
-    printf("[HID-MOCK] Mocking device paths for testing.\n");
-    g_keyboard_device = strdup("/dev/null");
-    g_mouse_device = strdup("/dev/null");
-    g_consumer_device = strdup("/dev/null");
-    return 3;
-#else
-    return 0;
-#endif
+  /* The drain thread writes reports too: same real-time settings */
+  static __thread int rt_applied = 0;
+  if (!rt_applied) {
+    rt_applied = 1;
+    int prio = hid_ctx_get_option(g_ctx, HID_OPT_RT_PRIORITY);
+    int cpu = hid_ctx_get_option(g_ctx, HID_OPT_RT_CPU);
+    if (prio > 0 || cpu >= 0)
+      hid_rt_enter_thread(prio, cpu);
   }
 
-  return count;
+  pthread_mutex_lock(&g_output_lock);
+  int ret = hid_ctx_send_report(g_ctx, role, report, len);
+  pthread_mutex_unlock(&g_output_lock);
+  return ret;
 }
 
-// Function to free allocated device path strings
-void cleanup_device_paths() {
-  free(g_keyboard_device);
-  free(g_mouse_device);
-  free(g_consumer_device);
-  g_keyboard_device = NULL;
-  g_mouse_device = NULL;
-  g_consumer_device = NULL;
+static void print_shm_stats(FILE *out) {
+  const struct hid_shm_header *h = hid_shm_server_header(g_shm);
+  if (!h)
+    return;
+  fprintf(out,
+          "shm ring: %u slots, %llu pushed, %llu drained, %llu dropped, "
+          "%llu rejected (full), %llu wakeups, %llu pending\n",
+          h->capacity, (unsigned long long)atomic_load(&h->pushed),
+          (unsigned long long)atomic_load(&h->drained),
+          (unsigned long long)atomic_load(&h->dropped),
+          (unsigned long long)atomic_load(&h->full),
+          (unsigned long long)atomic_load(&h->wakeups),
+          (unsigned long long)(atomic_load(&h->head) - atomic_load(&h->tail)));
 }
+// --- End Shared-Memory Ring ---
 
-/* Load device overrides from environment variables if provided */
-void load_env_devices() {
-  const char *kb = getenv("HID_KEYBOARD_DEV");
-  const char *ms = getenv("HID_MOUSE_DEV");
-  const char *cc = getenv("HID_CONSUMER_DEV");
-  struct stat st;
-  if (kb && stat(kb, &st) == 0 && S_ISCHR(st.st_mode)) {
-    g_keyboard_device = strdup(kb);
-  }
-  if (ms && stat(ms, &st) == 0 && S_ISCHR(st.st_mode)) {
-    g_mouse_device = strdup(ms);
-  }
-  if (cc && stat(cc, &st) == 0 && S_ISCHR(st.st_mode)) {
-    g_consumer_device = strdup(cc);
-  }
-}
+/* Native Auto-Recovery for Android/Magisk. Once per command: the daemon
+ * clears the flag before each one, so a gadget lost later is repaired too. */
+static int g_recovery_attempted;
 
-/* Native Auto-Recovery for Android/Magisk */
 void attempt_hid_recovery() {
-  static int recovery_attempted = 0;
-  if (recovery_attempted)
+  if (g_recovery_attempted)
     return;
-  recovery_attempted = 1;
-
-  if (access("/system/bin/hid-setup", F_OK) == 0) {
+  g_recovery_attempted = 1;
+
+  // Native setup first: it only fixes what is broken and returns once the
+  // nodes exist; the script remains for gadgets it cannot handle
+  struct hid_gadget_spec spec;
+  struct hid_gadget_changes changes;
+  char gadget[PATH_MAX];
+  int have_spec = hid_gadget_spec_default(&spec, hid_sysroot()) == 0;
+  int announced = 0;
+  snprintf(gadget, sizeof(gadget), "%s%s", hid_sysroot(),
+           have_spec ? spec.gadget : HID_GADGET_DEFAULT_DIR);
+  if (have_spec && access(gadget, F_OK) == 0) {
     fprintf(
         stderr,
         "\x1b[1;33m[!] HID devices missing. Attempting auto-fix...\x1b[0m\n");
+    announced = 1;
+    if (hid_gadget_reconcile(&spec, &changes) == 0) {
+      char desc[256];
+      hid_gadget_describe(desc, sizeof(desc), &changes);
+      fprintf(stderr, "[HID-SETUP] %s\n", desc);
+      hid_ctx_discover(g_ctx);
+      if (device_path(HID_ROLE_KEYBOARD) || device_path(HID_ROLE_MOUSE) ||
+          device_path(HID_ROLE_CONSUMER)) {
+        fprintf(stderr, "\x1b[1;32m[+] Auto-fix successful. HID devices "
+                        "restored.\x1b[0m\n");
+        return;
+      }
+    } else {
+      fprintf(stderr, "[HID-SETUP] %s; trying hid-setup\n", changes.why);
+    }
+  }
+
+  if (access("/system/bin/hid-setup", F_OK) == 0) {
+    if (!announced)
+      fprintf(stderr, "\x1b[1;33m[!] HID devices missing. Attempting "
+                      "auto-fix...\x1b[0m\n");
     // We attempt to run the setup script which handles UDC binding
-    int ret = system("setprop sys.usb.config hid && /system/bin/hid-setup");
+    int ret = system(HID_SETUP_DEFAULT_COMMAND);
     if (ret == 0) {
       // Small delay for udev/devd to settle nodes
       usleep(250000);
-      find_hidg_devices();
-      if (g_keyboard_device || g_mouse_device || g_consumer_device) {
+      hid_ctx_discover(g_ctx);
+      if (device_path(HID_ROLE_KEYBOARD) || device_path(HID_ROLE_MOUSE) || device_path(HID_ROLE_CONSUMER)) {
         fprintf(stderr, "\x1b[1;32m[+] Auto-fix successful. HID devices "
                         "restored.\x1b[0m\n");
       }
@@ -362,8 +209,9 @@ void attempt_hid_recovery() {
 }
 
 void print_usage(const char *prog_name) {
-  if (!g_keyboard_device && !g_mouse_device && !g_consumer_device) {
-    find_hidg_devices();
+  if (!device_path(HID_ROLE_KEYBOARD) && !device_path(HID_ROLE_MOUSE) &&
+      !device_path(HID_ROLE_CONSUMER)) {
+    hid_ctx_discover(g_ctx);
   }
 
   fprintf(stderr, "\n\x1b[1;"
@@ -381,7 +229,8 @@ void print_usage(const char *prog_name) {
 
   fprintf(stderr, "\n\x1b[1;34m[ ⌨️  KEYBOARD ]\x1b[0m\n");
   fprintf(stderr, "  \x1b[1;32mkeyboard\x1b[0m "
-                  "[\x1b[1;35m--hold\x1b[0m|\x1b[1;35m--release\x1b[0m] "
+                  "[\x1b[1;35m--hold\x1b[0m|\x1b[1;35m--release\x1b[0m|"
+                  "\x1b[1;35m--rollover\x1b[0m] "
                   "[\x1b[1;33mmodifiers\x1b[0m] \x1b[1;37m<sequence>\x1b[0m\n");
   fprintf(stderr, "  \x1b[1;30mDescription:\x1b[0m Sends text or raw key "
                   "combos to the target.\n");
@@ -394,11 +243,21 @@ void print_usage(const char *prog_name) {
 
   fprintf(stderr, "\n\x1b[1;35m[ 🖱️  MOUSE ]\x1b[0m\n");
   fprintf(stderr, "  \x1b[1;32mmouse move\x1b[0m \x1b[1;37m<X> <Y>\x1b[0m      "
-                  "- Relative motion (-127 to 127)\n");
+                  "- Relative motion, split into as few reports as fit\n");
+  fprintf(stderr, "  \x1b[1;32mmouse moveto\x1b[0m \x1b[1;37m<X> <Y>\x1b[0m    "
+                  "- Absolute position, pixels or N%% (HID_ABSOLUTE, "
+                  "HID_SCREEN)\n");
+  fprintf(stderr, "  \x1b[1;32mmouse path\x1b[0m \x1b[1;37m<kind> <ms> ..."
+                  "\x1b[0m - Smooth motion at the polling rate:\n"
+                  "      line <ms> <X> <Y> [<X> <Y>...], "
+                  "bezier <ms> <CX> <CY> [<CX> <CY>] <X> <Y>,\n"
+                  "      arc <ms> <CX> <CY> <degrees>\n");
+  fprintf(stderr, "  \x1b[1;32mmouse drag\x1b[0m \x1b[1;37m[btn] <kind> <ms> "
+                  "...\x1b[0m - Path with a button held\n");
   fprintf(stderr, "  \x1b[1;32mmouse click\x1b[0m \x1b[1;37m[btn]\x1b[0m     - "
                   "left (default), right, middle\n");
-  fprintf(stderr, "  \x1b[1;32mmouse scroll\x1b[0m \x1b[1;37m<V> [H]\x1b[0m  - "
-                  "Scroll vertical/horizontal\n");
+  fprintf(stderr, "  \x1b[1;32mmouse scroll\x1b[0m \x1b[1;37m<V> [H] [ms]\x1b[0m "
+                  "- Scroll detents vertical/horizontal, over ms\n");
   fprintf(stderr, "  \x1b[1;32mmouse down/up\x1b[0m         - Latch/Release "
                   "specific buttons\n");
 
@@ -417,6 +276,49 @@ void print_usage(const char *prog_name) {
   fprintf(stderr, "  \x1b[1;30mInteractive:\x1b[0m Use '-' as path to read "
                   "from stdin (Ctrl+D to finish).\n");
 
+  fprintf(stderr, "\n\x1b[1;36m[ 📊 STATISTICS ]\x1b[0m\n");
+  fprintf(stderr, "  \x1b[1;32mstats\x1b[0m [\x1b[1;35m--reset\x1b[0m] "
+                  "[\x1b[1;37mfile\x1b[0m]  - Write latency histograms and "
+                  "error counters\n");
+  fprintf(stderr, "  \x1b[1;30mCollect:\x1b[0m     HID_STATS_FILE=<path> "
+                  "accumulates runs; HID_STATS=1 dumps at exit\n");
+
+  fprintf(stderr, "\n\x1b[1;32m[ 🔀 DEVICES ]\x1b[0m\n");
+  fprintf(stderr, "  \x1b[1;32mdevices\x1b[0m                   - List the "
+                  "hidg nodes of every gadget\n");
+  fprintf(stderr, "  \x1b[1;35m--device\x1b[0m \x1b[1;37mSPEC\x1b[0m "
+                  "\x1b[1;37m<command>\x1b[0m - Route a command, e.g. "
+                  "hidg3 or mouse=hidg4 (HID_DEVICE)\n");
+
+  fprintf(stderr, "\n\x1b[1;35m[ ⏺️  RECORD & REPLAY ]\x1b[0m\n");
+  fprintf(stderr, "  \x1b[1;32mreplay\x1b[0m [\x1b[1;35m--speed\x1b[0m "
+                  "\x1b[1;37mN\x1b[0m|\x1b[1;35m--fast\x1b[0m] "
+                  "\x1b[1;37m<file>\x1b[0m - Re-emit a capture with its "
+                  "original timing\n");
+  fprintf(stderr, "  \x1b[1;30mRecord:\x1b[0m      HID_OUTPUT=record:<file> "
+                  "(to the devices) or capture:<file> (dry run)\n");
+
+  fprintf(stderr, "\n\x1b[1;34m[ 🔌 DAEMON ]\x1b[0m\n");
+  fprintf(stderr, "  \x1b[1;32mdaemon\x1b[0m [\x1b[1;35m--socket\x1b[0m "
+                  "\x1b[1;37mpath\x1b[0m]  - Keep devices open and serve "
+                  "commands on a UNIX socket\n");
+  fprintf(stderr, "  \x1b[1;30mRing:\x1b[0m        --shm [--shm-path file] "
+                  "[--shm-slots N] drains reports pushed via hid_shm.h\n");
+  fprintf(stderr, "  \x1b[1;32msend\x1b[0m \x1b[1;37m<command> ...\x1b[0m    "
+                  "- Run a command through the daemon (local fallback)\n");
+  fprintf(stderr, "  \x1b[1;30mSocket:\x1b[0m      HID_SOCKET (default "
+                  HID_DAEMON_DEFAULT_SOCKET ")\n");
+
+  fprintf(stderr, "\n\x1b[1;33m[ 🛡️  SUPERVISOR ]\x1b[0m\n");
+  fprintf(stderr, "  \x1b[1;32msetup\x1b[0m [\x1b[1;35m--dry-run\x1b[0m]  "
+                  "    - Create/fix the configfs gadget, changing only what "
+                  "differs\n");
+  fprintf(stderr, "  \x1b[1;32msupervise\x1b[0m [\x1b[1;35m--once\x1b[0m]  "
+                  "    - Re-run hid-setup when the gadget breaks (event "
+                  "driven)\n");
+  fprintf(stderr, "  \x1b[1;30mTuning:\x1b[0m      HID_SETUP_CMD, "
+                  "HID_SUPERVISE_SETTLE_MS, HID_SUPERVISE_RECHECK_S\n");
+
   fprintf(stderr, "\n\x1b[1;32m[ 🖥️  INTERACTIVE TUI ]\x1b[0m\n");
   fprintf(stderr, "  \x1b[1;32mtui\x1b[0m                       - Launch full "
                   "terminal graphical remote\n");
@@ -427,209 +329,19 @@ void print_usage(const char *prog_name) {
   exit(EXIT_FAILURE);
 }
 
-/* Function to parse modifier keys.
-   If remainder is not NULL, and the string contains something that is not a
-   modifier, it will point to the first non-modifier part in mod_str. */
-uint8_t parse_modifiers(const char *mod_str, const char **remainder) {
-  uint8_t modifiers = 0;
-  if (remainder)
-    *remainder = mod_str;
-
-  char *mod_copy = strdup(mod_str);
-  if (!mod_copy)
-    return 0;
-
-  char *token = strtok(mod_copy, "-");
-
-  while (token != NULL) {
-    uint8_t m = 0;
-    if (strcasecmp(token, "CTRL") == 0 || strcasecmp(token, "CONTROL") == 0)
-      m = MOD_CTRL_LEFT;
-    else if (strcasecmp(token, "SHIFT") == 0)
-      m = MOD_SHIFT_LEFT;
-    else if (strcasecmp(token, "ALT") == 0)
-      m = MOD_ALT_LEFT;
-    else if (strcasecmp(token, "GUI") == 0 || strcasecmp(token, "WIN") == 0 ||
-             strcasecmp(token, "META") == 0 || strcasecmp(token, "SUPER") == 0)
-      m = MOD_GUI_LEFT;
-    else if (strcasecmp(token, "RCTRL") == 0 ||
-             strcasecmp(token, "RCONTROL") == 0)
-      m = MOD_CTRL_RIGHT;
-    else if (strcasecmp(token, "RSHIFT") == 0)
-      m = MOD_SHIFT_RIGHT;
-    else if (strcasecmp(token, "RALT") == 0)
-      m = MOD_ALT_RIGHT;
-    else if (strcasecmp(token, "RGUI") == 0 || strcasecmp(token, "RWIN") == 0 ||
-             strcasecmp(token, "RMETA") == 0 ||
-             strcasecmp(token, "RSUPER") == 0)
-      m = MOD_GUI_RIGHT;
-
-    if (m == 0) {
-      /* This token is not a modifier. */
-      if (remainder)
-        *remainder = mod_str + (token - mod_copy);
-      break;
-    }
-
-    modifiers |= m;
-
-    /* Move remainder to after this token and hyphen if present */
-    if (remainder) {
-      *remainder = mod_str + (token - mod_copy) + strlen(token);
-      if (**remainder == '-')
-        (*remainder)++;
-    }
-
-    token = strtok(NULL, "-");
-  }
-
-  free(mod_copy);
-  return modifiers;
-}
-
-/* Get function key usage code by name */
-uint8_t get_fn_key_usage(const char *key_name) {
-  int i;
-  for (i = 0; fn_keys[i].name != NULL; i++) {
-    if (strcasecmp(key_name, fn_keys[i].name) == 0) {
-      return fn_keys[i].usage;
-    }
-  }
-  return 0;
-}
-
-// Get consumer key usage code by name */
-uint16_t get_consumer_key_usage(const char *key_name) {
-  int i;
-  for (i = 0; consumer_keys[i].name != NULL; i++) {
-    if (strcasecmp(key_name, consumer_keys[i].name) == 0)
-      return consumer_keys[i].usage;
-  }
-  return 0;
-}
-
-/* Internal function to send a raw keyboard report */
-int send_keyboard_report(uint8_t modifiers, uint8_t key1, uint8_t key2,
-                         uint8_t key3, uint8_t key4, uint8_t key5,
-                         uint8_t key6) {
-  if (!g_keyboard_device)
-    return -1;
-
-  int fd = get_cached_fd(g_keyboard_device, &g_fd_keyboard);
-  if (fd < 0)
-    return -1;
-
-  uint8_t report[8] = {modifiers, 0, key1, key2, key3, key4, key5, key6};
-  int ret = write(fd, report, 8);
-  return (ret == 8) ? 0 : -1;
-}
-
-/* Send a single consumer report (press then release) */
-int send_consumer_key(const char *action) {
-  if (!g_consumer_device)
-    return -1;
-  uint16_t usage = get_consumer_key_usage(action);
-  if (usage == 0)
-    return -1;
-
-  int fd = get_cached_fd(g_consumer_device, &g_fd_consumer);
-  if (fd < 0)
-    return -1;
-
-  uint8_t report[2] = {usage & 0xFF, (usage >> 8) & 0xFF};
-  write(fd, report, 2);
-  usleep(50000); // 50ms tap
-  memset(report, 0, 2);
-  write(fd, report, 2);
-  return 0;
-}
-
-/* Reusable function to send a key sequence with optional modifiers */
-int send_key_sequence(const char *modifiers_str, const char *sequence) {
-  if (!g_keyboard_device)
-    return -1;
-
-  // Check if the entire sequence is a consumer key first
-  if (sequence && get_consumer_key_usage(sequence) != 0) {
-    return send_consumer_key(sequence);
-  }
-
-  int fd = get_cached_fd(g_keyboard_device, &g_fd_keyboard);
-  if (fd < 0)
-    return -1;
-
-  uint8_t modifiers = 0;
-  if (modifiers_str) {
-    modifiers = parse_modifiers(modifiers_str, NULL);
-  }
-
-  uint8_t report[8] = {0};
-  report[0] = modifiers;
-
-  if (sequence == NULL || strlen(sequence) == 0) {
-    /* Just send modifiers */
-    write(fd, report, 8);
-    return 0;
-  }
-
-  /* Check for function key */
-  uint8_t fn_usage = get_fn_key_usage(sequence);
-  if (fn_usage != 0) {
-    report[2] = fn_usage;
-    write(fd, report, 8);
-    /* Release if it's a one-shot */
-    report[2] = 0;
-    write(fd, report, 8);
-  } else {
-    /* Regular text */
-    for (size_t i = 0; i < strlen(sequence); i++) {
-      char c = sequence[i];
-      uint8_t usage = 0;
-      uint8_t current_mods = modifiers;
-
-      if ((unsigned char)c < 128)
-        usage = (current_usage_table ? current_usage_table
-                                     : usage_table_us)[(unsigned char)c];
-
-      if (usage != 0) {
-        if (strchr(current_shift_chars ? current_shift_chars : shift_chars_us,
-                   c))
-          current_mods |= MOD_SHIFT_LEFT;
-
-        report[0] = current_mods;
-        report[2] = usage;
-        write(fd, report, 8);
-
-        /* Release */
-        report[0] = modifiers;
-        report[2] = 0;
-        write(fd, report, 8);
-      }
-    }
-  }
-
-  /* Final release if modifiers were used and it's not a holding operation */
-  if (modifiers != 0) {
-    report[0] = 0;
-    report[2] = 0;
-    write(fd, report, 8);
-  }
-
-  return 0;
-}
 
 /* Process a keyboard sequence */
 int process_keyboard(int argc, char *argv[]) {
-  int fd;
-  uint8_t report[KEYBOARD_REPORT_SIZE] = {0};
+  uint8_t report[HID_KEYBOARD_REPORT_SIZE] = {0};
   int opt;
   int hold_keys = 0;
   int release_keys = 0;
   uint8_t modifiers = 0;
-  int i, seq_start = 0;
+  int seq_start = 0;
   // Default delay per key (ms), can be overridden by env HID_KEY_DELAY_MS or
   // --delay wrapper
-  int key_delay_ms = 10;
+  // In poll pacing mode the endpoint paces the keys unless a delay is set.
+  int key_delay_ms = hid_ctx_get_option(g_ctx, HID_OPT_PACING_POLL) ? 0 : 10;
   {
     const char *env_delay = getenv("HID_KEY_DELAY_MS");
     if (env_delay) {
@@ -640,7 +352,7 @@ int process_keyboard(int argc, char *argv[]) {
   }
 
   // --- Check if device path is valid ---
-  if (!g_keyboard_device) {
+  if (!device_path(HID_ROLE_KEYBOARD)) {
     fprintf(stderr, "Error: Keyboard device path not set.\n");
     return EXIT_FAILURE;
   }
@@ -648,6 +360,7 @@ int process_keyboard(int argc, char *argv[]) {
 
   static struct option long_options[] = {{"hold", no_argument, 0, 'h'},
                                          {"release", no_argument, 0, 'r'},
+                                         {"rollover", no_argument, 0, 'o'},
                                          {0, 0, 0, 0}};
 
   // Reset getopt for parsing within a function
@@ -664,6 +377,9 @@ int process_keyboard(int argc, char *argv[]) {
     case 'r':
       release_keys = 1;
       break;
+    case 'o':
+      hid_ctx_set_option(g_ctx, HID_OPT_TYPING_ROLLOVER, 1);
+      break;
     // Handle '?' or ':' for unknown options or missing arguments if needed
     case '?':
     default:
@@ -682,7 +398,7 @@ int process_keyboard(int argc, char *argv[]) {
   const char *sequence = NULL;
   if (seq_start < argc) {
     const char *rem = NULL;
-    uint8_t temp_mods = parse_modifiers(argv[seq_start], &rem);
+    uint8_t temp_mods = hid_parse_modifiers(argv[seq_start], &rem);
 
     if (temp_mods != 0) {
       modifiers = temp_mods;
@@ -703,10 +419,9 @@ int process_keyboard(int argc, char *argv[]) {
   }
 
   /* Open the HID keyboard device */
-  fd = get_cached_fd(g_keyboard_device, &g_fd_keyboard);
-  if (fd < 0) {
+  if (hid_ctx_open(g_ctx, HID_ROLE_KEYBOARD) != 0) {
     fprintf(stderr, "Error opening HID keyboard device (%s): %s\n",
-            g_keyboard_device, strerror(errno));
+            device_path(HID_ROLE_KEYBOARD), strerror(errno));
     return EXIT_FAILURE;
   }
 
@@ -716,8 +431,9 @@ int process_keyboard(int argc, char *argv[]) {
   /* Process key sequence or release */
   if (release_keys) {
     /* Release all keys and modifiers */
-    memset(report, 0, KEYBOARD_REPORT_SIZE);
-    if (write(fd, report, KEYBOARD_REPORT_SIZE) != KEYBOARD_REPORT_SIZE) {
+    memset(report, 0, HID_KEYBOARD_REPORT_SIZE);
+    if (hid_ctx_send_report(g_ctx, HID_ROLE_KEYBOARD, report,
+                            HID_KEYBOARD_REPORT_SIZE) != 0) {
       fprintf(stderr, "Error writing keyboard release report: %s\n",
               strerror(errno));
       return EXIT_FAILURE;
@@ -727,13 +443,14 @@ int process_keyboard(int argc, char *argv[]) {
     int seq_len = strlen(sequence);
 
     /* Check if it's a special function key */
-    uint8_t fn_usage = get_fn_key_usage(sequence);
+    uint8_t fn_usage = hid_fn_key_usage(sequence);
     if (fn_usage != 0) {
       /* Function key */
       report[2] = fn_usage;
 
       /* Send key press */
-      if (write(fd, report, KEYBOARD_REPORT_SIZE) != KEYBOARD_REPORT_SIZE) {
+      if (hid_ctx_send_report(g_ctx, HID_ROLE_KEYBOARD, report,
+                              HID_KEYBOARD_REPORT_SIZE) != 0) {
         fprintf(stderr, "Error writing keyboard report: %s\n", strerror(errno));
         return EXIT_FAILURE;
       }
@@ -741,95 +458,39 @@ int process_keyboard(int argc, char *argv[]) {
       /* If not holding, send key release */
       if (!hold_keys) {
         /* Clear key presses but keep explicit modifiers */
-        memset(&report[2], 0, KEYBOARD_REPORT_SIZE - 2);
+        memset(&report[2], 0, HID_KEYBOARD_REPORT_SIZE - 2);
         // report[0] = modifiers; // Already set
-        if (write(fd, report, KEYBOARD_REPORT_SIZE) != KEYBOARD_REPORT_SIZE) {
+        if (hid_ctx_send_report(g_ctx, HID_ROLE_KEYBOARD, report,
+                                HID_KEYBOARD_REPORT_SIZE) != 0) {
           fprintf(stderr, "Error writing keyboard release report: %s\n",
                   strerror(errno));
           return EXIT_FAILURE;
         }
       }
-    } else {
-      /* Regular keys */
-      for (i = 0; i < seq_len; i++) {
-        char c = sequence[i];
-        uint8_t usage = 0;
-        uint8_t current_modifiers = modifiers; // Start with explicit modifiers
-
-        /* Get usage code */
-        if ((unsigned char)c < 128) {
-          usage = (current_usage_table ? current_usage_table
-                                       : usage_table_us)[(unsigned char)c];
-        }
-
-        if (usage != 0) {
-          /* Add shift modifier if needed */
-          if (strchr(current_shift_chars ? current_shift_chars : shift_chars_us,
-                     c)) {
-            current_modifiers |= MOD_SHIFT_LEFT;
-          }
-
-          /* Set modifiers and key in report */
-          report[0] = current_modifiers;
-          report[2] = usage;
-
-          /* Send key press */
-          if (write(fd, report, KEYBOARD_REPORT_SIZE) != KEYBOARD_REPORT_SIZE) {
-            fprintf(stderr, "Error writing keyboard report for '%c': %s\n", c,
-                    strerror(errno));
-            return EXIT_FAILURE;
-          }
-
-          /* Send key release if not holding */
-          if (!hold_keys) {
-            /* Clear key press */
-            report[2] = 0;
-            /* Restore original explicit modifiers for the release report */
-            report[0] = modifiers;
-
-            if (write(fd, report, KEYBOARD_REPORT_SIZE) !=
-                KEYBOARD_REPORT_SIZE) {
-              fprintf(stderr,
-                      "Error writing keyboard release report for '%c': %s\n", c,
-                      strerror(errno));
-              return EXIT_FAILURE;
-            }
-
-            /* Small delay between keypresses */
-            if (key_delay_ms > 0) {
-              usleep((useconds_t)key_delay_ms * 1000);
-            }
-          }
-        } else {
-          fprintf(stderr,
-                  "Warning: Character '%c' (ASCII %d) not mapped to HID usage "
-                  "code.\n",
-                  c, (unsigned char)c);
-        }
-      }
-      // If holding keys, the last key remains pressed with its modifiers.
-      // If not holding, ensure a final release with only explicit modifiers
-      // is sent.
-      if (!hold_keys && seq_len > 0) {
-        memset(&report[2], 0, KEYBOARD_REPORT_SIZE - 2);
-        report[0] = modifiers; // Restore original explicit modifiers
-        if (write(fd, report, KEYBOARD_REPORT_SIZE) != KEYBOARD_REPORT_SIZE) {
-          fprintf(stderr, "Error writing final keyboard release report: %s\n",
-                  strerror(errno));
-          return EXIT_FAILURE;
-        }
+    } else if (!hold_keys) {
+      /* Regular keys: encoded strokes submitted as one batch, with the
+         per-key delay after each completed keystroke, then released */
+      if (hid_ctx_send_keys(g_ctx, modifiers, sequence, seq_len,
+                            key_delay_ms) != 0) {
+        fprintf(stderr, "Error writing keyboard reports: %s\n",
+                strerror(errno));
+        return EXIT_FAILURE;
       }
-      /* Ensure FULL release including modifiers if not holding */
-      if (!hold_keys && modifiers != 0) {
-        memset(report, 0, KEYBOARD_REPORT_SIZE);
-        write(fd, report, KEYBOARD_REPORT_SIZE);
+    } else {
+      /* Regular keys, held: presses only; the last key remains pressed with
+         its modifiers */
+      if (hid_ctx_press_keys(g_ctx, modifiers, sequence, seq_len) != 0) {
+        fprintf(stderr, "Error writing keyboard report: %s\n",
+                strerror(errno));
+        return EXIT_FAILURE;
       }
     }
   } else if (modifiers != 0 && !release_keys) {
     // Only modifiers were given (and not --release)
     // Send a report with just modifiers pressed, no keys.
     // User must explicitly call --release later to clear modifiers.
-    if (write(fd, report, KEYBOARD_REPORT_SIZE) != KEYBOARD_REPORT_SIZE) {
+    if (hid_ctx_send_report(g_ctx, HID_ROLE_KEYBOARD, report,
+                            HID_KEYBOARD_REPORT_SIZE) != 0) {
       fprintf(stderr, "Error writing modifier-only report: %s\n",
               strerror(errno));
       return EXIT_FAILURE;
@@ -844,77 +505,155 @@ int process_keyboard(int argc, char *argv[]) {
   return EXIT_SUCCESS;
 }
 
-/* Mouse Helper Functions */
-int send_mouse_move(int8_t x, int8_t y) {
-  if (!g_mouse_device)
-    return -1;
-  int fd = get_cached_fd(g_mouse_device, &g_fd_mouse);
-  if (fd < 0)
-    return -1;
-
-  uint8_t report[8] = {0};
-  report[1] = x;
-  report[2] = y;
-
-  if (write(fd, report, g_mouse_report_size) != g_mouse_report_size) {
-    return -1;
+/* Prints (or with --reset, clears) the statistics accumulated in the stats
+ * file: `stats [--reset] [file]`, file defaulting to HID_STATS_FILE. */
+int process_stats(int argc, char *argv[]) {
+  int reset = 0;
+  const char *path = g_stats_file;
+  for (int i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "--reset") == 0)
+      reset = 1;
+    else
+      path = argv[i];
+  }
+  /* A daemon also reports what it has written since it started */
+  if (g_daemon_mode && !reset) {
+    for (int r = 0; r < HID_ROLE_COUNT; r++) {
+      struct hid_stats st;
+      hid_ctx_get_stats(g_ctx, (enum hid_role)r, &st);
+      if (st.writes)
+        hid_stats_print(stdout, hid_role_names[r], &st);
+    }
+    struct hid_timing_stats ts;
+    hid_ctx_get_timing(g_ctx, &ts);
+    hid_timing_print(stdout, &ts);
+    print_shm_stats(stdout);
+    if (!path)
+      return EXIT_SUCCESS;
+  }
+  if (!path) {
+    fprintf(stderr, "Error: No stats file. Set HID_STATS_FILE (where runs "
+                    "accumulate) or pass a path.\n");
+    return EXIT_FAILURE;
   }
 
-  // Minimal zero report to ensure state is clean? Not strictly required for
-  // relative moves but good for consistency.
-  memset(report, 0, g_mouse_report_size);
-  // write(fd, report, g_mouse_report_size);
+  if (reset) {
+    if (unlink(path) != 0 && errno != ENOENT) {
+      fprintf(stderr, "Error: Cannot reset %s: %s\n", path, strerror(errno));
+      return EXIT_FAILURE;
+    }
+    return EXIT_SUCCESS;
+  }
 
-  return 0;
+  struct hid_stats st[HID_ROLE_COUNT];
+  if (hid_stats_load(path, hid_role_names, st, HID_ROLE_COUNT) != 0) {
+    if (errno == ENOENT) {
+      printf("No statistics recorded yet in %s\n", path);
+      return EXIT_SUCCESS;
+    }
+    fprintf(stderr, "Error: Cannot read %s: %s\n", path, strerror(errno));
+    return EXIT_FAILURE;
+  }
+  for (int r = 0; r < HID_ROLE_COUNT; r++) {
+    if (st[r].writes)
+      hid_stats_print(stdout, hid_role_names[r], &st[r]);
+  }
+  return EXIT_SUCCESS;
 }
 
-int send_mouse_press(uint8_t button) {
-  if (!g_mouse_device)
-    return -1;
-  int fd = get_cached_fd(g_mouse_device, &g_fd_mouse);
-  if (fd < 0)
-    return -1;
-
-  uint8_t report[8] = {0};
-  report[0] = button;
+/* Re-emits a capture: `replay [--speed N|--fast] [--max-gap MS] <file>`.
+ * Record one with HID_OUTPUT=record:FILE (or capture:FILE for dry runs). */
+int process_replay(int argc, char *argv[]) {
+  struct hid_replay_opts opts = {.speed = 1.0};
+  const char *path = NULL;
+  for (int i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "--fast") == 0) {
+      opts.speed = 0;
+    } else if (strcmp(argv[i], "--speed") == 0 && i + 1 < argc) {
+      char *end;
+      opts.speed = strtod(argv[++i], &end);
+      if (end == argv[i] || (*end && strcmp(end, "x") != 0) ||
+          opts.speed < 0) {
+        fprintf(stderr, "Error: Invalid speed '%s'\n", argv[i]);
+        return EXIT_FAILURE;
+      }
+    } else if (strcmp(argv[i], "--max-gap") == 0 && i + 1 < argc) {
+      opts.max_gap_ns = (uint64_t)atoi(argv[++i]) * 1000000ull;
+    } else {
+      path = argv[i];
+    }
+  }
+  if (!path) {
+    fprintf(stderr, "Error: replay requires a capture file.\n");
+    return EXIT_FAILURE;
+  }
 
-  if (write(fd, report, g_mouse_report_size) != g_mouse_report_size) {
-    return -1;
+  struct hid_capture cap;
+  if (hid_capture_map(&cap, path) != 0) {
+    fprintf(stderr, "Error: Cannot read capture %s: %s\n", path,
+            errno == EINVAL ? "not a capture file of this version"
+                            : strerror(errno));
+    return EXIT_FAILURE;
   }
-  return 0;
+  struct hid_replay_result res;
+  int ret = hid_ctx_replay(g_ctx, &cap, &opts, &res);
+  int err = errno;
+  hid_capture_unmap(&cap);
+
+  fprintf(stderr, "[HID-REPLAY] %zu reports in %.1f ms, %zu late (max %.1f "
+                  "us)\n",
+          res.reports, res.elapsed_ns / 1e6, res.late_reports,
+          res.max_late_ns / 1e3);
+  if (ret != 0) {
+    fprintf(stderr, "Error: Replay stopped after %zu reports: %s\n",
+            res.reports, strerror(err));
+    return EXIT_FAILURE;
+  }
+  return EXIT_SUCCESS;
 }
 
-int send_mouse_release() {
-  if (!g_mouse_device)
-    return -1;
-  int fd = get_cached_fd(g_mouse_device, &g_fd_mouse);
-  if (fd < 0)
-    return -1;
-
-  uint8_t report[8] = {0};
-  if (write(fd, report, g_mouse_report_size) != g_mouse_report_size) {
-    return -1;
+/* `mouse moveto X Y`: one report on the absolute pointer. X and Y are
+ * pixels of HID_SCREEN, logical units 0..32767 without it, or "N%". */
+static int process_mouse_moveto(int argc, char *argv[]) {
+  int x, y;
+  if (argc < 4) {
+    fprintf(stderr, "Error: moveto requires X Y parameters\n");
+    return EXIT_FAILURE;
   }
-  return 0;
+  if (hid_ctx_parse_coordinate(g_ctx, 0, argv[2], &x) != 0 ||
+      hid_ctx_parse_coordinate(g_ctx, 1, argv[3], &y) != 0) {
+    fprintf(stderr, "Error: Invalid coordinates '%s %s'\n", argv[2],
+            argv[3]);
+    return EXIT_FAILURE;
+  }
+  if (!device_path(HID_ROLE_ABSOLUTE)) {
+    fprintf(stderr, "Error: Absolute pointer not set up (run hid-setup with "
+                    "HID_ABSOLUTE=1).\n");
+    return EXIT_FAILURE;
+  }
+  if (hid_ctx_open(g_ctx, HID_ROLE_ABSOLUTE) != 0) {
+    fprintf(stderr, "Error opening HID absolute pointer (%s): %s\n",
+            device_path(HID_ROLE_ABSOLUTE), strerror(errno));
+    return EXIT_FAILURE;
+  }
+  if (hid_ctx_send_absolute(g_ctx, 0, x, y) != 0) {
+    fprintf(stderr, "Error writing absolute pointer report: %s\n",
+            strerror(errno));
+    return EXIT_FAILURE;
+  }
+  return EXIT_SUCCESS;
 }
 
-int send_mouse_click(uint8_t button) {
-  if (send_mouse_press(button) != 0)
-    return -1;
-  usleep(30000); // 30ms
-  return send_mouse_release();
-}
 int process_mouse(int argc, char *argv[]) {
-  int fd;
   // Mouse report: [Buttons] [X delta] [Y delta] [VScroll delta] [HScroll
-  // delta (optional)] Use a buffer large enough for both 4- and 5-byte
-  // reports
-  uint8_t report[8] = {0};
-  // Some descriptors might use 5 bytes to include HScroll separately.
-  // Adapt MOUSE_REPORT_SIZE and indexing if necessary.
+  // delta (optional)], built by the library for the configured report size
+
+  /* moveto goes to the absolute pointer, not this device */
+  if (argc >= 2 && strcmp(argv[1], "moveto") == 0)
+    return process_mouse_moveto(argc, argv);
 
   // --- Check if device path is valid ---
-  if (!g_mouse_device) {
+  if (!device_path(HID_ROLE_MOUSE)) {
     fprintf(stderr, "Error: Mouse device path not set.\n");
     return EXIT_FAILURE;
   }
@@ -929,9 +668,8 @@ int process_mouse(int argc, char *argv[]) {
   }
 
   /* Open the HID mouse device */
-  fd = get_cached_fd(g_mouse_device, &g_fd_mouse);
-  if (fd < 0) {
-    fprintf(stderr, "Error opening HID mouse device (%s): %s\n", g_mouse_device,
+  if (hid_ctx_open(g_ctx, HID_ROLE_MOUSE) != 0) {
+    fprintf(stderr, "Error opening HID mouse device (%s): %s\n", device_path(HID_ROLE_MOUSE),
             strerror(errno));
     return EXIT_FAILURE;
   }
@@ -944,77 +682,96 @@ int process_mouse(int argc, char *argv[]) {
       return EXIT_FAILURE;
     }
 
-    long x_val_long = strtol(argv[2], NULL, 10);
-    long y_val_long = strtol(argv[3], NULL, 10);
-
-    // Clamp values to int8_t range (-127 to 127)
-    // Note: HID uses signed 8-bit relative values.
-    int8_t x = (x_val_long > 127)
-                   ? 127
-                   : ((x_val_long < -127) ? -127 : (int8_t)x_val_long);
-    int8_t y = (y_val_long > 127)
-                   ? 127
-                   : ((y_val_long < -127) ? -127 : (int8_t)y_val_long);
-
-    // close(fd); // Helper opens its own, but we are in process_mouse which used to open manually.
-    // Actually send_mouse_move calls get_cached_fd too.
-    // If we are calling helper functions like send_mouse_move, we don't need to open FD here necessarily,
-    // BUT process_mouse does write() directly in "up" and "scroll" cases.
-    // Wait, "move" calls send_mouse_move. "click" calls send_mouse_click. "down" calls send_mouse_press.
-    // "up" does write() manually. "scroll" does write() manually.
-    // So for "move", "click", "down", we just call the helper.
-    // For "up", "scroll", we use `fd` obtained above.
-    // Since `get_cached_fd` returns the SAME fd, it works.
-
-    if (send_mouse_move(x, y) != 0)
+    // Any 32-bit delta: the library splits it into as few reports as the
+    // mouse format (or HID_MOUSE_STEP_MAX) allows
+    long long x_val = strtoll(argv[2], NULL, 10);
+    long long y_val = strtoll(argv[3], NULL, 10);
+    int32_t x = (int32_t)(x_val > INT32_MAX   ? INT32_MAX
+                          : x_val < -INT32_MAX ? -INT32_MAX
+                                               : x_val);
+    int32_t y = (int32_t)(y_val > INT32_MAX   ? INT32_MAX
+                          : y_val < -INT32_MAX ? -INT32_MAX
+                                               : y_val);
+
+    if (hid_ctx_send_mouse_motion(g_ctx, 0, x, y) != 0)
+      return EXIT_FAILURE;
+
+  } else if (strcmp(action, "path") == 0 || strcmp(action, "drag") == 0) {
+    int drag = action[0] == 'd';
+    int first = 2;
+    uint8_t button = drag ? HID_MOUSE_BTN_LEFT : 0;
+    if (drag && argc > 2) { // Optional button before the path
+      if (strcasecmp(argv[2], "right") == 0)
+        button = HID_MOUSE_BTN_RIGHT;
+      else if (strcasecmp(argv[2], "middle") == 0)
+        button = HID_MOUSE_BTN_MIDDLE;
+      if (button != HID_MOUSE_BTN_LEFT || strcasecmp(argv[2], "left") == 0)
+        first = 3;
+    }
+
+    struct hid_path path;
+    if (hid_path_parse(&path, argc - first, argv + first) != 0) {
+      fprintf(stderr, "Error: %s requires line|bezier|arc <ms> and the "
+                      "path's points\n", action);
+      return EXIT_FAILURE;
+    }
+    if (button && hid_ctx_send_mouse_press(g_ctx, button) != 0)
+      return EXIT_FAILURE;
+    int failed = hid_ctx_send_mouse_path(g_ctx, button, &path) != 0;
+    if (button && hid_ctx_send_mouse_release(g_ctx) != 0)
+      failed = 1;
+    if (failed) {
+      fprintf(stderr, "Error writing mouse path reports: %s\n",
+              strerror(errno));
       return EXIT_FAILURE;
+    }
 
   } else if (strcmp(action, "click") == 0) {
-    uint8_t button = MOUSE_BTN_LEFT; /* Default to left button */
+    uint8_t button = HID_MOUSE_BTN_LEFT; /* Default to left button */
 
     if (argc > 2) { // Check argv[2] for button type
       if (strcasecmp(argv[2], "right") == 0) {
-        button = MOUSE_BTN_RIGHT;
+        button = HID_MOUSE_BTN_RIGHT;
       } else if (strcasecmp(argv[2], "middle") == 0) {
-        button = MOUSE_BTN_MIDDLE;
+        button = HID_MOUSE_BTN_MIDDLE;
       } else if (strcasecmp(argv[2], "left") != 0) {
         fprintf(stderr,
                 "Warning: Unknown button '%s' for click, defaulting to left.\n",
                 argv[2]);
       }
     }
-    if (send_mouse_click(button) != 0)
+    if (hid_ctx_send_mouse_click(g_ctx, button) != 0)
       return EXIT_FAILURE;
 
   } else if (strcmp(action, "doubleclick") == 0) {
-    uint8_t button = MOUSE_BTN_LEFT; /* Double-click is typically left button */
+    uint8_t button = HID_MOUSE_BTN_LEFT; /* Double-click is typically left button */
 
     // Argument check (should not have extra args)
     if (argc > 2) {
       fprintf(stderr,
               "Warning: doubleclick does not take additional arguments.\n");
     }
-    if (send_mouse_click(button) != 0)
+    if (hid_ctx_send_mouse_click(g_ctx, button) != 0)
       return EXIT_FAILURE;
     usleep(100000);
-    if (send_mouse_click(button) != 0)
+    if (hid_ctx_send_mouse_click(g_ctx, button) != 0)
       return EXIT_FAILURE;
 
   } else if (strcmp(action, "down") == 0) {
-    uint8_t button = MOUSE_BTN_LEFT; /* Default to left button */
+    uint8_t button = HID_MOUSE_BTN_LEFT; /* Default to left button */
 
     if (argc > 2) { // Check argv[2] for button type
       if (strcasecmp(argv[2], "right") == 0) {
-        button = MOUSE_BTN_RIGHT;
+        button = HID_MOUSE_BTN_RIGHT;
       } else if (strcasecmp(argv[2], "middle") == 0) {
-        button = MOUSE_BTN_MIDDLE;
+        button = HID_MOUSE_BTN_MIDDLE;
       } else if (strcasecmp(argv[2], "left") != 0) {
         fprintf(stderr,
                 "Warning: Unknown button '%s' for down, defaulting to left.\n",
                 argv[2]);
       }
     }
-    if (send_mouse_press(button) != 0)
+    if (hid_ctx_send_mouse_press(g_ctx, button) != 0)
       return EXIT_FAILURE;
 
   } else if (strcmp(action, "up") == 0) {
@@ -1022,52 +779,36 @@ int process_mouse(int argc, char *argv[]) {
     if (argc > 2) {
       fprintf(stderr, "Warning: up does not take additional arguments.\n");
     }
-    if (write(fd, report, g_mouse_report_size) != g_mouse_report_size) {
+    if (hid_ctx_send_mouse_release(g_ctx) != 0) {
       fprintf(stderr, "Error writing mouse button release report: %s\n",
               strerror(errno));
       return EXIT_FAILURE;
     }
   } else if (strcmp(action, "scroll") == 0) {
-    if (argc < 3) { // Need action + V [H] (argv[1], argv[2], [argv[3]])
-      fprintf(stderr, "Error: scroll requires V [H] parameters (Vertical, "
-                      "optional Horizontal)\n");
+    if (argc < 3) { // Need action + V [H [MS]] (argv[1], argv[2], ...)
+      fprintf(stderr, "Error: scroll requires V [H [MS]] parameters "
+                      "(Vertical, optional Horizontal and duration)\n");
       return EXIT_FAILURE;
     }
 
-    long v_val_long = strtol(argv[2], NULL, 10);
-    long h_val_long = (argc > 3) ? strtol(argv[3], NULL, 10) : 0; // Optional H
-
-    // Clamp values to int8_t range (-127 to 127)
-    int8_t vertical = (v_val_long > 127)
-                          ? 127
-                          : ((v_val_long < -127) ? -127 : (int8_t)v_val_long);
-    int8_t horizontal = (h_val_long > 127)
-                            ? 127
-                            : ((h_val_long < -127) ? -127 : (int8_t)h_val_long);
-
-    // Vertical scroll always at byte 3; optional horizontal at byte 4 when
-    // enabled
-    report[3] = vertical;
-    if (g_mouse_support_hscroll && g_mouse_report_size >= 5) {
-      report[4] = horizontal;
-    } else if (horizontal != 0) {
+    // Detents, fractions included: with a hi-res wheel (HID_MOUSE_HIRES)
+    // each is several counts, spread over MS milliseconds if given
+    double vertical = strtod(argv[2], NULL);
+    double horizontal = (argc > 3) ? strtod(argv[3], NULL) : 0; // Optional H
+    int duration_ms = (argc > 4) ? atoi(argv[4]) : 0;
+
+    if (horizontal != 0 && !hid_ctx_get_option(g_ctx, HID_OPT_MOUSE_HSCROLL)) {
       fprintf(stderr, "Warning: Horizontal scroll requested but not enabled "
                       "(set HID_MOUSE_HSCROLL=1).\n");
+      horizontal = 0;
     }
 
-    if (write(fd, report, g_mouse_report_size) != g_mouse_report_size) {
+    if (hid_ctx_send_mouse_wheel(g_ctx, vertical, horizontal, duration_ms) !=
+        0) {
       fprintf(stderr, "Error writing mouse scroll report: %s\n",
               strerror(errno));
       return EXIT_FAILURE;
     }
-    // Send a zero report immediately after scroll to stop it
-    memset(report, 0, g_mouse_report_size);
-    usleep(10000); // Small delay before zero report
-    if (write(fd, report, g_mouse_report_size) != g_mouse_report_size) {
-      fprintf(stderr, "Warning: Error writing zero scroll report: %s\n",
-              strerror(errno));
-      // Non-fatal, scroll likely still occurred.
-    }
 
   } else {
     fprintf(stderr, "Error: Unknown mouse action '%s'\n", action);
@@ -1079,11 +820,10 @@ int process_mouse(int argc, char *argv[]) {
 
 /* Process consumer control commands */
 int process_consumer(int argc, char *argv[]) {
-  int fd;
-  uint8_t report[CONSUMER_REPORT_SIZE] = {0};
+  uint8_t report[HID_CONSUMER_REPORT_SIZE] = {0};
 
   // --- Check if device path is valid ---
-  if (!g_consumer_device) {
+  if (!device_path(HID_ROLE_CONSUMER)) {
     fprintf(stderr, "Error: Consumer device path not set.\n");
     return EXIT_FAILURE;
   }
@@ -1098,15 +838,14 @@ int process_consumer(int argc, char *argv[]) {
   }
 
   /* Open the HID consumer device */
-  fd = get_cached_fd(g_consumer_device, &g_fd_consumer);
-  if (fd < 0) {
+  if (hid_ctx_open(g_ctx, HID_ROLE_CONSUMER) != 0) {
     fprintf(stderr, "Error opening HID consumer device (%s): %s\n",
-            g_consumer_device, strerror(errno));
+            device_path(HID_ROLE_CONSUMER), strerror(errno));
     return EXIT_FAILURE;
   }
 
   const char *action = argv[1]; // Action is now argv[1]
-  uint16_t usage = get_consumer_key_usage(action);
+  uint16_t usage = hid_consumer_key_usage(action);
 
   if (usage == 0) {
     fprintf(stderr, "Error: Unknown consumer control action '%s'\n", action);
@@ -1118,17 +857,19 @@ int process_consumer(int argc, char *argv[]) {
   report[1] = (usage >> 8) & 0xFF;
 
   /* Send key press */
-  if (write(fd, report, CONSUMER_REPORT_SIZE) != CONSUMER_REPORT_SIZE) {
+  if (hid_ctx_send_report(g_ctx, HID_ROLE_CONSUMER, report,
+                          HID_CONSUMER_REPORT_SIZE) != 0) {
     fprintf(stderr, "Error writing consumer report: %s\n", strerror(errno));
     return EXIT_FAILURE;
   }
 
   /* Short delay (necessary for consumer controls) */
-  usleep(50000); // 50ms
+  hid_ctx_tap_hold(g_ctx, 50000); // 50ms
 
   /* Send key release */
-  memset(report, 0, CONSUMER_REPORT_SIZE);
-  if (write(fd, report, CONSUMER_REPORT_SIZE) != CONSUMER_REPORT_SIZE) {
+  memset(report, 0, HID_CONSUMER_REPORT_SIZE);
+  if (hid_ctx_send_report(g_ctx, HID_ROLE_CONSUMER, report,
+                          HID_CONSUMER_REPORT_SIZE) != 0) {
     fprintf(stderr, "Error writing consumer release report: %s\n",
             strerror(errno));
     return EXIT_FAILURE;
@@ -1137,38 +878,49 @@ int process_consumer(int argc, char *argv[]) {
   return EXIT_SUCCESS;
 }
 
-int main(int argc, char *argv[]) {
-  // Allow environment overrides first
-  load_env_devices();
-  // Configure optional mouse capabilities from env (HID_MOUSE_HSCROLL /
-  // HID_MOUSE_REPORT_SIZE)
-  {
-    const char *sz = getenv("HID_MOUSE_REPORT_SIZE");
-    const char *hs = getenv("HID_MOUSE_HSCROLL");
-    if (sz) {
-      int v = atoi(sz);
-      if (v == 5 || v == 4) {
-        g_mouse_report_size = v;
-      }
-    }
-    if (hs && (strcmp(hs, "1") == 0 || strcasecmp(hs, "true") == 0 ||
-               strcasecmp(hs, "yes") == 0)) {
-      g_mouse_support_hscroll = 1;
-      if (g_mouse_report_size < 5)
-        g_mouse_report_size = 5;
-    }
+/* Routes roles to the registry devices named by HID_DEVICE, if set */
+static int apply_device_env(void) {
+  const char *spec = getenv("HID_DEVICE");
+  if (!spec || !*spec)
+    return 0;
+  if (hid_ctx_select_devices(g_ctx, spec) != 0) {
+    fprintf(stderr, "Error: HID_DEVICE '%s': %s\n", spec, strerror(errno));
+    return -1;
   }
-  // Attempt to discover devices; may return fewer than 3 and that's OK.
-  find_hidg_devices();
-
-  // Register cleanup function to free memory on exit
-  atexit(cleanup_device_paths);
-  atexit(close_hid_fds);
+  return 0;
+}
 
-  if (argc < 2) {
-    print_usage(argv[0]); // Will exit
+/* `devices`: the device registry, one node per line */
+static int process_devices(void) {
+  struct hid_device_info info;
+  for (int i = 0; i < hid_ctx_device_count(g_ctx); i++) {
+    if (hid_ctx_device_info(g_ctx, i, &info) != 0 || !info.path)
+      continue;
+    printf("%2d  %-8s %-12s %s%s\n", i, info.name,
+           info.composite  ? "composite"
+           : info.kind >= 0 ? hid_role_names[info.kind]
+                            : "?",
+           info.path,
+           info.selected >= 0 ? "  *" : "");
+    if (info.selected >= 0 && !info.composite && info.selected != info.kind)
+      printf("      (selected as %s)\n", hid_role_names[info.selected]);
   }
+  return EXIT_SUCCESS;
+}
 
+/* Runs one subcommand; argv[0] is the program name, argv[1] the command.
+ * Shared by the CLI and the daemon. */
+static int dispatch_command(int argc, char *argv[]) {
+  // `--device SPEC <command> ...`: route roles before running the command
+  if (argc >= 4 && strcmp(argv[1], "--device") == 0) {
+    if (hid_ctx_select_devices(g_ctx, argv[2]) != 0) {
+      fprintf(stderr, "Error: --device '%s': %s\n", argv[2],
+              strerror(errno));
+      return EXIT_FAILURE;
+    }
+    argv[2] = argv[0];
+    return dispatch_command(argc - 2, argv + 2);
+  }
   const char *command = argv[1];
 
   // Shift arguments for sub-functions
@@ -1176,44 +928,56 @@ int main(int argc, char *argv[]) {
   // and the subsequent arguments starting from argv[1]
   int result = EXIT_FAILURE; // Default result
   if (strcmp(command, "keyboard") == 0) {
-    if (!g_keyboard_device)
+    if (!device_path(HID_ROLE_KEYBOARD))
       attempt_hid_recovery();
-    if (!g_keyboard_device) {
+    if (!device_path(HID_ROLE_KEYBOARD)) {
       fprintf(stderr, "Error: No keyboard device available. Set "
                       "HID_KEYBOARD_DEV or run setup.\n");
       return EXIT_FAILURE;
     }
     result = process_keyboard(argc - 1, &argv[1]);
   } else if (strcmp(command, "mouse") == 0) {
-    if (!g_mouse_device)
+    if (!device_path(HID_ROLE_MOUSE))
       attempt_hid_recovery();
-    if (!g_mouse_device) {
+    if (!device_path(HID_ROLE_MOUSE)) {
       fprintf(stderr, "Error: No mouse device available. Set HID_MOUSE_DEV or "
                       "run setup.\n");
       return EXIT_FAILURE;
     }
     result = process_mouse(argc - 1, &argv[1]);
   } else if (strcmp(command, "consumer") == 0) {
-    if (!g_consumer_device)
+    if (!device_path(HID_ROLE_CONSUMER))
       attempt_hid_recovery();
-    if (!g_consumer_device) {
+    if (!device_path(HID_ROLE_CONSUMER)) {
       fprintf(stderr, "Error: No consumer device available. Set "
                       "HID_CONSUMER_DEV or run setup.\n");
       return EXIT_FAILURE;
     }
     result = process_consumer(argc - 1, &argv[1]);
+  } else if (strcmp(command, "tui") == 0 && g_daemon_mode) {
+    fprintf(stderr, "Error: The TUI needs a terminal; run it without the "
+                    "daemon.\n");
   } else if (strcmp(command, "tui") == 0) {
-    if (!g_keyboard_device)
+    if (!device_path(HID_ROLE_KEYBOARD))
       attempt_hid_recovery();
-    if (!g_keyboard_device) {
+    if (!device_path(HID_ROLE_KEYBOARD)) {
       fprintf(stderr, "Error: No keyboard device available for TUI.\n");
       return EXIT_FAILURE;
     }
     result = run_tui();
+  } else if (strcmp(command, "stats") == 0) {
+    result = process_stats(argc - 1, &argv[1]);
+  } else if (strcmp(command, "devices") == 0) {
+    result = process_devices();
+  } else if (strcmp(command, "replay") == 0) {
+    if (!device_path(HID_ROLE_KEYBOARD) && !device_path(HID_ROLE_MOUSE) &&
+        !device_path(HID_ROLE_CONSUMER))
+      attempt_hid_recovery();
+    result = process_replay(argc - 1, &argv[1]);
   } else if (strcmp(command, "ducky") == 0) {
-    if (!g_keyboard_device)
+    if (!device_path(HID_ROLE_KEYBOARD))
       attempt_hid_recovery();
-    if (!g_keyboard_device) {
+    if (!device_path(HID_ROLE_KEYBOARD)) {
       // Ducky needs keyboard usually
       fprintf(stderr,
               "Warning: No keyboard device found. Ducky scripts might fail.\n");
@@ -1237,122 +1001,243 @@ int main(int argc, char *argv[]) {
     result = ducky_execute_script(script);
   } else {
     fprintf(stderr, "Error: Unknown command '%s'\n", command);
-    print_usage(argv[0]); // Will exit
+    if (!g_daemon_mode)
+      print_usage(argv[0]); // Will exit
   }
 
+
   // cleanup_device_paths(); // Called automatically by atexit
   return result;
 }
 
-/* --- DuckyScript Support Impl --- */
-static uint8_t g_held_keys[6] = {0};
-static uint8_t g_held_mods = 0;
-
-void hid_sleep(int ms) { usleep(ms * 1000); }
-
-static void send_held_state() {
-  send_keyboard_report(g_held_mods, g_held_keys[0], g_held_keys[1],
-                       g_held_keys[2], g_held_keys[3], g_held_keys[4],
-                       g_held_keys[5]);
+/* Daemon request handler: one command, then a clean slate for the next */
+static int daemon_command(int argc, char *argv[]) {
+  int rollover = hid_ctx_get_option(g_ctx, HID_OPT_TYPING_ROLLOVER);
+  if (strcmp(argv[1], "daemon") == 0 || strcmp(argv[1], "send") == 0) {
+    fprintf(stderr, "Error: '%s' cannot be sent to the daemon.\n", argv[1]);
+    return EXIT_FAILURE;
+  }
+  pthread_mutex_lock(&g_output_lock);
+  g_recovery_attempted = 0;
+  // The client's HID_DEVICE is only installed while this handler runs
+  int result =
+      apply_device_env() == 0 ? dispatch_command(argc, argv) : EXIT_FAILURE;
+  if (hid_ctx_flush(g_ctx) != 0 && result == EXIT_SUCCESS)
+    result = EXIT_FAILURE;
+  // Undo HID_DEVICE / --device / DEVICE selections
+  hid_ctx_select_devices(g_ctx, "default");
+  if (g_daemon_device)
+    hid_ctx_select_devices(g_ctx, g_daemon_device);
+  pthread_mutex_unlock(&g_output_lock);
+  hid_ctx_set_option(g_ctx, HID_OPT_TYPING_ROLLOVER, rollover);
+  ducky_reset();
+  return result;
 }
 
-uint8_t get_key_code(const char *name) {
-  // Basic lookup - minimal implementation using usage_table reverse or helper?
-  // For now, rely on utility provided or brute force usage_table?
-  // Actually send_key_sequence does lookup internaly.
-  // We need a helper to get code from name.
-  // Let's iterate usage table? No, it's ASCII to code.
-  // We need string ("ENTER") to code.
-  // fn_keys has this!
-  for (int i = 0; fn_keys[i].name != NULL; i++) {
-    if (strcasecmp(name, fn_keys[i].name) == 0)
-      return fn_keys[i].usage;
+/* `daemon [--socket PATH] [--shm] [--shm-path FILE] [--shm-slots N]`:
+ * serve commands (and drain the report ring) until SIGTERM/SIGINT */
+static int run_daemon(int argc, char *argv[]) {
+  const char *path = NULL;
+  const char *shm_path = NULL;
+  int shm = 0;
+  size_t shm_slots = HID_SHM_DEFAULT_SLOTS;
+  for (int i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "--socket") == 0 && i + 1 < argc) {
+      path = argv[++i];
+    } else if (strcmp(argv[i], "--shm") == 0) {
+      shm = 1;
+    } else if (strcmp(argv[i], "--shm-path") == 0 && i + 1 < argc) {
+      shm = 1;
+      shm_path = argv[++i];
+    } else if (strcmp(argv[i], "--shm-slots") == 0 && i + 1 < argc) {
+      shm = 1;
+      int v = atoi(argv[++i]);
+      if (v > 0)
+        shm_slots = (size_t)v;
+    }
   }
-  // Check ASCII
-  if (strlen(name) == 1) {
-    unsigned char c = (unsigned char)name[0];
-    if (c < 128)
-      return (current_usage_table ? current_usage_table : usage_table_us)[c];
+  path = hid_daemon_socket_path(path);
+
+  if (!device_path(HID_ROLE_KEYBOARD) && !device_path(HID_ROLE_MOUSE) &&
+      !device_path(HID_ROLE_CONSUMER))
+    attempt_hid_recovery();
+  /* Pin HID_SYSROOT / HID_GADGET_DIR before clients' variables come and go
+   * around writer threads that read them */
+  hid_sysroot();
+  const char *device = getenv("HID_DEVICE");
+  if (device && *device)
+    g_daemon_device = strdup(device);
+  g_daemon_mode = 1;
+  fprintf(stderr, "[HID-DAEMON] Listening on %s (keyboard=%s mouse=%s "
+                  "consumer=%s)\n",
+          path, device_path(HID_ROLE_KEYBOARD) ? device_path(HID_ROLE_KEYBOARD) : "-",
+          device_path(HID_ROLE_MOUSE) ? device_path(HID_ROLE_MOUSE) : "-",
+          device_path(HID_ROLE_CONSUMER) ? device_path(HID_ROLE_CONSUMER) : "-");
+  if (shm) {
+    g_shm = hid_shm_server_start(shm_path, shm_slots, shm_sink);
+    if (!g_shm) {
+      fprintf(stderr, "Error: Cannot create the report ring%s%s: %s\n",
+              shm_path ? " at " : "", shm_path ? shm_path : "",
+              strerror(errno));
+      return EXIT_FAILURE;
+    }
+    hid_daemon_share_fd(hid_shm_server_fd(g_shm));
+    fprintf(stderr, "[HID-DAEMON] Report ring: %u slots (%s)\n",
+            hid_shm_server_header(g_shm)->capacity,
+            shm_path ? shm_path : "memfd, ask the socket for 'shm-fd'");
   }
-  return 0;
+  int served = hid_daemon_serve(path, daemon_command);
+  int err = errno;
+  if (g_shm) {
+    hid_daemon_share_fd(-1);
+    hid_shm_server_stop(g_shm);
+    g_shm = NULL;
+    hid_ctx_flush(g_ctx);
+  }
+  if (served != 0) {
+    fprintf(stderr, "Error: Cannot serve on %s: %s\n", path, strerror(err));
+    return EXIT_FAILURE;
+  }
+  fprintf(stderr, "[HID-DAEMON] Stopped.\n");
+  return EXIT_SUCCESS;
 }
 
-int hold_key(const char *key_name) {
-  if (strcasecmp(key_name, "CTRL") == 0)
-    g_held_mods |= (MOD_CTRL_LEFT);
-  else if (strcasecmp(key_name, "SHIFT") == 0)
-    g_held_mods |= (MOD_SHIFT_LEFT);
-  else if (strcasecmp(key_name, "ALT") == 0)
-    g_held_mods |= (MOD_ALT_LEFT);
-  else if (strcasecmp(key_name, "GUI") == 0 ||
-           strcasecmp(key_name, "WINDOWS") == 0)
-    g_held_mods |= (MOD_GUI_LEFT);
-  else {
-    uint8_t code = get_key_code(key_name);
-    if (code) {
-      for (int i = 0; i < 6; i++) {
-        if (g_held_keys[i] == 0) {
-          g_held_keys[i] = code;
-          break;
-        }
-      }
+/* `setup [--dry-run]`: create or fix the gadget natively (hid_configfs.h) */
+static int run_setup(int argc, char *argv[]) {
+  struct hid_gadget_spec spec;
+  struct hid_gadget_changes changes;
+  char desc[256];
+  if (hid_gadget_spec_default(&spec, hid_sysroot()) != 0) {
+    fprintf(stderr, "Error: Cannot read the HID descriptors: %s\n",
+            strerror(errno));
+    return EXIT_FAILURE;
+  }
+  for (int i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "--dry-run") == 0) {
+      spec.dry_run = 1;
+    } else {
+      fprintf(stderr, "Error: Unknown setup option '%s'\n", argv[i]);
+      return EXIT_FAILURE;
     }
   }
-  send_held_state();
-  return 0;
+  if (hid_gadget_reconcile(&spec, &changes) != 0) {
+    fprintf(stderr, "Error: Gadget setup failed: %s\n", changes.why);
+    return EXIT_FAILURE;
+  }
+  hid_gadget_describe(desc, sizeof(desc), &changes);
+  fprintf(stderr, "[HID-SETUP] %s%s\n", spec.dry_run ? "would: " : "", desc);
+  return EXIT_SUCCESS;
 }
 
-int release_key(const char *key_name) {
-  if (strcasecmp(key_name, "CTRL") == 0)
-    g_held_mods &= ~(MOD_CTRL_LEFT);
-  else if (strcasecmp(key_name, "SHIFT") == 0)
-    g_held_mods &= ~(MOD_SHIFT_LEFT);
-  else if (strcasecmp(key_name, "ALT") == 0)
-    g_held_mods &= ~(MOD_ALT_LEFT);
-  else if (strcasecmp(key_name, "GUI") == 0)
-    g_held_mods &= ~(MOD_GUI_LEFT);
-  else {
-    uint8_t code = get_key_code(key_name);
-    if (code) {
-      for (int i = 0; i < 6; i++) {
-        if (g_held_keys[i] == code) {
-          g_held_keys[i] = 0;
-        }
-      }
-      // Pack
-      // (Optional: move zeros to end)
+/* `supervise [--once]`: keep the gadget set up (hid_supervise.h) */
+static int run_supervise(int argc, char *argv[]) {
+  struct hid_supervise_opts opts = {
+      .root = hid_sysroot(),
+      .gadget = hid_gadget_dir(),
+      .settle_ms = HID_SUPERVISE_DEFAULT_SETTLE_MS,
+      .recheck_s = HID_SUPERVISE_DEFAULT_RECHECK_S,
+  };
+  const char *env = getenv("HID_SETUP_CMD");
+  if (env && *env)
+    opts.setup_cmd = env;
+  if ((env = getenv("HID_SUPERVISE_SETTLE_MS")) && atoi(env) >= 0)
+    opts.settle_ms = atoi(env);
+  if ((env = getenv("HID_SUPERVISE_RECHECK_S")) && atoi(env) >= 0)
+    opts.recheck_s = atoi(env);
+  for (int i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "--once") == 0) {
+      opts.once = 1;
+    } else {
+      fprintf(stderr, "Error: Unknown supervise option '%s'\n", argv[i]);
+      return EXIT_FAILURE;
     }
   }
-  send_held_state();
-  return 0;
+  int result = hid_supervise_run(&opts);
+  if (result < 0) {
+    fprintf(stderr, "Error: Cannot watch the gadget: %s\n", strerror(errno));
+    return EXIT_FAILURE;
+  }
+  return result == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
 }
 
-int release_all_keys(void) {
-  g_held_mods = 0;
-  memset(g_held_keys, 0, 6);
-  send_held_state();
-  return 0;
-}
+int main(int argc, char *argv[]) {
+  // `send <command> ...`: hand the command to a running daemon before doing
+  // any discovery; without a daemon, run it here as usual.
+  if (argc >= 3 && strcmp(argv[1], "send") == 0) {
+    argv[1] = argv[0];
+    argc--;
+    argv++;
+    int status;
+    if (hid_daemon_forward(hid_daemon_socket_path(NULL), argc, argv,
+                           &status) == 0)
+      return status;
+  }
 
-/* --- Mouse Support Impl --- */
-int send_mouse_report(uint8_t buttons, int8_t x, int8_t y, int8_t wheel,
-                      int8_t hwheel) {
-  if (!g_mouse_device)
-    return -1;
-  int fd = get_cached_fd(g_mouse_device, &g_fd_mouse);
-  if (fd < 0)
-    return -1;
+  // `supervise` and `setup` manage the gadget, never open the devices
+  if (argc >= 2 && strcmp(argv[1], "supervise") == 0)
+    return run_supervise(argc - 1, argv + 1);
+  if (argc >= 2 && strcmp(argv[1], "setup") == 0)
+    return run_setup(argc - 1, argv + 1);
+
+  // Tight timer slack for delays; HID_TIMER_SLACK_NS (load_env) overrides
+  hid_timer_set_slack(HID_TIMER_DEFAULT_SLACK_NS);
+  g_ctx = hid_ctx_new();
+  if (!g_ctx) {
+    perror("Error creating HID context");
+    return EXIT_FAILURE;
+  }
+  // Allow environment overrides first: devices, report formats, output mode
+  hid_ctx_load_env(g_ctx);
+  hid_set_default_ctx(g_ctx);
+  // Write statistics reporting (HID_STATS=1, HID_STATS_FILE)
+  {
+    const char *st = getenv("HID_STATS");
+    const char *sf = getenv("HID_STATS_FILE");
+    if (hid_env_true(st))
+      g_stats_dump = 1;
+    if (sf && *sf)
+      g_stats_file = sf;
+  }
+  // Batch submission ceiling (HID_BATCH=loop|writev|uring, default uring)
+  {
+    const char *bm = getenv("HID_BATCH");
+    if (bm && strcasecmp(bm, "loop") == 0)
+      hid_batch_set_max_mode(HID_BATCH_LOOP);
+    else if (bm && strcasecmp(bm, "writev") == 0)
+      hid_batch_set_max_mode(HID_BATCH_WRITEV);
+  }
+  // Attempt to discover devices; may return fewer than 3 and that's OK.
+  hid_ctx_discover(g_ctx);
+  if (apply_device_env() != 0)
+    return EXIT_FAILURE;
 
-  char report[8];
-  memset(report, 0, 8);
-  report[0] = buttons;
-  report[1] = x;
-  report[2] = y;
-  report[3] = wheel;
-  if (g_mouse_report_size > 4) {
-    report[4] = hwheel;
+  // Real-time mode (HID_RT=1 / HID_RT_PRIORITY / HID_RT_CPU), best effort
+  {
+    int prio = hid_ctx_get_option(g_ctx, HID_OPT_RT_PRIORITY);
+    int cpu = hid_ctx_get_option(g_ctx, HID_OPT_RT_CPU);
+    if (prio > 0 || cpu >= 0) {
+      int result = hid_ctx_rt_enter(g_ctx);
+      int want = (prio > 0 ? HID_RT_FIFO | HID_RT_LOCKED : 0) |
+                 (cpu >= 0 ? HID_RT_PINNED : 0);
+      char desc[128];
+      hid_rt_describe(desc, sizeof(desc), prio, cpu, result);
+      if ((result & want) != want)
+        fprintf(stderr, "[HID-RT] %s (%s); continuing\n", desc,
+                strerror(errno));
+      else if (g_stats_dump)
+        fprintf(stderr, "[HID-RT] %s\n", desc);
+    }
+  }
+
+  // Register cleanup function to flush and free the context on exit
+  atexit(shutdown_output);
+
+  if (argc < 2) {
+    print_usage(argv[0]); // Will exit
   }
 
-  int ret = write(fd, report, g_mouse_report_size);
-  return (ret == g_mouse_report_size) ? 0 : -1;
+  if (strcmp(argv[1], "daemon") == 0)
+    return run_daemon(argc - 1, &argv[1]);
+
+  return dispatch_command(argc, argv);
 }
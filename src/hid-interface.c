@@ -0,0 +1,182 @@
+/*
+ * hid-interface.c - the global hid_interface.h API over a default context.
+ */
+
+#include "../include/hid_interface.h"
+#include "../include/hid_ctx.h"
+#include "../include/hid_path.h"
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+static struct hid_ctx *g_default_ctx = NULL;
+static int g_default_owned = 0; // created here rather than installed
+
+struct hid_ctx *hid_default_ctx(void) {
+  if (!g_default_ctx) {
+    g_default_ctx = hid_ctx_new();
+    if (!g_default_ctx)
+      return NULL;
+    g_default_owned = 1;
+    hid_ctx_load_env(g_default_ctx);
+    hid_ctx_discover(g_default_ctx);
+  }
+  return g_default_ctx;
+}
+
+void hid_set_default_ctx(struct hid_ctx *ctx) {
+  if (g_default_owned)
+    hid_ctx_free(g_default_ctx);
+  g_default_ctx = ctx;
+  g_default_owned = 0;
+}
+
+/* Resolves the default context, failing the call when none can be made */
+#define DEFAULT_CTX(ctx)                                                       \
+  struct hid_ctx *ctx = hid_default_ctx();                                     \
+  if (!ctx) {                                                                  \
+    errno = ENOMEM;                                                            \
+    return -1;                                                                 \
+  }
+
+int send_keyboard_report(uint8_t modifiers, uint8_t key1, uint8_t key2,
+                         uint8_t key3, uint8_t key4, uint8_t key5,
+                         uint8_t key6) {
+  DEFAULT_CTX(ctx);
+  const uint8_t keys[6] = {key1, key2, key3, key4, key5, key6};
+  return hid_ctx_send_keyboard_report(ctx, modifiers, keys);
+}
+
+int send_mouse_report(uint8_t buttons, int8_t x, int8_t y, int8_t wheel,
+                      int8_t hwheel) {
+  DEFAULT_CTX(ctx);
+  return hid_ctx_send_mouse_report(ctx, buttons, x, y, wheel, hwheel);
+}
+
+int send_mouse_click(uint8_t buttons) {
+  DEFAULT_CTX(ctx);
+  return hid_ctx_send_mouse_click(ctx, buttons);
+}
+
+int send_mouse_move(int8_t x, int8_t y) {
+  DEFAULT_CTX(ctx);
+  return hid_ctx_send_mouse_move(ctx, x, y);
+}
+
+int send_mouse_press(uint8_t buttons) {
+  DEFAULT_CTX(ctx);
+  return hid_ctx_send_mouse_press(ctx, buttons);
+}
+
+int send_mouse_release(void) {
+  DEFAULT_CTX(ctx);
+  return hid_ctx_send_mouse_release(ctx);
+}
+
+int send_mouse_scroll(int8_t wheel) {
+  DEFAULT_CTX(ctx);
+  return hid_ctx_send_mouse_scroll(ctx, wheel, 0);
+}
+
+int send_mouse_moveto(const char *x, const char *y) {
+  DEFAULT_CTX(ctx);
+  int px, py;
+  if (hid_ctx_parse_coordinate(ctx, 0, x, &px) != 0 ||
+      hid_ctx_parse_coordinate(ctx, 1, y, &py) != 0)
+    return -1;
+  return hid_ctx_send_absolute(ctx, 0, px, py);
+}
+
+int send_mouse_path(uint8_t buttons, const char *spec) {
+  DEFAULT_CTX(ctx);
+  char copy[512], *argv[2 + 2 * HID_PATH_POINTS_MAX], *save = NULL;
+  int argc = 0;
+  snprintf(copy, sizeof(copy), "%s", spec);
+  for (char *tok = strtok_r(copy, " \t", &save); tok;
+       tok = strtok_r(NULL, " \t", &save)) {
+    if (argc == (int)(sizeof(argv) / sizeof(argv[0]))) {
+      errno = EINVAL;
+      return -1;
+    }
+    argv[argc++] = tok;
+  }
+  struct hid_path path;
+  if (hid_path_parse(&path, argc, argv) != 0)
+    return -1;
+  if (buttons && hid_ctx_send_mouse_press(ctx, buttons) != 0)
+    return -1;
+  int ret = hid_ctx_send_mouse_path(ctx, buttons, &path);
+  if (buttons && hid_ctx_send_mouse_release(ctx) != 0)
+    ret = -1;
+  return ret;
+}
+
+int send_consumer_key(const char *action) {
+  DEFAULT_CTX(ctx);
+  return hid_ctx_send_consumer_key(ctx, action);
+}
+
+int set_hid_locale(const char *name) {
+  DEFAULT_CTX(ctx);
+  return hid_ctx_set_locale(ctx, name);
+}
+
+int select_hid_device(const char *spec) {
+  DEFAULT_CTX(ctx);
+  return hid_ctx_select_devices(ctx, spec);
+}
+
+int send_raw_hid_report(const uint8_t *report, size_t size) {
+  DEFAULT_CTX(ctx);
+  return hid_ctx_send_report(ctx, HID_ROLE_KEYBOARD, report, size);
+}
+
+uint8_t parse_modifiers(const char *mod_str, const char **remainder) {
+  return hid_parse_modifiers(mod_str, remainder);
+}
+
+int send_key_sequence(const char *modifiers_str, const char *sequence) {
+  DEFAULT_CTX(ctx);
+  return hid_ctx_send_key_sequence(ctx, modifiers_str, sequence);
+}
+
+int send_text(const char *buf, size_t len) {
+  DEFAULT_CTX(ctx);
+  return hid_ctx_send_text(ctx, buf, len);
+}
+
+int send_text_delayed(const char *buf, size_t len, int delay_ms, int fuzz_ms) {
+  DEFAULT_CTX(ctx);
+  return hid_ctx_send_text_delayed(ctx, buf, len, delay_ms, fuzz_ms);
+}
+
+int hold_key(const char *key_name) {
+  DEFAULT_CTX(ctx);
+  return hid_ctx_hold_key(ctx, key_name);
+}
+
+int release_key(const char *key_name) {
+  DEFAULT_CTX(ctx);
+  return hid_ctx_release_key(ctx, key_name);
+}
+
+int release_all_keys(void) {
+  DEFAULT_CTX(ctx);
+  return hid_ctx_release_all_keys(ctx);
+}
+
+int hid_flush(void) {
+  return g_default_ctx ? hid_ctx_flush(g_default_ctx) : 0;
+}
+
+int hid_take_error(void) {
+  return g_default_ctx ? hid_ctx_take_error(g_default_ctx) : 0;
+}
+
+void hid_sleep(int ms) {
+  if (g_default_ctx)
+    hid_ctx_sleep(g_default_ctx, ms);
+  else
+    usleep(ms * 1000);
+}
@@ -0,0 +1,149 @@
+/*
+ * hid-path.c - mouse gesture curves (see hid_path.h).
+ */
+
+#include "../include/hid_path.h"
+#include <errno.h>
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+#ifndef M_PI
+#define M_PI 3.14159265358979323846
+#endif
+
+static int parse_number(const char *s, double *out) {
+  char *end;
+  errno = 0;
+  double v = strtod(s, &end);
+  if (end == s || *end || errno || !isfinite(v))
+    return -1;
+  *out = v;
+  return 0;
+}
+
+int hid_path_parse(struct hid_path *path, int argc, char *const argv[]) {
+  memset(path, 0, sizeof(*path));
+  if (argc < 2)
+    goto invalid;
+  if (strcasecmp(argv[0], "line") == 0)
+    path->kind = HID_PATH_LINE;
+  else if (strcasecmp(argv[0], "bezier") == 0)
+    path->kind = HID_PATH_BEZIER;
+  else if (strcasecmp(argv[0], "arc") == 0)
+    path->kind = HID_PATH_ARC;
+  else
+    goto invalid;
+
+  double ms;
+  if (parse_number(argv[1], &ms) != 0 || ms < 0 || ms > 3600000)
+    goto invalid;
+  path->duration_ms = (int)ms;
+
+  int nargs = argc - 2;
+  switch (path->kind) {
+  case HID_PATH_LINE:
+    if (nargs < 2 || nargs % 2 || nargs > 2 * HID_PATH_POINTS_MAX)
+      goto invalid;
+    break;
+  case HID_PATH_BEZIER:
+    if (nargs != 4 && nargs != 6)
+      goto invalid;
+    break;
+  case HID_PATH_ARC:
+    if (nargs != 3)
+      goto invalid;
+    break;
+  }
+
+  path->npoints = nargs / 2;
+  for (int i = 0; i < path->npoints; i++) {
+    if (parse_number(argv[2 + 2 * i], &path->x[i]) != 0 ||
+        parse_number(argv[3 + 2 * i], &path->y[i]) != 0 ||
+        fabs(path->x[i]) > HID_PATH_COORD_MAX ||
+        fabs(path->y[i]) > HID_PATH_COORD_MAX)
+      goto invalid;
+  }
+  if (path->kind == HID_PATH_ARC &&
+      parse_number(argv[4], &path->degrees) != 0)
+    goto invalid;
+
+  /* Constant speed along a polyline: sample by distance, not by segment */
+  if (path->kind == HID_PATH_LINE) {
+    double px = 0, py = 0, total = 0;
+    for (int i = 0; i < path->npoints; i++) {
+      total += hypot(path->x[i] - px, path->y[i] - py);
+      path->length[i] = total;
+      px = path->x[i];
+      py = path->y[i];
+    }
+  }
+  return 0;
+
+invalid:
+  errno = EINVAL;
+  return -1;
+}
+
+static void line_point(const struct hid_path *path, double t, double *x,
+                       double *y) {
+  double total = path->length[path->npoints - 1];
+  double at = t * total, from = 0, px = 0, py = 0;
+  int i = 0;
+  while (i < path->npoints - 1 && path->length[i] < at) {
+    from = path->length[i];
+    px = path->x[i];
+    py = path->y[i];
+    i++;
+  }
+  double seg = path->length[i] - from;
+  double f = seg > 0 ? (at - from) / seg : 1;
+  *x = px + (path->x[i] - px) * f;
+  *y = py + (path->y[i] - py) * f;
+}
+
+/* De Casteljau over the start (0, 0) and the path's points */
+static void bezier_point(const struct hid_path *path, double t, double *x,
+                         double *y) {
+  double bx[HID_PATH_POINTS_MAX + 1] = {0}, by[HID_PATH_POINTS_MAX + 1] = {0};
+  int n = path->npoints;
+  memcpy(bx + 1, path->x, (size_t)n * sizeof(double));
+  memcpy(by + 1, path->y, (size_t)n * sizeof(double));
+  for (int level = n; level > 0; level--) {
+    for (int i = 0; i < level; i++) {
+      bx[i] += (bx[i + 1] - bx[i]) * t;
+      by[i] += (by[i + 1] - by[i]) * t;
+    }
+  }
+  *x = bx[0];
+  *y = by[0];
+}
+
+/* Y grows downwards on screen, so a positive angle turns clockwise */
+static void arc_point(const struct hid_path *path, double t, double *x,
+                      double *y) {
+  double a = path->degrees * t * M_PI / 180;
+  double vx = -path->x[0], vy = -path->y[0];
+  *x = path->x[0] + vx * cos(a) - vy * sin(a);
+  *y = path->y[0] + vx * sin(a) + vy * cos(a);
+}
+
+void hid_path_point(const struct hid_path *path, double t, double *x,
+                    double *y) {
+  if (t < 0)
+    t = 0;
+  if (t > 1)
+    t = 1;
+  switch (path->kind) {
+  case HID_PATH_LINE:
+    line_point(path, t, x, y);
+    break;
+  case HID_PATH_BEZIER:
+    bezier_point(path, t, x, y);
+    break;
+  case HID_PATH_ARC:
+    arc_point(path, t, x, y);
+    break;
+  }
+}
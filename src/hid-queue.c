@@ -0,0 +1,293 @@
+/*
+ * hid-queue.c - Single-producer/single-consumer report ring with a writer
+ * thread per hidg device.
+ *
+ * The ring indices are free-running 64-bit counters: the producer owns head,
+ * the writer owns tail and only advances it once the report has left the
+ * sink. The mutex/condvar pair is used for sleeping only, never on the data
+ * path, and only when the other side has announced that it is waiting.
+ *
+ * Merging rewrites the newest queued slot in place. The writer announces
+ * the slot it is about to read in `claimed`, the producer the slot it is
+ * about to rewrite in `merging`; each stores its own flag before loading
+ * the other's (both sequentially consistent), so at least one of them sees
+ * the conflict: the producer then queues a new slot instead, and the writer
+ * waits for the rewrite in progress to finish.
+ */
+
+#include "../include/hid_queue.h"
+#include "../include/hid_rt.h"
+#include "../include/hid_timeline.h"
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+
+struct hid_queue_slot {
+  uint8_t len;
+  uint8_t data[HID_QUEUE_SLOT_SIZE];
+};
+
+struct hid_queue {
+  int fd;
+  hid_queue_sink sink;
+  void *sink_arg;
+  struct hid_queue_slot *ring;
+  uint32_t mask;
+
+  _Atomic uint64_t head; /* next slot the producer fills */
+  _Atomic uint64_t tail; /* next slot the writer drains */
+  _Atomic uint64_t claimed; /* slots below it are the writer's */
+  _Atomic uint64_t merging; /* slot being rewritten + 1, 0 none */
+  _Atomic(hid_queue_gate) gate;
+  _Atomic int writer_idle;
+  _Atomic int producer_waiting;
+  _Atomic int stop;
+  _Atomic int error_pending;
+
+  pthread_t thread;
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+
+  /* Writer-side counters (read by the producer for stats) */
+  _Atomic uint64_t written;
+  _Atomic uint64_t errors;
+  _Atomic uint64_t gate_failures;
+  _Atomic uint64_t write_ns;
+
+  /* Producer-side counters */
+  uint64_t pushed;
+  uint64_t merged;
+  uint64_t stalls;
+  uint64_t stall_ns;
+  uint64_t flush_ns;
+  uint32_t max_depth;
+};
+
+static _Atomic(hid_queue_thread_hook) g_thread_hook;
+
+void hid_queue_set_thread_hook(hid_queue_thread_hook hook) {
+  atomic_store(&g_thread_hook, hook);
+}
+
+static void wake(struct hid_queue *q) {
+  pthread_mutex_lock(&q->lock);
+  pthread_cond_broadcast(&q->cond);
+  pthread_mutex_unlock(&q->lock);
+}
+
+static void *writer_main(void *arg) {
+  struct hid_queue *q = arg;
+  hid_queue_thread_hook hook = atomic_load(&g_thread_hook);
+  if (hook)
+    hook(q->sink_arg);
+
+  for (;;) {
+    uint64_t tail = atomic_load_explicit(&q->tail, memory_order_relaxed);
+    uint64_t head = atomic_load(&q->head);
+
+    if (tail == head) {
+      pthread_mutex_lock(&q->lock);
+      atomic_store(&q->writer_idle, 1);
+      while (atomic_load(&q->head) == tail && !atomic_load(&q->stop))
+        pthread_cond_wait(&q->cond, &q->lock);
+      atomic_store(&q->writer_idle, 0);
+      int done = atomic_load(&q->stop) && atomic_load(&q->head) == tail;
+      pthread_mutex_unlock(&q->lock);
+      if (done)
+        break;
+      continue;
+    }
+
+    hid_queue_gate gate = atomic_load_explicit(&q->gate, memory_order_relaxed);
+    if (gate && gate(q->sink_arg, q->fd) != 0)
+      atomic_fetch_add_explicit(&q->gate_failures, 1, memory_order_relaxed);
+    atomic_store(&q->claimed, tail + 1);
+    while (atomic_load(&q->merging) == tail + 1)
+      sched_yield();
+
+    const struct hid_queue_slot *slot = &q->ring[tail & q->mask];
+    uint64_t t0 = hid_monotonic_ns();
+    int n = q->sink(q->sink_arg, q->fd, slot->data, slot->len);
+    atomic_fetch_add_explicit(&q->write_ns, hid_monotonic_ns() - t0,
+                              memory_order_relaxed);
+    if (n != (int)slot->len) {
+      atomic_fetch_add_explicit(&q->errors, 1, memory_order_relaxed);
+      atomic_store(&q->error_pending, 1);
+    }
+    atomic_fetch_add_explicit(&q->written, 1, memory_order_relaxed);
+
+    atomic_store(&q->tail, tail + 1);
+    if (atomic_load(&q->producer_waiting))
+      wake(q);
+  }
+  return NULL;
+}
+
+struct hid_queue *hid_queue_create(int fd, size_t depth, hid_queue_sink sink,
+                                   void *arg) {
+  if (!sink)
+    return NULL;
+
+  size_t cap = 16;
+  while (cap < depth && cap < (1u << 20))
+    cap <<= 1;
+
+  struct hid_queue *q = calloc(1, sizeof(*q));
+  if (!q)
+    return NULL;
+  q->ring = calloc(cap, sizeof(*q->ring));
+  if (!q->ring) {
+    free(q);
+    return NULL;
+  }
+  q->fd = fd;
+  q->sink = sink;
+  q->sink_arg = arg;
+  q->mask = (uint32_t)(cap - 1);
+  pthread_mutex_init(&q->lock, NULL);
+  pthread_cond_init(&q->cond, NULL);
+
+  pthread_attr_t attr;
+  pthread_attr_init(&attr);
+  pthread_attr_setstacksize(&attr, HID_RT_THREAD_STACK);
+  int rc = pthread_create(&q->thread, &attr, writer_main, q);
+  pthread_attr_destroy(&attr);
+  if (rc != 0) {
+    pthread_cond_destroy(&q->cond);
+    pthread_mutex_destroy(&q->lock);
+    free(q->ring);
+    free(q);
+    return NULL;
+  }
+  return q;
+}
+
+/* Blocks the producer until the writer has drained up to `target`. */
+static void wait_for_tail(struct hid_queue *q, uint64_t target) {
+  pthread_mutex_lock(&q->lock);
+  atomic_store(&q->producer_waiting, 1);
+  while (atomic_load(&q->tail) < target)
+    pthread_cond_wait(&q->cond, &q->lock);
+  atomic_store(&q->producer_waiting, 0);
+  pthread_mutex_unlock(&q->lock);
+}
+
+int hid_queue_push(struct hid_queue *q, const void *report, size_t len) {
+  if (!q || len > HID_QUEUE_SLOT_SIZE) {
+    errno = q ? EMSGSIZE : EINVAL;
+    return -1;
+  }
+
+  uint64_t head = atomic_load_explicit(&q->head, memory_order_relaxed);
+  uint64_t cap = (uint64_t)q->mask + 1;
+
+  if (head - atomic_load_explicit(&q->tail, memory_order_acquire) >= cap) {
+    uint64_t t0 = hid_monotonic_ns();
+    q->stalls++;
+    wait_for_tail(q, head - cap + 1);
+    q->stall_ns += hid_monotonic_ns() - t0;
+  }
+
+  struct hid_queue_slot *slot = &q->ring[head & q->mask];
+  slot->len = (uint8_t)len;
+  memcpy(slot->data, report, len);
+  atomic_store(&q->head, head + 1);
+  q->pushed++;
+
+  uint32_t depth =
+      (uint32_t)(head + 1 -
+                 atomic_load_explicit(&q->tail, memory_order_relaxed));
+  if (depth > q->max_depth)
+    q->max_depth = depth;
+
+  if (atomic_load(&q->writer_idle))
+    wake(q);
+  return 0;
+}
+
+int hid_queue_push_merge(struct hid_queue *q, const void *report, size_t len,
+                         hid_queue_merge merge, void *arg) {
+  if (!q || len > HID_QUEUE_SLOT_SIZE) {
+    errno = q ? EMSGSIZE : EINVAL;
+    return -1;
+  }
+
+  uint64_t head = atomic_load_explicit(&q->head, memory_order_relaxed);
+  if (merge && head > 0) {
+    uint64_t last = head - 1;
+    int merged = 0;
+    atomic_store(&q->merging, last + 1);
+    if (atomic_load(&q->claimed) <= last) {
+      struct hid_queue_slot *slot = &q->ring[last & q->mask];
+      merged = merge(arg, slot->data, slot->len, report, len);
+    }
+    atomic_store(&q->merging, 0);
+    if (merged) {
+      q->pushed++;
+      q->merged++;
+      return 0;
+    }
+  }
+  return hid_queue_push(q, report, len);
+}
+
+void hid_queue_set_gate(struct hid_queue *q, hid_queue_gate gate) {
+  if (q)
+    atomic_store(&q->gate, gate);
+}
+
+int hid_queue_flush(struct hid_queue *q) {
+  if (!q)
+    return 0;
+
+  uint64_t head = atomic_load_explicit(&q->head, memory_order_relaxed);
+  if (atomic_load(&q->tail) < head) {
+    uint64_t t0 = hid_monotonic_ns();
+    wait_for_tail(q, head);
+    q->flush_ns += hid_monotonic_ns() - t0;
+  }
+  return atomic_exchange(&q->error_pending, 0) ? -1 : 0;
+}
+
+size_t hid_queue_depth(const struct hid_queue *q) {
+  if (!q)
+    return 0;
+  return (size_t)(atomic_load(&((struct hid_queue *)q)->head) -
+                  atomic_load(&((struct hid_queue *)q)->tail));
+}
+
+void hid_queue_get_stats(const struct hid_queue *q,
+                         struct hid_queue_stats *out) {
+  memset(out, 0, sizeof(*out));
+  if (!q)
+    return;
+  struct hid_queue *mq = (struct hid_queue *)q;
+  out->pushed = q->pushed;
+  out->merged = q->merged;
+  out->written = atomic_load(&mq->written);
+  out->errors = atomic_load(&mq->errors);
+  out->gate_failures = atomic_load(&mq->gate_failures);
+  out->stalls = q->stalls;
+  out->stall_ns = q->stall_ns;
+  out->flush_ns = q->flush_ns;
+  out->write_ns = atomic_load(&mq->write_ns);
+  out->depth = (uint32_t)hid_queue_depth(q);
+  out->max_depth = q->max_depth;
+  out->capacity = q->mask + 1;
+}
+
+void hid_queue_destroy(struct hid_queue *q) {
+  if (!q)
+    return;
+  hid_queue_flush(q);
+  atomic_store(&q->stop, 1);
+  wake(q);
+  pthread_join(q->thread, NULL);
+  pthread_cond_destroy(&q->cond);
+  pthread_mutex_destroy(&q->lock);
+  free(q->ring);
+  free(q);
+}
@@ -0,0 +1,141 @@
+/*
+ * hid-replay.c - capture file reader and replay engine (see hid_replay.h).
+ */
+
+#include "../include/hid_replay.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// --- Capture Reader ---
+int hid_capture_map(struct hid_capture *cap, const char *path) {
+  static const uint8_t header[HID_CAPTURE_HEADER_SIZE] = {
+      'H', 'I', 'D', 'C', HID_CAPTURE_VERSION, 0, 0, 0};
+  cap->data = NULL;
+  cap->size = 0;
+
+  int fd = open(path, O_RDONLY | O_CLOEXEC);
+  if (fd < 0)
+    return -1;
+  struct stat st;
+  if (fstat(fd, &st) != 0) {
+    close(fd);
+    return -1;
+  }
+  if (st.st_size < HID_CAPTURE_HEADER_SIZE) {
+    close(fd);
+    errno = EINVAL;
+    return -1;
+  }
+  void *data = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (data == MAP_FAILED)
+    return -1;
+  if (memcmp(data, header, sizeof(header)) != 0) {
+    munmap(data, (size_t)st.st_size);
+    errno = EINVAL;
+    return -1;
+  }
+  madvise(data, (size_t)st.st_size, MADV_SEQUENTIAL);
+  cap->data = data;
+  cap->size = (size_t)st.st_size;
+  return 0;
+}
+
+void hid_capture_unmap(struct hid_capture *cap) {
+  if (cap->data)
+    munmap((void *)cap->data, cap->size);
+  cap->data = NULL;
+  cap->size = 0;
+}
+
+int hid_capture_next(const struct hid_capture *cap, size_t *pos,
+                     struct hid_capture_record *rec) {
+  size_t p = *pos < HID_CAPTURE_HEADER_SIZE ? HID_CAPTURE_HEADER_SIZE : *pos;
+  if (p == cap->size)
+    return 0;
+  const uint8_t *r = cap->data + p;
+  if (cap->size - p < HID_CAPTURE_RECORD_HEADER ||
+      cap->size - p - HID_CAPTURE_RECORD_HEADER < r[9] ||
+      r[8] >= HID_ROLE_COUNT) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  uint64_t ts = 0;
+  for (int i = 7; i >= 0; i--)
+    ts = (ts << 8) | r[i];
+  rec->timestamp_ns = ts;
+  rec->role = (enum hid_role)r[8];
+  rec->len = r[9];
+  rec->report = r + HID_CAPTURE_RECORD_HEADER;
+  *pos = p + HID_CAPTURE_RECORD_HEADER + rec->len;
+  return 1;
+}
+// --- End Capture Reader ---
+
+// --- Replay ---
+int hid_ctx_replay(struct hid_ctx *ctx, const struct hid_capture *cap,
+                   const struct hid_replay_opts *opts,
+                   struct hid_replay_result *result) {
+  struct hid_replay_result res = {0};
+  double speed = opts ? opts->speed : 1.0;
+  uint64_t max_gap = opts ? opts->max_gap_ns : 0;
+  uint32_t spin_ns =
+      (uint32_t)hid_ctx_get_option(ctx, HID_OPT_TIMER_SPIN_US) * 1000u;
+  struct hid_capture_record rec;
+  size_t pos = 0;
+  int ret = 0, got;
+
+  uint64_t start = hid_monotonic_ns();
+  uint64_t offset = 0; // capture time since the first record, gaps shortened
+  uint64_t prev_ts = 0;
+  while ((got = hid_capture_next(cap, &pos, &rec)) > 0) {
+    if (res.reports > 0) {
+      /* Appended runs may start at an earlier clock (after a reboot) */
+      uint64_t gap =
+          rec.timestamp_ns > prev_ts ? rec.timestamp_ns - prev_ts : 0;
+      if (max_gap && gap > max_gap)
+        gap = max_gap;
+      offset += gap;
+    }
+    prev_ts = rec.timestamp_ns;
+
+    if (speed > 0) {
+      uint64_t deadline = start + (uint64_t)((double)offset / speed);
+      uint64_t now = hid_monotonic_ns();
+      if (now < deadline) {
+        hid_sleep_until_ns(deadline, spin_ns);
+        now = hid_monotonic_ns();
+      }
+      uint64_t late = now - (now < deadline ? now : deadline);
+      if (late > HID_REPLAY_LATE_NS)
+        res.late_reports++;
+      if (late > res.max_late_ns)
+        res.max_late_ns = late;
+    }
+
+    if (hid_ctx_send_report(ctx, rec.role, rec.report, rec.len) != 0) {
+      ret = -1;
+      break;
+    }
+    res.reports++;
+  }
+  if (got < 0)
+    ret = -1;
+
+  int err = errno;
+  if (hid_ctx_flush(ctx) != 0 && ret == 0) {
+    ret = -1;
+    err = errno;
+  }
+  res.elapsed_ns = hid_monotonic_ns() - start;
+  if (result)
+    *result = res;
+  errno = err;
+  return ret;
+}
+// --- End Replay ---
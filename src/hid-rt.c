@@ -0,0 +1,69 @@
+/*
+ * hid-rt.c - real-time scheduling, memory locking and pinning (hid_rt.h).
+ */
+
+#define _GNU_SOURCE
+#include "../include/hid_rt.h"
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+
+/* Touches the stack a deep call chain may need, so the first burst does not
+ * take page faults growing it */
+static void __attribute__((noinline)) prefault_stack(void) {
+  volatile unsigned char buf[HID_RT_STACK_PREFAULT];
+  for (size_t i = 0; i < sizeof(buf); i += 4096)
+    buf[i] = 0;
+}
+
+int hid_rt_enter_thread(int priority, int cpu) {
+  int result = 0, err = 0;
+
+  if (priority > 0) {
+    struct sched_param sp = {.sched_priority = priority};
+    int r = pthread_setschedparam(pthread_self(), SCHED_FIFO, &sp);
+    if (r == 0)
+      result |= HID_RT_FIFO;
+    else
+      err = r;
+  }
+  if (cpu >= 0) {
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    if (cpu < CPU_SETSIZE)
+      CPU_SET(cpu, &set);
+    int r = cpu < CPU_SETSIZE
+                ? pthread_setaffinity_np(pthread_self(), sizeof(set), &set)
+                : EINVAL;
+    if (r == 0)
+      result |= HID_RT_PINNED;
+    else
+      err = r;
+  }
+  prefault_stack();
+  if (err)
+    errno = err;
+  return result;
+}
+
+int hid_rt_lock_memory(void) {
+  return mlockall(MCL_CURRENT | MCL_FUTURE) == 0 ? 0 : -1;
+}
+
+void hid_rt_describe(char *buf, unsigned long size, int priority, int cpu,
+                     int result) {
+  char fifo[40] = "", pin[40] = "", lock[24] = "";
+  if (priority > 0) {
+    snprintf(fifo, sizeof(fifo), "SCHED_FIFO %d %s", priority,
+             (result & HID_RT_FIFO) ? "on" : "unavailable");
+    snprintf(lock, sizeof(lock), ", memory %s",
+             (result & HID_RT_LOCKED) ? "locked" : "not locked");
+  }
+  if (cpu >= 0)
+    snprintf(pin, sizeof(pin), "%sCPU %d %s", priority > 0 ? ", " : "", cpu,
+             (result & HID_RT_PINNED) ? "pinned" : "not pinned");
+  snprintf(buf, size, "%s%s%s", fifo, pin, lock);
+}
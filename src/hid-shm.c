@@ -0,0 +1,251 @@
+/*
+ * hid-shm.c - Consumer side of the shared-memory report ring (hid_shm.h).
+ *
+ * One drain thread owns tail. It writes published slots in ring order,
+ * honouring each slot's deadline, and hands the slot back to producers by
+ * advancing its sequence by one lap. When the ring runs dry it polls for
+ * SHM_SPIN_NS, then announces itself idle and sleeps on the header's futex
+ * word; producers only enter the kernel to wake it.
+ */
+
+#define _GNU_SOURCE
+#include "../include/hid_shm.h"
+#include "../include/hid_rt.h"
+#include <pthread.h>
+#include <stdio.h>
+
+#ifndef MFD_CLOEXEC
+#define MFD_CLOEXEC 0x0001U
+#endif
+
+#define SHM_SPIN_NS 50000ull /* poll this long before sleeping */
+#define SHM_IDLE_TIMEOUT_NS 100000000ull /* re-check stop while idle */
+#define SHM_MAX_SLOTS (1u << 20)
+
+struct hid_shm_server {
+  struct hid_shm_ring ring;
+  int fd;
+  char *path; /* NULL for a memfd ring */
+  uint64_t capacity; /* private copies: the mapped header is writable by */
+  uint64_t mask;     /* every producer and is never trusted for indexing */
+  hid_shm_sink sink;
+  pthread_t thread;
+};
+
+static int slot_ready(struct hid_shm_server *srv, uint64_t tail) {
+  struct hid_shm_slot *slot = &srv->ring.slots[tail & srv->mask];
+  return atomic_load_explicit(&slot->seq, memory_order_acquire) == tail + 1;
+}
+
+static void futex_wait(_Atomic uint32_t *word, uint32_t val, uint64_t ns) {
+  struct timespec ts = {.tv_sec = (time_t)(ns / 1000000000ull),
+                        .tv_nsec = (long)(ns % 1000000000ull)};
+  syscall(SYS_futex, word, FUTEX_WAIT, val, &ts, NULL, 0);
+}
+
+static void futex_wake(_Atomic uint32_t *word) {
+  atomic_fetch_add(word, 1);
+  syscall(SYS_futex, word, FUTEX_WAKE, 1, NULL, NULL, 0);
+}
+
+/* Sleeps until due_ns in bounded steps so a stop request is noticed.
+ * Returns 0 once due, -1 if the server is stopping. */
+static int wait_until(struct hid_shm_header *h, uint64_t due_ns) {
+  for (;;) {
+    if (atomic_load(&h->stop))
+      return -1;
+    uint64_t now = hid_shm_now_ns();
+    if (now >= due_ns)
+      return 0;
+    uint64_t until = due_ns - now > SHM_IDLE_TIMEOUT_NS
+                         ? now + SHM_IDLE_TIMEOUT_NS
+                         : due_ns;
+    struct timespec ts = {.tv_sec = (time_t)(until / 1000000000ull),
+                          .tv_nsec = (long)(until % 1000000000ull)};
+    clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL);
+  }
+}
+
+/* Returns once a slot is ready at tail, or 0 if the server is stopping */
+static int wait_for_slot(struct hid_shm_server *srv, uint64_t tail) {
+  struct hid_shm_header *h = srv->ring.hdr;
+  /* A sink that outruns its producers would otherwise sleep after every
+   * report and make each push pay for a wake */
+  uint64_t spin_until = 0;
+  for (unsigned i = 0;; i++) {
+    if (slot_ready(srv, tail))
+      return 1;
+    if ((i & 63) == 0) {
+      uint64_t now = hid_shm_now_ns();
+      if (!spin_until)
+        spin_until = now + SHM_SPIN_NS;
+      else if (now >= spin_until)
+        break;
+    }
+  }
+
+  for (;;) {
+    if (atomic_load(&h->stop))
+      return 0;
+    uint32_t word = atomic_load(&h->wake);
+    atomic_store(&h->consumer_idle, 1);
+    /* Pairs with the fence in hid_shm_push() */
+    atomic_thread_fence(memory_order_seq_cst);
+    if (slot_ready(srv, tail)) {
+      atomic_store(&h->consumer_idle, 0);
+      return 1;
+    }
+    futex_wait(&h->wake, word, SHM_IDLE_TIMEOUT_NS);
+    atomic_store(&h->consumer_idle, 0);
+    if (slot_ready(srv, tail))
+      return 1;
+  }
+}
+
+static void *drain_main(void *arg) {
+  struct hid_shm_server *srv = arg;
+  struct hid_shm_header *h = srv->ring.hdr;
+
+  for (uint64_t tail = 0;; tail++) {
+    if (!wait_for_slot(srv, tail))
+      break;
+
+    struct hid_shm_slot *slot = &srv->ring.slots[tail & srv->mask];
+    /* Copy out first: the slot is writable by any process that maps it */
+    uint64_t due = slot->due_ns;
+    uint8_t role = slot->role, len = slot->len;
+    uint8_t data[HID_SHM_REPORT_MAX];
+    if (len > HID_SHM_REPORT_MAX)
+      len = 0;
+    memcpy(data, slot->data, len);
+
+    /* Hand the slot back before sleeping on its deadline so producers are
+     * not blocked a full lap early */
+    atomic_store_explicit(&slot->seq, tail + srv->capacity,
+                          memory_order_release);
+    atomic_store_explicit(&h->tail, tail + 1, memory_order_release);
+
+    if (due && wait_until(h, due) != 0)
+      break;
+    if (role > HID_SHM_CONSUMER || len == 0 ||
+        srv->sink((enum hid_shm_role)role, data, len) != 0)
+      atomic_fetch_add_explicit(&h->dropped, 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&h->drained, 1, memory_order_relaxed);
+  }
+  return NULL;
+}
+
+static int create_fd(const char *path, size_t size) {
+  int fd;
+  if (path) {
+    /* Replace any old ring: producers still mapping it keep the old inode */
+    unlink(path);
+    fd = open(path, O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, 0660);
+  } else {
+#ifdef SYS_memfd_create
+    fd = (int)syscall(SYS_memfd_create, "hid-gadget-ring", MFD_CLOEXEC);
+#else
+    errno = ENOSYS;
+    fd = -1;
+#endif
+  }
+  if (fd < 0)
+    return -1;
+  if (ftruncate(fd, (off_t)size) != 0) {
+    int err = errno;
+    close(fd);
+    if (path)
+      unlink(path);
+    errno = err;
+    return -1;
+  }
+  return fd;
+}
+
+struct hid_shm_server *hid_shm_server_start(const char *path, size_t slots,
+                                            hid_shm_sink sink) {
+  if (!sink || slots == 0 || slots > SHM_MAX_SLOTS) {
+    errno = EINVAL;
+    return NULL;
+  }
+  uint32_t capacity = 1;
+  while (capacity < slots)
+    capacity <<= 1;
+
+  struct hid_shm_server *srv = calloc(1, sizeof(*srv));
+  if (!srv)
+    return NULL;
+  srv->sink = sink;
+  srv->capacity = capacity;
+  srv->mask = capacity - 1;
+  srv->path = path ? strdup(path) : NULL;
+  size_t size = hid_shm_map_size(capacity);
+  srv->fd = create_fd(path, size);
+  if (srv->fd < 0 || (path && !srv->path))
+    goto fail;
+
+  void *p = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, srv->fd, 0);
+  if (p == MAP_FAILED)
+    goto fail;
+  struct hid_shm_header *h = p;
+  srv->ring.hdr = h;
+  srv->ring.slots = (struct hid_shm_slot *)((char *)p + sizeof(*h));
+  srv->ring.map_len = size;
+
+  /* Fresh mapping is zeroed; only identity and slot sequences need setting.
+   * The magic goes last so attaching producers never see a half-built ring. */
+  for (uint32_t i = 0; i < capacity; i++)
+    atomic_init(&srv->ring.slots[i].seq, i);
+  h->version = HID_SHM_VERSION;
+  h->capacity = capacity;
+  h->slot_size = sizeof(struct hid_shm_slot);
+  h->header_size = sizeof(struct hid_shm_header);
+  atomic_thread_fence(memory_order_release);
+  h->magic = HID_SHM_MAGIC;
+
+  pthread_attr_t attr;
+  pthread_attr_init(&attr);
+  pthread_attr_setstacksize(&attr, HID_RT_THREAD_STACK);
+  int rc = pthread_create(&srv->thread, &attr, drain_main, srv);
+  pthread_attr_destroy(&attr);
+  if (rc != 0) {
+    munmap(p, size);
+    goto fail;
+  }
+  return srv;
+
+fail:
+  if (srv->fd >= 0) {
+    close(srv->fd);
+    if (path)
+      unlink(path);
+  }
+  free(srv->path);
+  free(srv);
+  return NULL;
+}
+
+int hid_shm_server_fd(const struct hid_shm_server *srv) {
+  return srv ? srv->fd : -1;
+}
+
+const struct hid_shm_header *
+hid_shm_server_header(const struct hid_shm_server *srv) {
+  return srv ? srv->ring.hdr : NULL;
+}
+
+void hid_shm_server_stop(struct hid_shm_server *srv) {
+  if (!srv)
+    return;
+  struct hid_shm_header *h = srv->ring.hdr;
+  atomic_store(&h->stop, 1);
+  futex_wake(&h->wake);
+  pthread_join(srv->thread, NULL);
+
+  munmap(srv->ring.hdr, srv->ring.map_len);
+  close(srv->fd);
+  if (srv->path)
+    unlink(srv->path);
+  free(srv->path);
+  free(srv);
+}
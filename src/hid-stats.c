@@ -0,0 +1,272 @@
+/*
+ * hid-stats.c - Write latency histograms and counters, plus the on-disk
+ * accumulator behind `hid-gadget stats`.
+ *
+ * The stats file is plain text, one device per line:
+ *   <name> writes N reports N ... hist b0 b1 ... b23
+ * so it can be inspected with cat and merged across invocations.
+ */
+
+#include "../include/hid_stats.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/file.h>
+#include <unistd.h>
+
+static int bucket_of(uint64_t ns) {
+  int b = 0;
+  ns >>= 10;
+  while (ns && b < HID_STATS_BUCKETS - 1) {
+    ns >>= 1;
+    b++;
+  }
+  return b;
+}
+
+enum hid_err_class hid_err_classify(int err) {
+  switch (err) {
+  case EAGAIN:
+#if EWOULDBLOCK != EAGAIN
+  case EWOULDBLOCK:
+#endif
+    return HID_ERR_AGAIN;
+  case ESHUTDOWN:
+  case ENODEV:
+  case ENXIO:
+  case EPIPE:
+  case EIO:
+    return HID_ERR_GONE;
+  case ETIMEDOUT:
+    return HID_ERR_TIMEOUT;
+  case EINTR:
+    return HID_ERR_INTR;
+  default:
+    return HID_ERR_OTHER;
+  }
+}
+
+void hid_stats_record(struct hid_stats *s, long res, size_t len,
+                      size_t reports, uint64_t ns, int err) {
+  s->writes++;
+  if (res < 0) {
+    s->errors[hid_err_classify(err)]++;
+  } else {
+    s->bytes += (uint64_t)res;
+    if ((size_t)res < len) {
+      s->short_writes++;
+      reports = len ? reports * (size_t)res / len : 0;
+    }
+    s->reports += reports;
+  }
+  if (ns == HID_STATS_NO_LATENCY)
+    return;
+  s->lat_samples++;
+  s->lat_total_ns += ns;
+  if (ns > s->lat_max_ns)
+    s->lat_max_ns = ns;
+  s->hist[bucket_of(ns)]++;
+}
+
+void hid_stats_merge(struct hid_stats *dst, const struct hid_stats *src) {
+  dst->writes += src->writes;
+  dst->reports += src->reports;
+  dst->bytes += src->bytes;
+  dst->short_writes += src->short_writes;
+  for (int i = 0; i < HID_ERR_CLASSES; i++)
+    dst->errors[i] += src->errors[i];
+  dst->lat_samples += src->lat_samples;
+  dst->lat_total_ns += src->lat_total_ns;
+  if (src->lat_max_ns > dst->lat_max_ns)
+    dst->lat_max_ns = src->lat_max_ns;
+  for (int i = 0; i < HID_STATS_BUCKETS; i++)
+    dst->hist[i] += src->hist[i];
+}
+
+static uint64_t bucket_upper_ns(int b) { return 1ull << (10 + b); }
+
+uint64_t hid_stats_percentile_ns(const struct hid_stats *s, double p) {
+  if (s->lat_samples == 0)
+    return 0;
+  uint64_t want = (uint64_t)(p * (double)s->lat_samples + 0.5);
+  if (want == 0)
+    want = 1;
+  uint64_t seen = 0;
+  for (int b = 0; b < HID_STATS_BUCKETS; b++) {
+    seen += s->hist[b];
+    if (seen >= want) {
+      uint64_t upper = bucket_upper_ns(b);
+      return (b == HID_STATS_BUCKETS - 1 || upper > s->lat_max_ns)
+                 ? s->lat_max_ns
+                 : upper;
+    }
+  }
+  return s->lat_max_ns;
+}
+
+static void format_us(char *buf, size_t len, uint64_t ns) {
+  if (ns >= 10000000)
+    snprintf(buf, len, "%llums", (unsigned long long)(ns / 1000000));
+  else
+    snprintf(buf, len, "%lluus", (unsigned long long)(ns / 1000));
+}
+
+void hid_stats_print(FILE *out, const char *name, const struct hid_stats *s) {
+  fprintf(out,
+          "[HID-STATS] %s: %llu reports, %llu bytes, %llu writes, "
+          "%llu short, errors again=%llu gone=%llu timeout=%llu intr=%llu "
+          "other=%llu\n",
+          name, (unsigned long long)s->reports, (unsigned long long)s->bytes,
+          (unsigned long long)s->writes, (unsigned long long)s->short_writes,
+          (unsigned long long)s->errors[HID_ERR_AGAIN],
+          (unsigned long long)s->errors[HID_ERR_GONE],
+          (unsigned long long)s->errors[HID_ERR_TIMEOUT],
+          (unsigned long long)s->errors[HID_ERR_INTR],
+          (unsigned long long)s->errors[HID_ERR_OTHER]);
+  if (s->lat_samples == 0)
+    return;
+  fprintf(out,
+          "[HID-STATS] %s: latency avg %.1fus p50<=%.1fus p99<=%.1fus "
+          "max %.1fus\n",
+          name, (double)s->lat_total_ns / (double)s->lat_samples / 1000.0,
+          hid_stats_percentile_ns(s, 0.50) / 1000.0,
+          hid_stats_percentile_ns(s, 0.99) / 1000.0, s->lat_max_ns / 1000.0);
+  for (int b = 0; b < HID_STATS_BUCKETS; b++) {
+    if (!s->hist[b])
+      continue;
+    char bound[24];
+    int last = (b == HID_STATS_BUCKETS - 1);
+    format_us(bound, sizeof(bound), bucket_upper_ns(last ? b - 1 : b));
+    fprintf(out, "[HID-STATS] %s:   %s %7s %llu (%.1f%%)\n", name,
+            last ? ">=" : "< ", bound, (unsigned long long)s->hist[b],
+            100.0 * (double)s->hist[b] / (double)s->lat_samples);
+  }
+}
+
+/* --- Stats file --- */
+
+static const struct {
+  const char *key;
+  size_t off;
+} g_fields[] = {
+    {"writes", offsetof(struct hid_stats, writes)},
+    {"reports", offsetof(struct hid_stats, reports)},
+    {"bytes", offsetof(struct hid_stats, bytes)},
+    {"short", offsetof(struct hid_stats, short_writes)},
+    {"again", offsetof(struct hid_stats, errors[HID_ERR_AGAIN])},
+    {"gone", offsetof(struct hid_stats, errors[HID_ERR_GONE])},
+    {"timeout", offsetof(struct hid_stats, errors[HID_ERR_TIMEOUT])},
+    {"intr", offsetof(struct hid_stats, errors[HID_ERR_INTR])},
+    {"other", offsetof(struct hid_stats, errors[HID_ERR_OTHER])},
+    {"samples", offsetof(struct hid_stats, lat_samples)},
+    {"total_ns", offsetof(struct hid_stats, lat_total_ns)},
+    {"max_ns", offsetof(struct hid_stats, lat_max_ns)},
+};
+#define FIELD_COUNT (sizeof(g_fields) / sizeof(g_fields[0]))
+
+static uint64_t *field_ptr(struct hid_stats *s, size_t i) {
+  return (uint64_t *)((char *)s + g_fields[i].off);
+}
+
+static void parse_stats(FILE *f, const char *const names[],
+                        struct hid_stats *st, size_t n) {
+  char line[2048];
+  memset(st, 0, n * sizeof(*st));
+
+  while (fgets(line, sizeof(line), f)) {
+    char *save = NULL;
+    char *tok = strtok_r(line, " \t\n", &save);
+    if (!tok || tok[0] == '#')
+      continue;
+    struct hid_stats *s = NULL;
+    for (size_t d = 0; d < n; d++) {
+      if (strcmp(tok, names[d]) == 0)
+        s = &st[d];
+    }
+    if (!s)
+      continue;
+
+    while ((tok = strtok_r(NULL, " \t\n", &save)) != NULL) {
+      if (strcmp(tok, "hist") == 0) {
+        for (int b = 0; b < HID_STATS_BUCKETS; b++) {
+          char *v = strtok_r(NULL, " \t\n", &save);
+          if (!v)
+            break;
+          s->hist[b] = strtoull(v, NULL, 10);
+        }
+        break;
+      }
+      char *v = strtok_r(NULL, " \t\n", &save);
+      if (!v)
+        break;
+      for (size_t i = 0; i < FIELD_COUNT; i++) {
+        if (strcmp(tok, g_fields[i].key) == 0)
+          *field_ptr(s, i) = strtoull(v, NULL, 10);
+      }
+    }
+  }
+}
+
+static void write_stats(FILE *f, const char *const names[],
+                        struct hid_stats *st, size_t n) {
+  fprintf(f, "# hid-gadget stats v1\n");
+  for (size_t d = 0; d < n; d++) {
+    fprintf(f, "%s", names[d]);
+    for (size_t i = 0; i < FIELD_COUNT; i++)
+      fprintf(f, " %s %llu", g_fields[i].key,
+              (unsigned long long)*field_ptr(&st[d], i));
+    fprintf(f, " hist");
+    for (int b = 0; b < HID_STATS_BUCKETS; b++)
+      fprintf(f, " %llu", (unsigned long long)st[d].hist[b]);
+    fprintf(f, "\n");
+  }
+}
+
+int hid_stats_save(const char *path, const char *const names[],
+                   const struct hid_stats *st, size_t n) {
+  int fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+  if (fd < 0)
+    return -1;
+  if (flock(fd, LOCK_EX) != 0) {
+    close(fd);
+    return -1;
+  }
+  FILE *f = fdopen(fd, "r+");
+  if (!f) {
+    close(fd);
+    return -1;
+  }
+
+  struct hid_stats *total = calloc(n, sizeof(*total));
+  if (!total) {
+    fclose(f);
+    errno = ENOMEM;
+    return -1;
+  }
+  parse_stats(f, names, total, n);
+  for (size_t d = 0; d < n; d++)
+    hid_stats_merge(&total[d], &st[d]);
+
+  rewind(f);
+  int ret = ftruncate(fd, 0);
+  if (ret == 0) {
+    write_stats(f, names, total, n);
+    ret = fflush(f) == 0 ? 0 : -1;
+  }
+  free(total);
+  fclose(f); /* drops the lock */
+  return ret;
+}
+
+int hid_stats_load(const char *path, const char *const names[],
+                   struct hid_stats *st, size_t n) {
+  FILE *f = fopen(path, "re");
+  if (!f)
+    return -1;
+  flock(fileno(f), LOCK_SH);
+  parse_stats(f, names, st, n);
+  fclose(f);
+  return 0;
+}
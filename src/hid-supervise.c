@@ -0,0 +1,482 @@
+/*
+ * hid-supervise.c - event-driven gadget supervisor (see hid_supervise.h).
+ */
+
+#define _GNU_SOURCE
+#include "../include/hid_supervise.h"
+#include "../include/hid_configfs.h"
+#include "../include/hid_ctx.h"
+#include "../include/hid_discover.h"
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <linux/netlink.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/inotify.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+#ifdef __ANDROID__
+#include <pthread.h>
+#include <sys/system_properties.h>
+#endif
+
+#define REPAIR_BACKOFF_MIN_MS 1000
+#define REPAIR_BACKOFF_MAX_MS 60000
+
+/* Configfs functions hid-setup creates, one per role; the optional ones
+ * only when enabled */
+static const char *const g_functions[HID_ROLE_COUNT] = {"hid.gs1", "hid.gs2",
+                                                        "hid.gs3", "hid.gs4"};
+
+static volatile sig_atomic_t g_stop = 0;
+
+static void on_stop_signal(int sig) {
+  (void)sig;
+  g_stop = 1;
+}
+
+static int64_t now_ms(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (int64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static int __attribute__((format(printf, 3, 4)))
+problem(char *why, size_t size, const char *fmt, ...) {
+  if (why && size) {
+    va_list ap;
+    va_start(ap, fmt);
+    vsnprintf(why, size, fmt, ap);
+    va_end(ap);
+  }
+  return 1;
+}
+
+// --- Health Check ---
+/* Whether some configuration of the gadget links the function */
+static int function_linked(const char *gadget, const char *func) {
+  char configs[PATH_MAX];
+  DIR *dir = NULL;
+  if (hid_path_fmt(configs, sizeof(configs), "%s/configs", gadget) == 0)
+    dir = opendir(configs);
+  if (!dir)
+    return 0;
+  int linked = 0;
+  struct dirent *entry;
+  while (!linked && (entry = readdir(dir)) != NULL) {
+    char link[PATH_MAX];
+    struct stat st;
+    if (entry->d_name[0] != '.' &&
+        hid_path_fmt(link, sizeof(link), "%s/%s/%s", configs, entry->d_name,
+                 func) == 0 &&
+        lstat(link, &st) == 0)
+      linked = 1;
+  }
+  closedir(dir);
+  return linked;
+}
+
+/* hid.gs1 of the composite layout carries every role behind report IDs */
+static int composite_layout(const char *gadget) {
+  char path[PATH_MAX];
+  unsigned char desc[HID_GADGET_DESC_MAX];
+  if (hid_path_fmt(path, sizeof(path), "%s/functions/%s/report_desc", gadget,
+               g_functions[HID_ROLE_KEYBOARD]) != 0)
+    return 0;
+  FILE *f = fopen(path, "rb");
+  if (!f)
+    return 0;
+  size_t len = fread(desc, 1, sizeof(desc), f);
+  fclose(f);
+  return hid_desc_has_report_ids(desc, len);
+}
+
+int hid_gadget_check(const char *root, const char *gadget_dir, char *why,
+                     size_t size) {
+  char gadget[PATH_MAX], path[PATH_MAX], udc[64] = "";
+  struct stat st;
+  if (hid_path_fmt(gadget, sizeof(gadget), "%s%s", root, gadget_dir) != 0 ||
+      stat(gadget, &st) != 0)
+    return problem(why, size, "no gadget at %s", gadget_dir);
+
+  /* An optional function is checked like the others once it exists */
+  int functions = composite_layout(gadget) ? 1 : HID_ROLE_COUNT;
+  int wanted[HID_ROLE_COUNT] = {0};
+  for (int role = 0; role < functions; role++) {
+    if (hid_path_fmt(path, sizeof(path), "%s/functions/%s", gadget,
+                 g_functions[role]) != 0 ||
+        stat(path, &st) != 0) {
+      if (role >= HID_ROLE_BASE_COUNT)
+        continue;
+      return problem(why, size, "function %s missing", g_functions[role]);
+    }
+    wanted[role] = 1;
+    if (!function_linked(gadget, g_functions[role]))
+      return problem(why, size, "function %s not in any configuration",
+                     g_functions[role]);
+  }
+
+  FILE *f = NULL;
+  if (hid_path_fmt(path, sizeof(path), "%s/UDC", gadget) == 0)
+    f = fopen(path, "r");
+  if (f) {
+    if (!fgets(udc, sizeof(udc), f))
+      udc[0] = '\0';
+    fclose(f);
+  }
+  udc[strcspn(udc, "\n")] = '\0';
+  if (!udc[0])
+    return problem(why, size, "gadget not bound to a UDC");
+
+  /* The nodes: every wanted role labelled by configfs, or as many
+   * unlabelled ones as hid-setup creates on kernels without the dev
+   * attribute */
+  struct hid_node nodes[HID_DISCOVER_MAX];
+  int count = hid_discover_nodes(root, NULL, nodes, HID_DISCOVER_MAX);
+  int found[HID_ROLE_COUNT] = {0}, labelled = 0;
+  for (int i = 0; i < count; i++) {
+    if (nodes[i].role == HID_NODE_COMPOSITE)
+      return 0;
+    if (nodes[i].role >= 0 && nodes[i].role < HID_ROLE_COUNT) {
+      found[nodes[i].role] = 1;
+      labelled = 1;
+    }
+  }
+  int expected = 0;
+  for (int role = 0; role < HID_ROLE_COUNT; role++)
+    expected += wanted[role];
+  if (!labelled)
+    return count >= expected ? 0
+                             : problem(why, size, "%d of %d hidg nodes",
+                                       count < 0 ? 0 : count, expected);
+  for (int role = 0; role < HID_ROLE_COUNT; role++)
+    if (wanted[role] && !found[role])
+      return problem(why, size, "no %s node", hid_role_names[role]);
+  return 0;
+}
+// --- End Health Check ---
+
+// --- Event Sources ---
+struct watch {
+  int inotify;  /* configfs gadget and /dev, -1 if unavailable */
+  int uevent;   /* NETLINK_KOBJECT_UEVENT, -1 if unavailable */
+  int property; /* read end of the property watcher's pipe, or -1 */
+  int dev_wd;   /* the /dev watch: only hidg* names count there */
+};
+
+/* (Re)adds the watches. Directories that appear later (the gadget, a new
+ * configuration) are picked up by the check that their creation triggers;
+ * inotify_add_watch() on a watched path just returns the existing watch. */
+static void add_watches(struct watch *w, const char *root,
+                        const char *gadget) {
+  const uint32_t dir_mask = IN_CREATE | IN_DELETE | IN_MOVED_FROM |
+                            IN_MOVED_TO | IN_ATTRIB | IN_DELETE_SELF;
+  char path[PATH_MAX];
+  if (w->inotify < 0)
+    return;
+  if (hid_path_fmt(path, sizeof(path), "%s/dev", root) == 0)
+    w->dev_wd = inotify_add_watch(w->inotify, path, dir_mask);
+  /* The parent sees the gadget directory itself come and go */
+  if (hid_path_fmt(path, sizeof(path), "%s%s/..", root, gadget) == 0)
+    inotify_add_watch(w->inotify, path, dir_mask);
+  if (hid_path_fmt(path, sizeof(path), "%s%s", root, gadget) == 0)
+    inotify_add_watch(w->inotify, path, dir_mask);
+  /* Writes to UDC: configfs reports them as modifications of the file */
+  if (hid_path_fmt(path, sizeof(path), "%s%s/UDC", root, gadget) == 0)
+    inotify_add_watch(w->inotify, path, IN_MODIFY | IN_CLOSE_WRITE);
+  if (hid_path_fmt(path, sizeof(path), "%s%s/configs", root, gadget) != 0)
+    return;
+  inotify_add_watch(w->inotify, path, dir_mask);
+  DIR *dir = opendir(path);
+  if (!dir)
+    return;
+  struct dirent *entry;
+  while ((entry = readdir(dir)) != NULL) {
+    char config[PATH_MAX];
+    if (entry->d_name[0] != '.' &&
+        hid_path_fmt(config, sizeof(config), "%s/%s", path, entry->d_name) == 0)
+      inotify_add_watch(w->inotify, config, dir_mask);
+  }
+  closedir(dir);
+}
+
+/* Drains the inotify queue: 1 if any event concerns the gadget */
+static int inotify_relevant(const struct watch *w) {
+  char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+  int relevant = 0;
+  ssize_t n;
+  while ((n = read(w->inotify, buf, sizeof(buf))) > 0) {
+    for (char *p = buf; p < buf + n;) {
+      const struct inotify_event *ev = (const struct inotify_event *)p;
+      if (ev->wd != w->dev_wd || (ev->mask & IN_IGNORED) ||
+          (ev->len && strncmp(ev->name, "hidg", 4) == 0))
+        relevant = 1;
+      p += sizeof(*ev) + ev->len;
+    }
+  }
+  return relevant;
+}
+
+static int uevent_open(void) {
+  struct sockaddr_nl addr = {.nl_family = AF_NETLINK, .nl_groups = 1};
+  int fd = socket(AF_NETLINK, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC,
+                  NETLINK_KOBJECT_UEVENT);
+  if (fd < 0)
+    return -1;
+  if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0) {
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+/* Drains the uevent socket: 1 if a udc, hidg or android_usb device changed.
+ * A message is "action@devpath" followed by NUL-separated KEY=value pairs. */
+static int uevent_relevant(int fd) {
+  static const char *const subsystems[] = {
+      "SUBSYSTEM=udc", "SUBSYSTEM=hidg", "SUBSYSTEM=android_usb"};
+  char buf[8192];
+  int relevant = 0;
+  ssize_t n;
+  while ((n = recv(fd, buf, sizeof(buf) - 1, 0)) > 0) {
+    buf[n] = '\0';
+    for (ssize_t i = 0; i < n; i += (ssize_t)strlen(buf + i) + 1)
+      for (size_t s = 0; s < sizeof(subsystems) / sizeof(*subsystems); s++)
+        if (strcmp(buf + i, subsystems[s]) == 0)
+          relevant = 1;
+  }
+  return relevant;
+}
+
+static void drain(int fd) {
+  char buf[64];
+  while (read(fd, buf, sizeof(buf)) > 0)
+    ;
+}
+
+#ifdef __ANDROID__
+static int usb_config_wants_hid(void) {
+  char value[PROP_VALUE_MAX] = "";
+  __system_property_get("sys.usb.config", value);
+  return strstr(value, "hid") != NULL;
+}
+
+static void wait_for_boot(void) {
+  char value[PROP_VALUE_MAX] = "";
+  while (!g_stop) {
+    __system_property_get("sys.boot_completed", value);
+    if (strcmp(value, "1") == 0)
+      return;
+    sleep(1);
+  }
+}
+
+#if __ANDROID_API__ >= 26
+/* Wakes the supervisor through a pipe whenever sys.usb.config changes */
+static void *watch_usb_config(void *arg) {
+  int fd = (int)(intptr_t)arg;
+  const prop_info *pi;
+  while (!(pi = __system_property_find("sys.usb.config")))
+    sleep(1);
+  uint32_t serial = __system_property_serial(pi);
+  while (__system_property_wait(pi, serial, &serial, NULL)) {
+    char c = 1;
+    if (write(fd, &c, 1) < 0 && errno != EAGAIN)
+      break;
+  }
+  return NULL;
+}
+#endif
+
+static int property_open(void) {
+#if __ANDROID_API__ >= 26
+  int fds[2];
+  pthread_t thread;
+  if (pipe2(fds, O_NONBLOCK | O_CLOEXEC) != 0)
+    return -1;
+  if (pthread_create(&thread, NULL, watch_usb_config,
+                     (void *)(intptr_t)fds[1]) != 0) {
+    close(fds[0]);
+    close(fds[1]);
+    return -1;
+  }
+  pthread_detach(thread);
+  return fds[0];
+#else
+  return -1;
+#endif
+}
+#else
+/* Plain Linux has no USB mode property: the gadget should always be up */
+static int usb_config_wants_hid(void) { return 1; }
+static void wait_for_boot(void) {}
+static int property_open(void) { return -1; }
+#endif
+// --- End Event Sources ---
+
+/* The native setup (hid_configfs.h), falling back to hid-setup if the spec
+ * cannot be built or configfs refuses a change */
+static int repair(const struct hid_supervise_opts *opts) {
+  struct hid_gadget_spec spec;
+  struct hid_gadget_changes changes;
+  char desc[256];
+  if (hid_gadget_spec_default(&spec, opts->root) != 0) {
+    fprintf(stderr, "[HID-SUPERVISE] No HID descriptors (%s)\n",
+            strerror(errno));
+  } else {
+    spec.gadget = opts->gadget;
+    if (hid_gadget_reconcile(&spec, &changes) == 0) {
+      hid_gadget_describe(desc, sizeof(desc), &changes);
+      fprintf(stderr, "[HID-SUPERVISE] %s\n", desc);
+      return 0;
+    }
+    fprintf(stderr, "[HID-SUPERVISE] Reconcile failed: %s\n", changes.why);
+  }
+  if (opts->root[0] || access("/system/bin/hid-setup", X_OK) != 0)
+    return -1;
+  return system(HID_SETUP_DEFAULT_COMMAND);
+}
+
+/* Checks and, when the gadget is incomplete, runs the setup command (at
+ * boot even if the USB mode is something else, as service.sh always did).
+ * Returns 0 if the gadget is healthy afterwards. */
+static int check_and_repair(const struct hid_supervise_opts *opts, int boot,
+                            unsigned *repairs) {
+  char why[256];
+  if (hid_gadget_check(opts->root, opts->gadget, why, sizeof(why)) == 0)
+    return 0;
+  if (!boot && !usb_config_wants_hid()) {
+    fprintf(stderr, "[HID-SUPERVISE] %s, but USB mode is not HID; leaving "
+                    "it\n",
+            why);
+    return 0;
+  }
+  fprintf(stderr, "[HID-SUPERVISE] %s; %s\n", why,
+          opts->setup_cmd ? "running setup" : "reconciling");
+  int status = opts->setup_cmd ? system(opts->setup_cmd) : repair(opts);
+  (*repairs)++;
+  if (hid_gadget_check(opts->root, opts->gadget, why, sizeof(why)) == 0) {
+    fprintf(stderr, "[HID-SUPERVISE] Gadget restored (repair %u)\n",
+            *repairs);
+    return 0;
+  }
+  fprintf(stderr, "[HID-SUPERVISE] Setup %s; still %s\n",
+          status == 0 ? "finished" : "failed", why);
+  return -1;
+}
+
+int hid_supervise_run(const struct hid_supervise_opts *opts) {
+  unsigned repairs = 0;
+  wait_for_boot();
+  if (opts->once)
+    return check_and_repair(opts, 1, &repairs) == 0 ? 0 : 1;
+
+  struct watch w = {.inotify = inotify_init1(IN_NONBLOCK | IN_CLOEXEC),
+                    .uevent = uevent_open(),
+                    .property = property_open(),
+                    .dev_wd = -1};
+  if (w.inotify < 0 && w.uevent < 0 && w.property < 0)
+    return -1;
+
+  struct sigaction sa;
+  memset(&sa, 0, sizeof(sa));
+  sa.sa_handler = on_stop_signal;
+  sigaction(SIGINT, &sa, NULL);
+  sigaction(SIGTERM, &sa, NULL);
+  signal(SIGCHLD, SIG_DFL);
+
+  fprintf(stderr, "[HID-SUPERVISE] Watching %s%s (inotify %s, uevents %s, "
+                  "property %s)\n",
+          opts->root, opts->gadget, w.inotify >= 0 ? "on" : "off",
+          w.uevent >= 0 ? "on" : "off", w.property >= 0 ? "on" : "off");
+
+  /* The first check runs at once; later ones settle_ms after the last event,
+   * or at the periodic recheck */
+  int64_t now = now_ms();
+  int64_t check_at = now;
+  int64_t recheck_at =
+      opts->recheck_s > 0 ? now + (int64_t)opts->recheck_s * 1000 : -1;
+  int backoff = REPAIR_BACKOFF_MIN_MS;
+  int boot = 1;
+  add_watches(&w, opts->root, opts->gadget);
+
+  while (!g_stop) {
+    now = now_ms();
+    if (check_at >= 0 && now >= check_at) {
+      check_at = -1;
+      add_watches(&w, opts->root, opts->gadget);
+      if (check_and_repair(opts, boot, &repairs) == 0) {
+        backoff = REPAIR_BACKOFF_MIN_MS;
+        boot = 0;
+      } else {
+        check_at = now_ms() + backoff;
+        backoff = backoff * 2 > REPAIR_BACKOFF_MAX_MS ? REPAIR_BACKOFF_MAX_MS
+                                                      : backoff * 2;
+      }
+      /* Setup's own changes are already accounted for */
+      if (w.inotify >= 0)
+        inotify_relevant(&w);
+      if (w.uevent >= 0)
+        uevent_relevant(w.uevent);
+      if (opts->recheck_s > 0)
+        recheck_at = now_ms() + (int64_t)opts->recheck_s * 1000;
+      continue;
+    }
+    if (recheck_at >= 0 && now >= recheck_at && check_at < 0) {
+      check_at = now;
+      continue;
+    }
+
+    int64_t until = check_at >= 0 ? check_at : recheck_at;
+    int timeout = until < 0 ? -1 : until > now ? (int)(until - now) : 0;
+    struct pollfd fds[3];
+    int nfds = 0;
+    if (w.inotify >= 0)
+      fds[nfds++] = (struct pollfd){.fd = w.inotify, .events = POLLIN};
+    if (w.uevent >= 0)
+      fds[nfds++] = (struct pollfd){.fd = w.uevent, .events = POLLIN};
+    if (w.property >= 0)
+      fds[nfds++] = (struct pollfd){.fd = w.property, .events = POLLIN};
+    int ready = poll(fds, (nfds_t)nfds, timeout);
+    if (ready < 0 && errno != EINTR)
+      break;
+    if (ready <= 0)
+      continue;
+
+    int relevant = 0;
+    for (int i = 0; i < nfds; i++) {
+      if (!(fds[i].revents & POLLIN))
+        continue;
+      if (fds[i].fd == w.inotify)
+        relevant |= inotify_relevant(&w);
+      else if (fds[i].fd == w.uevent)
+        relevant |= uevent_relevant(w.uevent);
+      else {
+        drain(w.property);
+        relevant = 1;
+      }
+    }
+    /* Debounce: a setup run is a burst of events, check once it is over.
+     * A pending repair backoff is not shortened by further events. */
+    if (relevant && (check_at < 0 || backoff == REPAIR_BACKOFF_MIN_MS))
+      check_at = now_ms() + opts->settle_ms;
+  }
+
+  if (w.inotify >= 0)
+    close(w.inotify);
+  if (w.uevent >= 0)
+    close(w.uevent);
+  if (w.property >= 0)
+    close(w.property);
+  fprintf(stderr, "[HID-SUPERVISE] Stopped after %u repair%s.\n", repairs,
+          repairs == 1 ? "" : "s");
+  return 0;
+}
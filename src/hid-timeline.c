@@ -0,0 +1,83 @@
+/*
+ * hid-timeline.c - absolute-deadline delays (see hid_timeline.h).
+ */
+
+#include "../include/hid_timeline.h"
+#include <errno.h>
+#include <string.h>
+#include <sys/prctl.h>
+#include <time.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#define cpu_relax() __builtin_ia32_pause()
+#elif defined(__aarch64__) || defined(__arm__)
+#define cpu_relax() __asm__ __volatile__("yield" ::: "memory")
+#else
+#define cpu_relax() ((void)0)
+#endif
+
+uint64_t hid_monotonic_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+void hid_sleep_until_ns(uint64_t deadline_ns, uint32_t spin_ns) {
+  uint64_t wake = deadline_ns > spin_ns ? deadline_ns - spin_ns : 0;
+  if (hid_monotonic_ns() < wake) {
+    struct timespec ts = {.tv_sec = (time_t)(wake / 1000000000ull),
+                          .tv_nsec = (long)(wake % 1000000000ull)};
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) ==
+           EINTR)
+      ;
+  }
+  if (spin_ns) {
+    while (hid_monotonic_ns() < deadline_ns)
+      cpu_relax();
+  }
+}
+
+int hid_timer_set_slack(unsigned long ns) {
+  return prctl(PR_SET_TIMERSLACK, ns, 0, 0, 0) == 0 ? 0 : -1;
+}
+
+void hid_timeline_init(struct hid_timeline *tl) { memset(tl, 0, sizeof(*tl)); }
+
+uint64_t hid_timeline_start(struct hid_timeline *tl) {
+  uint64_t now = hid_monotonic_ns();
+  if (tl->relative || tl->deadline_ns == 0)
+    return now;
+  if (now > tl->deadline_ns + HID_TIMELINE_RESYNC_NS) {
+    tl->stats.resyncs++;
+    return now;
+  }
+  return tl->deadline_ns;
+}
+
+void hid_timeline_wait(struct hid_timeline *tl, uint64_t delay_ns) {
+  uint64_t deadline = hid_timeline_start(tl) + delay_ns;
+  hid_sleep_until_ns(deadline, tl->spin_ns);
+
+  uint64_t now = hid_monotonic_ns();
+  uint64_t late = now > deadline ? now - deadline : 0;
+  tl->stats.waits++;
+  tl->stats.late_total_ns += late;
+  if (late > tl->stats.late_max_ns)
+    tl->stats.late_max_ns = late;
+  tl->deadline_ns = deadline;
+}
+
+void hid_timeline_set(struct hid_timeline *tl, uint64_t deadline_ns) {
+  tl->deadline_ns = deadline_ns;
+}
+
+void hid_timing_print(FILE *out, const struct hid_timing_stats *s) {
+  if (s->waits == 0)
+    return;
+  fprintf(out,
+          "[HID-STATS] timing: %llu waits, late avg %.1fus max %.1fus, "
+          "%llu resyncs\n",
+          (unsigned long long)s->waits,
+          (double)s->late_total_ns / (double)s->waits / 1000.0,
+          s->late_max_ns / 1000.0, (unsigned long long)s->resyncs);
+}
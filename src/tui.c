@@ -1,24 +1,12 @@
 #define TB_IMPL
 #include "tui.h"
 #include "termbox2.h"
+#include "hid_interface.h"
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 
-// External declarations for HID functions (from hid-gadget.c)
-extern int send_keyboard_report(uint8_t modifiers, uint8_t key1, uint8_t key2,
-                                uint8_t key3, uint8_t key4, uint8_t key5,
-                                uint8_t key6);
-extern int send_key_sequence(const char *modifiers_str, const char *sequence);
-extern uint8_t parse_modifiers(const char *mod_str, const char **remainder);
-
-// External declarations for Mouse functions (from hid-gadget.c)
-extern int send_mouse_move(int8_t x, int8_t y);
-extern int send_mouse_click(uint8_t button);
-extern int send_mouse_press(uint8_t button);
-extern int send_mouse_release(void);
-
 // Constants
 #define MOUSE_BTN_LEFT 1
 #define MOUSE_BTN_RIGHT 2
@@ -0,0 +1,648 @@
+#!/usr/bin/env python3
+"""Micro-benchmarks for the hid-gadget output paths.
+
+Usage: python3 tests/bench.py [benchmark ...]
+Without arguments every benchmark is run.
+"""
+import os
+import sys
+import glob
+import subprocess
+import resource
+import shutil
+import socket
+import stat
+import statistics
+import struct
+import tempfile
+import time
+
+TEST_DIR = os.path.dirname(os.path.abspath(__file__))
+ROOT_DIR = os.path.dirname(TEST_DIR)
+PROD_BIN = os.path.join(TEST_DIR, "hid-gadget-bench")
+
+TYPING_CHARS = 20000
+
+
+def compile_binaries():
+    # One production build; mock runs select it with HID_OUTPUT=mock
+    print("[*] Compiling production executable...")
+    sources = sorted(glob.glob(os.path.join(ROOT_DIR, "src", "*.c")))
+    base = ["gcc", "-Wall", "-Wextra", "-O2", "-Iinclude"]
+    try:
+        subprocess.check_call(base + ["-o", PROD_BIN] + sources +
+                              ["-pthread", "-lm"], cwd=ROOT_DIR)
+        return True
+    except subprocess.CalledProcessError:
+        print("[-] Compilation failed.")
+        return False
+
+
+def run_rusage(args, env=None):
+    """Runs args and returns (result, wall_s, cpu_s) for the child."""
+    before = resource.getrusage(resource.RUSAGE_CHILDREN)
+    result, elapsed = run_timed(args, env)
+    after = resource.getrusage(resource.RUSAGE_CHILDREN)
+    cpu = (after.ru_utime - before.ru_utime) + (after.ru_stime - before.ru_stime)
+    return result, elapsed, cpu
+
+
+def write_string_script(chars, prefix=""):
+    """Writes a Ducky script typing `chars` characters; returns its path."""
+    line = "The quick brown fox jumps over the lazy dog 0123456789 !?@#$ " * 8
+    with tempfile.NamedTemporaryFile("w", suffix=".ducky", delete=False) as f:
+        f.write(prefix)
+        left = chars
+        while left > 0:
+            f.write("STRING " + line[:left] + "\n")
+            left -= len(line[:left])
+        return f.name
+
+
+def run_timed(args, env=None):
+    start = time.perf_counter()
+    result = subprocess.run(args, capture_output=True, text=True, env=env)
+    elapsed = time.perf_counter() - start
+    return result, elapsed
+
+
+def bench_typing():
+    """Reports per second for a long STRING payload in mock mode."""
+    script = write_string_script(TYPING_CHARS)
+    try:
+        best = None
+        for _ in range(3):
+            result, elapsed = run_timed([PROD_BIN, "ducky", script],
+                                        dict(os.environ, HID_OUTPUT="mock"))
+            reports = sum(1 for l in result.stdout.splitlines()
+                          if l.startswith("[HID-MOCK] Writing"))
+            if best is None or elapsed < best[1]:
+                best = (reports, elapsed)
+        reports, elapsed = best
+        print(f"[+] typing: {TYPING_CHARS} chars, {reports} reports in "
+              f"{elapsed * 1000:.1f} ms -> {reports / elapsed:,.0f} reports/s")
+    finally:
+        os.unlink(script)
+
+
+ASYNC_LINES = 10
+ASYNC_LATENCY_US = 500
+
+
+def bench_async():
+    """Producer time saved by HID_ASYNC=1 under a slow (simulated) host."""
+    line = "hello world " * 4
+    with tempfile.NamedTemporaryFile("w", suffix=".ducky", delete=False) as f:
+        for _ in range(ASYNC_LINES):
+            f.write("STRING " + line + "\n")
+        script = f.name
+    try:
+        for mode in ("0", "1"):
+            env = dict(os.environ, HID_OUTPUT="mock", HID_ASYNC=mode,
+                       HID_QUEUE_STATS="1",
+                       HID_MOCK_LATENCY_US=str(ASYNC_LATENCY_US))
+            result, elapsed = run_timed([PROD_BIN, "ducky", script], env)
+            stats = [l for l in result.stderr.splitlines()
+                     if l.startswith("[HID-QUEUE]")]
+            label = "async" if mode == "1" else "sync "
+            print(f"[+] {label}: wall {elapsed * 1000:.1f} ms")
+            for l in stats:
+                print(f"      {l}")
+    finally:
+        os.unlink(script)
+
+
+BATCH_CHARS = 10000
+BATCH_DELAYED_CHARS = 1000
+
+
+def batch_stats(stderr):
+    for l in stderr.splitlines():
+        if l.startswith("[HID-BATCH]"):
+            return l
+    return "(no batch stats)"
+
+
+def bench_batch():
+    """Syscalls per character and CPU time per 10k characters by mode."""
+    env = dict(os.environ, HID_KEYBOARD_DEV="/dev/null", HID_QUEUE_STATS="1")
+    plain = write_string_script(BATCH_CHARS)
+    delayed = write_string_script(BATCH_DELAYED_CHARS, "DEFAULTCHARDELAY 1\n")
+    try:
+        for label, script, chars in (("no delay", plain, BATCH_CHARS),
+                                     ("1 ms/char", delayed,
+                                      BATCH_DELAYED_CHARS)):
+            for mode in ("loop", "writev", "uring"):
+                env["HID_BATCH"] = mode
+                result, elapsed, cpu = run_rusage([PROD_BIN, "ducky", script],
+                                                  env)
+                stats = batch_stats(result.stderr)
+                syscalls = 0
+                if "syscalls" in stats:
+                    syscalls = int(stats.split(" syscalls")[0].split()[-1])
+                print(f"[+] batch {label:9} {mode:6}: "
+                      f"{syscalls / chars:.3f} syscalls/char, "
+                      f"CPU {cpu * 1000 * 10000 / chars:.1f} ms per 10k chars, "
+                      f"wall {elapsed * 1000:.0f} ms")
+    finally:
+        os.unlink(plain)
+        os.unlink(delayed)
+
+
+ROLLOVER_CHARS = 2000
+ROLLOVER_LATENCY_US = 1000
+
+
+def bench_rollover():
+    """Report count and wall time per typing engine with a 1 ms host poll."""
+    script = write_string_script(ROLLOVER_CHARS)
+    try:
+        for engine in ("classic", "rollover"):
+            env = dict(os.environ, HID_OUTPUT="mock", HID_TYPING=engine,
+                       HID_MOCK_LATENCY_US=str(ROLLOVER_LATENCY_US))
+            result, elapsed = run_timed([PROD_BIN, "ducky", script], env)
+            reports = sum(1 for l in result.stdout.splitlines()
+                          if l.startswith("[HID-MOCK] Writing"))
+            print(f"[+] {engine:8}: {ROLLOVER_CHARS} chars, {reports} reports "
+                  f"({reports / ROLLOVER_CHARS:.2f}/char), "
+                  f"wall {elapsed * 1000:.0f} ms")
+    finally:
+        os.unlink(script)
+
+
+STATS_CHARS = 20000
+STATS_RUNS = 5
+
+
+def bench_stats():
+    """Per-report CPU cost of the write statistics (HID_STATS=0 vs on)."""
+    script = write_string_script(STATS_CHARS)
+    env = dict(os.environ, HID_KEYBOARD_DEV="/dev/null", HID_BATCH="loop")
+    try:
+        cpu = {}
+        for mode in ("0", ""):
+            env["HID_STATS"] = mode
+            best = None
+            for _ in range(STATS_RUNS):
+                _, _, c = run_rusage([PROD_BIN, "ducky", script], env)
+                best = c if best is None else min(best, c)
+            cpu[mode] = best
+        reports = 2 * STATS_CHARS
+        for mode, label in (("0", "off"), ("", "on ")):
+            print(f"[+] stats {label}: CPU {cpu[mode] * 1000:.1f} ms for "
+                  f"{reports} reports ({cpu[mode] * 1e9 / reports:.0f} ns/report)")
+        print(f"[+] stats overhead: "
+              f"{(cpu[''] - cpu['0']) * 1e9 / reports:+.0f} ns/report")
+    finally:
+        os.unlink(script)
+
+
+BACKEND_CHARS = 20000
+
+
+def bench_backends():
+    """Interpreter throughput per output backend, no gadget involved."""
+    script = write_string_script(BACKEND_CHARS)
+    capture = script + ".cap"
+    try:
+        result, _ = run_timed([PROD_BIN, "ducky", script],
+                              dict(os.environ, HID_OUTPUT="mock"))
+        reports = sum(1 for l in result.stdout.splitlines()
+                      if l.startswith("[HID-MOCK] Writing"))
+        for spec in ("null", "memory", "capture:" + capture, "mock"):
+            env = dict(os.environ, HID_OUTPUT=spec, HID_STATS="0")
+            best = None
+            for _ in range(3):
+                _, elapsed, cpu = run_rusage([PROD_BIN, "ducky", script], env)
+                if best is None or cpu < best[1]:
+                    best = (elapsed, cpu)
+            elapsed, cpu = best
+            print(f"[+] backend {spec.split(':')[0]:7}: {reports} reports, "
+                  f"CPU {cpu * 1000:.1f} ms ({reports / cpu:,.0f} reports/s), "
+                  f"wall {elapsed * 1000:.1f} ms")
+        print(f"      capture file: {os.path.getsize(capture)} bytes")
+    finally:
+        os.unlink(script)
+        if os.path.exists(capture):
+            os.unlink(capture)
+
+
+REPLAY_CHARS = 20000
+REPLAY_PACED_CHARS = 200
+
+
+def bench_replay():
+    """Replays one recorded workload: flat out, and at 1x/4x for accuracy."""
+    script = write_string_script(REPLAY_CHARS)
+    paced = write_string_script(REPLAY_PACED_CHARS, "DEFAULT_CHAR_DELAY 2\n")
+    capture = script + ".cap"
+    paced_capture = paced + ".cap"
+    try:
+        run_timed([PROD_BIN, "ducky", script],
+                  dict(os.environ, HID_OUTPUT="capture:" + capture))
+        run_timed([PROD_BIN, "ducky", paced],
+                  dict(os.environ, HID_OUTPUT="capture:" + paced_capture))
+        env = dict(os.environ, HID_OUTPUT="null", HID_STATS="0")
+        result, elapsed, cpu = run_rusage(
+            [PROD_BIN, "replay", "--fast", capture], env)
+        print(f"[+] replay --fast: {result.stderr.strip()} "
+              f"(process wall {elapsed * 1000:.1f} ms, CPU {cpu * 1000:.1f} ms)")
+        for speed in ("1", "4"):
+            result, elapsed = run_timed(
+                [PROD_BIN, "replay", "--speed", speed, paced_capture], env)
+            print(f"[+] replay {speed}x paced: {result.stderr.strip()}")
+    finally:
+        for path in (script, paced, capture, paced_capture):
+            if os.path.exists(path):
+                os.unlink(path)
+
+
+TIMING_DELAYS = 10000
+TIMING_DELAY_MS = 1
+
+
+def capture_press_times(path):
+    """Timestamps (ns) of the key-down records in a capture file."""
+    with open(path, "rb") as f:
+        data = f.read()
+    times, pos = [], 8
+    while pos + 10 <= len(data):
+        ts, role, length = struct.unpack_from("<QBB", data, pos)
+        if role == 0 and length >= 3 and data[pos + 12] != 0:
+            times.append(ts)
+        pos += 10 + length
+    return times
+
+
+def measure_delays(label, delays, delay_ms, extra_env):
+    """Types `delays` keystrokes with delay_ms between them into a capture
+    and prints drift and jitter of the key-down timestamps."""
+    script = write_string_script(delays, f"DEFAULT_CHAR_DELAY {delay_ms}\n")
+    capture = script + ".cap"
+    nominal = delay_ms * 1000000
+    try:
+        env = dict(os.environ, HID_OUTPUT="capture:" + capture, **extra_env)
+        result, elapsed, cpu = run_rusage([PROD_BIN, "ducky", script], env)
+        times = capture_press_times(capture)
+        gaps = [b - a - nominal for a, b in zip(times, times[1:])]
+        drift = times[-1] - times[0] - nominal * len(gaps)
+        mean = sum(gaps) / len(gaps)
+        stddev = (sum((g - mean) ** 2 for g in gaps) / len(gaps)) ** 0.5
+        dev = sorted(abs(g) for g in gaps)
+        print(f"[+] {label:14}: {len(gaps)} delays of {delay_ms} ms, drift "
+              f"{drift / 1e6:+.2f} ms, jitter sd {stddev / 1e3:.1f} us "
+              f"p99 {dev[int(len(dev) * 0.99)] / 1e3:.1f} us "
+              f"max {dev[-1] / 1e3:.1f} us, wall {elapsed:.2f} s, "
+              f"CPU {cpu:.2f} s")
+        for l in result.stderr.splitlines():
+            if l.startswith("[HID-RT]"):
+                print(f"      {l}")
+    finally:
+        for path in (script, capture):
+            if os.path.exists(path):
+                os.unlink(path)
+
+
+def bench_timing():
+    """Jitter and cumulative drift over TIMING_DELAYS keystroke delays."""
+    modes = [("relative", {"HID_TIMING": "relative"}),
+             ("absolute", {}),
+             ("abs+spin", {"HID_TIMER_SPIN_US": "100"})]
+    for label, extra in modes:
+        measure_delays("timing " + label, TIMING_DELAYS, TIMING_DELAY_MS,
+                       extra)
+
+
+RT_DELAYS = 2000
+RT_LOAD_PER_CPU = 2
+
+
+def bench_rt():
+    """Delay jitter under synthetic CPU load, normal vs real-time mode."""
+    load = [subprocess.Popen(["sh", "-c", "while :; do :; done"])
+            for _ in range(RT_LOAD_PER_CPU * (os.cpu_count() or 1))]
+    print(f"[*] {len(load)} busy-loop processes running")
+    modes = [("rt off", {}),
+             ("rt", {"HID_RT": "1"}),
+             ("rt+pin+spin", {"HID_RT": "1", "HID_RT_CPU": "0",
+                              "HID_TIMER_SPIN_US": "100"})]
+    try:
+        for label, extra in modes:
+            measure_delays(label, RT_DELAYS, TIMING_DELAY_MS,
+                           dict(extra, HID_STATS="1"))
+    finally:
+        for p in load:
+            p.kill()
+            p.wait()
+
+
+DAEMON_COMMANDS = 200
+
+
+def daemon_request(sock, args, fds):
+    """One request over the daemon protocol; returns the exit status."""
+    payload = b"".join(a.encode() + b"\0" for a in args)
+    msg = b"HGD1" + struct.pack("II", len(args), 0) + payload
+    socket.send_fds(sock, [msg], fds)
+    return struct.unpack("i", sock.recv(4))[0]
+
+
+def bench_daemon():
+    """Per-command latency: process spawn vs the daemon socket."""
+    tmpdir = tempfile.mkdtemp()
+    sock_path = os.path.join(tmpdir, "hid.sock")
+    env = dict(os.environ, HID_KEYBOARD_DEV="/dev/null", HID_KEY_DELAY_MS="0",
+               HID_SOCKET=sock_path)
+    daemon = subprocess.Popen([PROD_BIN, "daemon"], env=env,
+                              stderr=subprocess.DEVNULL)
+    try:
+        for _ in range(100):
+            if os.path.exists(sock_path):
+                break
+            time.sleep(0.01)
+
+        def per_command(label, fn):
+            start = time.perf_counter()
+            for _ in range(DAEMON_COMMANDS):
+                fn()
+            ms = (time.perf_counter() - start) * 1000 / DAEMON_COMMANDS
+            print(f"[+] daemon {label:28}: {ms:.3f} ms/command")
+
+        cmd = ["keyboard", "a"]
+        per_command("sh -c hid-gadget (wrapper)", lambda: subprocess.run(
+            ["sh", "-c", 'exec "$0" "$@"', PROD_BIN] + cmd, env=env,
+            stdout=subprocess.DEVNULL, stderr=subprocess.DEVNULL))
+        per_command("hid-gadget spawn", lambda: subprocess.run(
+            [PROD_BIN] + cmd, env=env, stdout=subprocess.DEVNULL,
+            stderr=subprocess.DEVNULL))
+        per_command("hid-gadget send (spawn)", lambda: subprocess.run(
+            [PROD_BIN, "send"] + cmd, env=env, stdout=subprocess.DEVNULL,
+            stderr=subprocess.DEVNULL))
+
+        devnull = os.open(os.devnull, os.O_RDWR)
+        with socket.socket(socket.AF_UNIX, socket.SOCK_SEQPACKET) as s:
+            s.connect(sock_path)
+            fds = [devnull] * 3
+            per_command("socket (persistent client)",
+                        lambda: daemon_request(s, ["hid-gadget"] + cmd, fds))
+        os.close(devnull)
+    finally:
+        daemon.terminate()
+        daemon.wait()
+        if os.path.exists(sock_path):
+            os.unlink(sock_path)
+        os.rmdir(tmpdir)
+
+
+SHM_REPORTS = 200000
+
+SHM_PRODUCER = r"""
+#include "hid_shm.h"
+#include <stdio.h>
+#include <sys/resource.h>
+
+int main(int argc, char **argv) {
+  int n = atoi(argv[2]);
+  int fd = hid_shm_request_fd(argv[1]);
+  struct hid_shm_ring *r = hid_shm_attach_fd(fd);
+  if (argc < 3 || !r)
+    return 1;
+  close(fd);
+  uint8_t press[8] = {0, 0, 0x04}, release[8] = {0};
+  struct rusage before, after;
+  getrusage(RUSAGE_SELF, &before);
+  uint64_t start = hid_shm_now_ns();
+  for (int i = 0; i < n; i++) {
+    while (hid_shm_push(r, HID_SHM_KEYBOARD, (i & 1) ? release : press, 8,
+                        0) != 0)
+      ;
+  }
+  uint64_t pushed = hid_shm_now_ns();
+  while (hid_shm_pending(r))
+    usleep(100);
+  uint64_t drained = hid_shm_now_ns();
+  getrusage(RUSAGE_SELF, &after);
+  printf("%.3f %.3f %ld %llu\n", (pushed - start) / 1e9,
+         (drained - start) / 1e9,
+         (after.ru_nvcsw + after.ru_nivcsw) -
+             (before.ru_nvcsw + before.ru_nivcsw),
+         (unsigned long long)atomic_load(&r->hdr->wakeups));
+  hid_shm_detach(r);
+  return 0;
+}
+"""
+
+
+def bench_shm():
+    """Producer throughput into the daemon's shared-memory report ring."""
+    tmpdir = tempfile.mkdtemp()
+    sock_path = os.path.join(tmpdir, "hid.sock")
+    producer = os.path.join(tmpdir, "producer")
+    with open(producer + ".c", "w") as f:
+        f.write(SHM_PRODUCER)
+    subprocess.check_call(["gcc", "-O2", "-Iinclude", "-o", producer,
+                           producer + ".c"], cwd=ROOT_DIR)
+    env = dict(os.environ, HID_KEYBOARD_DEV="/dev/null", HID_STATS="0",
+               HID_SOCKET=sock_path)
+    daemon = subprocess.Popen([PROD_BIN, "daemon", "--shm"], env=env,
+                              stderr=subprocess.DEVNULL)
+    try:
+        for _ in range(100):
+            if os.path.exists(sock_path):
+                break
+            time.sleep(0.01)
+        out = subprocess.run([producer, sock_path, str(SHM_REPORTS)],
+                             capture_output=True, text=True, env=env).stdout
+        push_s, drain_s, switches, wakeups = out.split()
+        print(f"[+] shm ring: {SHM_REPORTS} reports pushed in "
+              f"{float(push_s) * 1000:.1f} ms "
+              f"({SHM_REPORTS / float(push_s):,.0f}/s), drained in "
+              f"{float(drain_s) * 1000:.1f} ms, producer context switches "
+              f"{switches}, futex wakeups {wakeups}")
+        # Reference point: one process per report
+        start = time.perf_counter()
+        for _ in range(DAEMON_COMMANDS):
+            subprocess.run([PROD_BIN, "keyboard", "a"], env=env,
+                           stdout=subprocess.DEVNULL,
+                           stderr=subprocess.DEVNULL)
+        per = (time.perf_counter() - start) / (DAEMON_COMMANDS * 2)
+        print(f"[+] shm vs spawning hid-gadget: {1 / per:,.0f} reports/s")
+    finally:
+        daemon.terminate()
+        daemon.wait()
+        for path in (sock_path, producer, producer + ".c"):
+            if os.path.exists(path):
+                os.unlink(path)
+        os.rmdir(tmpdir)
+
+
+STARTUP_RUNS = 300
+STARTUP_DEV_NODES = 1000  # a busy Android /dev
+
+
+def make_sysroot(root, with_sysfs):
+    """Fake HID_SYSROOT: keyboard, mouse and consumer hidg nodes among
+    STARTUP_DEV_NODES other character devices, with configfs functions and
+    optionally /sys/class/hidg."""
+    dev = os.path.join(root, "dev")
+    funcs = os.path.join(root, "config", "usb_gadget", "g1", "functions")
+    os.makedirs(dev)
+    for i in range(STARTUP_DEV_NODES):
+        os.mknod(os.path.join(dev, f"tty{i}"), 0o600 | stat.S_IFCHR,
+                 os.makedev(1, 3))
+    for n, (protocol, length) in enumerate(((1, 8), (2, 4), (0, 2))):
+        attrs = {os.path.join(funcs, f"hid.gs{n + 1}", "dev"): f"1:{3 + n}",
+                 os.path.join(funcs, f"hid.gs{n + 1}", "protocol"): protocol,
+                 os.path.join(funcs, f"hid.gs{n + 1}", "report_length"):
+                     length}
+        if with_sysfs:
+            attrs[os.path.join(root, "sys", "class", "hidg", f"hidg{n}",
+                               "dev")] = f"1:{3 + n}"
+        for path, value in attrs.items():
+            os.makedirs(os.path.dirname(path), exist_ok=True)
+            with open(path, "w") as f:
+                f.write(f"{value}\n")
+        os.mknod(os.path.join(dev, f"hidg{n}"), 0o600 | stat.S_IFCHR,
+                 os.makedev(1, 3 + n))
+
+
+def bench_startup():
+    """Per-invocation cost of finding the hidg nodes."""
+    if os.geteuid() != 0:
+        print("[~] startup: skipped (mknod needs root)")
+        return
+    tmpdir = tempfile.mkdtemp()
+    cache = os.path.join(tmpdir, "devices.cache")
+    modes = [("/dev scan", "devscan", ""),
+             ("sysfs", "sysfs", ""),
+             ("sysfs+cache", "sysfs", cache)]
+    try:
+        for name in ("devscan", "sysfs"):
+            make_sysroot(os.path.join(tmpdir, name), name == "sysfs")
+        for label, root, cache_path in modes:
+            env = dict(os.environ, HID_OUTPUT="null", HID_STATS="0",
+                       HID_SYSROOT=os.path.join(tmpdir, root),
+                       HID_DEVICE_CACHE=cache_path)
+            args = [PROD_BIN, "keyboard", "--release"]
+            run_timed(args, env)  # warm up (and fill the cache)
+            walls, cpus = [], []
+            for _ in range(STARTUP_RUNS):
+                _, elapsed, cpu = run_rusage(args, env)
+                walls.append(elapsed)
+                cpus.append(cpu)
+            print(f"[+] startup {label:12}: median wall "
+                  f"{statistics.median(walls) * 1e6:7.0f} us, mean CPU "
+                  f"{statistics.mean(cpus) * 1e6:6.0f} us "
+                  f"({STARTUP_RUNS} runs, {STARTUP_DEV_NODES} nodes in /dev)")
+    finally:
+        shutil.rmtree(tmpdir)
+
+
+SETUP_RUNS = 50
+
+
+def make_gadget(root):
+    """Bare fake configfs gadget (hid.gs1..3 with device numbers), a UDC
+    and /sys/class/hidg + /dev nodes named after the minors, as the kernel
+    and ueventd would leave them."""
+    gadget = os.path.join(root, "config", "usb_gadget", "g1")
+    os.makedirs(os.path.join(gadget, "configs", "b.1"))
+    os.makedirs(os.path.join(root, "sys", "class", "udc", "fake-udc"))
+    os.makedirs(os.path.join(root, "dev"))
+    for n in range(3):
+        paths = [os.path.join(gadget, "functions", f"hid.gs{n + 1}", "dev"),
+                 os.path.join(root, "sys", "class", "hidg", f"hidg{n}", "dev")]
+        for path in paths:
+            os.makedirs(os.path.dirname(path), exist_ok=True)
+            with open(path, "w") as f:
+                f.write(f"240:{n}\n")
+        os.mknod(os.path.join(root, "dev", f"hidg{n}"), 0o666 | stat.S_IFCHR,
+                 os.makedev(240, n))
+    return gadget
+
+
+def bench_setup():
+    """Native gadget repair time (`hid-gadget setup`) per kind of damage.
+    hid-setup rebuilds everything behind a 1 s sleep for each of them."""
+    if os.geteuid() != 0:
+        print("[~] setup: skipped (mknod needs root)")
+        return
+    root = tempfile.mkdtemp()
+    env = dict(os.environ, HID_SYSROOT=root,
+               HID_DESC_DIR=os.path.join(ROOT_DIR, "system", "etc", "hid"))
+    for name in ("HID_KEYBOARD_NKRO", "HID_MOUSE_HSCROLL", "HID_GADGET_DIR",
+                 "HID_CONFIG_DIR", "HID_MOUSE_REPORT_SIZE"):
+        env.pop(name, None)
+    try:
+        gadget = make_gadget(root)
+        args = [PROD_BIN, "setup"]
+        run_timed(args, env)  # first build
+
+        def unbind():
+            with open(os.path.join(gadget, "UDC"), "w") as f:
+                f.write("\n")
+
+        def stale():
+            with open(os.path.join(gadget, "functions", "hid.gs2",
+                                   "protocol"), "w") as f:
+                f.write("1\n")
+
+        def unlink():
+            os.unlink(os.path.join(gadget, "configs", "b.1", "hid.gs3"))
+
+        for label, damage in (("healthy", None), ("UDC lost", unbind),
+                              ("stale attribute", stale),
+                              ("link lost", unlink)):
+            walls, reported = [], []
+            for _ in range(SETUP_RUNS):
+                if damage:
+                    damage()
+                result, elapsed = run_timed(args, env)
+                walls.append(elapsed)
+                ms = result.stderr.rsplit("(", 1)[-1].split(" ms")[0]
+                reported.append(float(ms))
+            print(f"[+] setup {label:16}: median "
+                  f"{statistics.median(reported):6.2f} ms reconcile, "
+                  f"{statistics.median(walls) * 1e3:6.2f} ms per invocation "
+                  f"({SETUP_RUNS} runs)")
+    finally:
+        shutil.rmtree(root)
+
+
+BENCHMARKS = {
+    "typing": bench_typing,
+    "async": bench_async,
+    "batch": bench_batch,
+    "rollover": bench_rollover,
+    "stats": bench_stats,
+    "daemon": bench_daemon,
+    "shm": bench_shm,
+    "backends": bench_backends,
+    "replay": bench_replay,
+    "timing": bench_timing,
+    "rt": bench_rt,
+    "startup": bench_startup,
+    "setup": bench_setup,
+}
+
+
+def main():
+    names = sys.argv[1:] or list(BENCHMARKS)
+    for name in names:
+        if name not in BENCHMARKS:
+            print(f"[-] Unknown benchmark '{name}'. "
+                  f"Available: {', '.join(BENCHMARKS)}")
+            sys.exit(1)
+
+    if not compile_binaries():
+        sys.exit(1)
+    try:
+        for name in names:
+            BENCHMARKS[name]()
+    finally:
+        if os.path.exists(PROD_BIN):
+            os.remove(PROD_BIN)
+
+
+if __name__ == "__main__":
+    main()
@@ -3,22 +3,25 @@ import os
 import sys
 import subprocess
 import glob
+import re
+import shutil
+import stat
+import tempfile
+import time
 
 TEST_DIR = os.path.dirname(os.path.abspath(__file__))
 ROOT_DIR = os.path.dirname(TEST_DIR)
-MOCK_BIN = os.path.join(TEST_DIR, "hid-gadget-test")
+TEST_BIN = os.path.join(TEST_DIR, "hid-gadget-test")
 CASES_DIR = os.path.join(TEST_DIR, "cases")
 
-def compile_mock():
-    print("[*] Compiling mock executable...")
+def compile_binary():
+    # The production build: output goes to the backend named by HID_OUTPUT
+    print("[*] Compiling test executable...")
     cmd = [
         "gcc", "-Wall", "-Wextra", "-O2", "-Iinclude",
-        "-DMOCK_HID",
-        "-o", MOCK_BIN,
-        os.path.join(ROOT_DIR, "src/hid-gadget.c"),
-        os.path.join(ROOT_DIR, "src/tui.c"),
-        os.path.join(ROOT_DIR, "src/ducky.c")
-    ]
+        "-o", TEST_BIN,
+    ] + sorted(glob.glob(os.path.join(ROOT_DIR, "src", "*.c"))) + \
+        ["-pthread", "-lm"]
     try:
         subprocess.check_call(cmd, cwd=ROOT_DIR)
         print("[+] Compilation successful.")
@@ -27,9 +30,740 @@ def compile_mock():
         print("[-] Compilation failed.")
         return False
 
-def run_test_case(ducky_file):
-    case_name = os.path.basename(ducky_file)
+# Two contexts typing concurrently into regular files: each must get exactly
+# its own report stream, in its own format (boot vs NKRO keyboard). A third
+# types into the memory backend without any device node. A fourth loses its
+# host for a few writes and must resume without losing or repeating reports.
+# A fifth sends a mouse burst while the host is not polling: the moves merge
+# into one report per run of equal buttons, presses and releases in place.
+LIB_CLIENT = r"""
+#include "hid_ctx.h"
+#include <errno.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+struct job { const char *path; int nkro; int ok; };
+
+static void *type_into(void *arg) {
+  struct job *j = arg;
+  struct hid_ctx *ctx = hid_ctx_new();
+  hid_ctx_set_device(ctx, HID_ROLE_KEYBOARD, j->path);
+  hid_ctx_set_option(ctx, HID_OPT_KEYBOARD_NKRO, j->nkro);
+  for (int i = 0; i < 500; i++)
+    hid_ctx_send_text(ctx, "ab", 2);
+  hid_ctx_free(ctx);
+
+  size_t size =
+      j->nkro ? HID_KEYBOARD_NKRO_REPORT_SIZE : HID_KEYBOARD_REPORT_SIZE;
+  unsigned char want[4][16] = {{0}}, got[16];
+  if (j->nkro) { want[0][1] = 0x10; want[2][1] = 0x20; }
+  else { want[0][2] = 0x04; want[2][2] = 0x05; }
+  FILE *f = fopen(j->path, "rb");
+  size_t n = 0;
+  j->ok = f != NULL;
+  while (f && fread(got, 1, size, f) == size) {
+    if (memcmp(got, want[n % 4], size) != 0)
+      j->ok = 0;
+    n++;
+  }
+  if (n != 2000)
+    j->ok = 0;
+  if (f)
+    fclose(f);
+  return NULL;
+}
+
+static int memory_ok(void) {
+  static const unsigned char want[] = {0, 8, 0, 0, 4, 0, 0, 0, 0, 0,
+                                       0, 8, 0, 0, 0, 0, 0, 0, 0, 0};
+  struct hid_ctx *ctx = hid_ctx_new();
+  hid_ctx_set_backend(ctx, hid_backend_open("memory"));
+  hid_ctx_send_text(ctx, "a", 1);
+  size_t len;
+  const uint8_t *data = hid_backend_data(hid_ctx_backend(ctx), &len);
+  int ok = len == sizeof(want) && memcmp(data, want, len) == 0;
+  hid_ctx_free(ctx);
+  return ok;
+}
+
+/* Writes [fail_from, fail_to) fail like an unplugged cable */
+struct flaky { int calls, fail_from, fail_to, n; unsigned char log[16][8]; };
+
+static long flaky_write(void *state, int role, int fd, const void *buf,
+                        size_t len) {
+  struct flaky *f = state;
+  int call = f->calls++;
+  (void)role;
+  (void)fd;
+  if (call >= f->fail_from && call < f->fail_to) {
+    errno = ESHUTDOWN;
+    return -1;
+  }
+  if (f->n < 16)
+    memcpy(f->log[f->n++], buf, 8);
+  return (long)len;
+}
+
+static const struct hid_backend_ops flaky_ops = {
+    .name = "flaky", .needs_fd = 1, .write = flaky_write};
+
+static int reconnect_ok(const char *path, int async) {
+  struct flaky f = {0, 3, 7, 0, {{0}}};
+  struct hid_ctx *ctx = hid_ctx_new();
+  hid_ctx_set_device(ctx, HID_ROLE_KEYBOARD, path);
+  hid_ctx_set_option(ctx, HID_OPT_ASYNC, async);
+  hid_ctx_set_backend(ctx, hid_backend_new(&flaky_ops, &f));
+  int ok = hid_ctx_send_text(ctx, "abcd", 4) == 0 && hid_ctx_flush(ctx) == 0 &&
+           hid_ctx_take_error(ctx) == 0 && f.n == 8;
+  for (int i = 0; ok && i < 8; i++)
+    ok = f.log[i][2] == (i % 2 ? 0 : 4 + i / 2);
+
+  /* A host that stays away: the report fails and the error sticks once */
+  f.fail_to = 1 << 30;
+  hid_ctx_set_option(ctx, HID_OPT_RECONNECT_MS, 20);
+  int sent = hid_ctx_send_text(ctx, "a", 1);
+  int flushed = hid_ctx_flush(ctx);
+  ok = ok && (async ? flushed : sent) != 0 &&
+       hid_ctx_take_error(ctx) == (async ? EIO : ESHUTDOWN) &&
+       hid_ctx_take_error(ctx) == 0;
+  hid_ctx_free(ctx);
+  return ok;
+}
+
+/* A host that polls only once go is set */
+struct stalled { atomic_int entered, go; int n; unsigned char log[16][4]; };
+
+static long stalled_write(void *state, int role, int fd, const void *buf,
+                          size_t len) {
+  struct stalled *s = state;
+  (void)role;
+  (void)fd;
+  atomic_store(&s->entered, 1);
+  while (!atomic_load(&s->go))
+    usleep(1000);
+  if (s->n < 16)
+    memcpy(s->log[s->n++], buf, 4);
+  return (long)len;
+}
+
+static const struct hid_backend_ops stalled_ops = {
+    .name = "stalled", .needs_fd = 1, .write = stalled_write};
+
+static int coalesce_ok(const char *path) {
+  static const unsigned char want[6][4] = {
+      {0, 1, 0, 0}, {0, 2, 0, 0}, {1, 0, 0, 0}, {1, 100, 156, 0},
+      {0, 0, 0, 0}, {0, 40, 0, 2}};
+  struct stalled s = {0};
+  struct hid_ctx *ctx = hid_ctx_new();
+  hid_ctx_set_device(ctx, HID_ROLE_MOUSE, path);
+  hid_ctx_set_option(ctx, HID_OPT_MOUSE_COALESCE, 1);
+  hid_ctx_set_backend(ctx, hid_backend_new(&stalled_ops, &s));
+  hid_ctx_send_mouse_move(ctx, 1, 0);
+  while (!atomic_load(&s.entered)) /* the writer is stuck on the first */
+    usleep(1000);
+  hid_ctx_send_mouse_move(ctx, 1, 0);
+  hid_ctx_send_mouse_move(ctx, 1, 0);
+  hid_ctx_send_mouse_press(ctx, HID_MOUSE_BTN_LEFT);
+  for (int i = 0; i < 100; i++)
+    hid_ctx_send_mouse_report(ctx, HID_MOUSE_BTN_LEFT, 1, -1, 0, 0);
+  hid_ctx_send_mouse_release(ctx);
+  for (int i = 0; i < 20; i++)
+    hid_ctx_send_mouse_move(ctx, 2, 0);
+  hid_ctx_send_mouse_scroll(ctx, 2, 0);
+  atomic_store(&s.go, 1);
+  int ok = hid_ctx_flush(ctx) == 0 && s.n == 6;
+  for (int i = 0; ok && i < 6; i++)
+    ok = memcmp(s.log[i], want[i], 4) == 0;
+  /* Turning it off hands back the synchronous writes it turned async */
+  hid_ctx_set_option(ctx, HID_OPT_MOUSE_COALESCE, 0);
+  ok = ok && hid_ctx_get_option(ctx, HID_OPT_ASYNC) == 0;
+  hid_ctx_free(ctx);
+  return ok;
+}
+
+int main(int argc, char **argv) {
+  struct job jobs[2] = {{argv[1], 0, 0}, {argv[2], 1, 0}};
+  pthread_t t[2];
+  (void)argc;
+  for (int i = 0; i < 2; i++)
+    pthread_create(&t[i], NULL, type_into, &jobs[i]);
+  for (int i = 0; i < 2; i++)
+    pthread_join(t[i], NULL);
+  return jobs[0].ok && jobs[1].ok && memory_ok() && reconnect_ok(argv[1], 0) &&
+                 reconnect_ok(argv[1], 1) && coalesce_ok(argv[1])
+             ? 0
+             : 1;
+}
+"""
+
+def run_library_test():
+    """Builds LIB_CLIENT against the library sources and runs it."""
+    tmpdir = tempfile.mkdtemp()
+    client = os.path.join(tmpdir, "client")
+    outputs = [os.path.join(tmpdir, "kbd0"), os.path.join(tmpdir, "kbd1")]
+    lib_src = ["hid-ctx.c", "hid-backend.c", "hid-discover.c", "hid-replay.c",
+               "hid-timeline.c", "hid-rt.c", "hid-interface.c", "hid-queue.c",
+               "hid-batch.c", "hid-stats.c", "hid-path.c"]
+    try:
+        with open(client + ".c", "w") as f:
+            f.write(LIB_CLIENT)
+        subprocess.check_call(
+            ["gcc", "-O2", "-Iinclude", "-o", client, client + ".c"] +
+            [os.path.join("src", s) for s in lib_src] +
+            ["-pthread", "-lm"],
+            cwd=ROOT_DIR)
+        for path in outputs:
+            open(path, "w").close()
+        ok = subprocess.run([client] + outputs, timeout=10).returncode == 0
+    except (subprocess.CalledProcessError, subprocess.TimeoutExpired):
+        ok = False
+    finally:
+        for path in outputs + [client, client + ".c"]:
+            if os.path.exists(path):
+                os.unlink(path)
+        os.rmdir(tmpdir)
+    print(f"[{'+' if ok else '-'}] libhidgadget [contexts, backends, reconnect, "
+          f"coalescing]: "
+          f"{'PASS' if ok else 'FAIL'}")
+    return ok
+
+def load_case_env(ducky_file, env):
+    """Overlays KEY=VALUE lines from an optional <case>.env file."""
+    env_file = ducky_file.replace(".ducky", ".env")
+    if not os.path.exists(env_file):
+        return env
+    env = dict(env if env is not None else os.environ)
+    with open(env_file, "r") as f:
+        for line in f:
+            line = line.strip()
+            if line and not line.startswith("#") and "=" in line:
+                key, value = line.split("=", 1)
+                env[key] = value
+    return env
+
+def read_capture(path):
+    """Decodes a capture file (hid_backend.h) into mock-style lines."""
+    with open(path, "rb") as f:
+        data = f.read()
+    if data[:5] != b"HIDC\x02":
+        return ["<bad capture header>"]
+    lines, pos = [], 8
+    while pos + 10 <= len(data):
+        length = data[pos + 9]
+        report = data[pos + 10:pos + 10 + length]
+        lines.append(f"[HID-MOCK] Writing {length} bytes: " +
+                     " ".join(f"{b:02X}" for b in report))
+        pos += 10 + length
+    return lines
+
+def run_replay(ducky_file, capture, args, env):
+    """Replays capture through the mock backend: (mock lines, seconds)."""
+    env = load_case_env(ducky_file, env)
+    start = time.monotonic()
+    try:
+        result = subprocess.run([TEST_BIN, "replay"] + args + [capture],
+                                capture_output=True, text=True, timeout=5,
+                                env=env)
+    except subprocess.TimeoutExpired:
+        return None, 0
+    lines = [l.strip() for l in result.stdout.splitlines()
+             if l.startswith("[HID-MOCK] Writing")]
+    return lines, time.monotonic() - start
+
+def run_drift_test(capture):
+    """Keystroke delays must add up to their nominal sum (no drift)."""
+    script = capture + ".ducky"
+    with open(script, "w") as f:
+        f.write("DEFAULT_CHAR_DELAY 3\nSTRING " + "abcdefghij" * 20 + "\n")
+    if os.path.exists(capture):
+        os.unlink(capture)
+    try:
+        subprocess.run([TEST_BIN, "ducky", script], capture_output=True,
+                       timeout=10,
+                       env=dict(os.environ, HID_OUTPUT="capture:" + capture))
+        with open(capture, "rb") as f:
+            data = f.read()
+        presses, pos = [], 8
+        while pos + 10 <= len(data):
+            if data[pos + 12] != 0:
+                presses.append(int.from_bytes(data[pos:pos + 8], "little"))
+            pos += 10 + data[pos + 9]
+        drift_ms = (presses[-1] - presses[0]) / 1e6 - 3 * (len(presses) - 1)
+        ok = len(presses) == 200 and abs(drift_ms) < 2
+    except (subprocess.TimeoutExpired, OSError, IndexError):
+        ok = False
+    finally:
+        os.unlink(script)
+        if os.path.exists(capture):
+            os.unlink(capture)
+    print(f"[{'+' if ok else '-'}] timing [absolute deadlines]: "
+          f"{'PASS' if ok else 'FAIL'}")
+    return ok
+
+def run_replay_timing_test(capture):
+    """A recorded DELAY must come back at 1x and shrink at --speed 4."""
+    script = capture + ".ducky"
+    with open(script, "w") as f:
+        f.write("STRING a\nDELAY 300\nSTRING b\n")
+    ok = True
+    if os.path.exists(capture):
+        os.unlink(capture)
+    try:
+        subprocess.run([TEST_BIN, "ducky", script], capture_output=True,
+                       timeout=5,
+                       env=dict(os.environ, HID_OUTPUT="capture:" + capture))
+        env = dict(os.environ, HID_OUTPUT="mock")
+        lines, real = run_replay(script, capture, [], env)
+        ok = lines is not None and len(lines) == 4 and 0.29 <= real < 1.0
+        lines, fast = run_replay(script, capture, ["--speed", "4"], env)
+        ok = ok and lines is not None and len(lines) == 4 and fast < 0.2
+    finally:
+        os.unlink(script)
+        if os.path.exists(capture):
+            os.unlink(capture)
+    print(f"[{'+' if ok else '-'}] replay timing [1x, 4x]: "
+          f"{'PASS' if ok else 'FAIL'}")
+    return ok
+
+def make_sysroot(root, functions):
+    """Fake /dev, /sys/class/hidg and configfs for HID_SYSROOT: hidgN is
+    the character device functions[N] = (protocol, report_length, (major,
+    minor)) of configfs function hid.gs<N+1>."""
+    funcs = os.path.join(root, "config", "usb_gadget", "g1", "functions")
+    for name, (protocol, length, (major, minor)) in enumerate(functions):
+        node = f"hidg{name}"
+        attrs = {os.path.join(root, "sys", "class", "hidg", node, "dev"):
+                 f"{major}:{minor}"}
+        func = os.path.join(funcs, f"hid.gs{name + 1}")
+        attrs[os.path.join(func, "dev")] = f"{major}:{minor}"
+        attrs[os.path.join(func, "protocol")] = str(protocol)
+        attrs[os.path.join(func, "report_length")] = str(length)
+        for path, value in attrs.items():
+            os.makedirs(os.path.dirname(path), exist_ok=True)
+            with open(path, "w") as f:
+                f.write(value + "\n")
+        os.makedirs(os.path.join(root, "dev"), exist_ok=True)
+        os.mknod(os.path.join(root, "dev", node), 0o666 | stat.S_IFCHR,
+                 os.makedev(major, minor))
+
+def run_discovery_test():
+    """Roles come from configfs rather than hidg order, and the device cache
+    is reused until a node changes."""
+    if os.geteuid() != 0:
+        print("[~] discovery [sysfs, cache]: SKIP (mknod needs root)")
+        return True
+    root = tempfile.mkdtemp()
+    cache = os.path.join(root, "devices.cache")
+    capture = os.path.join(root, "reports.cap")
+    env = dict(os.environ, HID_SYSROOT=root, HID_DEVICE_CACHE=cache,
+               HID_OUTPUT="record:" + capture)
+
+    def typed():
+        """Reports that reached the keyboard for `keyboard a`"""
+        if os.path.exists(capture):
+            os.unlink(capture)
+        subprocess.run([TEST_BIN, "keyboard", "a"], capture_output=True,
+                       timeout=5, env=env)
+        return len(read_capture(capture)) if os.path.exists(capture) else 0
+
+    try:
+        # Consumer control first: keyboard reports sent there (/dev/full)
+        # fail, the keyboard function's node (/dev/null) takes them
+        make_sysroot(root, [(0, 2, (1, 7)), (1, 8, (1, 3)), (2, 4, (1, 5))])
+        ok = typed() > 0 and os.path.exists(cache)
+        # Without sysfs only the cache still knows the roles...
+        shutil.rmtree(os.path.join(root, "sys"))
+        ok = ok and typed() > 0
+        # ...until a node changes: swap the two functions' roles, as a new
+        # hid-setup layout would, and the keyboard moves to hidg0
+        funcs = os.path.join(root, "config", "usb_gadget", "g1", "functions")
+        for func, protocol, length in (("hid.gs1", 1, 8), ("hid.gs2", 0, 2)):
+            for attr, value in (("protocol", protocol),
+                                ("report_length", length)):
+                with open(os.path.join(funcs, func, attr), "w") as f:
+                    f.write(f"{value}\n")
+        ok = ok and typed() > 0
+        os.utime(os.path.join(root, "dev", "hidg1"), ns=(0, 0))
+        ok = ok and typed() == 0
+    except (subprocess.TimeoutExpired, OSError):
+        ok = False
+    finally:
+        shutil.rmtree(root)
+    print(f"[{'+' if ok else '-'}] discovery [sysfs, cache]: "
+          f"{'PASS' if ok else 'FAIL'}")
+    return ok
+
+def run_probe_test():
+    """Without HID_KEYBOARD_NKRO the NKRO keyboard, and with HID_MOUSE_HIRES
+    the wheel multiplier, come from the functions of the gadget HID_SYSROOT
+    and HID_GADGET_DIR name, not from a fixed /config/usb_gadget/g1."""
+    root = tempfile.mkdtemp()
+    funcs = os.path.join(root, "config", "usb_gadget", "g7", "functions")
+    env = dict(os.environ, HID_OUTPUT="mock", HID_SYSROOT=root,
+               HID_GADGET_DIR="/config/usb_gadget/g7")
+    for name in ("HID_KEYBOARD_NKRO", "HID_MOUSE_HIRES", "HID_COMPOSITE",
+                 "HID_MOUSE_REPORT_SIZE", "HID_MOUSE_HSCROLL",
+                 "HID_MOUSE_16BIT"):
+        env.pop(name, None)
+
+    def writes(*args):
+        out = subprocess.run([TEST_BIN] + list(args), capture_output=True,
+                             text=True, timeout=5, env=env).stdout
+        return [line.split("Writing ")[1].strip() for line in out.splitlines()
+                if "Writing" in line]
+
+    try:
+        os.makedirs(os.path.join(root, "dev"))  # no nodes: placeholders
+        ok = writes("keyboard", "a")[0].startswith("8 bytes")
+        ok = ok and writes("mouse", "scroll", "0.5") == \
+            ["4 bytes: 00 00 00 01"]
+        for func, attr, value in (
+                ("hid.gs1", "report_length", b"16\n"),
+                ("hid.gs2", "report_length", b"4\n"),
+                # Generic Desktop, Resolution Multiplier, physical max 4
+                ("hid.gs2", "report_desc",
+                 bytes.fromhex("05 01 09 48 45 04 B1 02"))):
+            os.makedirs(os.path.join(funcs, func), exist_ok=True)
+            with open(os.path.join(funcs, func, attr), "wb") as f:
+                f.write(value)
+        ok = ok and writes("keyboard", "a")[0].startswith("16 bytes")
+        # A multiplier the host may never set is not applied unasked
+        ok = ok and writes("mouse", "scroll", "0.5") == \
+            ["4 bytes: 00 00 00 01"]
+        env["HID_MOUSE_HIRES"] = "1"
+        ok = ok and writes("mouse", "scroll", "0.5") == \
+            ["4 bytes: 00 00 00 02"]
+    except (subprocess.TimeoutExpired, IndexError, OSError):
+        ok = False
+    finally:
+        shutil.rmtree(root)
+    print(f"[{'+' if ok else '-'}] configfs probes [sysroot, gadget dir]: "
+          f"{'PASS' if ok else 'FAIL'}")
+    return ok
+
+def run_registry_test():
+    """Nodes beyond the first three join the device registry and can be
+    selected per command, from the environment or from a script."""
+    if os.geteuid() != 0:
+        print("[~] device registry [--device, DEVICE]: SKIP (mknod needs "
+              "root)")
+        return True
+    root = tempfile.mkdtemp()
+    env = dict(os.environ, HID_SYSROOT=root, HID_DEVICE_CACHE="")
+    env.pop("HID_OUTPUT", None)
+
+    def run(args, **extra):
+        return subprocess.run([TEST_BIN] + args, capture_output=True,
+                              text=True, timeout=5, env=dict(env, **extra))
+
+    try:
+        # The first keyboard is /dev/full and fails every write; a second
+        # gadget's keyboard (hidg3, /dev/random) takes them once selected
+        make_sysroot(root, [(1, 8, (1, 7)), (2, 4, (1, 3)), (0, 2, (1, 5)),
+                            (1, 8, (1, 8)), (2, 4, (1, 9))])
+        listed = run(["devices"]).stdout.splitlines()
+        ok = len(listed) == 5 and "hidg3" in listed[3] and \
+            "keyboard" in listed[3] and "*" not in listed[3]
+        ok = ok and run(["keyboard", "a"]).returncode != 0
+        ok = ok and run(["--device", "hidg3", "keyboard", "a"]).returncode == 0
+        index = listed[3].split()[0]
+        ok = ok and run(["keyboard", "a"], HID_DEVICE="keyboard=" + index
+                        ).returncode == 0
+        ok = ok and run(["--device", "hidg9", "keyboard", "a"]
+                        ).returncode != 0
+        script = os.path.join(root, "switch.ducky")
+        with open(script, "w") as f:
+            f.write("DEVICE hidg3\nSTRING a\n")
+        result = run(["ducky", script])
+        ok = ok and result.returncode == 0 and \
+            "DEVICE hidg3:" not in result.stderr
+        listed = run(["devices"], HID_DEVICE="hidg3").stdout.splitlines()
+        ok = ok and "*" in listed[3] and "*" not in listed[0]
+        # A client's HID_DEVICE applies to its own command, not the next one
+        env["HID_SOCKET"] = os.path.join(root, "hid.sock")
+        daemon = subprocess.Popen([TEST_BIN, "daemon"], env=env,
+                                  stdout=subprocess.DEVNULL,
+                                  stderr=subprocess.DEVNULL)
+        try:
+            for _ in range(200):
+                if os.path.exists(env["HID_SOCKET"]):
+                    break
+                time.sleep(0.01)
+            ok = ok and run(["send", "keyboard", "a"],
+                            HID_DEVICE="hidg3").returncode == 0
+            ok = ok and run(["send", "keyboard", "a"]).returncode != 0
+        finally:
+            daemon.terminate()
+            daemon.wait()
+    except (subprocess.TimeoutExpired, OSError, IndexError):
+        ok = False
+    finally:
+        shutil.rmtree(root)
+    print(f"[{'+' if ok else '-'}] device registry [--device, DEVICE]: "
+          f"{'PASS' if ok else 'FAIL'}")
+    return ok
+
+def run_mouse_test():
+    """Large relative moves are split into the fewest reports that sum to
+    the exact delta, fewer still with 16-bit X/Y or more under a cap.
+    Scrolls need no zero report; hi-res wheels take fractions of a detent
+    and glide at the polling interval."""
+    def reports(args, action="move", **extra):
+        env = dict(os.environ, HID_OUTPUT="mock", **extra)
+        for name in ("HID_MOUSE_HIRES", "HID_MOUSE_INTERVAL_US"):
+            if name not in extra:
+                env.pop(name, None)
+        out = subprocess.run([TEST_BIN, "mouse", action] + args,
+                             capture_output=True, text=True, timeout=5,
+                             env=env).stdout
+        return [line.split(": ")[1].split() for line in out.splitlines()
+                if "Writing" in line]
+
+    def total(rs, i):
+        # sum of the signed 8-bit field i over all reports
+        return sum(int(r[i], 16) - (256 if int(r[i], 16) > 127 else 0)
+                   for r in rs)
+
+    try:
+        rs = reports(["1000", "-400"])
+        ok = len(rs) == 8 and total(rs, 1) == 1000 and total(rs, 2) == -400
+        rs = reports(["1000", "-400"], HID_MOUSE_16BIT="1")
+        ok = ok and rs == [["00", "E8", "03", "70", "FE", "00"]]
+        rs = reports(["1000", "400"], HID_MOUSE_STEP_MAX="100")
+        ok = ok and len(rs) == 10 and total(rs, 1) == 1000 and \
+            total(rs, 2) == 400
+        ok = ok and reports(["-3"], "scroll") == [["00", "00", "00", "FD"]]
+        ok = ok and reports(["0.5"], "scroll", HID_MOUSE_HIRES="1") == \
+            [["00", "00", "00", "04"]]
+        rs = reports(["2", "0", "8"], "scroll", HID_MOUSE_HIRES="1",
+                     HID_MOUSE_INTERVAL_US="1000")
+        ok = ok and len(rs) == 8 and total(rs, 3) == 16
+        # Percentages outside 0-100 (or not numbers) are refused, not
+        # turned into wrapped or undefined coordinates
+        ok = ok and len(reports(["100%", "0"], "moveto")) == 1
+        for bad in ("150%", "-1%", "nan%", "inf%"):
+            ok = ok and reports([bad, "0"], "moveto") == []
+    except (subprocess.TimeoutExpired, IndexError, ValueError):
+        ok = False
+    print(f"[{'+' if ok else '-'}] mouse move splitting, scrolling: "
+          f"{'PASS' if ok else 'FAIL'}")
+    return ok
+
+def run_setup_test():
+    """`setup` builds the gadget from a bare configfs tree, then changes
+    only what differs: a lost UDC is just bound, a stale attribute costs
+    one unlink/rewrite/relink, a missing node is recreated, and the
+    composite layout replaces the three functions with one; the absolute
+    pointer function comes and goes with HID_ABSOLUTE and the mouse widens
+    with HID_MOUSE_16BIT and gains a resolution multiplier with
+    HID_MOUSE_HIRES."""
+    if os.geteuid() != 0:
+        print("[~] setup [configfs reconcile]: SKIP (mknod needs root)")
+        return True
+    root = tempfile.mkdtemp()
+    gadget = os.path.join(root, "config", "usb_gadget", "g1")
+    env = dict(os.environ, HID_SYSROOT=root, HID_SETUP_WAIT_MS="1000",
+               HID_DESC_DIR=os.path.join(ROOT_DIR, "system", "etc", "hid"))
+    for name in ("HID_KEYBOARD_NKRO", "HID_MOUSE_HSCROLL", "HID_GADGET_DIR",
+                 "HID_CONFIG_DIR", "HID_MOUSE_REPORT_SIZE", "HID_ABSOLUTE",
+                 "HID_MOUSE_16BIT", "HID_MOUSE_STEP_MAX", "HID_MOUSE_HIRES"):
+        env.pop(name, None)
+
+    def setup(*args):
+        result = subprocess.run([TEST_BIN, "setup"] + list(args),
+                                capture_output=True, text=True, timeout=5,
+                                env=env)
+        return result.returncode == 0, result.stderr
+
+    def attr(*path):
+        with open(os.path.join(gadget, *path)) as f:
+            return f.read().strip()
+
+    try:
+        # Functions as the kernel would have left them, nothing linked/bound
+        make_sysroot(root, [(1, 8, (240, 0)), (2, 4, (240, 1)),
+                            (0, 2, (240, 2))])
+        os.makedirs(os.path.join(gadget, "configs", "b.1"))
+        os.makedirs(os.path.join(root, "sys", "class", "udc", "fake-udc"))
+        ok, err = setup()
+        ok = ok and "3 links added" in err and attr("UDC") == "fake-udc"
+        ok = ok and attr("functions", "hid.gs2", "subclass") == "1"
+        ok = ok and os.path.islink(
+            os.path.join(gadget, "configs", "b.1", "hid.gs3"))
+        ok = ok and "up to date" in setup()[1]
+        ok = ok and "up to date" in setup("--dry-run")[1]
+
+        with open(os.path.join(gadget, "UDC"), "w") as f:
+            f.write("\n")
+        done, err = setup()
+        ok = ok and done and "0 attributes" in err and "UDC bound" in err
+
+        with open(os.path.join(gadget, "functions", "hid.gs2",
+                               "protocol"), "w") as f:
+            f.write("1\n")
+        ok = ok and "1 attribute written" in setup("--dry-run")[1]
+        ok = ok and attr("functions", "hid.gs2", "protocol") == "1"
+        done, err = setup()
+        ok = ok and done and "1 attribute written, 1 link added, 1 removed, " \
+            "UDC rebound" in err
+        ok = ok and attr("functions", "hid.gs2", "protocol") == "2"
+
+        node = os.path.join(root, "dev", "hidg2")
+        os.unlink(node)
+        done, err = setup()
+        ok = ok and done and "1 node made" in err
+        ok = ok and os.stat(node).st_rdev == os.makedev(240, 2)
+
+        # Composite layout: hid.gs1 carries all three descriptors behind
+        # report IDs, the other two functions leave the configuration
+        # (switches read "true" like the runtime does)
+        env["HID_COMPOSITE"] = "true"
+        done, err = setup()
+        ok = ok and done and "4 attributes written, 1 link added, " \
+            "3 removed, UDC rebound" in err
+        ok = ok and not os.path.lexists(
+            os.path.join(gadget, "configs", "b.1", "hid.gs2"))
+        # hid-setup's own _with_report_id must build the same descriptor
+        # (bash for its printf \x, as Android's sh has)
+        with open(os.path.join(ROOT_DIR, "system", "bin", "hid-setup")) as f:
+            script = re.search(r"^_with_report_id\(\) \{.*?^\}", f.read(),
+                               re.S | re.M).group(0)
+        desc = b""
+        for report_id, name in enumerate(("keyboard-desc.bin",
+                                          "mouse-desc.bin",
+                                          "consumer-desc.bin"), 1):
+            with open(os.path.join(env["HID_DESC_DIR"], name), "rb") as f:
+                desc += subprocess.run(
+                    ["bash", "-c", f"{script}\n_with_report_id {report_id}"],
+                    stdin=f, capture_output=True, timeout=5).stdout
+        with open(os.path.join(gadget, "functions", "hid.gs1",
+                               "report_desc"), "rb") as f:
+            ok = ok and f.read() == desc
+        ok = ok and attr("functions", "hid.gs1", "report_length") == "9"
+        ok = ok and "up to date" in setup()[1]
+        # ...which discovery recognises: every role goes to hidg0 with IDs
+        moved = subprocess.run([TEST_BIN, "mouse", "move", "1", "-1"],
+                               capture_output=True, text=True, timeout=5,
+                               env=dict(env, HID_OUTPUT="mock",
+                                        HID_DEVICE_CACHE="",
+                                        HID_COMPOSITE="0"))
+        ok = ok and "Writing 5 bytes: 02 00 01 FF 00" in moved.stdout
+        ok = ok and subprocess.run(
+            [TEST_BIN, "supervise", "--once"], capture_output=True,
+            timeout=5, env=dict(env, HID_SETUP_CMD="false")).returncode == 0
+        del env["HID_COMPOSITE"]
+        done, err = setup()
+        ok = ok and done and os.path.islink(
+            os.path.join(gadget, "configs", "b.1", "hid.gs2"))
+
+        # The absolute pointer is a fourth function, gone again once off
+        env["HID_ABSOLUTE"] = "1"
+        done, err = setup()
+        ok = ok and done and os.path.islink(
+            os.path.join(gadget, "configs", "b.1", "hid.gs4"))
+        ok = ok and attr("functions", "hid.gs4", "report_length") == "5"
+        del env["HID_ABSOLUTE"]
+        done, err = setup()
+        ok = ok and done and not os.path.lexists(
+            os.path.join(gadget, "configs", "b.1", "hid.gs4"))
+
+        # 16-bit X/Y: a 6-byte mouse, report protocol only
+        env["HID_MOUSE_16BIT"] = "1"
+        done, err = setup()
+        ok = ok and done and attr("functions", "hid.gs2", "protocol") == "0"
+        ok = ok and attr("functions", "hid.gs2", "report_length") == "6"
+        del env["HID_MOUSE_16BIT"]
+
+        # Hi-res scrolling adds the Resolution Multiplier feature only
+        env["HID_MOUSE_HIRES"] = "1"
+        done, err = setup()
+        with open(os.path.join(gadget, "functions", "hid.gs2",
+                               "report_desc"), "rb") as f:
+            ok = ok and done and b"\x09\x48" in f.read()
+        ok = ok and attr("functions", "hid.gs2", "report_length") == "4"
+        del env["HID_MOUSE_HIRES"]
+    except (subprocess.TimeoutExpired, OSError):
+        ok = False
+    finally:
+        shutil.rmtree(root)
+    print(f"[{'+' if ok else '-'}] setup [configfs reconcile]: "
+          f"{'PASS' if ok else 'FAIL'}")
+    return ok
+
+def run_supervise_test():
+    """`supervise` stays idle while the gadget is complete and runs the
+    setup command exactly once when it comes unbound."""
+    if os.geteuid() != 0:
+        print("[~] supervise [inotify]: SKIP (mknod needs root)")
+        return True
+    root = tempfile.mkdtemp()
+    gadget = os.path.join(root, "config", "usb_gadget", "g1")
+    udc = os.path.join(gadget, "UDC")
+    runs = os.path.join(root, "setup.log")
+    # The stand-in hid-setup: rebind the UDC and log the run
+    setup = f"echo run >> {runs}; echo fake-udc > {udc}"
+    env = dict(os.environ, HID_SYSROOT=root, HID_SETUP_CMD=setup,
+               HID_SUPERVISE_SETTLE_MS="50", HID_SUPERVISE_RECHECK_S="0")
+
+    def setups():
+        if not os.path.exists(runs):
+            return 0
+        with open(runs) as f:
+            return len(f.readlines())
+
+    def wait_for(count, seconds):
+        deadline = time.time() + seconds
+        while time.time() < deadline and setups() < count:
+            time.sleep(0.02)
+        return setups() == count
+
+    proc = None
+    try:
+        make_sysroot(root, [(1, 8, (1, 3)), (2, 4, (1, 7)), (0, 2, (1, 5))])
+        os.makedirs(os.path.join(gadget, "configs", "b.1"))
+        for n in range(1, 4):
+            os.symlink(os.path.join(gadget, "functions", f"hid.gs{n}"),
+                       os.path.join(gadget, "configs", "b.1", f"hid.gs{n}"))
+        with open(udc, "w") as f:
+            f.write("fake-udc\n")
+        once = subprocess.run([TEST_BIN, "supervise", "--once"],
+                              capture_output=True, timeout=5, env=env)
+        ok = once.returncode == 0 and setups() == 0
+
+        proc = subprocess.Popen([TEST_BIN, "supervise"], env=env,
+                                stderr=subprocess.PIPE, text=True)
+        time.sleep(0.3)
+        # Unrelated /dev traffic is no reason to look, let alone repair
+        open(os.path.join(root, "dev", "null0"), "w").close()
+        time.sleep(0.3)
+        ok = ok and setups() == 0
+        with open(udc, "w") as f:
+            f.write("\n")
+        ok = ok and wait_for(1, 2.0)
+        time.sleep(0.5)
+        ok = ok and setups() == 1
+        proc.terminate()
+        _, err = proc.communicate(timeout=5)
+        ok = ok and proc.returncode == 0 and "1 repair" in err
+    except (subprocess.TimeoutExpired, OSError):
+        ok = False
+    finally:
+        if proc and proc.poll() is None:
+            proc.kill()
+            proc.wait()
+        shutil.rmtree(root)
+    print(f"[{'+' if ok else '-'}] supervise [inotify]: "
+          f"{'PASS' if ok else 'FAIL'}")
+    return ok
+
+def run_test_case(ducky_file, env=None, mode="", via_daemon=False,
+                  capture=None):
+    case_name = os.path.basename(ducky_file) + mode
     expected_file = ducky_file.replace(".ducky", ".expected")
+    env = load_case_env(ducky_file, env)
 
     if not os.path.exists(expected_file):
         print(f"[!] Warning: No expected output for {case_name}. Skipping.")
@@ -37,13 +771,14 @@ def run_test_case(ducky_file):
 
     # Run the mock executable
     try:
-        # We need to set up environment variables if tests depend on them,
-        # but for now basic tests shouldn't need them.
+        # Cases that need a non-default configuration ship a .env file
+        cmd = [TEST_BIN, "send", "ducky"] if via_daemon else [TEST_BIN, "ducky"]
         result = subprocess.run(
-            [MOCK_BIN, "ducky", ducky_file],
+            cmd + [ducky_file],
             capture_output=True,
             text=True,
-            timeout=5
+            timeout=5,
+            env=env
         )
     except subprocess.TimeoutExpired:
         print(f"[-] {case_name}: Timed out.")
@@ -57,6 +792,8 @@ def run_test_case(ducky_file):
         for line in result.stdout.splitlines()
         if line.strip() and not line.strip().startswith("[HID-MOCK] Mocking device paths")
     ]
+    if capture:
+        actual_lines = read_capture(capture)
 
     with open(expected_file, "r") as f:
         expected_lines = [line.strip() for line in f.read().splitlines() if line.strip()]
@@ -76,8 +813,9 @@ def run_test_case(ducky_file):
         return False
 
 def main():
-    if not compile_mock():
+    if not compile_binary():
         sys.exit(1)
+    base_env = dict(os.environ, HID_OUTPUT="mock")
 
     print(f"[*] Running tests from {CASES_DIR}...")
     ducky_files = sorted(glob.glob(os.path.join(CASES_DIR, "*.ducky")))
@@ -91,14 +829,107 @@ def main():
 
     for df in ducky_files:
         total += 1
-        if run_test_case(df):
+        if run_test_case(df, base_env):
+            passed += 1
+
+    # The asynchronous pipeline must produce exactly the same report stream
+    async_env = dict(base_env, HID_ASYNC="1")
+    for df in ducky_files:
+        total += 1
+        if run_test_case(df, async_env, " [async]"):
             passed += 1
 
+    # Real-time mode changes scheduling only (and degrades without root)
+    rt_env = dict(base_env, HID_RT="1", HID_RT_CPU="0", HID_ASYNC="1")
+    total += 1
+    if run_test_case(ducky_files[0], rt_env, " [rt]"):
+        passed += 1
+
+    # Commands sent to a resident daemon must behave exactly like local runs.
+    # Cases with a .env need start-up configuration and are skipped here.
+    sock_dir = tempfile.mkdtemp()
+    daemon_env = dict(base_env, HID_SOCKET=os.path.join(sock_dir, "hid.sock"))
+    daemon = subprocess.Popen([TEST_BIN, "daemon"], env=daemon_env,
+                              stdout=subprocess.DEVNULL,
+                              stderr=subprocess.DEVNULL)
+    try:
+        for _ in range(200):
+            if os.path.exists(daemon_env["HID_SOCKET"]):
+                break
+            time.sleep(0.01)
+        for df in ducky_files:
+            if os.path.exists(df.replace(".ducky", ".env")):
+                continue
+            total += 1
+            if run_test_case(df, daemon_env, " [daemon]", via_daemon=True):
+                passed += 1
+    finally:
+        daemon.terminate()
+        daemon.wait()
+        os.rmdir(sock_dir)
+
+    # The binary capture backend records the same reports, and replaying
+    # the capture reproduces them
+    capture = os.path.join(tempfile.mkdtemp(), "reports.cap")
+    try:
+        for df in ducky_files:
+            if os.path.exists(capture):
+                os.unlink(capture) # captures are append-only
+            total += 1
+            env = dict(os.environ, HID_OUTPUT="capture:" + capture)
+            if run_test_case(df, env, " [capture]", capture=capture):
+                passed += 1
+            total += 1
+            lines, _ = run_replay(df, capture, ["--fast"], base_env)
+            if lines == read_capture(capture):
+                print(f"[+] {os.path.basename(df)} [replay]: PASS")
+                passed += 1
+            else:
+                print(f"[-] {os.path.basename(df)} [replay]: FAIL")
+        total += 1
+        if run_replay_timing_test(capture):
+            passed += 1
+        total += 1
+        if run_drift_test(capture):
+            passed += 1
+    finally:
+        if os.path.exists(capture):
+            os.unlink(capture)
+        os.rmdir(os.path.dirname(capture))
+
+    total += 1
+    if run_discovery_test():
+        passed += 1
+
+    total += 1
+    if run_probe_test():
+        passed += 1
+
+    total += 1
+    if run_registry_test():
+        passed += 1
+
+    total += 1
+    if run_mouse_test():
+        passed += 1
+
+    total += 1
+    if run_setup_test():
+        passed += 1
+
+    total += 1
+    if run_supervise_test():
+        passed += 1
+
+    total += 1
+    if run_library_test():
+        passed += 1
+
     print("-" * 40)
     print(f"Results: {passed}/{total} passed.")
 
-    if os.path.exists(MOCK_BIN):
-        os.remove(MOCK_BIN)
+    if os.path.exists(TEST_BIN):
+        os.remove(TEST_BIN)
 
     if passed != total:
         sys.exit(1)